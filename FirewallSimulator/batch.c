@@ -0,0 +1,628 @@
+/**
+    @file batch.c
+    @author Griffin Brookshire (glbrook2)
+    Runs a stream of commands as a pipeline of four threads. Input and
+    output move in blocks of up to BATCH_BLOCK bytes, so a long run of
+    test lines costs a handful of read and write calls, and test lines
+    are parsed without stdio and tested against the policy in groups.
+    Each pair of stages shares a single producer, single consumer ring
+    of block pointers, and blocks return to their producer through a
+    second ring, so nothing is allocated once the pipeline is running.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "policy.h"
+#include "packet.h"
+#include "report.h"
+
+/** Size of the cache lines the ring indices are kept apart by */
+#define BATCH_LINE 64
+
+/** Most lines parsed in one block, the rest are left to the fallback */
+#define BATCH_LINES ( BATCH_BLOCK / 16 )
+
+/** Times a waiting stage yields before it starts to sleep */
+#define BATCH_SPINS 64
+
+/** Nanoseconds a waiting stage sleeps between checks */
+#define BATCH_NAP 20000
+
+/** Most digits accepted in a number, longer ones go to the fallback */
+#define BATCH_DIGITS 9
+
+/** Line kinds: blank, a test parsed into .pkt, anything else */
+#define LINE_EMPTY 0
+#define LINE_TEST 1
+#define LINE_OTHER 2
+
+/** Line kind: the rest of a block with too many lines, one per line */
+#define LINE_REST 3
+
+/**
+ * One line of an input block.
+ * .text: the line, without its newline
+ * .kind: one of the LINE_ values
+ * .pkt: the packet of a test line
+ */
+typedef struct line {
+    char      *text;
+    int       kind;
+    packet_t  pkt;
+} line_t;
+
+/**
+ * A block of input or output.
+ * .text / .len: the bytes, whole lines only for input
+ * .lines / .nlines: the lines of an input block once parsed
+ * .last: set on the block that ends the stream
+ */
+typedef struct block {
+    char      *text;
+    size_t    len;
+    line_t    *lines;
+    int       nlines;
+    int       last;
+} block_t;
+
+/**
+ * A bounded ring handing blocks from one thread to another. Each index
+ * is only written by one side and sits on its own cache line.
+ * .head: the next slot to take, written by the consumer
+ * .tail: the next slot to fill, written by the producer
+ */
+typedef struct ring {
+    block_t       *slots[ BATCH_DEPTH ];
+    unsigned int  head __attribute__(( aligned( BATCH_LINE ) ));
+    unsigned int  tail __attribute__(( aligned( BATCH_LINE ) ));
+} __attribute__(( aligned( BATCH_LINE ) )) ring_t;
+
+/**
+ * The pipeline. Input blocks go reader, parser, evaluator and back to
+ * the reader; output blocks go evaluator, writer and back.
+ * .in / .out: the file descriptors read and written
+ * .free_in / .parse / .eval: the rings input blocks travel through
+ * .free_out / .write: the rings output blocks travel through
+ * .cur: the output block the evaluator is filling
+ * .sent: output blocks handed to the writer, kept by the evaluator
+ * .written: output blocks written out, kept by the writer
+ * .blocks: every block, to free them at the end
+ */
+typedef struct pipeline {
+    int           in;
+    int           out;
+    ring_t        free_in;
+    ring_t        parse;
+    ring_t        eval;
+    ring_t        free_out;
+    ring_t        write;
+    block_t       *cur;
+    unsigned int  sent;
+    unsigned int  written;
+    block_t       blocks[ 2 * BATCH_DEPTH ];
+} pipeline_t;
+
+/** The one pipeline, static so its rings are aligned */
+static pipeline_t batch;
+
+/**
+    Waits a little for the other side of a ring, yielding at first and
+    then sleeping so an idle pipeline does not keep cores busy.
+    @param spins The number of waits so far
+*/
+static void wait_turn( int *spins ) {
+  if ( ++*spins < BATCH_SPINS ) {
+    sched_yield();
+  } else {
+    struct timespec nap = { 0, BATCH_NAP };
+    nanosleep( &nap, NULL );
+  }
+}
+
+/**
+    Adds a block to a ring, waiting while it is full.
+    @param r The ring
+    @param b The block
+*/
+static void push( ring_t *r, block_t *b ) {
+  unsigned int tail = __atomic_load_n( &r->tail, __ATOMIC_RELAXED );
+  int spins = 0;
+  while ( tail - __atomic_load_n( &r->head, __ATOMIC_ACQUIRE ) == BATCH_DEPTH ) {
+    wait_turn( &spins );
+  }
+  r->slots[ tail % BATCH_DEPTH ] = b;
+  __atomic_store_n( &r->tail, tail + 1, __ATOMIC_RELEASE );
+}
+
+/**
+    Takes the oldest block from a ring, waiting while it is empty.
+    @param r The ring
+    @return The block
+*/
+static block_t *pop( ring_t *r ) {
+  unsigned int head = __atomic_load_n( &r->head, __ATOMIC_RELAXED );
+  int spins = 0;
+  while ( __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE ) == head ) {
+    wait_turn( &spins );
+  }
+  block_t *b = r->slots[ head % BATCH_DEPTH ];
+  __atomic_store_n( &r->head, head + 1, __ATOMIC_RELEASE );
+  return b;
+}
+
+/**
+    Tells the consumer of a ring whether a block is waiting.
+    @param r The ring
+    @return 1 if the ring is empty, 0 otherwise
+*/
+static int ring_empty( ring_t *r ) {
+  return __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE ) ==
+         __atomic_load_n( &r->head, __ATOMIC_RELAXED );
+}
+
+/**
+ * A cursor over one line of input.
+ * .p: the next unread character
+ * .end: one past the last character of the line
+ */
+typedef struct cursor {
+    const char  *p;
+    const char  *end;
+} cursor_t;
+
+/**
+    Consumes @word if it is next, followed by a space or the end of the line.
+    @param c The cursor
+    @param word The word to match
+    @return 1 if consumed, 0 if not
+*/
+static int take_word( cursor_t *c, const char *word ) {
+  const char *p = c->p;
+  while ( *word != '\0' ) {
+    if ( p == c->end || *p != *word ) {
+      return 0;
+    }
+    p++;
+    word++;
+  }
+  if ( p != c->end && *p != ' ' ) {
+    return 0;
+  }
+  c->p = p;
+  return 1;
+}
+
+/**
+    Consumes @ch if it is next.
+    @param c The cursor
+    @param ch The character to match
+    @return 1 if consumed, 0 if not
+*/
+static int take_char( cursor_t *c, char ch ) {
+  if ( c->p == c->end || *c->p != ch ) {
+    return 0;
+  }
+  c->p++;
+  return 1;
+}
+
+/**
+    Consumes a decimal number no greater than @max.
+    @param c The cursor
+    @param max The largest value accepted
+    @param out Set to the number
+    @return 1 if consumed, 0 if not
+*/
+static int take_num( cursor_t *c, int max, int *out ) {
+  const char *p = c->p;
+  int v = 0;
+  int digits = 0;
+  while ( p != c->end && *p >= '0' && *p <= '9' ) {
+    if ( ++digits > BATCH_DIGITS ) {
+      return 0;
+    }
+    v = v * 10 + ( *p - '0' );
+    p++;
+  }
+  if ( digits == 0 || v > max ) {
+    return 0;
+  }
+  c->p = p;
+  *out = v;
+  return 1;
+}
+
+/**
+    Consumes an address and port, a.b.c.d:port.
+    @param c The cursor
+    @param ip Set to the address
+    @param port Set to the port
+    @return 1 if consumed, 0 if not
+*/
+static int take_endpoint( cursor_t *c, ipaddr_t *ip, port_t *port ) {
+  int a, b, cc, d, p;
+  if ( !take_num( c, IP_OCTET_MAX, &a ) || !take_char( c, '.' ) ||
+       !take_num( c, IP_OCTET_MAX, &b ) || !take_char( c, '.' ) ||
+       !take_num( c, IP_OCTET_MAX, &cc ) || !take_char( c, '.' ) ||
+       !take_num( c, IP_OCTET_MAX, &d ) || !take_char( c, ':' ) ||
+       !take_num( c, PORT_MAX, &p ) ) {
+    return 0;
+  }
+  ip->a = a;
+  ip->b = b;
+  ip->c = cc;
+  ip->d = d;
+  *port = p;
+  return 1;
+}
+
+/**
+    Parses a test line.
+    @param c The cursor over the line
+    @param pkt Set to the packet to test
+    @return 1 if the line is a test, 0 if it needs the fallback
+*/
+static int take_test( cursor_t *c, packet_t *pkt ) {
+  if ( !take_word( c, "test" ) || !take_char( c, ' ' ) ) {
+    return 0;
+  }
+  if ( take_word( c, "tcp" ) ) {
+    pkt->protocol = PROTO_TCP;
+  } else if ( take_word( c, "udp" ) ) {
+    pkt->protocol = PROTO_UDP;
+  } else {
+    return 0;
+  }
+  return take_char( c, ' ' ) && take_endpoint( c, &pkt->src_ip, &pkt->src_port ) &&
+         take_char( c, ' ' ) && take_endpoint( c, &pkt->dst_ip, &pkt->dst_port ) &&
+         c->p == c->end;
+}
+
+/**
+    Tells a line's kind, parsing it if it is a test.
+    @param text The line, without its newline
+    @param len The length of the line
+    @param pkt Set to the packet of a test line
+    @return One of LINE_EMPTY, LINE_TEST or LINE_OTHER
+*/
+static int classify( const char *text, size_t len, packet_t *pkt ) {
+  cursor_t c = { text, text + len };
+  while ( c.end > c.p && ( c.end[ -1 ] == '\r' || c.end[ -1 ] == ' ' ) ) {
+    c.end--;
+  }
+  if ( c.p == c.end ) {
+    return LINE_EMPTY;
+  }
+  return take_test( &c, pkt ) ? LINE_TEST : LINE_OTHER;
+}
+
+/**
+    The reader stage: reads input in large blocks, carrying a partial
+    last line over to the next block. Each read is handed on as soon as
+    it holds a whole line, so a slow writer of input is not kept waiting.
+    @param arg Unused
+    @return NULL
+*/
+static void *read_loop( void *arg ) {
+  block_t *cur = pop( &batch.free_in );
+  cur->len = 0;
+  for ( ;; ) {
+    ssize_t n = read( batch.in, cur->text + cur->len, BATCH_BLOCK - cur->len );
+    if ( n < 0 && errno == EINTR ) {
+      continue;
+    }
+    if ( n <= 0 ) {
+      cur->last = 1;
+      push( &batch.parse, cur );
+      return NULL;
+    }
+    cur->len += n;
+    size_t end = cur->len;
+    while ( end > 0 && cur->text[ end - 1 ] != '\n' ) {
+      end--;
+    }
+    if ( end == 0 && cur->len < BATCH_BLOCK ) {
+      continue;
+    }
+    // A line longer than a block is cut where the block ends
+    if ( end == 0 ) {
+      end = cur->len;
+    }
+    block_t *next = pop( &batch.free_in );
+    next->len = cur->len - end;
+    memcpy( next->text, cur->text + end, next->len );
+    cur->len = end;
+    cur->last = 0;
+    push( &batch.parse, cur );
+    cur = next;
+  }
+}
+
+/**
+    The parser stage: splits blocks into lines and parses test lines.
+    @param arg Unused
+    @return NULL
+*/
+static void *parse_loop( void *arg ) {
+  for ( ;; ) {
+    block_t *b = pop( &batch.parse );
+    char *p = b->text;
+    char *end = b->text + b->len;
+    b->nlines = 0;
+    while ( p < end ) {
+      line_t *l = &b->lines[ b->nlines++ ];
+      l->text = p;
+      if ( b->nlines == BATCH_LINES ) {
+        *end = '\0';
+        l->kind = LINE_REST;
+        break;
+      }
+      char *nl = memchr( p, '\n', end - p );
+      char *eol = nl ? nl : end;
+      *eol = '\0';
+      l->kind = classify( p, eol - p, &l->pkt );
+      p = eol + 1;
+    }
+    int last = b->last;
+    push( &batch.eval, b );
+    if ( last ) {
+      return NULL;
+    }
+  }
+}
+
+/**
+    The writer stage: writes output blocks until the last one.
+    @param arg Unused
+    @return NULL
+*/
+static void *write_loop( void *arg ) {
+  for ( ;; ) {
+    block_t *b = pop( &batch.write );
+    if ( b->last ) {
+      return NULL;
+    }
+    size_t done = 0;
+    while ( done < b->len ) {
+      ssize_t n = write( batch.out, b->text + done, b->len - done );
+      if ( n < 0 && errno == EINTR ) {
+        continue;
+      }
+      if ( n <= 0 ) {
+        break;
+      }
+      done += n;
+    }
+    push( &batch.free_out, b );
+    __atomic_store_n( &batch.written, batch.written + 1, __ATOMIC_RELEASE );
+  }
+}
+
+/**
+    Hands the output block being filled to the writer and takes an empty one.
+*/
+static void send_output() {
+  push( &batch.write, batch.cur );
+  batch.sent++;
+  batch.cur = pop( &batch.free_out );
+  batch.cur->len = 0;
+}
+
+/**
+    Takes report output into the output block, as the report sink.
+    @param buf The bytes
+    @param len The number of bytes
+*/
+static void sink( const char *buf, size_t len ) {
+  while ( len > 0 ) {
+    size_t room = BATCH_BLOCK - batch.cur->len;
+    if ( room == 0 ) {
+      send_output();
+      continue;
+    }
+    size_t n = len < room ? len : room;
+    memcpy( batch.cur->text + batch.cur->len, buf, n );
+    batch.cur->len += n;
+    buf += n;
+    len -= n;
+  }
+}
+
+/**
+    Hands every verdict so far to the writer.
+*/
+static void flush_output() {
+  report_flush();
+  if ( batch.cur->len > 0 ) {
+    send_output();
+  }
+}
+
+/**
+    Tests @n packets against the policy together and reports them. The
+    verdicts are those of testing them one at a time, so a reply whose
+    flow was opened earlier in the group is allowed as it would be typed.
+    @param pkts The packets
+    @param n The number of packets
+*/
+static void run_tests( const packet_t *pkts, int n ) {
+  int actions[ BATCH_TESTS ];
+  int pos[ BATCH_TESTS ];
+  if ( n > 0 && policy_test_batch( pkts, n, actions, pos ) == 0 ) {
+    for ( int i = 0; i < n; i++ ) {
+      report_verdict( pkts[ i ], actions[ i ], pos[ i ] );
+    }
+  }
+}
+
+/**
+    Runs a line through the fallback once all earlier output is written,
+    since the fallback prints straight to stdout.
+    @param fallback The fallback
+    @param line The line
+    @return 0 to keep going, -1 to stop
+*/
+static int run_fallback( batch_fallback_t fallback, char *line ) {
+  flush_output();
+  int spins = 0;
+  while ( __atomic_load_n( &batch.written, __ATOMIC_ACQUIRE ) != batch.sent ) {
+    wait_turn( &spins );
+  }
+  int rc = fallback( line );
+  fflush( stdout );
+  return rc;
+}
+
+/**
+    Runs each line of a block with more than BATCH_LINES lines that the
+    parser left whole.
+    @param fallback The fallback
+    @param rest The lines
+    @return 0 to keep going, -1 to stop
+*/
+static int run_rest( batch_fallback_t fallback, char *rest ) {
+  while ( *rest != '\0' ) {
+    char *nl = strchr( rest, '\n' );
+    if ( nl != NULL ) {
+      *nl = '\0';
+    }
+    packet_t pkt;
+    int kind = classify( rest, strlen( rest ), &pkt );
+    if ( kind == LINE_TEST ) {
+      run_tests( &pkt, 1 );
+    } else if ( kind == LINE_OTHER && run_fallback( fallback, rest ) != 0 ) {
+      return -1;
+    }
+    if ( nl == NULL ) {
+      break;
+    }
+    rest = nl + 1;
+  }
+  return 0;
+}
+
+/**
+    The evaluator stage, run on the calling thread since only it may
+    touch the policy: tests runs of parsed test lines together and hands
+    the other lines to the fallback in order.
+    @param fallback The fallback
+    @return 0 at the end of input, -2 if the fallback asked to stop
+*/
+static int evaluate( batch_fallback_t fallback ) {
+  packet_t pkts[ BATCH_TESTS ];
+  for ( ;; ) {
+    block_t *b = pop( &batch.eval );
+    int n = 0;
+    int stop = 0;
+    for ( int i = 0; i < b->nlines && !stop; i++ ) {
+      line_t *l = &b->lines[ i ];
+      if ( l->kind == LINE_TEST ) {
+        pkts[ n++ ] = l->pkt;
+        if ( n == BATCH_TESTS ) {
+          run_tests( pkts, n );
+          n = 0;
+        }
+        continue;
+      }
+      run_tests( pkts, n );
+      n = 0;
+      if ( l->kind == LINE_OTHER ) {
+        stop = run_fallback( fallback, l->text ) != 0;
+      } else if ( l->kind == LINE_REST ) {
+        stop = run_rest( fallback, l->text ) != 0;
+      }
+    }
+    run_tests( pkts, n );
+    int last = b->last;
+    push( &batch.free_in, b );
+    if ( stop ) {
+      return -2;
+    }
+    if ( last ) {
+      return 0;
+    }
+    // Nothing more is ready, so let what there is go out
+    if ( ring_empty( &batch.eval ) ) {
+      flush_output();
+    }
+  }
+}
+
+/**
+    Runs the commands read from @in, writing their output to @out, in four
+    stages on their own threads: a reader that reads large blocks of
+    whole lines, a parser that parses the test lines, an evaluator that
+    tests runs of packets against the policy together, and a writer that
+    writes large blocks. The stages hand blocks on through bounded
+    lock-free queues. Every line other than a well formed test, and any
+    that does not parse cleanly, is passed to @fallback on the calling
+    thread once all earlier output is written, so it behaves exactly as
+    if it had been typed.
+    @param in The file descriptor to read commands from
+    @param out The file descriptor to write output to
+    @param fallback Runs the lines the pipeline does not handle itself
+    @return 0 at the end of input, -2 if @fallback asked to stop, -1 if
+            the stages could not be started
+*/
+int batch_run(int in, int out, batch_fallback_t fallback) {
+  memset( &batch, 0, sizeof( batch ) );
+  batch.in = in;
+  batch.out = out;
+  for ( int i = 0; i < 2 * BATCH_DEPTH; i++ ) {
+    block_t *b = &batch.blocks[ i ];
+    b->text = malloc( BATCH_BLOCK + 1 );
+    if ( i < BATCH_DEPTH ) {
+      b->lines = malloc( BATCH_LINES * sizeof( line_t ) );
+    }
+    if ( b->text == NULL || ( i < BATCH_DEPTH && b->lines == NULL ) ) {
+      for ( int k = 0; k <= i; k++ ) {
+        free( batch.blocks[ k ].text );
+        free( batch.blocks[ k ].lines );
+      }
+      return -1;
+    }
+    if ( i < BATCH_DEPTH ) {
+      push( &batch.free_in, b );
+    } else if ( i > BATCH_DEPTH ) {
+      push( &batch.free_out, b );
+    }
+  }
+  batch.cur = &batch.blocks[ BATCH_DEPTH ];
+
+  // A stage that fails to start leaves the others waiting for good, so
+  // the caller must exit rather than carry on
+  pthread_t reader, parser, writer;
+  if ( pthread_create( &writer, NULL, write_loop, NULL ) != 0 ||
+       pthread_create( &parser, NULL, parse_loop, NULL ) != 0 ||
+       pthread_create( &reader, NULL, read_loop, NULL ) != 0 ) {
+    return -1;
+  }
+  report_set_sink( sink );
+  int rc = evaluate( fallback );
+  flush_output();
+  report_set_sink( NULL );
+  batch.cur->last = 1;
+  push( &batch.write, batch.cur );
+  pthread_join( writer, NULL );
+  if ( rc != 0 ) {
+    // The reader may be blocked on input, so its blocks are left to exit
+    return rc;
+  }
+  pthread_join( parser, NULL );
+  pthread_join( reader, NULL );
+  for ( int i = 0; i < 2 * BATCH_DEPTH; i++ ) {
+    free( batch.blocks[ i ].text );
+    free( batch.blocks[ i ].lines );
+  }
+  return 0;
+}
@@ -0,0 +1,44 @@
+/**
+    @file batch.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior for running a stream of commands without prompts.
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+/** Bytes read or written at a time */
+#define BATCH_BLOCK ( 1 << 20 )
+
+/** Blocks in flight between each pair of stages, a power of two */
+#define BATCH_DEPTH 4
+
+/** Packets tested by one call into the policy */
+#define BATCH_TESTS 256
+
+/**
+    Runs one command line the pipeline does not handle itself.
+    @param line The command, without its newline
+    @return 0 to keep going, -1 to stop (quit)
+*/
+typedef int (*batch_fallback_t)(char *line);
+
+/**
+    Runs the commands read from @in, writing their output to @out, in four
+    stages on their own threads: a reader that reads large blocks of
+    whole lines, a parser that parses the test lines, an evaluator that
+    tests runs of packets against the policy together, and a writer that
+    writes large blocks. The stages hand blocks on through bounded
+    lock-free queues. Every line other than a well formed test, and any
+    that does not parse cleanly, is passed to @fallback on the calling
+    thread once all earlier output is written, so it behaves exactly as
+    if it had been typed.
+    @param in The file descriptor to read commands from
+    @param out The file descriptor to write output to
+    @param fallback Runs the lines the pipeline does not handle itself
+    @return 0 at the end of input, -2 if @fallback asked to stop, -1 if
+            the stages could not be started
+*/
+int batch_run(int in, int out, batch_fallback_t fallback);
+
+#endif
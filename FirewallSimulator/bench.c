@@ -0,0 +1,180 @@
+/**
+    @file bench.c
+    @author Griffin Brookshire (glbrook2)
+    Measures how fast the linear rule scan runs, before and after the
+    rules are packed into columns. Every packet misses every rule, so
+    each lookup walks the whole policy and the rate is rules per ns.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "packet.h"
+#include "policy.h"
+#include "scan.h"
+
+/** Packets tested against each policy size */
+#define BENCH_PACKETS 20000
+
+/** Smallest policy measured */
+#define BENCH_MIN_RULES 16
+
+/** Largest policy measured */
+#define BENCH_MAX_RULES 65536
+
+/* Print out a usage message. */
+static void usage()
+{
+  fprintf(stderr, "Usage: bench [<max_rules>]\n");
+}
+
+/**
+    Reads the monotonic clock.
+    @return The time in nanoseconds
+*/
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+    Makes an address from a 32-bit value.
+    @param v The packed address
+    @return The address
+*/
+static ipaddr_t make_ip( unsigned int v ) {
+  ipaddr_t ip;
+  ip.a = v >> 24;
+  ip.b = v >> 16;
+  ip.c = v >> 8;
+  ip.d = v;
+  return ip;
+}
+
+/**
+    Fills @rules with random rules inside 10.0.0.0/8.
+    @param rules The rules to fill
+    @param len The number of rules
+*/
+static void make_rules( rule_t *rules, int len ) {
+  for ( int i = 0; i < len; i++ ) {
+    rules[ i ].action = rand() % 2;
+    rules[ i ].match.protocol = rand() % 2;
+    rules[ i ].match.src_ip = make_ip( 0x0A000000 | ( rand() & 0xFFFFFF ) );
+    rules[ i ].match.dst_ip = make_ip( 0x0A000000 | ( rand() & 0xFFFFFF ) );
+    rules[ i ].match.src_port = rand() % 4 ? MATCH_PORT_ANY : rand() % PORT_MAX;
+    rules[ i ].match.dst_port = rand() % 8 ? rand() % 1024 : MATCH_PORT_ANY;
+  }
+}
+
+/**
+    Fills @pkts with packets from 192.168.0.0/16, which no rule matches.
+    @param pkts The packets to fill
+    @param len The number of packets
+*/
+static void make_misses( packet_t *pkts, int len ) {
+  for ( int i = 0; i < len; i++ ) {
+    pkts[ i ].protocol = rand() % 2;
+    pkts[ i ].src_ip = make_ip( 0xC0A80000 | ( rand() & 0xFFFF ) );
+    pkts[ i ].dst_ip = make_ip( 0xC0A80000 | ( rand() & 0xFFFF ) );
+    pkts[ i ].src_port = rand() % PORT_MAX;
+    pkts[ i ].dst_port = rand() % 1024;
+  }
+}
+
+/**
+    Scans rules laid out as a baseline the benchmark builds on purpose,
+    not as policy.c stores them: one allocation per rule reached through
+    an array of pointers, matched with packet_match.
+    @param policy The rule pointers
+    @param len The number of rules
+    @param pkt The packet to match
+    @return Index of the first matching rule, -1 if none match
+*/
+static int pointer_scan( rule_t **policy, int len, packet_t pkt ) {
+  for ( int i = 0; i < len; i++ ) {
+    if ( packet_match( policy[ i ]->match, pkt ) ) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Starting point for the benchmark.
+   @param argc number of command-line arguments.
+   @param argv list of command-line arguments.
+   @return program exit status
+*/
+int main(int argc, char *argv[])
+{
+  int max_rules = BENCH_MAX_RULES;
+  if ( argc == 2 ) {
+    max_rules = atoi( argv[ 1 ] );
+  }
+  if ( argc > 2 || max_rules < BENCH_MIN_RULES ) {
+    usage();
+    exit( 1 );
+  }
+
+  srand( 1 );
+  packet_t *pkts = malloc( BENCH_PACKETS * sizeof( packet_t ) );
+  rule_t *rules = malloc( max_rules * sizeof( rule_t ) );
+  rule_t **policy = malloc( max_rules * sizeof( rule_t * ) );
+  if ( pkts == NULL || rules == NULL || policy == NULL ) {
+    fprintf( stderr, "Out of memory.\n" );
+    exit( 1 );
+  }
+  make_misses( pkts, BENCH_PACKETS );
+
+  fprintf( stdout, "rules,pointer_rules_per_ns,column_rules_per_ns,speedup\n" );
+  for ( int len = BENCH_MIN_RULES; len <= max_rules; len *= 4 ) {
+    make_rules( rules, len );
+    for ( int i = 0; i < len; i++ ) {
+      policy[ i ] = malloc( sizeof( rule_t ) );
+      *( policy[ i ] ) = rules[ i ];
+    }
+    scan_t *sc = scan_build( rules, len );
+    if ( sc == NULL ) {
+      fprintf( stderr, "Out of memory.\n" );
+      exit( 1 );
+    }
+    // Keep the work per size roughly constant
+    int count = BENCH_PACKETS;
+    while ( count > 100 && ( double ) count * len > 2e8 ) {
+      count /= 2;
+    }
+
+    int found = 0;
+    double start = now_ns();
+    for ( int p = 0; p < count; p++ ) {
+      found += pointer_scan( policy, len, pkts[ p ] ) >= 0;
+    }
+    double pointer_ns = now_ns() - start;
+
+    start = now_ns();
+    for ( int p = 0; p < count; p++ ) {
+      found += scan_lookup( sc, pkts[ p ] ) >= 0;
+    }
+    double column_ns = now_ns() - start;
+
+    double scanned = ( double ) count * len;
+    fprintf( stdout, "%d,%.3f,%.3f,%.2f\n", len, scanned / pointer_ns, scanned / column_ns,
+             pointer_ns / column_ns );
+    if ( found != 0 ) {
+      fprintf( stderr, "Warning: %d packets matched a rule.\n", found );
+    }
+    scan_free( sc );
+    for ( int i = 0; i < len; i++ ) {
+      free( policy[ i ] );
+    }
+  }
+  free( pkts );
+  free( rules );
+  free( policy );
+  return EXIT_SUCCESS;
+}
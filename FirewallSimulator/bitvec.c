@@ -0,0 +1,329 @@
+/**
+    @file bitvec.c
+    @author Griffin Brookshire (glbrook2)
+    Bit-vector classifier over the policy rules. Each field value maps to
+    the set of rules it can match; a lookup intersects the five sets with
+    wide vector ANDs and the first set bit left is the matching rule.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define BITVEC_X86 1
+#endif
+
+#include "bitvec.h"
+
+/** Signature shared by the intersection routines */
+typedef int ( *intersect_fn )( const uint64_t *sets[ BITVEC_FIELDS ], int nwords );
+
+/**
+    Finds the first common bit of @sets within words @from to @nwords.
+    @param sets The bitsets to intersect
+    @param from The first word to check
+    @param nwords The length of each bitset in words
+    @return The index of the first common bit, -1 if there is none
+*/
+static int intersect_tail( const uint64_t *sets[ BITVEC_FIELDS ], int from, int nwords ) {
+  for ( int w = from; w < nwords; w++ ) {
+    uint64_t x = sets[ 0 ][ w ] & sets[ 1 ][ w ] & sets[ 2 ][ w ] & sets[ 3 ][ w ] & sets[ 4 ][ w ];
+    if ( x ) {
+      return w * 64 + __builtin_ctzll( x );
+    }
+  }
+  return -1;
+}
+
+/**
+    Finds the first bit set in all of @sets, one word at a time.
+    @param sets The bitsets to intersect
+    @param nwords The length of each bitset in words
+    @return The index of the first common bit, -1 if there is none
+*/
+static int intersect_scalar( const uint64_t *sets[ BITVEC_FIELDS ], int nwords ) {
+  return intersect_tail( sets, 0, nwords );
+}
+
+#ifdef BITVEC_X86
+/**
+    Finds the first bit set in all of @sets, two words per SSE2 AND.
+    @param sets The bitsets to intersect
+    @param nwords The length of each bitset in words
+    @return The index of the first common bit, -1 if there is none
+*/
+__attribute__(( target( "sse2" ) ))
+static int intersect_sse2( const uint64_t *sets[ BITVEC_FIELDS ], int nwords ) {
+  const __m128i zero = _mm_setzero_si128();
+  int w = 0;
+  for ( ; w + 2 <= nwords; w += 2 ) {
+    __m128i x = _mm_loadu_si128( ( const __m128i * ) ( sets[ 0 ] + w ) );
+    for ( int f = 1; f < BITVEC_FIELDS; f++ ) {
+      x = _mm_and_si128( x, _mm_loadu_si128( ( const __m128i * ) ( sets[ f ] + w ) ) );
+    }
+    if ( _mm_movemask_epi8( _mm_cmpeq_epi8( x, zero ) ) != 0xFFFF ) {
+      return intersect_tail( sets, w, w + 2 );
+    }
+  }
+  return intersect_tail( sets, w, nwords );
+}
+
+/**
+    Finds the first bit set in all of @sets, four words per AVX2 AND.
+    @param sets The bitsets to intersect
+    @param nwords The length of each bitset in words
+    @return The index of the first common bit, -1 if there is none
+*/
+__attribute__(( target( "avx2" ) ))
+static int intersect_avx2( const uint64_t *sets[ BITVEC_FIELDS ], int nwords ) {
+  int w = 0;
+  for ( ; w + 4 <= nwords; w += 4 ) {
+    __m256i x = _mm256_loadu_si256( ( const __m256i * ) ( sets[ 0 ] + w ) );
+    for ( int f = 1; f < BITVEC_FIELDS; f++ ) {
+      x = _mm256_and_si256( x, _mm256_loadu_si256( ( const __m256i * ) ( sets[ f ] + w ) ) );
+    }
+    if ( !_mm256_testz_si256( x, x ) ) {
+      _mm256_zeroupper();
+      return intersect_tail( sets, w, w + 4 );
+    }
+  }
+  // gcc drops the vzeroupper on tail calls, leaving later SSE code slow
+  _mm256_zeroupper();
+  return intersect_tail( sets, w, nwords );
+}
+#endif
+
+static int intersect_first( const uint64_t *sets[ BITVEC_FIELDS ], int nwords );
+
+/** The widest intersection the CPU supports, picked on first use */
+static intersect_fn intersect = intersect_first;
+
+/**
+    Picks the intersection routine for this CPU.
+*/
+static void pick_intersect() {
+  intersect = intersect_scalar;
+#ifdef BITVEC_X86
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports( "avx2" ) ) {
+    intersect = intersect_avx2;
+  } else if ( __builtin_cpu_supports( "sse2" ) ) {
+    intersect = intersect_sse2;
+  }
+#endif
+}
+
+/**
+    Picks the intersection routine on first use, then hands the call to it.
+    Bitsets mapped from a snapshot may be searched before any build.
+    @param sets The bitsets to intersect
+    @param nwords The length of each bitset in words
+    @return The index of the first common bit, -1 if there is none
+*/
+static int intersect_first( const uint64_t *sets[ BITVEC_FIELDS ], int nwords ) {
+  pick_intersect();
+  return intersect( sets, nwords );
+}
+
+/**
+    Reads the value of field @f of a rule.
+    @param rule The rule to read
+    @param f The field number
+    @param value Set to the value matched
+    @return 1 if the rule matches any value of the field, 0 if not
+*/
+static int rule_value( const rule_t *rule, int f, uint32_t *value ) {
+  switch ( f ) {
+    case 0:
+      *value = rule->match.protocol;
+      return 0;
+    case 1:
+      *value = ipaddr_to_int( rule->match.src_ip );
+      return 0;
+    case 2:
+      *value = rule->match.src_port;
+      return rule->match.src_port == MATCH_PORT_ANY;
+    case 3:
+      *value = ipaddr_to_int( rule->match.dst_ip );
+      return 0;
+    default:
+      *value = rule->match.dst_port;
+      return rule->match.dst_port == MATCH_PORT_ANY;
+  }
+}
+
+/**
+    Compares two field values for qsort.
+    @param a The first value
+    @param b The second value
+    @return Negative, zero or positive as for qsort
+*/
+static int by_value( const void *a, const void *b ) {
+  uint32_t x = *( const uint32_t * ) a;
+  uint32_t y = *( const uint32_t * ) b;
+  return ( x > y ) - ( x < y );
+}
+
+/**
+    Finds @value among the sorted distinct values of a field.
+    @param field The field to search
+    @param value The value to find
+    @return The index of the value, -1 if no rule matches it exactly
+*/
+static int find_value( const bitvec_field_t *field, uint32_t value ) {
+  int lo = 0;
+  int hi = field->nvalues - 1;
+  while ( lo <= hi ) {
+    int mid = ( lo + hi ) / 2;
+    if ( field->values[ mid ] < value ) {
+      lo = mid + 1;
+    } else if ( field->values[ mid ] > value ) {
+      hi = mid - 1;
+    } else {
+      return mid;
+    }
+  }
+  return -1;
+}
+
+/**
+    Collects the sorted distinct values of field @f.
+    @param field The field to fill
+    @param rules The rules in policy order
+    @param len The number of rules
+    @param f The field number
+    @return 0 if success, -1 if fail
+*/
+static int collect_values( bitvec_field_t *field, const rule_t *rules, int len, int f ) {
+  field->values = malloc( ( len ? len : 1 ) * sizeof( uint32_t ) );
+  if ( field->values == NULL ) {
+    return -1;
+  }
+  int n = 0;
+  for ( int i = 0; i < len; i++ ) {
+    uint32_t v;
+    if ( !rule_value( &rules[ i ], f, &v ) ) {
+      field->values[ n++ ] = v;
+    }
+  }
+  qsort( field->values, n, sizeof( uint32_t ), by_value );
+  int distinct = 0;
+  for ( int i = 0; i < n; i++ ) {
+    if ( distinct == 0 || field->values[ distinct - 1 ] != field->values[ i ] ) {
+      field->values[ distinct++ ] = field->values[ i ];
+    }
+  }
+  field->nvalues = distinct;
+  return 0;
+}
+
+/**
+    Builds the bitsets from @len rules stored in @rules.
+    @param rules The rules in policy order
+    @param len The number of rules
+    @return The new classifier, or NULL if memory ran out or the
+            bitsets would exceed BITVEC_MAX_BYTES
+*/
+bitvec_t *bitvec_build(const rule_t *rules, int len) {
+  bitvec_t *bv = calloc( 1, sizeof( bitvec_t ) );
+  if ( bv == NULL ) {
+    return NULL;
+  }
+  bv->len = len;
+  bv->nwords = ( len + 63 ) / 64;
+  size_t words = bv->nwords ? bv->nwords : 1;
+
+  size_t total = 0;
+  for ( int f = 0; f < BITVEC_FIELDS; f++ ) {
+    if ( collect_values( &bv->fields[ f ], rules, len, f ) ) {
+      bitvec_free( bv );
+      return NULL;
+    }
+    total += ( bv->fields[ f ].nvalues + 1 ) * words * sizeof( uint64_t );
+  }
+  if ( total > BITVEC_MAX_BYTES ) {
+    bitvec_free( bv );
+    return NULL;
+  }
+
+  for ( int f = 0; f < BITVEC_FIELDS; f++ ) {
+    bitvec_field_t *field = &bv->fields[ f ];
+    field->sets = calloc( ( field->nvalues ? field->nvalues : 1 ) * words, sizeof( uint64_t ) );
+    field->wild = calloc( words, sizeof( uint64_t ) );
+    if ( field->sets == NULL || field->wild == NULL ) {
+      bitvec_free( bv );
+      return NULL;
+    }
+    for ( int i = 0; i < len; i++ ) {
+      uint32_t v;
+      uint64_t bit = ( uint64_t ) 1 << ( i & 63 );
+      if ( rule_value( &rules[ i ], f, &v ) ) {
+        field->wild[ i / 64 ] |= bit;
+      } else {
+        field->sets[ find_value( field, v ) * words + i / 64 ] |= bit;
+      }
+    }
+    // Wildcard rules match every value, fold them in once here
+    for ( int j = 0; j < field->nvalues; j++ ) {
+      for ( size_t w = 0; w < words; w++ ) {
+        field->sets[ j * words + w ] |= field->wild[ w ];
+      }
+    }
+  }
+  return bv;
+}
+
+/**
+    Finds the first rule that matches @pkt.
+    @param bv The classifier to search
+    @param pkt The packet to classify
+    @return Index of the first matching rule, -1 if none match
+*/
+int bitvec_lookup(const bitvec_t *bv, packet_t pkt) {
+  uint32_t v[ BITVEC_FIELDS ];
+  v[ 0 ] = pkt.protocol;
+  v[ 1 ] = ipaddr_to_int( pkt.src_ip );
+  v[ 2 ] = pkt.src_port;
+  v[ 3 ] = ipaddr_to_int( pkt.dst_ip );
+  v[ 4 ] = pkt.dst_port;
+  const uint64_t *sets[ BITVEC_FIELDS ];
+  for ( int f = 0; f < BITVEC_FIELDS; f++ ) {
+    const bitvec_field_t *field = &bv->fields[ f ];
+    int j = find_value( field, v[ f ] );
+    sets[ f ] = j < 0 ? field->wild : field->sets + ( size_t ) j * bv->nwords;
+  }
+  return intersect( sets, bv->nwords );
+}
+
+/**
+    Reports the number of bytes held by the classifier.
+    @param bv The classifier to measure
+    @return Size in bytes
+*/
+size_t bitvec_bytes(const bitvec_t *bv) {
+  size_t bytes = sizeof( bitvec_t );
+  for ( int f = 0; f < BITVEC_FIELDS; f++ ) {
+    const bitvec_field_t *field = &bv->fields[ f ];
+    bytes += field->nvalues * sizeof( uint32_t );
+    bytes += ( field->nvalues + 1 ) * bv->nwords * sizeof( uint64_t );
+  }
+  return bytes;
+}
+
+/**
+    Frees a classifier returned by bitvec_build.
+    @param bv The classifier to free, may be NULL
+*/
+void bitvec_free(bitvec_t *bv) {
+  if ( bv == NULL ) {
+    return;
+  }
+  for ( int f = 0; f < BITVEC_FIELDS; f++ ) {
+    free( bv->fields[ f ].values );
+    free( bv->fields[ f ].sets );
+    free( bv->fields[ f ].wild );
+  }
+  free( bv );
+}
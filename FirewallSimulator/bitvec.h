@@ -0,0 +1,77 @@
+/**
+    @file bitvec.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior and data for the bit-vector rule classifier.
+*/
+
+#ifndef BITVEC_H
+#define BITVEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet.h"
+#include "policy.h"
+
+/** Number of packet fields with their own bitsets */
+#define BITVEC_FIELDS 5
+
+/** Largest bitset memory a build may use, in bytes */
+#define BITVEC_MAX_BYTES ( ( size_t ) 1 << 30 )
+
+/**
+ * The bitsets for one packet field.
+ * .values: the distinct values rules match exactly, sorted
+ * .nvalues: the number of distinct values
+ * .sets: one bitset per value, rules matching exactly or by wildcard
+ * .wild: the rules that match any value of this field
+ */
+typedef struct bitvec_field {
+    uint32_t  *values;
+    int       nvalues;
+    uint64_t  *sets;
+    uint64_t  *wild;
+} bitvec_field_t;
+
+/**
+ * A Lucent-style bit-vector classifier. Bit i of a set stands for rule i,
+ * so the first set bit of the intersection is the first matching rule.
+ * .nwords: the length of every bitset in 64-bit words
+ */
+typedef struct bitvec {
+    bitvec_field_t  fields[ BITVEC_FIELDS ];
+    int             len;
+    int             nwords;
+} bitvec_t;
+
+/**
+    Builds the bitsets from @len rules stored in @rules.
+    @param rules The rules in policy order
+    @param len The number of rules
+    @return The new classifier, or NULL if memory ran out or the
+            bitsets would exceed BITVEC_MAX_BYTES
+*/
+bitvec_t *bitvec_build(const rule_t *rules, int len);
+
+/**
+    Finds the first rule that matches @pkt.
+    @param bv The classifier to search
+    @param pkt The packet to classify
+    @return Index of the first matching rule, -1 if none match
+*/
+int bitvec_lookup(const bitvec_t *bv, packet_t pkt);
+
+/**
+    Reports the number of bytes held by the classifier.
+    @param bv The classifier to measure
+    @return Size in bytes
+*/
+size_t bitvec_bytes(const bitvec_t *bv);
+
+/**
+    Frees a classifier returned by bitvec_build.
+    @param bv The classifier to free, may be NULL
+*/
+void bitvec_free(bitvec_t *bv);
+
+#endif
@@ -0,0 +1,538 @@
+/**
+    @file bytecode.c
+    @author Griffin Brookshire (glbrook2)
+    Compiles the policy into a small branching program. Fields that every
+    remaining rule agrees on are checked once, fields that tell rules
+    apart are switched on through sorted jump tables, and once few rules
+    are left each is checked only on the fields not yet decided. Since
+    rules that wildcard a switched field are copied into every branch,
+    a switch is only taken when it does not blow the program up.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+
+/** Most rules left to a straight run of checks */
+#define BYTECODE_LEAF 4
+
+/** Most rule copies a switch may make, per rule it splits */
+#define BYTECODE_SPREAD 2
+
+/** Most rule copies in all switches together, per rule in the policy */
+#define BYTECODE_BUDGET 16
+
+/** Jump tables up to this size are searched in order */
+#define BYTECODE_SHORT_TABLE 8
+
+/** The rule index returned when no rule matches */
+#define BC_NONE 0xFFFFFFFFu
+
+/** Field value standing for a wildcard port */
+#define WILD ( ( uint64_t ) 1 << 32 )
+
+/**
+ * State kept while compiling.
+ * .bc: the program being written
+ * .rules: the rules being compiled
+ * .fail / .fail_len / .fail_cap: instructions whose .jf must point at
+ *                                the final no-match return
+ * .copies / .budget: rule copies made by switches so far and the limit
+ * .failed: set if memory ran out
+ */
+typedef struct builder {
+    bytecode_t    *bc;
+    const rule_t  *rules;
+    int           *fail;
+    int           fail_len;
+    int           fail_cap;
+    long          copies;
+    long          budget;
+    int           failed;
+} builder_t;
+
+/** Field names, as printed by bytecode_dump */
+static const char *bc_fields[ BC_FIELDS ] = { "proto", "src_ip", "dst_ip", "src_port", "dst_port" };
+
+/**
+    Returns the value a rule requires of a field.
+    @param r The rule
+    @param field One of the BC_ fields
+    @return The value, or WILD if the rule accepts any
+*/
+static uint64_t rule_value( const rule_t *r, int field ) {
+  if ( field == BC_PROTO ) {
+    return r->match.protocol;
+  } else if ( field == BC_SRC_IP ) {
+    return ipaddr_to_int( r->match.src_ip );
+  } else if ( field == BC_DST_IP ) {
+    return ipaddr_to_int( r->match.dst_ip );
+  } else if ( field == BC_SRC_PORT ) {
+    return r->match.src_port == MATCH_PORT_ANY ? WILD : ( uint64_t ) r->match.src_port;
+  }
+  return r->match.dst_port == MATCH_PORT_ANY ? WILD : ( uint64_t ) r->match.dst_port;
+}
+
+/**
+    Returns the value of a packet field.
+    @param pkt The packet
+    @param field One of the BC_ fields
+    @return The value
+*/
+static uint32_t packet_value( const packet_t *pkt, int field ) {
+  switch ( field ) {
+  case BC_PROTO:
+    return pkt->protocol;
+  case BC_SRC_IP:
+    return ipaddr_to_int( pkt->src_ip );
+  case BC_DST_IP:
+    return ipaddr_to_int( pkt->dst_ip );
+  case BC_SRC_PORT:
+    return pkt->src_port;
+  default:
+    return pkt->dst_port;
+  }
+}
+
+/**
+    Orders two field values for qsort.
+    @param a The first value
+    @param b The second value
+    @return Negative, zero or positive as @a is less, equal or greater
+*/
+static int compare_value( const void *a, const void *b ) {
+  uint32_t x = *( const uint32_t * ) a;
+  uint32_t y = *( const uint32_t * ) b;
+  return ( x > y ) - ( x < y );
+}
+
+/**
+    Appends an instruction.
+    @param b The builder
+    @param op The opcode
+    @param reg The register
+    @param k The constant
+    @param jf The jump target
+    @return The index of the instruction, -1 if memory ran out
+*/
+static int emit( builder_t *b, int op, int reg, uint32_t k, uint32_t jf ) {
+  bytecode_t *bc = b->bc;
+  if ( bc->code_len == bc->code_cap ) {
+    int cap = bc->code_cap > 0 ? bc->code_cap * 2 : 64;
+    bc_insn_t *grown = realloc( bc->code, cap * sizeof( bc_insn_t ) );
+    if ( grown == NULL ) {
+      b->failed = 1;
+      return -1;
+    }
+    bc->code = grown;
+    bc->code_cap = cap;
+  }
+  bc_insn_t *in = &bc->code[ bc->code_len ];
+  in->op = op;
+  in->reg = reg;
+  in->pad = 0;
+  in->k = k;
+  in->jf = jf;
+  return bc->code_len++;
+}
+
+/**
+    Makes the instruction at @at jump to the final no-match return.
+    @param b The builder
+    @param at The instruction
+*/
+static void jump_to_fail( builder_t *b, int at ) {
+  if ( b->fail_len == b->fail_cap ) {
+    int cap = b->fail_cap > 0 ? b->fail_cap * 2 : 64;
+    int *grown = realloc( b->fail, cap * sizeof( int ) );
+    if ( grown == NULL ) {
+      b->failed = 1;
+      return;
+    }
+    b->fail = grown;
+    b->fail_cap = cap;
+  }
+  b->fail[ b->fail_len++ ] = at;
+}
+
+/**
+    Reserves @words words of jump table.
+    @param b The builder
+    @param words The number of words
+    @return The offset of the first word, -1 if memory ran out
+*/
+static int reserve_table( builder_t *b, int words ) {
+  bytecode_t *bc = b->bc;
+  if ( bc->table_len + words > bc->table_cap ) {
+    int cap = bc->table_cap > 0 ? bc->table_cap : 64;
+    while ( cap < bc->table_len + words ) {
+      cap *= 2;
+    }
+    uint32_t *grown = realloc( bc->table, cap * sizeof( uint32_t ) );
+    if ( grown == NULL ) {
+      b->failed = 1;
+      return -1;
+    }
+    bc->table = grown;
+    bc->table_cap = cap;
+  }
+  bc->table_len += words;
+  return bc->table_len - words;
+}
+
+/**
+    Emits a run of checks for @n rules, in order, on the fields not yet
+    decided. A rule needing no checks ends the run.
+    @param b The builder
+    @param ids The rule indices, in policy order
+    @param n The number of rules
+    @param decided Bit f set if field f needs no check
+*/
+static void emit_leaf( builder_t *b, const int *ids, int n, int decided ) {
+  for ( int i = 0; i < n; i++ ) {
+    int checks[ BC_FIELDS ];
+    int nchecks = 0;
+    for ( int f = 0; f < BC_FIELDS; f++ ) {
+      uint64_t v = rule_value( &b->rules[ ids[ i ] ], f );
+      if ( !( decided & ( 1 << f ) ) && v != WILD ) {
+        checks[ nchecks++ ] = emit( b, BC_JNE, f, ( uint32_t ) v, 0 );
+      }
+    }
+    emit( b, BC_RET, 0, ids[ i ], 0 );
+    if ( b->failed ) {
+      return;
+    }
+    for ( int c = 0; c < nchecks; c++ ) {
+      b->bc->code[ checks[ c ] ].jf = b->bc->code_len;
+    }
+    if ( nchecks == 0 ) {
+      return;
+    }
+  }
+  emit( b, BC_RET, 0, BC_NONE, 0 );
+}
+
+/**
+    Emits the program for @n rules, every one of which matches on the
+    fields in @decided.
+    @param b The builder
+    @param ids The rule indices, in policy order
+    @param n The number of rules
+    @param decided Bit f set if field f needs no check
+*/
+static void emit_node( builder_t *b, const int *ids, int n, int decided ) {
+  if ( b->failed ) {
+    return;
+  }
+  if ( n == 0 ) {
+    emit( b, BC_RET, 0, BC_NONE, 0 );
+    return;
+  }
+  uint32_t *vals = malloc( n * sizeof( uint32_t ) );
+  if ( vals == NULL ) {
+    b->failed = 1;
+    return;
+  }
+
+  // Check fields all the rules agree on once, and weigh up the others
+  int best = -1, best_d = 0, best_w = 0;
+  long best_cost = 0, best_max = 0;
+  for ( int f = 0; f < BC_FIELDS; f++ ) {
+    if ( decided & ( 1 << f ) ) {
+      continue;
+    }
+    int w = 0, exact = 0;
+    for ( int i = 0; i < n; i++ ) {
+      uint64_t v = rule_value( &b->rules[ ids[ i ] ], f );
+      if ( v == WILD ) {
+        w++;
+      } else {
+        vals[ exact++ ] = ( uint32_t ) v;
+      }
+    }
+    qsort( vals, exact, sizeof( uint32_t ), compare_value );
+    int d = 0;
+    long most = 0;
+    for ( int i = 0, run = 0; i < exact; i++ ) {
+      run = i > 0 && vals[ i ] == vals[ i - 1 ] ? run + 1 : 1;
+      d += run == 1;
+      most = run > most ? run : most;
+    }
+    if ( w == n ) {
+      decided |= 1 << f;
+    } else if ( w == 0 && d == 1 ) {
+      jump_to_fail( b, emit( b, BC_JNE, f, vals[ 0 ], 0 ) );
+      decided |= 1 << f;
+    } else {
+      long cost = ( long ) ( n - w ) + ( long ) w * ( d + 1 );
+      long max = most + w;
+      if ( max < n && cost <= ( long ) BYTECODE_SPREAD * n &&
+           ( best < 0 || cost < best_cost || ( cost == best_cost && max < best_max ) ) ) {
+        best = f;
+        best_d = d;
+        best_w = w;
+        best_cost = cost;
+        best_max = max;
+      }
+    }
+  }
+  if ( n <= BYTECODE_LEAF || best < 0 || b->copies + best_cost > b->budget ) {
+    free( vals );
+    emit_leaf( b, ids, n, decided );
+    return;
+  }
+  b->copies += best_cost;
+
+  // Split the rules by their value of the chosen field, each branch
+  // keeping policy order and the wildcard rules
+  int d = 0;
+  for ( int i = 0; i < n; i++ ) {
+    uint64_t v = rule_value( &b->rules[ ids[ i ] ], best );
+    if ( v != WILD ) {
+      vals[ d++ ] = ( uint32_t ) v;
+    }
+  }
+  qsort( vals, d, sizeof( uint32_t ), compare_value );
+  d = 0;
+  for ( int i = 0; i < n - best_w; i++ ) {
+    if ( i == 0 || vals[ i ] != vals[ i - 1 ] ) {
+      vals[ d++ ] = vals[ i ];
+    }
+  }
+  int *start = malloc( ( best_d + 1 ) * sizeof( int ) );
+  int *fill = calloc( best_d + 1, sizeof( int ) );
+  int *lists = malloc( ( best_cost + 1 ) * sizeof( int ) );
+  if ( start == NULL || fill == NULL || lists == NULL ) {
+    free( vals );
+    free( start );
+    free( fill );
+    free( lists );
+    b->failed = 1;
+    return;
+  }
+  for ( int i = 0; i < n; i++ ) {
+    uint64_t v = rule_value( &b->rules[ ids[ i ] ], best );
+    if ( v != WILD ) {
+      uint32_t *at = bsearch( &( uint32_t ){ ( uint32_t ) v }, vals, d, sizeof( uint32_t ), compare_value );
+      fill[ at - vals ]++;
+    }
+  }
+  for ( int c = 0, off = 0; c <= best_d; c++ ) {
+    start[ c ] = off;
+    off += ( c < best_d ? fill[ c ] : 0 ) + best_w;
+    fill[ c ] = 0;
+  }
+  for ( int i = 0; i < n; i++ ) {
+    uint64_t v = rule_value( &b->rules[ ids[ i ] ], best );
+    if ( v != WILD ) {
+      uint32_t *at = bsearch( &( uint32_t ){ ( uint32_t ) v }, vals, d, sizeof( uint32_t ), compare_value );
+      int c = at - vals;
+      lists[ start[ c ] + fill[ c ]++ ] = ids[ i ];
+    } else {
+      for ( int c = 0; c <= best_d; c++ ) {
+        lists[ start[ c ] + fill[ c ]++ ] = ids[ i ];
+      }
+    }
+  }
+
+  int off = reserve_table( b, 1 + 2 * best_d );
+  int sw = emit( b, BC_SWITCH, best, off, 0 );
+  if ( b->failed ) {
+    free( vals );
+    free( start );
+    free( fill );
+    free( lists );
+    return;
+  }
+  b->bc->table[ off ] = best_d;
+  memcpy( &b->bc->table[ off + 1 ], vals, best_d * sizeof( uint32_t ) );
+  free( vals );
+  for ( int c = 0; c < best_d && !b->failed; c++ ) {
+    b->bc->table[ off + 1 + best_d + c ] = b->bc->code_len;
+    emit_node( b, lists + start[ c ], fill[ c ], decided | ( 1 << best ) );
+  }
+  if ( best_w == 0 ) {
+    jump_to_fail( b, sw );
+  } else if ( !b->failed ) {
+    b->bc->code[ sw ].jf = b->bc->code_len;
+    emit_node( b, lists + start[ best_d ], fill[ best_d ], decided | ( 1 << best ) );
+  }
+  free( start );
+  free( fill );
+  free( lists );
+}
+
+/**
+    Compiles @len rules stored in @rules into a program that loads each
+    field the rules test once, checks fields every rule agrees on once,
+    and branches through jump tables on fields that tell rules apart.
+    @param rules The rules in policy order
+    @param len The number of rules
+    @return The program, or NULL if memory ran out
+*/
+bytecode_t *bytecode_build(const rule_t *rules, int len) {
+  bytecode_t *bc = calloc( 1, sizeof( bytecode_t ) );
+  int *ids = malloc( ( len > 0 ? len : 1 ) * sizeof( int ) );
+  builder_t b = { bc, rules, NULL, 0, 0, 0, ( long ) BYTECODE_BUDGET * len, bc == NULL || ids == NULL };
+  if ( !b.failed ) {
+    // Load only the fields some rule tests
+    for ( int f = 0; f < BC_FIELDS; f++ ) {
+      for ( int i = 0; i < len; i++ ) {
+        if ( rule_value( &rules[ i ], f ) != WILD ) {
+          emit( &b, BC_LD, f, 0, 0 );
+          break;
+        }
+      }
+    }
+    for ( int i = 0; i < len; i++ ) {
+      ids[ i ] = i;
+    }
+    emit_node( &b, ids, len, 0 );
+    if ( b.fail_len > 0 ) {
+      int ret = emit( &b, BC_RET, 0, BC_NONE, 0 );
+      for ( int i = 0; i < b.fail_len && !b.failed; i++ ) {
+        bc->code[ b.fail[ i ] ].jf = ret;
+      }
+    }
+  }
+  free( ids );
+  free( b.fail );
+  if ( b.failed ) {
+    bytecode_free( bc );
+    return NULL;
+  }
+  return bc;
+}
+
+/**
+    Finds the jump target for @v in the jump table at @t.
+    @param t The jump table
+    @param v The value
+    @param absent The target if @v is not in the table
+    @return The target
+*/
+static uint32_t jump( const uint32_t *t, uint32_t v, uint32_t absent ) {
+  uint32_t n = t[ 0 ];
+  const uint32_t *vals = t + 1;
+  if ( n <= BYTECODE_SHORT_TABLE ) {
+    for ( uint32_t i = 0; i < n; i++ ) {
+      if ( vals[ i ] == v ) {
+        return vals[ n + i ];
+      }
+    }
+    return absent;
+  }
+  uint32_t lo = 0, hi = n;
+  while ( lo < hi ) {
+    uint32_t mid = ( lo + hi ) / 2;
+    if ( vals[ mid ] < v ) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo < n && vals[ lo ] == v ? vals[ n + lo ] : absent;
+}
+
+/**
+    Runs the program on @pkt.
+    @param bc The program
+    @param pkt The packet to classify
+    @return Index of the first matching rule, -1 if none match
+*/
+int bytecode_lookup(const bytecode_t *bc, packet_t pkt) {
+  const bc_insn_t *code = bc->code;
+  uint32_t reg[ BC_FIELDS ];
+  uint32_t pc = 0;
+  for ( ;; ) {
+    const bc_insn_t *in = &code[ pc ];
+    switch ( in->op ) {
+    case BC_LD:
+      reg[ in->reg ] = packet_value( &pkt, in->reg );
+      pc++;
+      break;
+    case BC_JNE:
+      pc = reg[ in->reg ] != in->k ? in->jf : pc + 1;
+      break;
+    case BC_SWITCH:
+      pc = jump( bc->table + in->k, reg[ in->reg ], in->jf );
+      break;
+    default:
+      return in->k == BC_NONE ? -1 : ( int ) in->k;
+    }
+  }
+}
+
+/**
+    Prints a field value the way rules write it.
+    @param stream Stream to print to
+    @param field One of the BC_ fields
+    @param v The value
+*/
+static void print_value( FILE *stream, int field, uint32_t v ) {
+  if ( field == BC_PROTO ) {
+    fprintf( stream, "%s", v == PROTO_TCP ? "tcp" : "udp" );
+  } else if ( field == BC_SRC_IP || field == BC_DST_IP ) {
+    fprintf( stream, "%u.%u.%u.%u", v >> 24, ( v >> 16 ) & 0xFF, ( v >> 8 ) & 0xFF, v & 0xFF );
+  } else {
+    fprintf( stream, "%u", v );
+  }
+}
+
+/**
+    Prints the program to @stream, one instruction per line.
+    @param stream Stream to print to
+    @param bc The program
+*/
+void bytecode_dump(FILE *stream, const bytecode_t *bc) {
+  fprintf( stream, "bytecode %d instructions, %d table words, %zu bytes\n", bc->code_len,
+           bc->table_len, bytecode_bytes( bc ) );
+  for ( int pc = 0; pc < bc->code_len; pc++ ) {
+    const bc_insn_t *in = &bc->code[ pc ];
+    fprintf( stream, "%04d  ", pc );
+    if ( in->op == BC_LD ) {
+      fprintf( stream, "ld     %s\n", bc_fields[ in->reg ] );
+    } else if ( in->op == BC_JNE ) {
+      fprintf( stream, "jne    %s, ", bc_fields[ in->reg ] );
+      print_value( stream, in->reg, in->k );
+      fprintf( stream, ", %04u\n", in->jf );
+    } else if ( in->op == BC_SWITCH ) {
+      const uint32_t *t = bc->table + in->k;
+      fprintf( stream, "switch %s, %u cases, default %04u\n", bc_fields[ in->reg ], t[ 0 ], in->jf );
+      for ( uint32_t i = 0; i < t[ 0 ]; i++ ) {
+        fprintf( stream, "          " );
+        print_value( stream, in->reg, t[ 1 + i ] );
+        fprintf( stream, " -> %04u\n", t[ 1 + t[ 0 ] + i ] );
+      }
+    } else if ( in->k == BC_NONE ) {
+      fprintf( stream, "ret    default\n" );
+    } else {
+      fprintf( stream, "ret    [%u]\n", in->k + 1 );
+    }
+  }
+}
+
+/**
+    Reports the number of bytes held by the program.
+    @param bc The program to measure
+    @return Size in bytes
+*/
+size_t bytecode_bytes(const bytecode_t *bc) {
+  return sizeof( bytecode_t ) + bc->code_cap * sizeof( bc_insn_t ) +
+         bc->table_cap * sizeof( uint32_t );
+}
+
+/**
+    Frees a program returned by bytecode_build.
+    @param bc The program to free, may be NULL
+*/
+void bytecode_free(bytecode_t *bc) {
+  if ( bc == NULL ) {
+    return;
+  }
+  free( bc->code );
+  free( bc->table );
+  free( bc );
+}
@@ -0,0 +1,105 @@
+/**
+    @file bytecode.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior and data for the policy compiled into bytecode.
+*/
+
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet.h"
+#include "policy.h"
+
+/** Load packet field .reg into register .reg */
+#define BC_LD     0
+
+/** Go to .jf if register .reg is not .k, else to the next instruction */
+#define BC_JNE    1
+
+/** Look register .reg up in the jump table at .k, go to .jf if absent */
+#define BC_SWITCH 2
+
+/** Stop with rule index .k, all ones for no rule */
+#define BC_RET    3
+
+/** Packet fields, each loaded into the register of the same number */
+#define BC_PROTO    0
+#define BC_SRC_IP   1
+#define BC_DST_IP   2
+#define BC_SRC_PORT 3
+#define BC_DST_PORT 4
+#define BC_FIELDS   5
+
+/**
+ * One instruction.
+ * .op: one of the BC_ opcodes
+ * .reg: the register, one of the BC_ fields
+ * .k: the constant, jump table offset or rule index
+ * .jf: the jump target
+ */
+typedef struct bc_insn {
+    uint8_t   op;
+    uint8_t   reg;
+    uint16_t  pad;
+    uint32_t  k;
+    uint32_t  jf;
+} bc_insn_t;
+
+/**
+ * A compiled policy. Each jump table in .table is a count c, then c
+ * sorted values, then the c matching jump targets.
+ * .code / .code_len / .code_cap: the program, run from instruction 0
+ * .table / .table_len / .table_cap: the jump tables
+ */
+typedef struct bytecode {
+    bc_insn_t *code;
+    int       code_len;
+    int       code_cap;
+    uint32_t  *table;
+    int       table_len;
+    int       table_cap;
+} bytecode_t;
+
+/**
+    Compiles @len rules stored in @rules into a program that loads each
+    field the rules test once, checks fields every rule agrees on once,
+    and branches through jump tables on fields that tell rules apart.
+    @param rules The rules in policy order
+    @param len The number of rules
+    @return The program, or NULL if memory ran out
+*/
+bytecode_t *bytecode_build(const rule_t *rules, int len);
+
+/**
+    Runs the program on @pkt.
+    @param bc The program
+    @param pkt The packet to classify
+    @return Index of the first matching rule, -1 if none match
+*/
+int bytecode_lookup(const bytecode_t *bc, packet_t pkt);
+
+/**
+    Prints the program to @stream, one instruction per line.
+    @param stream Stream to print to
+    @param bc The program
+*/
+void bytecode_dump(FILE *stream, const bytecode_t *bc);
+
+/**
+    Reports the number of bytes held by the program.
+    @param bc The program to measure
+    @return Size in bytes
+*/
+size_t bytecode_bytes(const bytecode_t *bc);
+
+/**
+    Frees a program returned by bytecode_build.
+    @param bc The program to free, may be NULL
+*/
+void bytecode_free(bytecode_t *bc);
+
+#endif
@@ -0,0 +1,139 @@
+/**
+    @file cache.c
+    @author Griffin Brookshire (glbrook2)
+    Caches recent verdicts by flow key. Each bucket is one cache line of
+    entries, picked by the key's stored hash and direction, so a lookup
+    touches a single line and hashes nothing, and entries carry the
+    policy generation they were computed under so any policy change
+    invalidates them without touching the cache.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+/** Where the CLOCK hand of a bucket is kept */
+#define HAND( bucket ) ( ( bucket )->way[ CACHE_WAYS - 1 ].pad[ 0 ] )
+
+/**
+    Creates a cache with room for at least @entries verdicts.
+    @param entries The number of verdicts to hold
+    @return The new cache, or NULL if memory ran out
+*/
+cache_t *cache_create(int entries) {
+  cache_t *cache = calloc( 1, sizeof( cache_t ) );
+  if ( cache == NULL ) {
+    return NULL;
+  }
+  uint32_t buckets = 1;
+  while ( buckets * CACHE_WAYS < ( uint32_t ) entries && buckets < ( 1u << 28 ) ) {
+    buckets *= 2;
+  }
+  void *mem = NULL;
+  if ( posix_memalign( &mem, CACHE_LINE, buckets * sizeof( cache_bucket_t ) ) != 0 ) {
+    free( cache );
+    return NULL;
+  }
+  memset( mem, 0, buckets * sizeof( cache_bucket_t ) );
+  cache->buckets = mem;
+  cache->mask = buckets - 1;
+  return cache;
+}
+
+/**
+    Looks up the verdict cached for the flow @key.
+    Entries from a generation other than @gen are treated as missing.
+    @param cache The cache to search
+    @param key The flow key of the packet to look up
+    @param gen The current policy generation
+    @param action Set to the cached action on a hit
+    @param pos Set to the cached rule position on a hit
+    @return 1 on a hit, 0 on a miss
+*/
+int cache_lookup(cache_t *cache, const flow_key_t *key, uint32_t gen, int *action, int *pos) {
+  cache_bucket_t *bucket = &cache->buckets[ FLOW_DIRECTED_HASH( *key ) & cache->mask ];
+  for ( int w = 0; w < CACHE_WAYS; w++ ) {
+    cache_entry_t *e = &bucket->way[ w ];
+    if ( e->gen == gen && FLOW_KEY_EQUAL( e->key, *key ) ) {
+      e->ref = 1;
+      *action = e->action;
+      *pos = e->pos;
+      cache->hits++;
+      return 1;
+    }
+  }
+  cache->misses++;
+  return 0;
+}
+
+/**
+    Stores the verdict for the flow @key, evicting with CLOCK if its line
+    is full. A flow already in the line is updated rather than stored
+    twice.
+    @param cache The cache to fill
+    @param key The flow key of the packet the verdict is for
+    @param gen The policy generation the verdict was computed under
+    @param action The action to cache
+    @param pos The rule position to cache
+*/
+void cache_insert(cache_t *cache, const flow_key_t *key, uint32_t gen, int action, int pos) {
+  cache_bucket_t *bucket = &cache->buckets[ FLOW_DIRECTED_HASH( *key ) & cache->mask ];
+
+  // A live entry for the key is refreshed, stale entries are free,
+  // otherwise sweep the hand past referenced ones
+  int victim = -1;
+  for ( int w = 0; w < CACHE_WAYS; w++ ) {
+    cache_entry_t *e = &bucket->way[ w ];
+    if ( e->gen != gen ) {
+      if ( victim < 0 ) {
+        victim = w;
+      }
+    } else if ( FLOW_KEY_EQUAL( e->key, *key ) ) {
+      // Two misses on one flow in a batch both insert it
+      e->pos = pos;
+      e->action = ( uint8_t ) action;
+      return;
+    }
+  }
+  if ( victim < 0 ) {
+    int hand = HAND( bucket );
+    while ( bucket->way[ hand ].ref ) {
+      bucket->way[ hand ].ref = 0;
+      hand = ( hand + 1 ) % CACHE_WAYS;
+    }
+    victim = hand;
+    HAND( bucket ) = ( hand + 1 ) % CACHE_WAYS;
+    cache->evictions++;
+  }
+  cache_entry_t *e = &bucket->way[ victim ];
+  e->key = *key;
+  e->gen = gen;
+  e->pos = pos;
+  e->action = ( uint8_t ) action;
+  e->ref = 0;
+}
+
+/**
+    Reports the number of verdicts the cache can hold.
+    @param cache The cache to measure
+    @return The number of entries
+*/
+int cache_size(const cache_t *cache) {
+  return ( int ) ( cache->mask + 1 ) * CACHE_WAYS;
+}
+
+/**
+    Frees a cache returned by cache_create.
+    @param cache The cache to free, may be NULL
+*/
+void cache_free(cache_t *cache) {
+  if ( cache == NULL ) {
+    return;
+  }
+  free( cache->buckets );
+  free( cache );
+}
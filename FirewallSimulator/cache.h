@@ -0,0 +1,101 @@
+/**
+    @file cache.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior and data for the flow verdict cache.
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+#include "packet.h"
+
+/** Entries sharing one cache line */
+#define CACHE_WAYS 2
+
+/** Size of the cache lines the buckets are aligned to */
+#define CACHE_LINE 64
+
+/**
+ * A cached verdict for one 5-tuple, 32 bytes so two fill a cache line.
+ * .key: the flow the verdict is for
+ * .gen: the policy generation the verdict was computed under, 0 if unused
+ * .ref: set on every hit, cleared as the CLOCK hand passes
+ */
+typedef struct cache_entry {
+    flow_key_t  key;
+    uint32_t    gen;
+    int32_t     pos;
+    uint8_t     action;
+    uint8_t     ref;
+    uint8_t     pad[ 6 ];
+} cache_entry_t;
+
+/**
+ * One cache line worth of entries. The hand is kept in the last entry's
+ * padding so the bucket stays exactly one line.
+ */
+typedef struct cache_bucket {
+    cache_entry_t way[ CACHE_WAYS ];
+} cache_bucket_t;
+
+/**
+ * A fixed size, set associative verdict cache.
+ * .mask: the number of buckets minus one
+ * .hits / .misses: lookups answered and not answered from the cache
+ * .evictions: valid entries replaced by a new flow
+ */
+typedef struct cache {
+    cache_bucket_t  *buckets;
+    uint32_t        mask;
+    uint64_t        hits;
+    uint64_t        misses;
+    uint64_t        evictions;
+} cache_t;
+
+/**
+    Creates a cache with room for at least @entries verdicts.
+    @param entries The number of verdicts to hold
+    @return The new cache, or NULL if memory ran out
+*/
+cache_t *cache_create(int entries);
+
+/**
+    Looks up the verdict cached for the flow @key.
+    Entries from a generation other than @gen are treated as missing.
+    @param cache The cache to search
+    @param key The flow key of the packet to look up
+    @param gen The current policy generation
+    @param action Set to the cached action on a hit
+    @param pos Set to the cached rule position on a hit
+    @return 1 on a hit, 0 on a miss
+*/
+int cache_lookup(cache_t *cache, const flow_key_t *key, uint32_t gen, int *action, int *pos);
+
+/**
+    Stores the verdict for the flow @key, evicting with CLOCK if its line
+    is full. A flow already in the line is updated rather than stored
+    twice.
+    @param cache The cache to fill
+    @param key The flow key of the packet the verdict is for
+    @param gen The policy generation the verdict was computed under
+    @param action The action to cache
+    @param pos The rule position to cache
+*/
+void cache_insert(cache_t *cache, const flow_key_t *key, uint32_t gen, int action, int pos);
+
+/**
+    Reports the number of verdicts the cache can hold.
+    @param cache The cache to measure
+    @return The number of entries
+*/
+int cache_size(const cache_t *cache);
+
+/**
+    Frees a cache returned by cache_create.
+    @param cache The cache to free, may be NULL
+*/
+void cache_free(cache_t *cache);
+
+#endif
@@ -0,0 +1,278 @@
+/**
+    @file churn.c
+    @author Griffin Brookshire (glbrook2)
+    Measures lookup latency on reader threads while the main thread keeps
+    inserting and deleting rules, and how long each change takes to
+    publish. Every lookup also tests a packet only rule 1 matches, so a
+    reader that ever sees a half-changed policy is counted.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "packet.h"
+#include "policy.h"
+
+/** Rules in the policy by default */
+#define CHURN_RULES 1000
+
+/** Reader threads by default */
+#define CHURN_THREADS 2
+
+/** Rule changes made by the writer */
+#define CHURN_UPDATES 1000
+
+/** Lookup latencies kept per reader */
+#define CHURN_SAMPLES ( 1 << 20 )
+
+/**
+ * One reader thread and what it measured.
+ * .seed: the reader's random state
+ * .lat / .count: latency of each lookup in ns
+ * .lookups: lookups made, including those past the last sample
+ * .torn: lookups that saw the policy without its first rule
+ */
+typedef struct reader {
+    pthread_t           thread;
+    unsigned int        seed;
+    unsigned int        *lat;
+    int                 count;
+    unsigned long long  lookups;
+    unsigned long long  torn;
+} reader_t;
+
+/** Set by the writer once it has made every change */
+static int stop = 0;
+
+/* Print out a usage message. */
+static void usage()
+{
+  fprintf(stderr, "Usage: churn [<rules> [<threads> [linear|tree|tuple|bitvec|scan|bytecode]]]\n");
+}
+
+/**
+    Reads the monotonic clock.
+    @return The time in nanoseconds
+*/
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+    Makes an address from a 32-bit value.
+    @param v The packed address
+    @return The address
+*/
+static ipaddr_t make_ip( unsigned int v ) {
+  ipaddr_t ip;
+  ip.a = v >> 24;
+  ip.b = v >> 16;
+  ip.c = v >> 8;
+  ip.d = v;
+  return ip;
+}
+
+/**
+    Makes a random rule inside 10.0.0.0/8.
+    @return The rule
+*/
+static rule_t make_rule() {
+  rule_t rule;
+  rule.action = rand() % 2;
+  rule.match.protocol = rand() % 2;
+  rule.match.src_ip = make_ip( 0x0A000000 | ( rand() & 0xFFFFFF ) );
+  rule.match.dst_ip = make_ip( 0x0A000000 | ( rand() & 0xFFFFFF ) );
+  rule.match.src_port = rand() % 4 ? MATCH_PORT_ANY : rand() % PORT_MAX;
+  rule.match.dst_port = rand() % 8 ? rand() % 1024 : MATCH_PORT_ANY;
+  return rule;
+}
+
+/**
+    Makes the packet only the first rule matches.
+    @return The packet
+*/
+static packet_t sentinel() {
+  packet_t pkt;
+  pkt.protocol = 0;
+  pkt.src_ip = make_ip( 0xC0A8FF01 );
+  pkt.dst_ip = make_ip( 0xC0A8FF02 );
+  pkt.src_port = 1;
+  pkt.dst_port = 2;
+  return pkt;
+}
+
+/**
+    Orders two latencies for qsort.
+    @param a The first latency
+    @param b The second latency
+    @return Negative, zero or positive as @a is less, equal or greater
+*/
+static int compare_lat( const void *a, const void *b ) {
+  unsigned int x = *( const unsigned int * ) a;
+  unsigned int y = *( const unsigned int * ) b;
+  return ( x > y ) - ( x < y );
+}
+
+/**
+    Prints the median, 99th percentile and worst of @n latencies.
+    @param lat The latencies, sorted in place
+    @param n The number of latencies
+*/
+static void print_lat( unsigned int *lat, int n ) {
+  if ( n == 0 ) {
+    fprintf( stdout, "no samples\n" );
+    return;
+  }
+  qsort( lat, n, sizeof( unsigned int ), compare_lat );
+  fprintf( stdout, "p50 %u ns, p99 %u ns, max %u ns\n",
+           lat[ n / 2 ], lat[ ( int ) ( n * 0.99 ) ], lat[ n - 1 ] );
+}
+
+/**
+    Tests packets against the published policy until the writer is done.
+    @param arg The reader_t
+    @return NULL
+*/
+static void *read_loop( void *arg ) {
+  reader_t *r = arg;
+  policy_reader_t *reader = policy_reader_register();
+  if ( reader == NULL ) {
+    return NULL;
+  }
+  packet_t pkts[ 2 ];
+  pkts[ 1 ] = sentinel();
+  int actions[ 2 ];
+  int pos[ 2 ];
+  while ( !__atomic_load_n( &stop, __ATOMIC_RELAXED ) ) {
+    pkts[ 0 ].protocol = rand_r( &r->seed ) % 2;
+    pkts[ 0 ].src_ip = make_ip( 0x0A000000 | ( rand_r( &r->seed ) & 0xFFFFFF ) );
+    pkts[ 0 ].dst_ip = make_ip( 0x0A000000 | ( rand_r( &r->seed ) & 0xFFFFFF ) );
+    pkts[ 0 ].src_port = rand_r( &r->seed ) % PORT_MAX;
+    pkts[ 0 ].dst_port = rand_r( &r->seed ) % 1024;
+    double start = now_ns();
+    const policy_frozen_t *version = policy_read_lock( reader );
+    policy_frozen_test_batch( version, pkts, 2, actions, pos );
+    policy_read_unlock( reader );
+    double took = now_ns() - start;
+    if ( pos[ 1 ] != 1 || actions[ 1 ] != ACTION_ALLOW ) {
+      r->torn++;
+    }
+    if ( r->count < CHURN_SAMPLES ) {
+      r->lat[ r->count++ ] = took;
+    }
+    r->lookups++;
+  }
+  policy_reader_unregister( reader );
+  return NULL;
+}
+
+/* Starting point for the benchmark.
+   @param argc number of command-line arguments.
+   @param argv list of command-line arguments.
+   @return program exit status
+*/
+int main(int argc, char *argv[])
+{
+  static const char *engines[] = { "linear", "tree", "tuple", "bitvec", "scan", "bytecode" };
+  int len = argc > 1 ? atoi( argv[ 1 ] ) : CHURN_RULES;
+  int threads = argc > 2 ? atoi( argv[ 2 ] ) : CHURN_THREADS;
+  int engine = argc > 3 ? -1 : ENGINE_LINEAR;
+  for ( int e = ENGINE_LINEAR; argc > 3 && e <= ENGINE_BYTECODE; e++ ) {
+    if ( strcmp( argv[ 3 ], engines[ e ] ) == 0 ) {
+      engine = e;
+    }
+  }
+  if ( argc > 4 || len < 2 || threads < 1 || threads >= POLICY_MAX_READERS || engine < 0 ) {
+    usage();
+    exit( 1 );
+  }
+
+  srand( 1 );
+  policy_init();
+  policy_set_engine( engine );
+  packet_t probe = sentinel();
+  rule_t first;
+  first.action = ACTION_ALLOW;
+  first.match.protocol = probe.protocol;
+  first.match.src_ip = probe.src_ip;
+  first.match.src_port = probe.src_port;
+  first.match.dst_ip = probe.dst_ip;
+  first.match.dst_port = probe.dst_port;
+  policy_append( first );
+  for ( int i = 1; i < len; i++ ) {
+    policy_append( make_rule() );
+  }
+  if ( policy_publish() != 0 ) {
+    fprintf( stderr, "Out of memory.\n" );
+    exit( 1 );
+  }
+
+  reader_t *readers = calloc( threads, sizeof( reader_t ) );
+  unsigned int *updates = malloc( CHURN_UPDATES * sizeof( unsigned int ) );
+  if ( readers == NULL || updates == NULL ) {
+    fprintf( stderr, "Out of memory.\n" );
+    exit( 1 );
+  }
+  for ( int t = 0; t < threads; t++ ) {
+    readers[ t ].seed = t + 1;
+    readers[ t ].lat = malloc( CHURN_SAMPLES * sizeof( unsigned int ) );
+    if ( readers[ t ].lat == NULL ||
+         pthread_create( &readers[ t ].thread, NULL, read_loop, &readers[ t ] ) != 0 ) {
+      fprintf( stderr, "Could not start readers.\n" );
+      exit( 1 );
+    }
+  }
+
+  // Alternate inserts and deletes below the first rule, keeping the size
+  for ( int u = 0; u < CHURN_UPDATES; u++ ) {
+    double start = now_ns();
+    if ( u % 2 == 0 ) {
+      policy_insert( make_rule(), 2 + rand() % len );
+    } else {
+      policy_delete( 2 + rand() % len );
+    }
+    updates[ u ] = now_ns() - start;
+  }
+  __atomic_store_n( &stop, 1, __ATOMIC_RELAXED );
+
+  unsigned long long lookups = 0;
+  unsigned long long torn = 0;
+  int samples = 0;
+  for ( int t = 0; t < threads; t++ ) {
+    pthread_join( readers[ t ].thread, NULL );
+    lookups += readers[ t ].lookups;
+    torn += readers[ t ].torn;
+    samples += readers[ t ].count;
+  }
+  unsigned int *lat = malloc( ( samples ? samples : 1 ) * sizeof( unsigned int ) );
+  if ( lat == NULL ) {
+    fprintf( stderr, "Out of memory.\n" );
+    exit( 1 );
+  }
+  samples = 0;
+  for ( int t = 0; t < threads; t++ ) {
+    memcpy( lat + samples, readers[ t ].lat, readers[ t ].count * sizeof( unsigned int ) );
+    samples += readers[ t ].count;
+    free( readers[ t ].lat );
+  }
+
+  fprintf( stdout, "%d rules, %s engine\n", len, engines[ engine ] );
+  fprintf( stdout, "lookups: %llu on %d threads, ", lookups, threads );
+  print_lat( lat, samples );
+  fprintf( stdout, "updates: %d, ", CHURN_UPDATES );
+  print_lat( updates, CHURN_UPDATES );
+  fprintf( stdout, "torn reads: %llu\n", torn );
+
+  policy_free();
+  free( lat );
+  free( updates );
+  free( readers );
+  return torn == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -11,6 +11,7 @@
 #include <ctype.h>
 
 #include "command.h"
+#include "report.h"
 
 /** Help cmd type */
 #define HELP 1
@@ -36,6 +37,45 @@
 /** Quit cmd type */
 #define QUIT 8
 
+/** Engine cmd type */
+#define ENGINE 9
+
+/** Report cmd type */
+#define REPORT 10
+
+/** Cache cmd type */
+#define CACHE 11
+
+/** Save cmd type */
+#define SAVE 12
+
+/** Load cmd type */
+#define LOAD 13
+
+/** Stats cmd type */
+#define STATS 14
+
+/** Optimize cmd type */
+#define OPTIMIZE 15
+
+/** Reorder cmd type */
+#define REORDER 16
+
+/** Conntrack cmd type */
+#define CONNTRACK 17
+
+/** Dump bytecode cmd type */
+#define DUMP_BYTECODE 18
+
+/** Begin cmd type */
+#define BEGIN 19
+
+/** Commit cmd type */
+#define COMMIT 20
+
+/** Abort cmd type */
+#define ABORT 21
+
 /** BITS bits */
 #define BITS 8
 
@@ -225,7 +265,7 @@ int parse_command(char *line, fw_cmd_t *cmd) {
     }
     word = strtok( NULL, " " );
     if ( strcmp( word, "*" ) == 0 ) {
-      cmd->src_prt = -1;
+      cmd->dst_prt = MATCH_PORT_ANY;
     } else if ( isNumber( word ) ) {
       port = atoi( word );
       if ( port < PORT_MIN || port > PORT_MAX ) {
@@ -373,7 +413,7 @@ int parse_command(char *line, fw_cmd_t *cmd) {
     }
     word = strtok( NULL, " " );
     if ( strcmp( word, "*" ) == 0 ) {
-      cmd->src_prt = -1;
+      cmd->dst_prt = MATCH_PORT_ANY;
     } else if ( isNumber( word ) ) {
       port = atoi( word );
       if ( port < PORT_MIN || port > PORT_MAX ) {
@@ -549,6 +589,155 @@ int parse_command(char *line, fw_cmd_t *cmd) {
     return 0;
 
 
+  } else if ( strcmp( word, "engine" ) == 0 ) {
+    cmd->command_type = ENGINE;
+    word = strtok( NULL, " " );
+    if ( word != NULL && strcmp( word, "linear" ) == 0 ) {
+      cmd->engine = ENGINE_LINEAR;
+      return 0;
+    } else if ( word != NULL && strcmp( word, "tree" ) == 0 ) {
+      cmd->engine = ENGINE_TREE;
+      return 0;
+    } else if ( word != NULL && strcmp( word, "tuple" ) == 0 ) {
+      cmd->engine = ENGINE_TUPLE;
+      return 0;
+    } else if ( word != NULL && strcmp( word, "bitvec" ) == 0 ) {
+      cmd->engine = ENGINE_BITVEC;
+      return 0;
+    } else if ( word != NULL && strcmp( word, "scan" ) == 0 ) {
+      cmd->engine = ENGINE_SCAN;
+      return 0;
+    } else if ( word != NULL && strcmp( word, "bytecode" ) == 0 ) {
+      cmd->engine = ENGINE_BYTECODE;
+      return 0;
+    }
+    fprintf( stdout, "Error: Could not parse command.\n" );
+    return -1;
+
+
+  } else if ( strcmp( word, "report" ) == 0 ) {
+    cmd->command_type = REPORT;
+    word = strtok( NULL, " " );
+    if ( word != NULL && strcmp( word, "text" ) == 0 ) {
+      cmd->format = REPORT_TEXT;
+      return 0;
+    } else if ( word != NULL && strcmp( word, "csv" ) == 0 ) {
+      cmd->format = REPORT_CSV;
+      return 0;
+    } else if ( word != NULL && strcmp( word, "binary" ) == 0 ) {
+      cmd->format = REPORT_BINARY;
+      return 0;
+    } else if ( word != NULL && strcmp( word, "off" ) == 0 ) {
+      cmd->format = REPORT_OFF;
+      return 0;
+    }
+    fprintf( stdout, "Error: Could not parse command.\n" );
+    return -1;
+
+
+  } else if ( strcmp( word, "cache" ) == 0 || strcmp( word, "conntrack" ) == 0 ) {
+    cmd->command_type = strcmp( word, "cache" ) == 0 ? CACHE : CONNTRACK;
+    word = strtok( NULL, " " );
+    if ( word == NULL ) {
+      cmd->cache_size = -1;
+      return 0;
+    } else if ( strcmp( word, "off" ) == 0 ) {
+      cmd->cache_size = 0;
+      return 0;
+    } else if ( isNumber( word ) ) {
+      cmd->cache_size = atoi( word );
+      return 0;
+    }
+    fprintf( stdout, "Error: Could not parse command.\n" );
+    return -1;
+
+
+  } else if ( strcmp( word, "save" ) == 0 || strcmp( word, "load" ) == 0 ) {
+    cmd->command_type = strcmp( word, "save" ) == 0 ? SAVE : LOAD;
+    word = strtok( NULL, " " );
+    if ( word != NULL && strlen( word ) < CMD_FILE_LEN ) {
+      strcpy( cmd->file, word );
+      return 0;
+    }
+    fprintf( stdout, "Error: Could not parse command.\n" );
+    return -1;
+
+
+  } else if ( strcmp( word, "stats" ) == 0 ) {
+    cmd->command_type = STATS;
+    word = strtok( NULL, " " );
+    if ( word == NULL ) {
+      cmd->stats_op = 0;
+      return 0;
+    } else if ( strcmp( word, "on" ) == 0 ) {
+      cmd->stats_op = 1;
+      return 0;
+    } else if ( strcmp( word, "off" ) == 0 ) {
+      cmd->stats_op = 2;
+      return 0;
+    } else if ( strcmp( word, "reset" ) == 0 ) {
+      cmd->stats_op = 3;
+      return 0;
+    } else if ( strcmp( word, "dump" ) == 0 ) {
+      cmd->stats_op = 4;
+      word = strtok( NULL, " " );
+      if ( word != NULL && strlen( word ) < CMD_FILE_LEN ) {
+        strcpy( cmd->file, word );
+        return 0;
+      }
+    }
+    fprintf( stdout, "Error: Could not parse command.\n" );
+    return -1;
+
+
+  } else if ( strcmp( word, "optimize" ) == 0 ) {
+    cmd->command_type = OPTIMIZE;
+    word = strtok( NULL, " " );
+    if ( word == NULL ) {
+      cmd->compact = 0;
+      return 0;
+    } else if ( strcmp( word, "compact" ) == 0 ) {
+      cmd->compact = 1;
+      return 0;
+    }
+    fprintf( stdout, "Error: Could not parse command.\n" );
+    return -1;
+
+
+  } else if ( strcmp( word, "reorder" ) == 0 ) {
+    cmd->command_type = REORDER;
+    word = strtok( NULL, " " );
+    if ( word == NULL ) {
+      cmd->reorder = 1;
+      return 0;
+    } else if ( strcmp( word, "off" ) == 0 ) {
+      cmd->reorder = 0;
+      return 0;
+    }
+    fprintf( stdout, "Error: Could not parse command.\n" );
+    return -1;
+
+
+  } else if ( strcmp( word, "dump-bytecode" ) == 0 ) {
+    cmd->command_type = DUMP_BYTECODE;
+    return 0;
+
+
+  } else if ( strcmp( word, "begin" ) == 0 ) {
+    cmd->command_type = BEGIN;
+    return 0;
+
+
+  } else if ( strcmp( word, "commit" ) == 0 ) {
+    cmd->command_type = COMMIT;
+    return 0;
+
+
+  } else if ( strcmp( word, "abort" ) == 0 ) {
+    cmd->command_type = ABORT;
+    return 0;
+
+
   } else if ( strcmp( word, "quit" ) == 0 ){
     cmd->command_type = QUIT;
     return 0;
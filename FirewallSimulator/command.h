@@ -13,6 +13,9 @@
 /** BITS bits */
 #define BITS 8
 
+/** Longest file name a command can hold */
+#define CMD_FILE_LEN 64
+
 /**
     Representation for a command that has been parsed.
     TYPES
@@ -24,6 +27,12 @@
     6 - test
     7 - print
     8 - quit
+    9 - engine
+    10 - report
+    11 - cache
+    12 - save
+    13 - load
+    14 - stats
 */
 typedef struct fw_cmd {
     int command_type;
@@ -41,6 +50,13 @@ typedef struct fw_cmd {
     int dst_prt;
     int pos;
     int all; // 0 = no, 1 = all
+    int engine; // one of the ENGINE_ values in policy.h
+    int format; // one of the REPORT_ values in report.h
+    int cache_size; // cache or conntrack entries, 0 = off, -1 = print counters
+    int stats_op; // 0 = print, 1 = on, 2 = off, 3 = reset, 4 = dump to file
+    int compact; // 0 = report only, 1 = remove the rules found
+    int reorder; // 1 = try hot rules first, 0 = back to policy order
+    char file[ CMD_FILE_LEN ]; // snapshot file for save and load, stats dump file
 } fw_cmd_t;
 
 /**
@@ -0,0 +1,270 @@
+/**
+    @file conntrack.c
+    @author Griffin Brookshire (glbrook2)
+    Tracks allowed flows so their later packets, in either direction,
+    skip the policy. Like the verdict cache, flows carry the policy
+    generation they were allowed under, so a policy change retires them.
+    The table is never resized: it is sized for its limit up front and
+    stale flows are cleared out lazily, by the probes that meet them and
+    by a sweep when the table fills, so memory stays fixed however fast
+    flows come and go.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "conntrack.h"
+
+/**
+    Puts the lower endpoint of @key first, so both directions give the
+    same flow. The hash is the same either way.
+    @param key The flow key of a packet
+    @return The flow as it is stored
+*/
+static flow_key_t make_flow( const flow_key_t *key ) {
+  if ( key->src_ip < key->dst_ip ||
+       ( key->src_ip == key->dst_ip && key->src_port <= key->dst_port ) ) {
+    return *key;
+  }
+  return flow_key_reverse( *key );
+}
+
+/**
+    Empties slot @i, moving later entries of the probe run back so that
+    no lookup stops short of them.
+    @param ct The table
+    @param i The slot to empty
+*/
+static void remove_at( conntrack_t *ct, uint32_t i ) {
+  for ( uint32_t j = ( i + 1 ) & ct->mask; ct->slots[ j ].expires != 0; j = ( j + 1 ) & ct->mask ) {
+    conntrack_entry_t *e = &ct->slots[ j ];
+    uint32_t k = FLOW_HASH( e->key ) & ct->mask;
+
+    // An entry whose home lies after the hole, up to itself, stays put
+    if ( i <= j ? ( i < k && k <= j ) : ( i < k || k <= j ) ) {
+      continue;
+    }
+    ct->slots[ i ] = *e;
+    i = j;
+  }
+  ct->slots[ i ].expires = 0;
+  ct->used--;
+}
+
+/**
+    Tells whether an entry has timed out or belongs to an older policy.
+    @param e The entry, in use
+    @param now The current second
+    @param gen The current policy generation
+    @return 1 if it is stale, 0 otherwise
+*/
+static int stale( const conntrack_entry_t *e, uint32_t now, uint32_t gen ) {
+  return e->expires <= now || e->gen != gen;
+}
+
+/**
+    Probes for @f, removing stale entries on the way.
+    @param ct The table
+    @param f The flow
+    @param now The current second
+    @param gen The current policy generation
+    @param found Set to 1 if the flow is tracked, 0 if not
+    @return The flow's slot if found, otherwise the empty slot ending the run
+*/
+static uint32_t probe( conntrack_t *ct, const flow_key_t *f, uint32_t now, uint32_t gen,
+                       int *found ) {
+  uint32_t i = FLOW_HASH( *f ) & ct->mask;
+  for ( ;; ) {
+    conntrack_entry_t *e = &ct->slots[ i ];
+    if ( e->expires == 0 ) {
+      *found = 0;
+      return i;
+    }
+    if ( stale( e, now, gen ) ) {
+      // The slot now holds the next entry of the run, or is empty
+      remove_at( ct, i );
+      ct->expired++;
+      continue;
+    }
+    if ( FLOW_KEY_EQUAL( e->key, *f ) ) {
+      *found = 1;
+      return i;
+    }
+    i = ( i + 1 ) & ct->mask;
+  }
+}
+
+/**
+    Removes every stale flow.
+    @param ct The table
+    @param now The current second
+    @param gen The current policy generation
+*/
+static void sweep( conntrack_t *ct, uint32_t now, uint32_t gen ) {
+  for ( uint32_t i = 0; i <= ct->mask; i++ ) {
+    while ( ct->slots[ i ].expires != 0 && stale( &ct->slots[ i ], now, gen ) ) {
+      remove_at( ct, i );
+      ct->expired++;
+    }
+  }
+}
+
+/**
+    Returns how long a flow of @protocol stays tracked while idle.
+    @param protocol The protocol
+    @return The timeout in seconds
+*/
+static uint32_t timeout( uint32_t protocol ) {
+  return protocol == PROTO_TCP ? CONNTRACK_TCP_TIMEOUT : CONNTRACK_UDP_TIMEOUT;
+}
+
+/**
+    Reads the monotonic clock.
+    @return The time in seconds
+*/
+static double clock_seconds() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+    Creates a table that tracks up to @entries flows.
+    @param entries The most flows to track
+    @return The new table, or NULL if memory ran out
+*/
+conntrack_t *conntrack_create(int entries) {
+  if ( entries <= 0 || entries > ( 1 << 28 ) ) {
+    return NULL;
+  }
+  conntrack_t *ct = calloc( 1, sizeof( conntrack_t ) );
+  if ( ct == NULL ) {
+    return NULL;
+  }
+  uint32_t slots = 2;
+  while ( slots < ( uint32_t ) entries * 2 ) {
+    slots *= 2;
+  }
+  ct->slots = calloc( slots, sizeof( conntrack_entry_t ) );
+  if ( ct->slots == NULL ) {
+    free( ct );
+    return NULL;
+  }
+  ct->mask = slots - 1;
+  ct->max = entries;
+  ct->start = clock_seconds();
+  return ct;
+}
+
+/**
+    Reads the table's clock, in whole seconds since it was created plus
+    one. Callers read it once and pass it to a run of lookups.
+    @param ct The table
+    @return The current second
+*/
+uint32_t conntrack_now(const conntrack_t *ct) {
+  return ( uint32_t ) ( clock_seconds() - ct->start ) + 1;
+}
+
+/**
+    Looks up the flow @key as conntrack_lookup does, without counting the
+    lookup as a hit or a miss. Callers that look a packet up more than
+    once count it themselves with conntrack_count.
+    @param ct The table
+    @param key The flow key of the packet
+    @param now The current second
+    @param gen The current policy generation
+    @param pos Set to the rule position that allowed the flow on a hit
+    @return 1 if the flow is tracked, 0 otherwise
+*/
+int conntrack_find(conntrack_t *ct, const flow_key_t *key, uint32_t now, uint32_t gen,
+                   int *pos) {
+  flow_key_t f = make_flow( key );
+  int found;
+  uint32_t i = probe( ct, &f, now, gen, &found );
+  if ( !found ) {
+    return 0;
+  }
+  ct->slots[ i ].expires = now + timeout( FLOW_PROTOCOL( f ) );
+  *pos = ct->slots[ i ].pos;
+  return 1;
+}
+
+/**
+    Counts one lookup made with conntrack_find.
+    @param ct The table
+    @param hit 1 if the packet's flow was tracked, 0 if not
+*/
+void conntrack_count(conntrack_t *ct, int hit) {
+  if ( hit ) {
+    ct->hits++;
+  } else {
+    ct->misses++;
+  }
+}
+
+/**
+    Looks up the flow @key, in either direction, and keeps it alive for
+    another timeout if it is tracked. Flows allowed under a generation
+    other than @gen are treated as missing.
+    @param ct The table
+    @param key The flow key of the packet
+    @param now The current second
+    @param gen The current policy generation
+    @param pos Set to the rule position that allowed the flow on a hit
+    @return 1 if the flow is tracked, 0 otherwise
+*/
+int conntrack_lookup(conntrack_t *ct, const flow_key_t *key, uint32_t now, uint32_t gen,
+                     int *pos) {
+  int hit = conntrack_find( ct, key, now, gen, pos );
+  conntrack_count( ct, hit );
+  return hit;
+}
+
+/**
+    Starts tracking the flow @key. If the table is full of live flows the
+    flow is not tracked.
+    @param ct The table
+    @param key The flow key of the packet that was allowed
+    @param now The current second
+    @param gen The policy generation the packet was allowed under
+    @param pos The rule position that allowed it, -1 for the default
+*/
+void conntrack_insert(conntrack_t *ct, const flow_key_t *key, uint32_t now, uint32_t gen,
+                      int pos) {
+  flow_key_t f = make_flow( key );
+  int found;
+  uint32_t i = probe( ct, &f, now, gen, &found );
+  if ( !found && ct->used >= ct->max ) {
+    sweep( ct, now, gen );
+    if ( ct->used >= ct->max ) {
+      ct->overflows++;
+      return;
+    }
+    i = probe( ct, &f, now, gen, &found );
+  }
+  conntrack_entry_t *e = &ct->slots[ i ];
+  if ( !found ) {
+    e->key = f;
+    ct->used++;
+  }
+  e->expires = now + timeout( FLOW_PROTOCOL( f ) );
+  e->gen = gen;
+  e->pos = pos;
+}
+
+/**
+    Frees a table returned by conntrack_create.
+    @param ct The table to free, may be NULL
+*/
+void conntrack_free(conntrack_t *ct) {
+  if ( ct == NULL ) {
+    return;
+  }
+  free( ct->slots );
+  free( ct );
+}
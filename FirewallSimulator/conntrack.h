@@ -0,0 +1,127 @@
+/**
+    @file conntrack.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior and data for the connection tracking table.
+*/
+
+#ifndef CONNTRACK_H
+#define CONNTRACK_H
+
+#include <stdint.h>
+
+#include "packet.h"
+
+/** Seconds an idle TCP flow stays tracked */
+#define CONNTRACK_TCP_TIMEOUT 300
+
+/** Seconds an idle UDP flow stays tracked */
+#define CONNTRACK_UDP_TIMEOUT 30
+
+/**
+ * A tracked flow. The key is stored with its lower endpoint as the
+ * source, so both directions of a flow find the same entry.
+ * .key: the flow
+ * .expires: the second the flow is forgotten, 0 if the slot is unused
+ * .gen: the policy generation the flow was allowed under
+ * .pos: the rule position that allowed the flow, -1 for the default
+ */
+typedef struct conntrack_entry {
+    flow_key_t  key;
+    uint32_t    expires;
+    uint32_t    gen;
+    int32_t     pos;
+} conntrack_entry_t;
+
+/**
+ * An open addressed table of allowed flows with linear probing. It holds
+ * at most .max flows in twice as many slots. Flows that timed out or
+ * were allowed under another policy generation are removed when a probe
+ * meets them, and all at once when the table fills.
+ * .mask: the number of slots minus one
+ * .used: the slots in use, expired or not
+ * .hits / .misses: lookups that found a live flow and that did not
+ * .expired: flows removed after timing out or a policy change
+ * .overflows: flows not tracked because the table was full
+ * .start: the clock reading of second 1
+ */
+typedef struct conntrack {
+    conntrack_entry_t *slots;
+    uint32_t          mask;
+    int               max;
+    int               used;
+    uint64_t          hits;
+    uint64_t          misses;
+    uint64_t          expired;
+    uint64_t          overflows;
+    double            start;
+} conntrack_t;
+
+/**
+    Creates a table that tracks up to @entries flows.
+    @param entries The most flows to track
+    @return The new table, or NULL if memory ran out
+*/
+conntrack_t *conntrack_create(int entries);
+
+/**
+    Reads the table's clock, in whole seconds since it was created plus
+    one. Callers read it once and pass it to a run of lookups.
+    @param ct The table
+    @return The current second
+*/
+uint32_t conntrack_now(const conntrack_t *ct);
+
+/**
+    Looks up the flow @key as conntrack_lookup does, without counting the
+    lookup as a hit or a miss. Callers that look a packet up more than
+    once count it themselves with conntrack_count.
+    @param ct The table
+    @param key The flow key of the packet
+    @param now The current second
+    @param gen The current policy generation
+    @param pos Set to the rule position that allowed the flow on a hit
+    @return 1 if the flow is tracked, 0 otherwise
+*/
+int conntrack_find(conntrack_t *ct, const flow_key_t *key, uint32_t now, uint32_t gen,
+                   int *pos);
+
+/**
+    Counts one lookup made with conntrack_find.
+    @param ct The table
+    @param hit 1 if the packet's flow was tracked, 0 if not
+*/
+void conntrack_count(conntrack_t *ct, int hit);
+
+/**
+    Looks up the flow @key, in either direction, and keeps it alive for
+    another timeout if it is tracked. Flows allowed under a generation
+    other than @gen are treated as missing.
+    @param ct The table
+    @param key The flow key of the packet
+    @param now The current second
+    @param gen The current policy generation
+    @param pos Set to the rule position that allowed the flow on a hit
+    @return 1 if the flow is tracked, 0 otherwise
+*/
+int conntrack_lookup(conntrack_t *ct, const flow_key_t *key, uint32_t now, uint32_t gen,
+                     int *pos);
+
+/**
+    Starts tracking the flow @key. If the table is full of live flows the
+    flow is not tracked.
+    @param ct The table
+    @param key The flow key of the packet that was allowed
+    @param now The current second
+    @param gen The policy generation the packet was allowed under
+    @param pos The rule position that allowed it, -1 for the default
+*/
+void conntrack_insert(conntrack_t *ct, const flow_key_t *key, uint32_t now, uint32_t gen,
+                      int pos);
+
+/**
+    Frees a table returned by conntrack_create.
+    @param ct The table to free, may be NULL
+*/
+void conntrack_free(conntrack_t *ct);
+
+#endif
@@ -0,0 +1,365 @@
+/**
+    @file fwload.c
+    @author Griffin Brookshire (glbrook2)
+    Drives a verdict server with many clients at once from one epoll
+    loop. Each client keeps a number of requests in flight, sending the
+    next as soon as an answer arrives, and the time from sending a
+    request to reading its answer is kept for every request.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "packet.h"
+#include "server.h"
+
+/** Clients by default */
+#define LOAD_CLIENTS 64
+
+/** Packets per request by default */
+#define LOAD_BATCH 64
+
+/** Requests each client keeps in flight by default */
+#define LOAD_DEPTH 4
+
+/** Seconds to run by default */
+#define LOAD_SECONDS 5
+
+/** Most requests a client may keep in flight */
+#define LOAD_MAX_DEPTH 64
+
+/** Distinct requests sent, one after another */
+#define LOAD_REQUESTS 64
+
+/** Request latencies kept */
+#define LOAD_SAMPLES ( 1 << 22 )
+
+/** Events taken from epoll at a time */
+#define LOAD_EVENTS 256
+
+/**
+ * One client and its requests in flight, watched edge-triggered so it
+ * is only woken when it can make progress.
+ * .fd: the socket
+ * .out / .out_off / .out_len: request bytes not yet sent
+ * .in_len: bytes read of the answer being read
+ * .sent / .head / .count: when each request in flight was sent, oldest
+ *                         at .head
+ * .next: the next of the distinct requests to send
+ */
+typedef struct client {
+    int             fd;
+    unsigned char   *out;
+    size_t          out_off;
+    size_t          out_len;
+    size_t          in_len;
+    double          sent[ LOAD_MAX_DEPTH ];
+    int             head;
+    int             count;
+    int             next;
+} client_t;
+
+/** The distinct requests, each of the same size */
+static unsigned char *requests;
+
+/** Size of one request and of its answer */
+static size_t request_size;
+static size_t answer_size;
+
+/** Buffer answers are read into and dropped from */
+static unsigned char scratch[ 1 << 16 ];
+
+/* Print out a usage message. */
+static void usage()
+{
+  fprintf(stderr, "Usage: fwload <socket> [<clients> [<batch> [<depth> [<seconds>]]]]\n");
+}
+
+/**
+    Reads the monotonic clock.
+    @return The time in nanoseconds
+*/
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+    Writes a little-endian integer.
+    @param p Where to write
+    @param v The value
+    @param bytes The number of bytes
+*/
+static void put_le( unsigned char *p, uint32_t v, int bytes ) {
+  for ( int i = 0; i < bytes; i++ ) {
+    p[ i ] = ( unsigned char ) ( v >> ( 8 * i ) );
+  }
+}
+
+/**
+    Fills a request with @batch random packets inside 10.0.0.0/8.
+    @param p The request
+    @param batch The number of packets
+*/
+static void make_request( unsigned char *p, int batch ) {
+  put_le( p, batch, SERVER_HEADER_SIZE );
+  p += SERVER_HEADER_SIZE;
+  for ( int i = 0; i < batch; i++, p += SERVER_PACKET_SIZE ) {
+    p[ 0 ] = rand() % 2 ? PROTO_TCP : PROTO_UDP;
+    put_le( p + 1, 0x0A | ( uint32_t ) ( rand() & 0xFFFFFF ) << 8, 4 );
+    put_le( p + 5, rand() % PORT_MAX, 2 );
+    put_le( p + 7, 0x0A | ( uint32_t ) ( rand() & 0xFFFFFF ) << 8, 4 );
+    put_le( p + 11, rand() % 1024, 2 );
+  }
+}
+
+/**
+    Queues the client's next request, timing it from now.
+    @param c The client
+*/
+static void queue_request( client_t *c ) {
+  if ( c->out_off > 0 ) {
+    memmove( c->out, c->out + c->out_off, c->out_len - c->out_off );
+    c->out_len -= c->out_off;
+    c->out_off = 0;
+  }
+  memcpy( c->out + c->out_len, requests + c->next * request_size, request_size );
+  c->out_len += request_size;
+  c->next = ( c->next + 1 ) % LOAD_REQUESTS;
+  c->sent[ ( c->head + c->count ) % LOAD_MAX_DEPTH ] = now_ns();
+  c->count++;
+}
+
+/**
+    Sends as much of the client's queued requests as the socket takes.
+    @param c The client
+    @return 0 if success, -1 if the connection failed
+*/
+static int send_requests( client_t *c ) {
+  while ( c->out_off < c->out_len ) {
+    ssize_t n = send( c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL );
+    if ( n < 0 && errno == EINTR ) {
+      continue;
+    }
+    if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+      break;
+    }
+    if ( n < 0 ) {
+      return -1;
+    }
+    c->out_off += n;
+  }
+  if ( c->out_off == c->out_len ) {
+    c->out_off = 0;
+    c->out_len = 0;
+  }
+  return 0;
+}
+
+/**
+    Orders two latencies for qsort.
+    @param a The first latency
+    @param b The second latency
+    @return Negative, zero or positive as @a is less, equal or greater
+*/
+static int compare_lat( const void *a, const void *b ) {
+  unsigned int x = *( const unsigned int * ) a;
+  unsigned int y = *( const unsigned int * ) b;
+  return ( x > y ) - ( x < y );
+}
+
+/**
+    Connects a client to the server.
+    @param path The socket
+    @param epfd The epoll instance to add it to
+    @param c The client
+    @return 0 if success, -1 if fail
+*/
+static int connect_client( const char *path, int epfd, client_t *c ) {
+  struct sockaddr_un addr;
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sun_family = AF_UNIX;
+  strncpy( addr.sun_path, path, sizeof( addr.sun_path ) - 1 );
+  c->fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( c->fd < 0 ) {
+    return -1;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  ev.data.ptr = c;
+  int flags;
+  if ( connect( c->fd, ( struct sockaddr * ) &addr, sizeof( addr ) ) != 0 ||
+       ( flags = fcntl( c->fd, F_GETFL ) ) < 0 ||
+       fcntl( c->fd, F_SETFL, flags | O_NONBLOCK ) != 0 ||
+       epoll_ctl( epfd, EPOLL_CTL_ADD, c->fd, &ev ) != 0 ) {
+    close( c->fd );
+    return -1;
+  }
+  return 0;
+}
+
+/* Starting point for the load generator.
+   @param argc number of command-line arguments.
+   @param argv list of command-line arguments.
+   @return program exit status
+*/
+int main(int argc, char *argv[])
+{
+  int clients = argc > 2 ? atoi( argv[ 2 ] ) : LOAD_CLIENTS;
+  int batch = argc > 3 ? atoi( argv[ 3 ] ) : LOAD_BATCH;
+  int depth = argc > 4 ? atoi( argv[ 4 ] ) : LOAD_DEPTH;
+  int seconds = argc > 5 ? atoi( argv[ 5 ] ) : LOAD_SECONDS;
+  if ( argc < 2 || argc > 6 || clients < 1 || batch < 1 || batch > SERVER_MAX_BATCH ||
+       depth < 1 || depth > LOAD_MAX_DEPTH || seconds < 1 ) {
+    usage();
+    exit( 1 );
+  }
+
+  struct rlimit lim;
+  if ( getrlimit( RLIMIT_NOFILE, &lim ) == 0 && lim.rlim_cur < lim.rlim_max ) {
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit( RLIMIT_NOFILE, &lim );
+  }
+
+  srand( 1 );
+  request_size = SERVER_HEADER_SIZE + ( size_t ) batch * SERVER_PACKET_SIZE;
+  answer_size = SERVER_HEADER_SIZE + ( size_t ) batch * SERVER_VERDICT_SIZE;
+  requests = malloc( LOAD_REQUESTS * request_size );
+  client_t *all = calloc( clients, sizeof( client_t ) );
+  unsigned int *lat = malloc( LOAD_SAMPLES * sizeof( unsigned int ) );
+  int epfd = epoll_create1( 0 );
+  if ( requests == NULL || all == NULL || lat == NULL || epfd < 0 ) {
+    fprintf( stderr, "Out of memory.\n" );
+    exit( 1 );
+  }
+  for ( int r = 0; r < LOAD_REQUESTS; r++ ) {
+    make_request( requests + r * request_size, batch );
+  }
+  for ( int i = 0; i < clients; i++ ) {
+    client_t *c = &all[ i ];
+    c->out = malloc( depth * request_size );
+    c->next = i % LOAD_REQUESTS;
+    if ( c->out == NULL || connect_client( argv[ 1 ], epfd, c ) != 0 ) {
+      fprintf( stderr, "Could not connect client %d to %s.\n", i + 1, argv[ 1 ] );
+      exit( 1 );
+    }
+  }
+
+  double start = now_ns();
+  double end = start + seconds * 1e9;
+  for ( int i = 0; i < clients; i++ ) {
+    while ( all[ i ].count < depth ) {
+      queue_request( &all[ i ] );
+    }
+    if ( send_requests( &all[ i ] ) != 0 ) {
+      fprintf( stderr, "Could not send to client %d.\n", i + 1 );
+      exit( 1 );
+    }
+  }
+
+  // Stop sending at the deadline, then collect what is still in flight
+  unsigned long long answered = 0;
+  int samples = 0;
+  int busy = clients;
+  int failed = 0;
+  struct epoll_event events[ LOAD_EVENTS ];
+  while ( busy > 0 ) {
+    int n = epoll_wait( epfd, events, LOAD_EVENTS, 1000 );
+    if ( n < 0 && errno != EINTR ) {
+      break;
+    }
+    double stamp = now_ns();
+    int sending = stamp < end;
+    for ( int e = 0; e < n; e++ ) {
+      client_t *c = events[ e ].data.ptr;
+      if ( c->fd < 0 ) {
+        continue;
+      }
+      int rc = 0;
+      if ( events[ e ].events & EPOLLIN ) {
+        for ( ;; ) {
+          size_t want = answer_size - c->in_len;
+          ssize_t got = recv( c->fd, scratch, want < sizeof( scratch ) ? want : sizeof( scratch ), 0 );
+          if ( got < 0 && errno == EINTR ) {
+            continue;
+          }
+          if ( got < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+            break;
+          }
+          if ( got <= 0 || c->count == 0 ) {
+            rc = -1;
+            break;
+          }
+          c->in_len += got;
+          if ( c->in_len == answer_size ) {
+            double took = now_ns() - c->sent[ c->head ];
+            c->head = ( c->head + 1 ) % LOAD_MAX_DEPTH;
+            c->count--;
+            c->in_len = 0;
+            answered++;
+            if ( samples < LOAD_SAMPLES ) {
+              lat[ samples++ ] = took;
+            }
+            if ( sending ) {
+              queue_request( c );
+            }
+          }
+        }
+      }
+      if ( rc == 0 && c->out_len > 0 ) {
+        rc = send_requests( c );
+      }
+      if ( rc != 0 ) {
+        failed++;
+      }
+      if ( rc != 0 || ( !sending && c->count == 0 ) ) {
+        close( c->fd );
+        c->fd = -1;
+        busy--;
+      }
+    }
+    if ( n == 0 && !sending ) {
+      break;
+    }
+  }
+  double took = ( now_ns() - start ) / 1e9;
+
+  fprintf( stdout, "%d clients, %d packets per request, %d in flight each\n",
+           clients, batch, depth );
+  fprintf( stdout, "requests: %llu in %.2f s, %.0f requests/s, %.0f packets/s\n",
+           answered, took, answered / took, answered * batch / took );
+  if ( samples > 0 ) {
+    qsort( lat, samples, sizeof( unsigned int ), compare_lat );
+    fprintf( stdout, "latency: p50 %u ns, p99 %u ns, p99.9 %u ns, max %u ns\n",
+             lat[ samples / 2 ], lat[ ( int ) ( samples * 0.99 ) ],
+             lat[ ( int ) ( samples * 0.999 ) ], lat[ samples - 1 ] );
+  }
+  if ( failed > 0 ) {
+    fprintf( stdout, "failed clients: %d\n", failed );
+  }
+
+  for ( int i = 0; i < clients; i++ ) {
+    if ( all[ i ].fd >= 0 ) {
+      close( all[ i ].fd );
+    }
+    free( all[ i ].out );
+  }
+  close( epfd );
+  free( lat );
+  free( all );
+  free( requests );
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
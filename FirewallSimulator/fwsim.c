@@ -5,15 +5,25 @@
     specific connections and test the outcome.
 */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "packet.h"
 #include "policy.h"
 #include "command.h"
+#include "report.h"
+#include "loader.h"
+#include "trace.h"
+#include "pool.h"
+#include "batch.h"
+#include "server.h"
 
 /** Command prompt shown to the user. */
 #define PROMPT "> "
@@ -39,16 +49,55 @@
 /** Print cmd type */
 #define PRINT 7
 
+/** Engine cmd type */
+#define ENGINE 9
+
+/** Report cmd type */
+#define REPORT 10
+
+/** Cache cmd type */
+#define CACHE 11
+
+/** Save cmd type */
+#define SAVE 12
+
+/** Load cmd type */
+#define LOAD 13
+
+/** Stats cmd type */
+#define STATS 14
+
+/** Optimize cmd type */
+#define OPTIMIZE 15
+
+/** Reorder cmd type */
+#define REORDER 16
+
+/** Conntrack cmd type */
+#define CONNTRACK 17
+
+/** Dump bytecode cmd type */
+#define DUMP_BYTECODE 18
+
+/** Begin cmd type */
+#define BEGIN 19
+
+/** Commit cmd type */
+#define COMMIT 20
+
+/** Abort cmd type */
+#define ABORT 21
+
 /** Line size */
 #define BUFFER 64
 
 /** Max number of command line args */
-#define MAX_ARGS 3
+#define MAX_ARGS 12
 
 /* Print out a usage message. */
 static void usage()
 {
-  fprintf(stderr, "Usage: fwsim [-h] [-r <rule_file>]\n");
+  fprintf(stderr, "Usage: fwsim [-h] [-r <rule_file> | -s <snapshot>] [-p <pcap_file> [-t <threads>] | --batch | -l <socket>]\n");
 }
 
 /**
@@ -63,15 +112,18 @@ static int execute_command( fw_cmd_t *cmd ) {
     fprintf( stdout, "(*|<dst_port>)\nappend (allow|deny) (tcp|udp) <src_ip>:" );
     fprintf( stdout, "(*|<src_port>) <dst_ip>:(*|<dst_port>)\ndelete <pos>\ntest " );
     fprintf( stdout, "(tcp|udp) <src_ip>:<src_port> <dst_ip>:<dst_port>\nprint " );
-    fprintf( stdout, "(all|<pos>)\nhelp\nquit\n" );
+    fprintf( stdout, "(all|<pos>)\nengine (linear|tree|tuple|bitvec|scan|bytecode)\n" );
+    fprintf( stdout, "report (text|csv|binary|off)\ncache [off|<entries>]\nconntrack [off|<entries>]\n" );
+    fprintf( stdout, "save <file>\nload <file>\nstats [on|off|reset|dump <file>]\n" );
+    fprintf( stdout, "optimize [compact]\nreorder [off]\ndump-bytecode\nbegin\ncommit\nabort\nhelp\nquit\n" );
     return 0;
   } else if ( cmd->command_type == DEFAULT ) { //default
     policy_set_default( cmd->default_pol );
     return 0;
   } else if ( cmd->command_type == INSERT ) { //insert
     /** Create rule */
-    rule_t *rule = ( rule_t * )malloc( sizeof( rule_t ) );
-    rule->action = cmd->default_pol;
+    rule_t rule;
+    rule.action = cmd->default_pol;
     /** Create packet for rule */
     packet_match_t pack;
     pack.protocol = cmd->trans_lay_prot; // 0 = tcp, 1 = udp
@@ -86,13 +138,13 @@ static int execute_command( fw_cmd_t *cmd ) {
     pack.dst_ip.d = cmd->dst_d;
     pack.dst_port = cmd->dst_prt;
     /** Add packet to rule and append */
-    rule->match = pack;
-    policy_insert( *rule, cmd->pos );
+    rule.match = pack;
+    policy_insert( rule, cmd->pos );
     return 0;
   } else if ( cmd->command_type == APPEND ) { //append
     /** Create rule */
-    rule_t *rule = ( rule_t * )malloc( sizeof( rule_t ) );
-    rule->action = cmd->default_pol;
+    rule_t rule;
+    rule.action = cmd->default_pol;
     /** Create packet for rule */
     packet_match_t pack;
     pack.protocol = cmd->trans_lay_prot; // 0 = tcp, 1 = udp
@@ -107,9 +159,8 @@ static int execute_command( fw_cmd_t *cmd ) {
     pack.dst_ip.d = cmd->dst_d;
     pack.dst_port = cmd->dst_prt;
     /** Add packet to rule and append */
-    rule->match = pack;
-    policy_append( *rule );
-    //free( rule );
+    rule.match = pack;
+    policy_append( rule );
     return 0;
   } else if ( cmd->command_type == DELETE ) { //delete
     policy_delete( cmd->pos );
@@ -130,7 +181,8 @@ static int execute_command( fw_cmd_t *cmd ) {
     pack.dst_port = cmd->dst_prt;
     int pos = -1;
     int *posp = &pos;
-    policy_test( pack, posp );
+    int action = policy_test( pack, posp );
+    report_verdict( pack, action, pos );
     return 0;
   } else if ( cmd->command_type == PRINT ) { //print
     if ( cmd->all == 1 ) { // all
@@ -139,40 +191,183 @@ static int execute_command( fw_cmd_t *cmd ) {
       policy_print_rule( stdout, cmd->pos );
     }
     return 0;
+  } else if ( cmd->command_type == ENGINE ) { //engine
+    policy_set_engine( cmd->engine );
+    return 0;
+  } else if ( cmd->command_type == REPORT ) { //report
+    report_set_format( cmd->format );
+    return 0;
+  } else if ( cmd->command_type == CACHE ) { //cache
+    if ( cmd->cache_size < 0 ) {
+      policy_print_cache( stdout );
+    } else if ( policy_set_cache( cmd->cache_size ) != 0 ) {
+      fprintf( stdout, "Error: Could not allocate cache.\n" );
+    }
+    return 0;
+  } else if ( cmd->command_type == CONNTRACK ) { //conntrack
+    if ( cmd->cache_size < 0 ) {
+      policy_print_conntrack( stdout );
+    } else if ( policy_set_conntrack( cmd->cache_size ) != 0 ) {
+      fprintf( stdout, "Error: Could not allocate conntrack table.\n" );
+    }
+    return 0;
+  } else if ( cmd->command_type == SAVE ) { //save
+    if ( policy_save( cmd->file ) != 0 ) {
+      fprintf( stdout, "Error: Could not save policy.\n" );
+    }
+    return 0;
+  } else if ( cmd->command_type == LOAD ) { //load
+    if ( policy_load( cmd->file ) != 0 ) {
+      fprintf( stdout, "Error: Could not load policy.\n" );
+    }
+    return 0;
+  } else if ( cmd->command_type == STATS ) { //stats
+    if ( cmd->stats_op == 0 ) {
+      policy_print_stats( stdout );
+    } else if ( cmd->stats_op == 1 || cmd->stats_op == 2 ) {
+      if ( policy_set_stats( cmd->stats_op == 1 ) != 0 ) {
+        fprintf( stdout, "Error: Could not allocate counters.\n" );
+      }
+    } else if ( cmd->stats_op == 3 ) {
+      policy_reset_stats();
+    } else if ( policy_dump_stats( cmd->file ) != 0 ) {
+      fprintf( stdout, "Error: Could not write stats.\n" );
+    }
+    return 0;
+  } else if ( cmd->command_type == OPTIMIZE ) { //optimize
+    if ( policy_optimize( stdout, cmd->compact ) < 0 ) {
+      fprintf( stdout, "Error: Could not optimize policy.\n" );
+    }
+    return 0;
+  } else if ( cmd->command_type == REORDER ) { //reorder
+    if ( policy_reorder( stdout, cmd->reorder ) < 0 ) {
+      fprintf( stdout, "Error: Could not reorder policy.\n" );
+    }
+    return 0;
+  } else if ( cmd->command_type == DUMP_BYTECODE ) { //dump-bytecode
+    if ( policy_dump_bytecode( stdout ) != 0 ) {
+      fprintf( stdout, "Error: Could not compile policy.\n" );
+    }
+    return 0;
+  } else if ( cmd->command_type == BEGIN ) { //begin
+    if ( policy_begin() != 0 ) {
+      fprintf( stdout, "Error: Could not begin transaction.\n" );
+    }
+    return 0;
+  } else if ( cmd->command_type == COMMIT ) { //commit
+    if ( policy_commit() < 0 ) {
+      fprintf( stdout, "Error: Could not commit transaction.\n" );
+    }
+    return 0;
+  } else if ( cmd->command_type == ABORT ) { //abort
+    if ( policy_abort() != 0 ) {
+      fprintf( stdout, "Error: No transaction to abort.\n" );
+    }
+    return 0;
   } else { //quit
     return -1;
   }
   return -1;
 }
 
+/**
+    Parses and executes one line of a rule file.
+    @param line The command to run
+    @return 0 to keep loading, -1 if the line was quit
+  */
+static int run_line( char *line ) {
+  fw_cmd_t cmd = { 0 };
+  fw_cmd_t *cmd_ptr = &cmd;
+  int par = parse_command( line, cmd_ptr );
+  if ( par == -1 ) {
+    return 0;
+  }
+  return execute_command( cmd_ptr ) == -1 ? -1 : 0;
+}
+
 /* Load firewall rules from a file.
    @param filename name of a file from which to load the rules.
 */
 static void load_rules(char *filename)
 {
-  FILE *file = fopen( filename, "r" );
-  if ( file == NULL ) {
+  int lines = loader_load( filename, run_line );
+  report_flush();
+  if ( lines == -1 ) {
     fprintf( stdout, "Could not open file.\n" );
     exit( 1 );
+  } else if ( lines == -2 ) {
+    exit( 0 );
   }
-  char line[ BUFFER ];
-  while ( fgets( line, sizeof( line ), file ) ) {
-    int size = strlen( line );
-    line[ size - 1 ] = '\0';
-    fw_cmd_t cmd;
-    fw_cmd_t *cmd_ptr = &cmd;
-    int par = parse_command( line, cmd_ptr );
-    if ( par == -1 ) {
-      continue;
-    }
-    int exe = execute_command( cmd_ptr );
-    if ( exe == -1 ) {
-      fclose( file );
-      exit( 0 );
-    }
+}
+
+/* Replay a pcap trace through the policy and print a summary.
+   @param filename name of the pcap file to replay.
+*/
+static void replay_trace(char *filename)
+{
+  trace_stats_t stats;
+  int rc = trace_replay( filename, &stats );
+  if ( rc == -1 ) {
+    fprintf( stdout, "Could not open file.\n" );
+    exit( 1 );
+  } else if ( rc == -2 ) {
+    fprintf( stdout, "Error: Not a supported pcap file.\n" );
+    exit( 1 );
+  }
+  fprintf( stdout, "Packets: %llu tested, %llu skipped\n",
+           ( unsigned long long ) stats.tested, ( unsigned long long ) stats.skipped );
+  fprintf( stdout, "Allowed: %llu\n", ( unsigned long long ) stats.allowed );
+  fprintf( stdout, "Denied: %llu\n", ( unsigned long long ) stats.denied );
+  fprintf( stdout, "Default policy: %llu\n", ( unsigned long long ) stats.defaulted );
+  fprintf( stdout, "Time: %.3f s (%.0f packets/sec)\n", stats.seconds,
+           stats.seconds > 0 ? stats.tested / stats.seconds : 0.0 );
+  if ( policy_stats_enabled() ) {
+    policy_print_stats( stdout );
+  }
+}
+
+/* Replay a pcap trace on several threads against the published policy
+   and print a summary.
+   @param filename name of the pcap file to replay.
+   @param threads number of threads to test on.
+*/
+static void replay_trace_parallel(char *filename, int threads)
+{
+  trace_stats_t stats;
+  packet_t *pkts = NULL;
+  size_t n = 0;
+  int rc = trace_load( filename, &pkts, &n, &stats );
+  if ( rc == -1 ) {
+    fprintf( stdout, "Could not open file.\n" );
+    exit( 1 );
+  } else if ( rc == -2 ) {
+    fprintf( stdout, "Error: Not a supported pcap file.\n" );
+    exit( 1 );
+  }
+  if ( policy_publish() != 0 ) {
+    fprintf( stdout, "Error: Could not publish policy.\n" );
+    exit( 1 );
+  }
+  pool_stats_t total;
+  struct timespec start, end;
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  if ( pool_run( pkts, n, threads, &total ) != 0 ) {
+    fprintf( stdout, "Error: Could not start workers.\n" );
+    exit( 1 );
+  }
+  clock_gettime( CLOCK_MONOTONIC, &end );
+  double seconds = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+  fprintf( stdout, "Packets: %llu tested, %llu skipped\n",
+           ( unsigned long long ) total.tested, ( unsigned long long ) stats.skipped );
+  fprintf( stdout, "Allowed: %llu\n", ( unsigned long long ) total.allowed );
+  fprintf( stdout, "Denied: %llu\n", ( unsigned long long ) total.denied );
+  fprintf( stdout, "Default policy: %llu\n", ( unsigned long long ) total.defaulted );
+  fprintf( stdout, "Time: %.3f s on %d threads (%.0f packets/sec)\n", seconds, threads,
+           seconds > 0 ? total.tested / seconds : 0.0 );
+  if ( policy_stats_enabled() ) {
+    policy_print_stats( stdout );
   }
-  fclose( file );
-  return;
+  free( pkts );
 }
 
 /* Starting point for the program.  Process command-line arguments then
@@ -184,22 +379,80 @@ static void load_rules(char *filename)
 int main(int argc, char *argv[])
 {
 
-  if ( argc != 1 && argc != MAX_ARGS ) { //either ./fwsim or ./fwsim -r <filename>
+  if ( argc > MAX_ARGS ) {
     usage();
     exit( 1 );
   }
 
   policy_init();
 
-  if ( argc == MAX_ARGS ) { // ./fwsim -r <filename>
-    if ( strcmp( argv[ 1 ], "-r" ) == 0 ) {
-      load_rules( argv[ 2 ] );
+  char *trace = NULL;
+  char *listen_path = NULL;
+  int threads = 0;
+  bool batch = false;
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp( argv[ i ], "--batch" ) == 0 ) { // --batch
+      batch = true;
+      continue;
+    }
+    if ( i + 1 == argc ) { //other options all take a value
+      usage();
+      exit( 1 );
+    }
+    if ( strcmp( argv[ i ], "-r" ) == 0 ) { // -r <rule_file>
+      load_rules( argv[ ++i ] );
+    } else if ( strcmp( argv[ i ], "-s" ) == 0 ) { // -s <snapshot>
+      if ( policy_load( argv[ ++i ] ) != 0 ) {
+        fprintf( stdout, "Could not load snapshot.\n" );
+        exit( 1 );
+      }
+    } else if ( strcmp( argv[ i ], "-p" ) == 0 ) { // -p <pcap_file>
+      trace = argv[ ++i ];
+    } else if ( strcmp( argv[ i ], "-l" ) == 0 ) { // -l <socket>
+      listen_path = argv[ ++i ];
+    } else if ( strcmp( argv[ i ], "-t" ) == 0 ) { // -t <threads>
+      threads = atoi( argv[ ++i ] );
+      if ( threads < 1 || threads > POOL_MAX_THREADS ) {
+        usage();
+        exit( 1 );
+      }
     } else {
       usage();
       exit( 1 );
     }
   }
 
+  if ( trace != NULL ) { // replay instead of reading commands
+    if ( threads > 0 ) {
+      replay_trace_parallel( trace, threads );
+    } else {
+      replay_trace( trace );
+    }
+    policy_free();
+    return EXIT_SUCCESS;
+  }
+
+  if ( listen_path != NULL ) { // serve verdicts instead of reading commands
+    if ( server_run( listen_path ) != 0 ) {
+      fprintf( stdout, "Error: Could not listen on %s.\n", listen_path );
+      exit( 1 );
+    }
+    policy_free();
+    return EXIT_SUCCESS;
+  }
+
+  if ( batch ) { // commands without prompts, pipelined
+    int rc = batch_run( STDIN_FILENO, STDOUT_FILENO, run_line );
+    if ( rc == -1 ) {
+      fprintf( stdout, "Error: Could not start batch mode.\n" );
+      exit( 1 );
+    } else if ( rc == -2 ) {
+      exit( 0 );
+    }
+    policy_free();
+    return EXIT_SUCCESS;
+  }
+
   char line[ BUFFER ];
   while ( true ) {
     fprintf( stdout, PROMPT );
@@ -216,11 +469,13 @@ int main(int argc, char *argv[])
       continue;
     }
     int exe = execute_command( cmd_ptr );
+    report_flush();
     if ( exe == -1 ) {
       exit( 0 );
     }
   }
 
+  report_flush();
   policy_free();
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,253 @@
+/**
+    @file gen.c
+    @author Griffin Brookshire (glbrook2)
+    Generates ClassBench-like rulesets and traffic for benchmarking. All
+    randomness comes from a private generator seeded from the parameters,
+    so every engine and every run sees exactly the same inputs.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "gen.h"
+
+/** Well known destination ports most rules name */
+static const int gen_ports[] = { 80, 443, 22, 25, 53, 110, 143, 993, 3306, 8080, 123, 161 };
+
+/** Number of well known ports */
+#define GEN_PORTS ( int ) ( sizeof( gen_ports ) / sizeof( gen_ports[ 0 ] ) )
+
+/** Rules per busy host in the overlap pool */
+#define GEN_POOL_SHARE 64
+
+/** Link type of raw IPv4 captures */
+#define GEN_LINK_IPV4 228
+
+/** IP protocol numbers of TCP and UDP */
+#define GEN_PROTO_TCP 6
+#define GEN_PROTO_UDP 17
+
+/**
+    Advances the generator state and returns the next value (splitmix64).
+    @param state The generator state
+    @return A 64-bit random value
+*/
+static uint64_t next( uint64_t *state ) {
+  uint64_t z = ( *state += 0x9E3779B97F4A7C15ULL );
+  z = ( z ^ ( z >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+  z = ( z ^ ( z >> 27 ) ) * 0x94D049BB133111EBULL;
+  return z ^ ( z >> 31 );
+}
+
+/**
+    Returns a uniform value in [0, 1).
+    @param state The generator state
+    @return The value
+*/
+static double unit( uint64_t *state ) {
+  return ( next( state ) >> 11 ) * ( 1.0 / 9007199254740992.0 );
+}
+
+/**
+    Makes an address from a 32-bit value.
+    @param v The packed address
+    @return The address
+*/
+static ipaddr_t make_ip( uint32_t v ) {
+  ipaddr_t ip;
+  ip.a = v >> 24;
+  ip.b = v >> 16;
+  ip.c = v >> 8;
+  ip.d = v;
+  return ip;
+}
+
+/**
+    Picks an address for a rule, from the busy host pool with chance
+    @overlap, favouring the first hosts of the pool.
+    @param state The generator state
+    @param pool The busy hosts
+    @param pool_len The number of busy hosts
+    @param overlap The chance of using the pool
+    @return The address
+*/
+static ipaddr_t pick_host( uint64_t *state, const uint32_t *pool, int pool_len, double overlap ) {
+  if ( unit( state ) < overlap ) {
+    double u = unit( state );
+    return make_ip( pool[ ( int ) ( u * u * pool_len ) ] );
+  }
+  return make_ip( 0x0A000000 | ( next( state ) & 0xFFFFFF ) );
+}
+
+/**
+    Fills @rules with @params->rules rules inside 10.0.0.0/8. As in
+    ClassBench, most rules name a well known destination port, busy hosts
+    appear in many rules and rules sharing hosts differ in their ports.
+    @param params The shape of the ruleset
+    @param rules The rules to fill
+    @return 0 if success, -1 if memory ran out
+*/
+int gen_rules(const gen_params_t *params, rule_t *rules) {
+  uint64_t state = params->seed;
+  int pool_len = params->rules / GEN_POOL_SHARE + 4;
+  uint32_t *pool = malloc( pool_len * sizeof( uint32_t ) );
+  if ( pool == NULL ) {
+    return -1;
+  }
+  for ( int i = 0; i < pool_len; i++ ) {
+    pool[ i ] = 0x0A000000 | ( next( &state ) & 0xFFFFFF );
+  }
+  for ( int i = 0; i < params->rules; i++ ) {
+    rule_t *r = &rules[ i ];
+    r->action = next( &state ) % 4 == 0 ? ACTION_DENY : ACTION_ALLOW;
+    r->match.protocol = unit( &state ) < 0.7 ? 0 : 1;
+    r->match.src_ip = pick_host( &state, pool, pool_len, params->overlap );
+    r->match.dst_ip = pick_host( &state, pool, pool_len, params->overlap );
+    if ( unit( &state ) < params->wildcard ) {
+      r->match.src_port = MATCH_PORT_ANY;
+    } else {
+      r->match.src_port = 1024 + next( &state ) % ( PORT_MAX - 1024 );
+    }
+    if ( unit( &state ) < params->wildcard ) {
+      r->match.dst_port = MATCH_PORT_ANY;
+    } else if ( unit( &state ) < 0.8 ) {
+      r->match.dst_port = gen_ports[ next( &state ) % GEN_PORTS ];
+    } else {
+      r->match.dst_port = next( &state ) % PORT_MAX;
+    }
+  }
+  free( pool );
+  return 0;
+}
+
+/**
+    Fills @pkts with @n packets. A share @params->match of them copy a
+    random rule, with any wildcard port filled in at random, and the rest
+    come from 192.168.0.0/16, which no generated rule matches.
+    @param params The shape of the traffic
+    @param rules The rules made by gen_rules
+    @param pkts The packets to fill
+    @param n The number of packets
+*/
+void gen_packets(const gen_params_t *params, const rule_t *rules, packet_t *pkts, int n) {
+  uint64_t state = params->seed ^ 0x5DEECE66DULL;
+  for ( int i = 0; i < n; i++ ) {
+    packet_t *p = &pkts[ i ];
+    if ( params->rules > 0 && unit( &state ) < params->match ) {
+      const packet_match_t *m = &rules[ next( &state ) % params->rules ].match;
+      p->protocol = m->protocol;
+      p->src_ip = m->src_ip;
+      p->dst_ip = m->dst_ip;
+      p->src_port = m->src_port == MATCH_PORT_ANY ? next( &state ) % PORT_MAX : m->src_port;
+      p->dst_port = m->dst_port == MATCH_PORT_ANY ? next( &state ) % PORT_MAX : m->dst_port;
+    } else {
+      p->protocol = next( &state ) % 2;
+      p->src_ip = make_ip( 0xC0A80000 | ( next( &state ) & 0xFFFF ) );
+      p->dst_ip = make_ip( 0xC0A80000 | ( next( &state ) & 0xFFFF ) );
+      p->src_port = next( &state ) % PORT_MAX;
+      p->dst_port = gen_ports[ next( &state ) % GEN_PORTS ];
+    }
+  }
+}
+
+/**
+    Prints an address and port the way rule files write them.
+    @param fp The file to print to
+    @param ip The address
+    @param port The port, or MATCH_PORT_ANY
+*/
+static void write_endpoint( FILE *fp, ipaddr_t ip, int port ) {
+  fprintf( fp, "%d.%d.%d.%d:", ip.a, ip.b, ip.c, ip.d );
+  if ( port == MATCH_PORT_ANY ) {
+    fprintf( fp, "*" );
+  } else {
+    fprintf( fp, "%d", port );
+  }
+}
+
+/**
+    Writes @rules as a rule file fwsim -r can read.
+    @param filename The file to write
+    @param rules The rules
+    @param len The number of rules
+    @param default_action The default policy to set first
+    @return 0 if success, -1 if the file can't be written
+*/
+int gen_write_rules(const char *filename, const rule_t *rules, int len, int default_action) {
+  FILE *fp = fopen( filename, "w" );
+  if ( fp == NULL ) {
+    return -1;
+  }
+  fprintf( fp, "default %s\n", default_action == ACTION_ALLOW ? "allow" : "deny" );
+  for ( int i = 0; i < len; i++ ) {
+    fprintf( fp, "append %s %s ", rules[ i ].action == ACTION_ALLOW ? "allow" : "deny",
+             rules[ i ].match.protocol == 0 ? "tcp" : "udp" );
+    write_endpoint( fp, rules[ i ].match.src_ip, rules[ i ].match.src_port );
+    fprintf( fp, " " );
+    write_endpoint( fp, rules[ i ].match.dst_ip, rules[ i ].match.dst_port );
+    fprintf( fp, "\n" );
+  }
+  return fclose( fp ) == 0 ? 0 : -1;
+}
+
+/**
+    Stores a 16-bit value in network byte order.
+    @param p Where to store it
+    @param v The value
+*/
+static void put16( unsigned char *p, uint32_t v ) {
+  p[ 0 ] = v >> 8;
+  p[ 1 ] = v;
+}
+
+/**
+    Stores a 32-bit value in network byte order.
+    @param p Where to store it
+    @param v The value
+*/
+static void put32( unsigned char *p, uint32_t v ) {
+  put16( p, v >> 16 );
+  put16( p + 2, v );
+}
+
+/**
+    Writes @pkts as a raw IPv4 pcap trace fwsim -p can replay.
+    @param filename The file to write
+    @param pkts The packets
+    @param n The number of packets
+    @return 0 if success, -1 if the file can't be written
+*/
+int gen_write_pcap(const char *filename, const packet_t *pkts, int n) {
+  FILE *fp = fopen( filename, "wb" );
+  if ( fp == NULL ) {
+    return -1;
+  }
+  // The header is written in host order, which readers detect by the magic
+  uint32_t header[ 6 ] = { 0xA1B2C3D4, 2 | 4 << 16, 0, 0, 65535, GEN_LINK_IPV4 };
+  fwrite( header, sizeof( header ), 1, fp );
+  unsigned char frame[ 40 ];
+  for ( int i = 0; i < n; i++ ) {
+    const packet_t *p = &pkts[ i ];
+    uint32_t len = p->protocol == 0 ? 40 : 28;
+    uint32_t record[ 4 ] = { i / 1000000, i % 1000000, len, len };
+    memset( frame, 0, sizeof( frame ) );
+    frame[ 0 ] = 0x45;
+    put16( frame + 2, len );
+    frame[ 8 ] = 64;
+    frame[ 9 ] = p->protocol == 0 ? GEN_PROTO_TCP : GEN_PROTO_UDP;
+    put32( frame + 12, ipaddr_to_int( p->src_ip ) );
+    put32( frame + 16, ipaddr_to_int( p->dst_ip ) );
+    put16( frame + 20, p->src_port );
+    put16( frame + 22, p->dst_port );
+    if ( p->protocol != 0 ) {
+      put16( frame + 24, 8 );
+    } else {
+      frame[ 32 ] = 5 << 4;
+    }
+    fwrite( record, sizeof( record ), 1, fp );
+    fwrite( frame, len, 1, fp );
+  }
+  return fclose( fp ) == 0 ? 0 : -1;
+}
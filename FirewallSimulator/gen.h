@@ -0,0 +1,71 @@
+/**
+    @file gen.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior and data for generating synthetic rulesets and
+    packet traces.
+*/
+
+#ifndef GEN_H
+#define GEN_H
+
+#include "packet.h"
+#include "policy.h"
+
+/**
+ * The shape of a generated ruleset and its traffic.
+ * .rules: the number of rules
+ * .wildcard: the share of port fields that match any port
+ * .overlap: the share of rules whose addresses come from a small pool of
+ *           busy hosts, so that they overlap each other
+ * .match: the share of packets aimed at a rule, the rest match none
+ * .seed: the seed, the same seed always gives the same output
+ */
+typedef struct gen_params {
+    int           rules;
+    double        wildcard;
+    double        overlap;
+    double        match;
+    unsigned int  seed;
+} gen_params_t;
+
+/**
+    Fills @rules with @params->rules rules inside 10.0.0.0/8. As in
+    ClassBench, most rules name a well known destination port, busy hosts
+    appear in many rules and rules sharing hosts differ in their ports.
+    @param params The shape of the ruleset
+    @param rules The rules to fill
+    @return 0 if success, -1 if memory ran out
+*/
+int gen_rules(const gen_params_t *params, rule_t *rules);
+
+/**
+    Fills @pkts with @n packets. A share @params->match of them copy a
+    random rule, with any wildcard port filled in at random, and the rest
+    come from 192.168.0.0/16, which no generated rule matches.
+    @param params The shape of the traffic
+    @param rules The rules made by gen_rules
+    @param pkts The packets to fill
+    @param n The number of packets
+*/
+void gen_packets(const gen_params_t *params, const rule_t *rules, packet_t *pkts, int n);
+
+/**
+    Writes @rules as a rule file fwsim -r can read.
+    @param filename The file to write
+    @param rules The rules
+    @param len The number of rules
+    @param default_action The default policy to set first
+    @return 0 if success, -1 if the file can't be written
+*/
+int gen_write_rules(const char *filename, const rule_t *rules, int len, int default_action);
+
+/**
+    Writes @pkts as a raw IPv4 pcap trace fwsim -p can replay.
+    @param filename The file to write
+    @param pkts The packets
+    @param n The number of packets
+    @return 0 if success, -1 if the file can't be written
+*/
+int gen_write_pcap(const char *filename, const packet_t *pkts, int n);
+
+#endif
@@ -0,0 +1,280 @@
+/**
+    @file loader.c
+    @author Griffin Brookshire (glbrook2)
+    Loads rule files in one pass over a memory mapped copy of the file.
+    Rule lines are tokenized in place without copying or calling into
+    stdio, so loading is bound by the policy appends rather than parsing.
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "loader.h"
+#include "policy.h"
+#include "packet.h"
+
+/** Most digits accepted in a number, longer ones go to the fallback */
+#define LOADER_DIGITS 9
+
+/** Bytes of the file read before the pages behind them are released */
+#define LOADER_RELEASE ( 1 << 20 )
+
+/**
+ * A cursor over one line of the mapped file.
+ * .p: the next unread character
+ * .end: one past the last character of the line
+ */
+typedef struct cursor {
+    const char  *p;
+    const char  *end;
+} cursor_t;
+
+/**
+    Consumes @word if it is next, followed by a space or the end of the line.
+    @param c The cursor
+    @param word The word to match
+    @return 1 if consumed, 0 if not
+*/
+static int take_word( cursor_t *c, const char *word ) {
+  const char *p = c->p;
+  while ( *word != '\0' ) {
+    if ( p == c->end || *p != *word ) {
+      return 0;
+    }
+    p++;
+    word++;
+  }
+  if ( p != c->end && *p != ' ' ) {
+    return 0;
+  }
+  c->p = p;
+  return 1;
+}
+
+/**
+    Consumes @ch if it is next.
+    @param c The cursor
+    @param ch The character to match
+    @return 1 if consumed, 0 if not
+*/
+static int take_char( cursor_t *c, char ch ) {
+  if ( c->p == c->end || *c->p != ch ) {
+    return 0;
+  }
+  c->p++;
+  return 1;
+}
+
+/**
+    Consumes a decimal number no greater than @max.
+    @param c The cursor
+    @param max The largest value accepted
+    @param out Set to the number
+    @return 1 if consumed, 0 if not
+*/
+static int take_num( cursor_t *c, int max, int *out ) {
+  const char *p = c->p;
+  int v = 0;
+  int digits = 0;
+  while ( p != c->end && *p >= '0' && *p <= '9' ) {
+    if ( ++digits > LOADER_DIGITS ) {
+      return 0;
+    }
+    v = v * 10 + ( *p - '0' );
+    p++;
+  }
+  if ( digits == 0 || v > max ) {
+    return 0;
+  }
+  c->p = p;
+  *out = v;
+  return 1;
+}
+
+/**
+    Consumes "allow" or "deny".
+    @param c The cursor
+    @param action Set to ACTION_ALLOW or ACTION_DENY
+    @return 1 if consumed, 0 if not
+*/
+static int take_action( cursor_t *c, int *action ) {
+  if ( take_word( c, "allow" ) ) {
+    *action = ACTION_ALLOW;
+    return 1;
+  } else if ( take_word( c, "deny" ) ) {
+    *action = ACTION_DENY;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+    Consumes an address and port, a.b.c.d:(*|port).
+    @param c The cursor
+    @param ip Set to the address
+    @param port Set to the port, MATCH_PORT_ANY for *
+    @return 1 if consumed, 0 if not
+*/
+static int take_endpoint( cursor_t *c, ipaddr_t *ip, int *port ) {
+  int a, b, cc, d;
+  if ( !take_num( c, IP_OCTET_MAX, &a ) || !take_char( c, '.' ) ||
+       !take_num( c, IP_OCTET_MAX, &b ) || !take_char( c, '.' ) ||
+       !take_num( c, IP_OCTET_MAX, &cc ) || !take_char( c, '.' ) ||
+       !take_num( c, IP_OCTET_MAX, &d ) || !take_char( c, ':' ) ) {
+    return 0;
+  }
+  ip->a = a;
+  ip->b = b;
+  ip->c = cc;
+  ip->d = d;
+  if ( take_char( c, '*' ) ) {
+    *port = MATCH_PORT_ANY;
+    return 1;
+  }
+  return take_num( c, PORT_MAX, port );
+}
+
+/**
+    Consumes the body of an append or insert, from the action onwards.
+    @param c The cursor
+    @param rule Set to the parsed rule
+    @return 1 if the rest of the line is a rule, 0 if not
+*/
+static int take_rule( cursor_t *c, rule_t *rule ) {
+  int action;
+  if ( !take_char( c, ' ' ) || !take_action( c, &action ) || !take_char( c, ' ' ) ) {
+    return 0;
+  }
+  rule->action = action;
+  if ( take_word( c, "tcp" ) ) {
+    rule->match.protocol = PROTO_TCP;
+  } else if ( take_word( c, "udp" ) ) {
+    rule->match.protocol = PROTO_UDP;
+  } else {
+    return 0;
+  }
+  return take_char( c, ' ' ) &&
+         take_endpoint( c, &rule->match.src_ip, &rule->match.src_port ) &&
+         take_char( c, ' ' ) &&
+         take_endpoint( c, &rule->match.dst_ip, &rule->match.dst_port ) &&
+         c->p == c->end;
+}
+
+/**
+    Applies a default, append, insert or delete line straight to the policy.
+    @param c The cursor over the line
+    @return 1 if the line was handled, 0 if it needs the fallback
+*/
+static int fast_line( cursor_t *c ) {
+  rule_t rule;
+  int n;
+  if ( take_word( c, "append" ) ) {
+    if ( !take_rule( c, &rule ) ) {
+      return 0;
+    }
+    policy_append( rule );
+    return 1;
+  } else if ( take_word( c, "insert" ) ) {
+    if ( !take_char( c, ' ' ) || !take_num( c, 1 << 30, &n ) || !take_rule( c, &rule ) ) {
+      return 0;
+    }
+    policy_insert( rule, n );
+    return 1;
+  } else if ( take_word( c, "delete" ) ) {
+    if ( !take_char( c, ' ' ) || !take_num( c, 1 << 30, &n ) || c->p != c->end ) {
+      return 0;
+    }
+    policy_delete( n );
+    return 1;
+  } else if ( take_word( c, "default" ) ) {
+    if ( !take_char( c, ' ' ) || !take_action( c, &n ) || c->p != c->end ) {
+      return 0;
+    }
+    policy_set_default( n );
+    return 1;
+  }
+  return 0;
+}
+
+/**
+    Loads the commands in @filename into the policy. The file is mapped
+    into memory and default, append, insert and delete lines are parsed
+    in place and applied straight to the policy. Every other line,
+    including anything that does not parse cleanly, is passed to
+    @fallback, so it behaves exactly as if it had been typed.
+    Compiled engines are left stale and built once on the next test.
+    Pages of the file are released once parsed, so loading holds little
+    more memory than the rules themselves.
+    @param filename The file to load
+    @param fallback Runs the lines the loader does not handle itself
+    @return The number of lines read, -1 if the file could not be
+            read, -2 if @fallback asked to stop
+*/
+int loader_load(const char *filename, loader_fallback_t fallback) {
+  int fd = open( filename, O_RDONLY );
+  if ( fd < 0 ) {
+    return -1;
+  }
+  struct stat st;
+  if ( fstat( fd, &st ) != 0 ) {
+    close( fd );
+    return -1;
+  }
+  size_t size = st.st_size;
+  if ( size == 0 ) {
+    close( fd );
+    return 0;
+  }
+  const char *data = mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if ( data == MAP_FAILED ) {
+    return -1;
+  }
+  posix_madvise( ( void * ) data, size, POSIX_MADV_SEQUENTIAL );
+
+  int lines = 0;
+  const char *p = data;
+  const char *end = data + size;
+  const char *released = data;
+  size_t page = sysconf( _SC_PAGESIZE );
+  while ( p < end ) {
+    // Drop pages already parsed, so only the rules stay resident
+    if ( ( size_t ) ( p - released ) >= LOADER_RELEASE ) {
+      size_t span = ( p - released ) / page * page;
+      madvise( ( void * ) released, span, MADV_DONTNEED );
+      released += span;
+    }
+    const char *nl = memchr( p, '\n', end - p );
+    const char *eol = nl ? nl : end;
+    const char *start = p;
+    cursor_t c = { p, eol };
+    while ( c.end > c.p && ( c.end[ -1 ] == '\r' || c.end[ -1 ] == ' ' ) ) {
+      c.end--;
+    }
+    p = nl ? nl + 1 : end;
+    lines++;
+    if ( c.p == c.end || fast_line( &c ) ) {
+      continue;
+    }
+    char line[ LOADER_LINE ];
+    size_t len = eol - start;
+    if ( len >= LOADER_LINE ) {
+      len = LOADER_LINE - 1;
+    }
+    memcpy( line, start, len );
+    line[ len ] = '\0';
+    if ( fallback( line ) != 0 ) {
+      munmap( ( void * ) data, size );
+      return -2;
+    }
+  }
+  munmap( ( void * ) data, size );
+  return lines;
+}
@@ -0,0 +1,36 @@
+/**
+    @file loader.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior for loading large rule files.
+*/
+
+#ifndef LOADER_H
+#define LOADER_H
+
+/** Longest line handed to the fallback, longer lines are cut short */
+#define LOADER_LINE 256
+
+/**
+    Runs one command line the loader could not handle itself.
+    @param line The command, without its newline
+    @return 0 to keep loading, -1 to stop (quit)
+*/
+typedef int (*loader_fallback_t)(char *line);
+
+/**
+    Loads the commands in @filename into the policy. The file is mapped
+    into memory and default, append, insert and delete lines are parsed
+    in place and applied straight to the policy. Every other line,
+    including anything that does not parse cleanly, is passed to
+    @fallback, so it behaves exactly as if it had been typed.
+    Compiled engines are left stale and built once on the next test.
+    Pages of the file are released once parsed, so loading holds little
+    more memory than the rules themselves.
+    @param filename The file to load
+    @param fallback Runs the lines the loader does not handle itself
+    @return The number of lines read, -1 if the file could not be
+            read, -2 if @fallback asked to stop
+*/
+int loader_load(const char *filename, loader_fallback_t fallback);
+
+#endif
@@ -0,0 +1,323 @@
+/**
+    @file optimize.c
+    @author Griffin Brookshire (glbrook2)
+    Finds shadowed and redundant rules. Addresses and protocols are
+    matched exactly, so two rules can only overlap when those are equal,
+    and within such a group a rule's ports give it one of four shapes.
+    Each sweep then needs only a handful of hash probes per rule.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "optimize.h"
+
+/** Most groups of rules sharing protocol and addresses a key can name */
+#define OPTIMIZE_MAX_GROUPS ( 1 << 26 )
+
+/** Key kinds: rules of one shape, keyed by the ports they name */
+#define KIND_EXACT 0
+#define KIND_SRC 1
+#define KIND_DST 2
+#define KIND_ANY 3
+
+/** Key kinds: rules naming both ports, by one of them */
+#define KIND_BY_SRC 4
+#define KIND_BY_DST 5
+
+/** Key kinds: every rule of the group with a given shape, or any shape */
+#define KIND_ALL_SRC 6
+#define KIND_ALL_DST 7
+#define KIND_ALL 8
+
+/** Marks an empty slot, no key can take this value */
+#define EMPTY UINT64_MAX
+
+/**
+ * A rule's place in the sort by protocol and addresses.
+ */
+typedef struct entry {
+    uint32_t  src_ip;
+    uint32_t  dst_ip;
+    uint32_t  protocol;
+    int       index;
+} entry_t;
+
+/**
+ * A hash slot holding rule indices, one per action where that matters.
+ */
+typedef struct slot {
+    uint64_t  key;
+    int       v[ 2 ];
+} slot_t;
+
+/**
+ * An open addressed table of slots, a power of two in size.
+ */
+typedef struct table {
+    slot_t    *slots;
+    uint64_t  mask;
+} table_t;
+
+/**
+    Orders entries by protocol and addresses, then by policy order.
+    @param a The first entry
+    @param b The second entry
+    @return Negative, zero or positive as @a sorts before, with or after @b
+*/
+static int compare_entry( const void *a, const void *b ) {
+  const entry_t *x = a;
+  const entry_t *y = b;
+  if ( x->protocol != y->protocol ) {
+    return x->protocol < y->protocol ? -1 : 1;
+  }
+  if ( x->src_ip != y->src_ip ) {
+    return x->src_ip < y->src_ip ? -1 : 1;
+  }
+  if ( x->dst_ip != y->dst_ip ) {
+    return x->dst_ip < y->dst_ip ? -1 : 1;
+  }
+  return ( x->index > y->index ) - ( x->index < y->index );
+}
+
+/**
+    Tells whether two entries share protocol and addresses.
+    @param x The first entry
+    @param y The second entry
+    @return 1 if they do, 0 otherwise
+*/
+static int same_group( const entry_t *x, const entry_t *y ) {
+  return x->protocol == y->protocol && x->src_ip == y->src_ip && x->dst_ip == y->dst_ip;
+}
+
+/**
+    Builds a key. Ports are stored one higher so that 0 means any port.
+    @param group The group of rules sharing protocol and addresses
+    @param kind One of the KIND_ values
+    @param src The source port plus one, 0 for none
+    @param dst The destination port plus one, 0 for none
+    @return The key
+*/
+static uint64_t make_key( int group, int kind, uint32_t src, uint32_t dst ) {
+  return ( uint64_t ) group << 38 | ( uint64_t ) kind << 34 | ( uint64_t ) src << 17 | dst;
+}
+
+/**
+    Finds the slot for @key, claiming an empty one if @create is set.
+    A claimed slot starts with no rule for either action.
+    @param t The table
+    @param key The key
+    @param create Whether to claim a slot if the key is missing
+    @return The slot, NULL if the key is missing and @create is not set
+*/
+static slot_t *find( table_t *t, uint64_t key, int create ) {
+  uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+  for ( uint64_t i = ( h ^ ( h >> 29 ) ) & t->mask; ; i = ( i + 1 ) & t->mask ) {
+    slot_t *s = &t->slots[ i ];
+    if ( s->key == key ) {
+      return s;
+    }
+    if ( s->key == EMPTY ) {
+      if ( !create ) {
+        return NULL;
+      }
+      s->key = key;
+      s->v[ 0 ] = INT_MAX;
+      s->v[ 1 ] = INT_MAX;
+      return s;
+    }
+  }
+}
+
+/**
+    Returns the rule stored under @key for @action, INT_MAX if none.
+    @param t The table
+    @param key The key
+    @param action Which of the slot's rules to read
+    @return The rule index, INT_MAX if none
+*/
+static int get( table_t *t, uint64_t key, int action ) {
+  slot_t *s = find( t, key, 0 );
+  return s == NULL ? INT_MAX : s->v[ action ];
+}
+
+/**
+    Returns the smaller of two rule indices.
+    @param a The first index
+    @param b The second index
+    @return The smaller one
+*/
+static int min_index( int a, int b ) {
+  return a < b ? a : b;
+}
+
+/**
+    Finds the earliest rule stored in @t that matches every packet a rule
+    of group @group with ports @src and @dst does.
+    @param t The table
+    @param group The rule's group
+    @param src The rule's source port plus one, 0 for any
+    @param dst The rule's destination port plus one, 0 for any
+    @return The covering rule's index, INT_MAX if none
+*/
+static int find_cover( table_t *t, int group, uint32_t src, uint32_t dst ) {
+  int best = get( t, make_key( group, KIND_ANY, 0, 0 ), 0 );
+  if ( src != 0 ) {
+    best = min_index( best, get( t, make_key( group, KIND_SRC, src, 0 ), 0 ) );
+  }
+  if ( dst != 0 ) {
+    best = min_index( best, get( t, make_key( group, KIND_DST, 0, dst ), 0 ) );
+  }
+  if ( src != 0 && dst != 0 ) {
+    best = min_index( best, get( t, make_key( group, KIND_EXACT, src, dst ), 0 ) );
+  }
+  return best;
+}
+
+/**
+    Returns the key under which a rule of the given ports is stored by
+    its own shape.
+    @param group The rule's group
+    @param src The rule's source port plus one, 0 for any
+    @param dst The rule's destination port plus one, 0 for any
+    @return The key
+*/
+static uint64_t shape_key( int group, uint32_t src, uint32_t dst ) {
+  if ( src != 0 && dst != 0 ) {
+    return make_key( group, KIND_EXACT, src, dst );
+  } else if ( src != 0 ) {
+    return make_key( group, KIND_SRC, src, 0 );
+  } else if ( dst != 0 ) {
+    return make_key( group, KIND_DST, 0, dst );
+  }
+  return make_key( group, KIND_ANY, 0, 0 );
+}
+
+/**
+    Classifies each of @len rules as OPTIMIZE_KEEP, OPTIMIZE_SHADOWED or
+    OPTIMIZE_REDUNDANT. Removing every rule not kept leaves a policy that
+    gives every packet the same action. Rules only overlap when their
+    protocol and addresses are equal, so the rules are sorted into groups
+    sharing those and each group is swept once forwards for shadowing and
+    once backwards for redundancy, in O(n log n) overall.
+    @param rules The rules in policy order
+    @param len The number of rules
+    @param default_action The action taken when no rule matches
+    @param verdict Set to the class of each rule
+    @param by Set to the index of the rule that shadows or covers each
+              rule, or -1 where a redundant rule falls to the default
+    @return The number of rules not kept, -1 if memory ran out
+*/
+int optimize_rules(const rule_t *rules, int len, int default_action, int *verdict, int *by) {
+  if ( len <= 0 ) {
+    return 0;
+  }
+  if ( len >= OPTIMIZE_MAX_GROUPS ) {
+    return -1;
+  }
+  table_t t;
+  uint64_t cap = 16;
+  while ( cap < ( uint64_t ) len * 6 ) {
+    cap *= 2;
+  }
+  entry_t *order = malloc( len * sizeof( entry_t ) );
+  t.slots = malloc( cap * sizeof( slot_t ) );
+  t.mask = cap - 1;
+  if ( order == NULL || t.slots == NULL ) {
+    free( order );
+    free( t.slots );
+    return -1;
+  }
+  for ( int i = 0; i < len; i++ ) {
+    order[ i ].src_ip = ipaddr_to_int( rules[ i ].match.src_ip );
+    order[ i ].dst_ip = ipaddr_to_int( rules[ i ].match.dst_ip );
+    order[ i ].protocol = rules[ i ].match.protocol;
+    order[ i ].index = i;
+    verdict[ i ] = OPTIMIZE_KEEP;
+    by[ i ] = -1;
+  }
+  qsort( order, len, sizeof( entry_t ), compare_entry );
+
+  // Forwards: a rule is shadowed if an earlier rule covers it
+  memset( t.slots, 0xFF, cap * sizeof( slot_t ) );
+  int group = 0;
+  for ( int k = 0; k < len; k++ ) {
+    if ( k > 0 && !same_group( &order[ k - 1 ], &order[ k ] ) ) {
+      group++;
+    }
+    int i = order[ k ].index;
+    uint32_t src = rules[ i ].match.src_port + 1;
+    uint32_t dst = rules[ i ].match.dst_port + 1;
+    int cover = find_cover( &t, group, src, dst );
+    if ( cover != INT_MAX ) {
+      verdict[ i ] = OPTIMIZE_SHADOWED;
+      by[ i ] = cover;
+    } else {
+      slot_t *s = find( &t, shape_key( group, src, dst ), 1 );
+      s->v[ 0 ] = min_index( s->v[ 0 ], i );
+    }
+  }
+
+  // Backwards over the rules still kept: a rule is redundant if the
+  // packets it matches all reach a rule, or the default, with its action
+  memset( t.slots, 0xFF, cap * sizeof( slot_t ) );
+  int removed = 0;
+  for ( int k = len - 1; k >= 0; k-- ) {
+    if ( k < len - 1 && !same_group( &order[ k + 1 ], &order[ k ] ) ) {
+      group--;
+    }
+    int i = order[ k ].index;
+    if ( verdict[ i ] == OPTIMIZE_SHADOWED ) {
+      removed++;
+      continue;
+    }
+    int action = rules[ i ].action;
+    int other = 1 - action;
+    uint32_t src = rules[ i ].match.src_port + 1;
+    uint32_t dst = rules[ i ].match.dst_port + 1;
+    int cover = find_cover( &t, group, src, dst );
+
+    // The earliest later rule that overlaps without covering and disagrees
+    int clash = INT_MAX;
+    if ( src != 0 && dst == 0 ) {
+      clash = min_index( get( &t, make_key( group, KIND_BY_SRC, src, 0 ), other ),
+                         get( &t, make_key( group, KIND_ALL_DST, 0, 0 ), other ) );
+    } else if ( src == 0 && dst != 0 ) {
+      clash = min_index( get( &t, make_key( group, KIND_BY_DST, 0, dst ), other ),
+                         get( &t, make_key( group, KIND_ALL_SRC, 0, 0 ), other ) );
+    } else if ( src == 0 && dst == 0 ) {
+      clash = get( &t, make_key( group, KIND_ALL, 0, 0 ), other );
+    }
+
+    int redundant;
+    if ( cover != INT_MAX ) {
+      redundant = clash > cover && ( int ) rules[ cover ].action == action;
+    } else {
+      redundant = clash == INT_MAX && default_action == action;
+    }
+    if ( redundant ) {
+      verdict[ i ] = OPTIMIZE_REDUNDANT;
+      by[ i ] = cover != INT_MAX ? cover : -1;
+      removed++;
+      continue;
+    }
+
+    // Going backwards, each store leaves the earliest later rule
+    find( &t, shape_key( group, src, dst ), 1 )->v[ 0 ] = i;
+    find( &t, make_key( group, KIND_ALL, 0, 0 ), 1 )->v[ action ] = i;
+    if ( src != 0 && dst != 0 ) {
+      find( &t, make_key( group, KIND_BY_SRC, src, 0 ), 1 )->v[ action ] = i;
+      find( &t, make_key( group, KIND_BY_DST, 0, dst ), 1 )->v[ action ] = i;
+    } else if ( src != 0 ) {
+      find( &t, make_key( group, KIND_ALL_SRC, 0, 0 ), 1 )->v[ action ] = i;
+    } else if ( dst != 0 ) {
+      find( &t, make_key( group, KIND_ALL_DST, 0, 0 ), 1 )->v[ action ] = i;
+    }
+  }
+  free( order );
+  free( t.slots );
+  return removed;
+}
@@ -0,0 +1,40 @@
+/**
+    @file optimize.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior and data for finding rules that can be removed
+    without changing any verdict.
+*/
+
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include "packet.h"
+#include "policy.h"
+
+/** The rule is needed */
+#define OPTIMIZE_KEEP 0
+
+/** An earlier rule matches every packet the rule does, so it never fires */
+#define OPTIMIZE_SHADOWED 1
+
+/** Every packet the rule matches gets the same action without it */
+#define OPTIMIZE_REDUNDANT 2
+
+/**
+    Classifies each of @len rules as OPTIMIZE_KEEP, OPTIMIZE_SHADOWED or
+    OPTIMIZE_REDUNDANT. Removing every rule not kept leaves a policy that
+    gives every packet the same action. Rules only overlap when their
+    protocol and addresses are equal, so the rules are sorted into groups
+    sharing those and each group is swept once forwards for shadowing and
+    once backwards for redundancy, in O(n log n) overall.
+    @param rules The rules in policy order
+    @param len The number of rules
+    @param default_action The action taken when no rule matches
+    @param verdict Set to the class of each rule
+    @param by Set to the index of the rule that shadows or covers each
+              rule, or -1 where a redundant rule falls to the default
+    @return The number of rules not kept, -1 if memory ran out
+*/
+int optimize_rules(const rule_t *rules, int len, int default_action, int *verdict, int *by);
+
+#endif
@@ -52,8 +52,110 @@ int packet_match(packet_match_t match, packet_t packet) {
   if ( match.dst_ip.d != packet.dst_ip.d ) {
     return 0;
   }
-  if ( match.dst_port != packet.dst_port ) {
-    return 0;
+  if ( match.dst_port != MATCH_PORT_ANY ) {
+    if ( match.dst_port != packet.dst_port ) {
+      return 0;
+    }
   }
   return 1;
 }
+
+/**
+    This function packs the four octets of @ip into a single
+    integer, most significant octet first.
+    @param ip The address to pack
+    @return The address as a 32-bit value
+*/
+unsigned int ipaddr_to_int(ipaddr_t ip) {
+  return ( ( unsigned int ) ip.a << 24 ) | ( ( unsigned int ) ip.b << 16 ) |
+         ( ( unsigned int ) ip.c << 8 ) | ( unsigned int ) ip.d;
+}
+
+/**
+    This function makes a flow key from its fields and hashes it.
+    @param src_ip The source address, packed as by ipaddr_to_int
+    @param dst_ip The destination address, packed the same way
+    @param src_port The source port
+    @param dst_port The destination port
+    @param protocol PROTO_TCP or PROTO_UDP
+    @return The key
+*/
+flow_key_t flow_key_pack(uint32_t src_ip, uint32_t dst_ip, unsigned int src_port,
+                         unsigned int dst_port, unsigned int protocol) {
+  flow_key_t key;
+  key.src_ip = src_ip;
+  key.dst_ip = dst_ip;
+  key.src_port = src_port;
+  key.dst_port = dst_port;
+
+  // Hash the endpoints lowest first so both directions of a flow agree
+  uint64_t a = ( uint64_t ) src_ip << 16 | ( uint16_t ) src_port;
+  uint64_t b = ( uint64_t ) dst_ip << 16 | ( uint16_t ) dst_port;
+  uint64_t lo = a < b ? a : b;
+  uint64_t hi = a < b ? b : a;
+  uint64_t h = lo * 0x9E3779B97F4A7C15ULL ^ hi ^ ( uint64_t ) ( protocol & 1 ) << 48;
+  h ^= h >> 32;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 32;
+  key.tag = ( ( uint32_t ) h & ~1u ) | ( protocol & 1 );
+  return key;
+}
+
+/**
+    This function makes the flow key of @pkt.
+    @param pkt The packet
+    @return The key
+*/
+flow_key_t flow_key_make(packet_t pkt) {
+  return flow_key_pack( ipaddr_to_int( pkt.src_ip ), ipaddr_to_int( pkt.dst_ip ),
+                        pkt.src_port, pkt.dst_port, pkt.protocol );
+}
+
+/**
+    This function makes the flow key of @match, with 0 for any port
+    that may be any.
+    @param match The match
+    @return The key
+*/
+flow_key_t flow_key_from_match(packet_match_t match) {
+  return flow_key_pack( ipaddr_to_int( match.src_ip ), ipaddr_to_int( match.dst_ip ),
+                        match.src_port == MATCH_PORT_ANY ? 0 : match.src_port,
+                        match.dst_port == MATCH_PORT_ANY ? 0 : match.dst_port,
+                        match.protocol );
+}
+
+/**
+    This function turns a flow key back into a packet.
+    @param key The key
+    @return The packet
+*/
+packet_t flow_key_packet(flow_key_t key) {
+  packet_t pkt;
+  pkt.protocol = FLOW_PROTOCOL( key );
+  pkt.src_ip.a = key.src_ip >> 24;
+  pkt.src_ip.b = key.src_ip >> 16;
+  pkt.src_ip.c = key.src_ip >> 8;
+  pkt.src_ip.d = key.src_ip;
+  pkt.src_port = key.src_port;
+  pkt.dst_ip.a = key.dst_ip >> 24;
+  pkt.dst_ip.b = key.dst_ip >> 16;
+  pkt.dst_ip.c = key.dst_ip >> 8;
+  pkt.dst_ip.d = key.dst_ip;
+  pkt.dst_port = key.dst_port;
+  return pkt;
+}
+
+/**
+    This function swaps the endpoints of @key, giving the key of the
+    other direction of the flow. The hash stays the same.
+    @param key The key
+    @return The reversed key
+*/
+flow_key_t flow_key_reverse(flow_key_t key) {
+  flow_key_t rev = key;
+  rev.src_ip = key.dst_ip;
+  rev.dst_ip = key.src_ip;
+  rev.src_port = key.dst_port;
+  rev.dst_port = key.src_port;
+  return rev;
+}
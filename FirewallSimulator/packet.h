@@ -7,6 +7,8 @@
 #ifndef PACKET_H
 #define PACKET_H
 
+#include <stdint.h>
+
 /** Protocol value indicating TCP */
 #define PROTO_TCP      0
 
@@ -81,6 +83,42 @@ typedef struct packet_match {
     port_match_t    dst_port; //int
 } packet_match_t;
 
+/**
+ * A packet's 5-tuple packed into 16 bytes with no padding, so every byte
+ * of a key is defined and two keys compare field by field. The hash is
+ * computed once when the key is made and is the same for both
+ * directions of a flow, so the verdict cache, connection tracking and
+ * the tuple classifier can all index by it without rehashing.
+ * .src_ip / .dst_ip: the addresses, packed as by ipaddr_to_int
+ * .src_port / .dst_port: the ports
+ * .tag: the protocol (PROTO_TCP or PROTO_UDP) in bit 0, the hash above it
+ */
+typedef struct flow_key {
+    uint32_t  src_ip;
+    uint32_t  dst_ip;
+    uint16_t  src_port;
+    uint16_t  dst_port;
+    uint32_t  tag;
+} flow_key_t;
+
+/** The 31-bit hash of a flow key */
+#define FLOW_HASH( key ) ( ( key ).tag >> 1 )
+
+/** The hash mixed with the source endpoint, for tables that keep the two
+    directions of a flow apart, so a flow and its reply land far apart */
+#define FLOW_DIRECTED_HASH( key ) \
+  ( FLOW_HASH( key ) ^ ( uint32_t ) ( ( ( ( uint64_t ) ( key ).src_ip << 16 | \
+                                         ( key ).src_port ) * 0x9E3779B97F4A7C15ULL ) >> 32 ) )
+
+/** The protocol of a flow key */
+#define FLOW_PROTOCOL( key ) ( ( key ).tag & 1 )
+
+/** Whether two flow keys are equal, the tag compared first */
+#define FLOW_KEY_EQUAL( x, y ) ( ( x ).tag == ( y ).tag && ( x ).src_ip == ( y ).src_ip && \
+                                 ( x ).dst_ip == ( y ).dst_ip && \
+                                 ( x ).src_port == ( y ).src_port && \
+                                 ( x ).dst_port == ( y ).dst_port )
+
 /**
     This function checks if @packet is matched by @match.
     It returns 1 if match and 0 if no match.
@@ -90,4 +128,54 @@ typedef struct packet_match {
 */
 int packet_match(packet_match_t match, packet_t packet);
 
+/**
+    This function packs the four octets of @ip into a single
+    integer, most significant octet first.
+    @param ip The address to pack
+    @return The address as a 32-bit value
+*/
+unsigned int ipaddr_to_int(ipaddr_t ip);
+
+/**
+    This function makes a flow key from its fields and hashes it.
+    @param src_ip The source address, packed as by ipaddr_to_int
+    @param dst_ip The destination address, packed the same way
+    @param src_port The source port
+    @param dst_port The destination port
+    @param protocol PROTO_TCP or PROTO_UDP
+    @return The key
+*/
+flow_key_t flow_key_pack(uint32_t src_ip, uint32_t dst_ip, unsigned int src_port,
+                         unsigned int dst_port, unsigned int protocol);
+
+/**
+    This function makes the flow key of @pkt.
+    @param pkt The packet
+    @return The key
+*/
+flow_key_t flow_key_make(packet_t pkt);
+
+/**
+    This function makes the flow key of @match, with 0 for any port
+    that may be any.
+    @param match The match
+    @return The key
+*/
+flow_key_t flow_key_from_match(packet_match_t match);
+
+/**
+    This function turns a flow key back into a packet.
+    @param key The key
+    @return The packet
+*/
+packet_t flow_key_packet(flow_key_t key);
+
+/**
+    This function swaps the endpoints of @key, giving the key of the
+    other direction of the flow. The hash stays the same.
+    @param key The key
+    @return The reversed key
+*/
+flow_key_t flow_key_reverse(flow_key_t key);
+
 #endif
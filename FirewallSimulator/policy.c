@@ -7,18 +7,46 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "policy.h"
+#include "tree.h"
+#include "tuple.h"
+#include "bitvec.h"
+#include "scan.h"
+#include "bytecode.h"
+#include "cache.h"
+#include "conntrack.h"
+#include "stats.h"
+#include "snapshot.h"
+#include "optimize.h"
+#include "reorder.h"
+#include "txn.h"
 
 /**
  * The initial allocation size of the policy
  */
 #define POLICY_INIT_SIZE 10
 
+/**
+ * Packets matched side by side by the batch linear scan
+ */
+#define POLICY_BATCH 8
+
+/**
+ * Packets gathered per pass when a batch goes through the verdict cache
+ */
+#define POLICY_CACHE_BATCH 64
+
+/**
+ * Size of a cache line, reader slots are aligned to it
+ */
+#define POLICY_LINE 64
+
 /**
  * The global firewall policy, internally managed
  */
-static rule_t **policy = NULL;
+static rule_t *policy = NULL;
 
 /**
  * The current number of policy in the policy
@@ -35,21 +63,333 @@ static int policy_cap = 0;
  */
 static int policy_default = ACTION_DENY;
 
-/** Holds the rules */
-static rule_t *rules[ POLICY_INIT_SIZE ] = { NULL };
+/**
+ * The engine used to answer policy_test
+ */
+static int policy_engine = ENGINE_LINEAR;
+
+/**
+ * The compiled decision tree, NULL until first needed
+ */
+static tree_t *policy_tree = NULL;
+
+/**
+ * The compiled tuple space, NULL until first needed
+ */
+static tuple_t *policy_tuple = NULL;
+
+/**
+ * The compiled bit-vector classifier, NULL until first needed
+ */
+static bitvec_t *policy_bitvec = NULL;
+
+/**
+ * The rules packed into columns, NULL until first needed
+ */
+static scan_t *policy_scan = NULL;
+
+/**
+ * The rules compiled into bytecode, NULL until first needed
+ */
+static bytecode_t *policy_bytecode = NULL;
+
+/**
+ * The open transaction, NULL if edits apply at once
+ */
+static txn_t *policy_txn = NULL;
+
+/**
+ * Set when the rules change and compiled engines are stale
+ */
+static int policy_dirty = 1;
+
+/**
+ * Bumped whenever a verdict could change, so cached verdicts go stale
+ */
+static unsigned int policy_gen = 1;
+
+/**
+ * The verdict cache in front of policy_test, NULL when disabled
+ */
+static cache_t *policy_cache = NULL;
+
+/**
+ * The connection tracking table in front of the cache, NULL when disabled
+ */
+static conntrack_t *policy_conntrack = NULL;
+
+/**
+ * Hit counters and latency of policy_test and policy_test_batch
+ */
+static stats_t policy_stats;
+
+/**
+ * Set while lookups are counted into policy_stats
+ */
+static int policy_counting = 0;
+
+/**
+ * The snapshot the rules or compiled engine were mapped from, if any
+ */
+static snapshot_t policy_snap;
+
+/**
+ * Set while policy points into policy_snap rather than the heap
+ */
+static int policy_borrowed = 0;
+
+/**
+ * The rules in the order the linear scan tries them, see policy_reorder,
+ * and the policy index of each. NULL while rules are tried in order.
+ */
+static rule_t *policy_ordered = NULL;
+static int *policy_order = NULL;
+
+/**
+ * A set of rules and the engine compiled from them, enough to answer
+ * lookups. A frozen copy is never changed, so any number of threads may
+ * search it at once.
+ * .rules / .len: the rules in policy order, stored after the struct
+ * .ordered / .order: the rules in the order the linear scan tries them
+ *                   and the policy index of each, stored after .rules,
+ *                   NULL for policy order
+ * .default_action: the action taken when no rule matches
+ * .tree / .tuple / .bitvec / .scan / .bytecode: the compiled engine,
+ *                                           NULL if none
+ */
+struct policy_frozen {
+    rule_t      *rules;
+    int         len;
+    rule_t      *ordered;
+    int         *order;
+    int         default_action;
+    tree_t      *tree;
+    tuple_t     *tuple;
+    bitvec_t    *bitvec;
+    scan_t      *scan;
+    bytecode_t  *bytecode;
+};
+
+/**
+ * A reader thread's slot, alone on its cache line so that entering and
+ * leaving a version never touches a line another thread writes.
+ * .used: set while a thread holds the slot
+ * .epoch: the epoch the reader locked a version in, 0 while it holds none
+ */
+struct policy_reader {
+    int             used;
+    unsigned long   epoch;
+} __attribute__(( aligned( POLICY_LINE ) ));
+
+/**
+ * A replaced version waiting for the readers that may hold it to leave.
+ * .version: the replaced version
+ * .epoch: the epoch it was replaced in
+ */
+typedef struct retired {
+    policy_frozen_t *version;
+    unsigned long   epoch;
+} retired_t;
+
+/**
+ * The reader slots
+ */
+static struct policy_reader policy_readers[ POLICY_MAX_READERS ];
+
+/**
+ * The latest published version, swapped atomically on every change
+ */
+static policy_frozen_t *policy_current = NULL;
+
+/**
+ * Advanced each time a version is replaced
+ */
+static unsigned long policy_epoch = 1;
+
+/**
+ * Set once the policy is published, so changes publish a new version
+ */
+static int policy_shared = 0;
+
+/**
+ * Replaced versions not yet freed
+ */
+static retired_t *policy_retired = NULL;
+
+/**
+ * The number and capacity of policy_retired
+ */
+static int policy_retired_len = 0;
+static int policy_retired_cap = 0;
+
+/**
+    Doubles the capacity of the policy, allocating it if needed.
+    It returns 0 if successful, -1 if unsuccessful.
+    @return 0 if success, -1 if fail
+*/
+static int grow_array() {
+  int cap = policy_cap > 0 ? policy_cap * 2 : POLICY_INIT_SIZE;
+  rule_t *grown = ( rule_t * )realloc( policy, cap * sizeof( rule_t ) );
+  if ( grown == NULL ) {
+    return -1;
+  }
+  policy = grown;
+  policy_cap = cap;
+  return 0;
+}
+
+/**
+    Halves the capacity of the policy while it is at most a quarter full,
+    so memory freed up by deletes goes back to the system. The policy is
+    left as it was if the smaller block cannot be had.
+*/
+static void shrink_array() {
+  int cap = policy_cap;
+  while ( cap / 2 >= POLICY_INIT_SIZE && policy_len <= cap / 4 ) {
+    cap /= 2;
+  }
+  if ( cap == policy_cap ) {
+    return;
+  }
+  rule_t *shrunk = ( rule_t * )realloc( policy, cap * sizeof( rule_t ) );
+  if ( shrunk != NULL ) {
+    policy = shrunk;
+    policy_cap = cap;
+  }
+}
+
+/**
+    Frees every compiled engine.
+*/
+static void drop_engines() {
+  if ( policy_tree != policy_snap.tree ) {
+    tree_free( policy_tree );
+  }
+  policy_tree = NULL;
+  if ( policy_tuple != policy_snap.tuple ) {
+    tuple_free( policy_tuple );
+  }
+  policy_tuple = NULL;
+  if ( policy_bitvec != policy_snap.bitvec ) {
+    bitvec_free( policy_bitvec );
+  }
+  policy_bitvec = NULL;
+  if ( policy_scan != policy_snap.scan ) {
+    scan_free( policy_scan );
+  }
+  policy_scan = NULL;
+  bytecode_free( policy_bytecode );
+  policy_bytecode = NULL;
+  if ( !policy_borrowed ) {
+    snapshot_unmap( &policy_snap );
+  }
+}
+
+/**
+    Goes back to trying rules in policy order.
+*/
+static void drop_order() {
+  free( policy_ordered );
+  free( policy_order );
+  policy_ordered = NULL;
+  policy_order = NULL;
+}
+
+/**
+    Copies rules mapped from a snapshot onto the heap so they can be
+    changed. The mapping is released once the engine no longer uses it.
+    It returns 0 if successful, -1 if unsuccessful.
+    @return 0 if success, -1 if fail
+*/
+static int own_rules() {
+  if ( !policy_borrowed ) {
+    return 0;
+  }
+  int cap = policy_len > POLICY_INIT_SIZE / 2 ? policy_len * 2 : POLICY_INIT_SIZE;
+  rule_t *copy = ( rule_t * )malloc( cap * sizeof( rule_t ) );
+  if ( copy == NULL ) {
+    return -1;
+  }
+  memcpy( copy, policy, policy_len * sizeof( rule_t ) );
+  policy = copy;
+  policy_cap = cap;
+  policy_borrowed = 0;
+  return 0;
+}
 
-static void grow_array() {
-  //printf("got to grow\n");
-  //policy = ( rule_t ** )realloc( policy[ 0 ], ( policy_len + policy_len ) * sizeof( rule_t * ) );
-  //int new_size = policy_len + policy_len;
-  //rule_t *new_rules[ new_size ] = { NULL };
-  //for ( int i = 0; i < new_size; i++ ) {
-    //new_rules[ i ] = ( rule_t * )malloc( sizeof( rule_t * ) );
-  //}
-  //rules = &new_rules[ 0 ];
-  //policy = rules;
-  //printf("grew to size: %d\n", new_size);
-  //policy_cap = new_size;
+/**
+    Moves to a new policy generation, invalidating every cached verdict.
+    Generation 0 is skipped since it marks unused cache entries.
+*/
+static void bump_generation() {
+  if ( ++policy_gen == 0 ) {
+    policy_gen = 1;
+  }
+}
+
+/**
+    Frees every replaced version that no reader can still hold. A reader
+    that entered in an epoch after a version was replaced loaded the
+    newer pointer, so only readers from that epoch or earlier matter.
+*/
+static void reclaim() {
+  unsigned long oldest = ULONG_MAX;
+  for ( int r = 0; r < POLICY_MAX_READERS; r++ ) {
+    unsigned long epoch = __atomic_load_n( &policy_readers[ r ].epoch, __ATOMIC_SEQ_CST );
+    if ( epoch != 0 && epoch < oldest ) {
+      oldest = epoch;
+    }
+  }
+  int kept = 0;
+  for ( int i = 0; i < policy_retired_len; i++ ) {
+    if ( policy_retired[ i ].epoch < oldest ) {
+      policy_frozen_free( policy_retired[ i ].version );
+    } else {
+      policy_retired[ kept++ ] = policy_retired[ i ];
+    }
+  }
+  policy_retired_len = kept;
+}
+
+/**
+    Builds a version from the current rules and swaps it in for readers.
+    The version it replaces is retired rather than freed.
+    It returns 0 if successful, -1 if unsuccessful.
+    @return 0 if success, -1 if fail
+*/
+static int publish() {
+  if ( policy_retired_len == policy_retired_cap ) {
+    int cap = policy_retired_cap > 0 ? policy_retired_cap * 2 : POLICY_INIT_SIZE;
+    retired_t *grown = ( retired_t * )realloc( policy_retired, cap * sizeof( retired_t ) );
+    if ( grown == NULL ) {
+      return -1;
+    }
+    policy_retired = grown;
+    policy_retired_cap = cap;
+  }
+  policy_frozen_t *version = policy_freeze();
+  if ( version == NULL ) {
+    return -1;
+  }
+  policy_frozen_t *old = __atomic_exchange_n( &policy_current, version, __ATOMIC_SEQ_CST );
+  if ( old != NULL ) {
+    policy_retired[ policy_retired_len ].version = old;
+    policy_retired[ policy_retired_len ].epoch =
+      __atomic_fetch_add( &policy_epoch, 1, __ATOMIC_SEQ_CST );
+    policy_retired_len++;
+  }
+  reclaim();
+  return 0;
+}
+
+/**
+    Publishes the changed policy if readers are being served. If that
+    fails readers keep the previous version until the next change.
+*/
+static void republish() {
+  if ( policy_shared && publish() != 0 ) {
+    fprintf( stdout, "Error: Could not publish policy.\n" );
+  }
 }
 
 /**
@@ -58,15 +398,11 @@ static void grow_array() {
     @return 0 if success, -1 if fail
 */
 int policy_init() {
-  for ( int i = 0; i < POLICY_INIT_SIZE; i++ ) {
-    rules[ i ] = ( rule_t * )malloc( sizeof( rule_t * ) );
-  }
-  //policy = ( rule_t ** )malloc( POLICY_INIT_SIZE * sizeof( rule_t * ) );
-  //policy = &rules[ 0 ];
-  policy = rules;
+  policy = ( rule_t * )malloc( POLICY_INIT_SIZE * sizeof( rule_t ) );
   if ( policy == NULL ) {
     return -1;
   }
+  policy_len = 0;
   policy_cap = POLICY_INIT_SIZE;
   return 0;
 }
@@ -76,12 +412,35 @@ int policy_init() {
     structure and re-initialize values as appropriate.
 */
 void policy_free() {
-  for ( int i = 0; i < policy_len; i++ ) {
-    free( rules[ i ] );
+  if ( !policy_borrowed ) {
+    free( policy );
   }
-  for ( int j = 0; j < policy_len; j++ ) {
-    //free( policy[ j ][ 0 ] );
+  policy_borrowed = 0;
+  policy = NULL;
+  policy_len = 0;
+  policy_cap = 0;
+  drop_engines();
+  drop_order();
+  policy_dirty = 1;
+  cache_free( policy_cache );
+  policy_cache = NULL;
+  conntrack_free( policy_conntrack );
+  policy_conntrack = NULL;
+  stats_free( &policy_stats );
+  policy_counting = 0;
+  txn_free( policy_txn );
+  policy_txn = NULL;
+  bump_generation();
+  // Readers must be gone by now, so every version can go
+  policy_shared = 0;
+  policy_frozen_free( __atomic_exchange_n( &policy_current, NULL, __ATOMIC_SEQ_CST ) );
+  for ( int i = 0; i < policy_retired_len; i++ ) {
+    policy_frozen_free( policy_retired[ i ].version );
   }
+  free( policy_retired );
+  policy_retired = NULL;
+  policy_retired_len = 0;
+  policy_retired_cap = 0;
 }
 
 /**
@@ -92,10 +451,42 @@ void policy_free() {
     @return 0 if success, -1 if fail
 */
 int policy_set_default(int action) {
+  if ( policy_txn != NULL ) {
+    policy_txn->default_action = action;
+    return 0;
+  }
   policy_default = action;
+  bump_generation();
+  republish();
   return 0;
 }
 
+/**
+    Adds the rule now at index @i to the compiled tuple space in place.
+    Other engines, and a tuple space that cannot take the edit or has
+    gathered enough edits to be worth rebuilding, are marked stale.
+    @param i The index of the new rule
+*/
+static void engine_inserted( int i ) {
+  if ( policy_dirty || policy_tuple == NULL || policy_tuple == policy_snap.tuple ||
+       tuple_insert( policy_tuple, &policy[ i ], i ) != 0 || tuple_fragmented( policy_tuple ) ) {
+    policy_dirty = 1;
+  }
+}
+
+/**
+    Removes @rule, which was at index @i, from the compiled tuple space
+    in place, marking the engines stale as engine_inserted does.
+    @param rule The deleted rule
+    @param i The index it had
+*/
+static void engine_deleted( const rule_t *rule, int i ) {
+  if ( policy_dirty || policy_tuple == NULL || policy_tuple == policy_snap.tuple ||
+       tuple_delete( policy_tuple, rule, i ) != 0 || tuple_fragmented( policy_tuple ) ) {
+    policy_dirty = 1;
+  }
+}
+
 /**
     This function will append a rule to the policy.
     It returns 0 if successful, -1 if unsuccessful.
@@ -103,14 +494,24 @@ int policy_set_default(int action) {
     @return 0 if success, -1 if fail
 */
 int policy_append(rule_t rule) {
-  if ( policy_len == policy_cap - 1 ) {
-    //printf("About to grow\n");
-    grow_array();
+  if ( policy_txn != NULL ) {
+    if ( txn_insert( policy_txn, rule, policy_txn->len ) != 0 ) {
+      fprintf( stdout, "Error: Could not add rule.\n" );
+      return -1;
+    }
+    return 0;
   }
-  //policy_print_rule( stdout, 9 );
-  *( policy[ policy_len ] ) = rule;
-  //printf("After one append\n");
+  if ( own_rules() != 0 || ( policy_len == policy_cap && grow_array() != 0 ) ) {
+    fprintf( stdout, "Error: Could not add rule.\n" );
+    return -1;
+  }
+  policy[ policy_len ] = rule;
+  stats_insert( &policy_stats, policy_len, policy_len );
   policy_len++;
+  engine_inserted( policy_len - 1 );
+  drop_order();
+  bump_generation();
+  republish();
   return 0;
 }
 
@@ -126,21 +527,29 @@ int policy_insert(rule_t rule, int pos) {
     fprintf( stdout, "Error: Could not add rule.\n" );
     return -1;
   }
-  if ( policy_len == policy_cap - 1 ) {
-    grow_array();
+  if ( pos > ( policy_txn != NULL ? policy_txn->len : policy_len ) ) {
+    return policy_append( rule );
   }
-  if ( pos > policy_len ) {
-    policy_append( rule );
+  if ( policy_txn != NULL ) {
+    if ( txn_insert( policy_txn, rule, pos - 1 ) != 0 ) {
+      fprintf( stdout, "Error: Could not add rule.\n" );
+      return -1;
+    }
     return 0;
   }
-  pos = pos - 1;
-  for ( int i = policy_len - 1; i >= pos; i-- ) {
-    rule_t rulei = policy[ i ][ 0 ];
-    //policy[ i + 1 ] = &( policy[ i ][ 0 ] );
-    *( policy[ i + 1 ] ) = rulei;
+  if ( own_rules() != 0 || ( policy_len == policy_cap && grow_array() != 0 ) ) {
+    fprintf( stdout, "Error: Could not add rule.\n" );
+    return -1;
   }
-  *( policy[ pos ] ) = rule;
+  pos = pos - 1;
+  memmove( &policy[ pos + 1 ], &policy[ pos ], ( policy_len - pos ) * sizeof( rule_t ) );
+  policy[ pos ] = rule;
+  stats_insert( &policy_stats, pos, policy_len );
   policy_len++;
+  engine_inserted( pos );
+  drop_order();
+  bump_generation();
+  republish();
   return 0;
 }
 
@@ -151,48 +560,1120 @@ int policy_insert(rule_t rule, int pos) {
     @return 0 if success, -1 if fail
 */
 int policy_delete(int pos) {
+  if ( policy_txn != NULL ) {
+    if ( txn_delete( policy_txn, pos - 1 ) != 0 ) {
+      fprintf( stdout, "Error: Could not delete rule.\n" );
+      return -1;
+    }
+    return 0;
+  }
   if ( pos <= 0 || pos > policy_len ) {
     fprintf( stdout, "Error: Could not delete rule.\n" );
     return -1;
   }
-  pos = pos - 1;
-  for ( int i = pos; i < policy_len; i++ ) {
-    policy[ i ] = &( policy[ i + 1 ][ 0 ] );
+  if ( own_rules() != 0 ) {
+    fprintf( stdout, "Error: Could not delete rule.\n" );
+    return -1;
   }
+  pos = pos - 1;
+  rule_t rule = policy[ pos ];
+  memmove( &policy[ pos ], &policy[ pos + 1 ], ( policy_len - pos - 1 ) * sizeof( rule_t ) );
+  stats_delete( &policy_stats, pos, policy_len );
   policy_len--;
+  shrink_array();
+  engine_deleted( &rule, pos );
+  drop_order();
+  bump_generation();
+  republish();
   return 0;
 }
 
+/**
+    This function will open a transaction. Until it is committed, rule
+    edits and default policy changes are staged and every test still
+    sees the policy as it was.
+    It returns 0 if successful, -1 if a transaction is already open or
+    memory ran out.
+    @return 0 if success, -1 if fail
+*/
+int policy_begin() {
+  if ( policy_txn != NULL ) {
+    return -1;
+  }
+  policy_txn = txn_begin( policy, policy_len, policy_default );
+  return policy_txn == NULL ? -1 : 0;
+}
+
+/**
+    This function will apply the staged edits as one new policy version.
+    Engines are rebuilt once for the lot, cached verdicts and tracked
+    flows go stale once, and rule hits follow their rules.
+    It returns the number of edits committed, -1 if no transaction is
+    open or memory ran out, in which case the transaction stays open.
+    @return The number of edits, -1 if fail
+*/
+int policy_commit() {
+  if ( policy_txn == NULL ) {
+    return -1;
+  }
+  int len = policy_txn->len;
+  int cap = len > POLICY_INIT_SIZE / 2 ? len * 2 : POLICY_INIT_SIZE;
+  rule_t *rules = ( rule_t * )malloc( cap * sizeof( rule_t ) );
+  int *from = ( int * )malloc( ( len ? len : 1 ) * sizeof( int ) );
+  if ( rules == NULL || from == NULL ) {
+    free( rules );
+    free( from );
+    return -1;
+  }
+  txn_flatten( policy_txn, rules, from );
+  if ( stats_remap( &policy_stats, from, len ) != 0 ) {
+    free( rules );
+    free( from );
+    return -1;
+  }
+  free( from );
+  if ( !policy_borrowed ) {
+    free( policy );
+  }
+  policy_borrowed = 0;
+  drop_engines();
+  drop_order();
+  policy = rules;
+  policy_len = len;
+  policy_cap = cap;
+  policy_default = policy_txn->default_action;
+  policy_dirty = 1;
+  int edits = policy_txn->edits;
+  txn_free( policy_txn );
+  policy_txn = NULL;
+  bump_generation();
+  republish();
+  return edits;
+}
+
+/**
+    This function will drop the staged edits, leaving the policy as it
+    was when the transaction was opened.
+    It returns 0 if successful, -1 if no transaction is open.
+    @return 0 if success, -1 if fail
+*/
+int policy_abort() {
+  if ( policy_txn == NULL ) {
+    return -1;
+  }
+  txn_free( policy_txn );
+  policy_txn = NULL;
+  return 0;
+}
+
+/**
+    This function will select the engine used by policy_test.
+    Compiled engines are rebuilt lazily after the rules change.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param engine One of the ENGINE_ values
+    @return 0 if success, -1 if fail
+*/
+int policy_set_engine(int engine) {
+  if ( engine < ENGINE_LINEAR || engine > ENGINE_BYTECODE ) {
+    return -1;
+  }
+  policy_engine = engine;
+  policy_dirty = 1;
+  republish();
+  return 0;
+}
+
+/**
+    Rebuilds the selected compiled engine from the current rules.
+    If the build fails the engine stays NULL and lookups scan the rules.
+*/
+static void rebuild_engine() {
+  drop_engines();
+  policy_dirty = 0;
+  if ( policy_engine == ENGINE_LINEAR ) {
+    return;
+  }
+  if ( policy_engine == ENGINE_TREE ) {
+    policy_tree = tree_build( policy, policy_len );
+  } else if ( policy_engine == ENGINE_TUPLE ) {
+    policy_tuple = tuple_build( policy, policy_len );
+  } else if ( policy_engine == ENGINE_BITVEC ) {
+    policy_bitvec = bitvec_build( policy, policy_len );
+  } else if ( policy_engine == ENGINE_SCAN ) {
+    policy_scan = scan_build( policy, policy_len );
+  } else if ( policy_engine == ENGINE_BYTECODE ) {
+    policy_bytecode = bytecode_build( policy, policy_len );
+  }
+}
+
+/**
+    Finds the first rule of @view that matches @pkt.
+    Falls back to scanning the rules if no engine is compiled.
+    @param view The rules and engine to search
+    @param pkt The packet to match
+    @return Index of the matching rule, -1 if none match
+*/
+static int view_lookup( const policy_frozen_t *view, packet_t pkt ) {
+  if ( view->tree != NULL ) {
+    return tree_lookup( view->tree, pkt );
+  } else if ( view->tuple != NULL ) {
+    return tuple_lookup( view->tuple, pkt );
+  } else if ( view->bitvec != NULL ) {
+    return bitvec_lookup( view->bitvec, pkt );
+  } else if ( view->scan != NULL ) {
+    return scan_lookup( view->scan, pkt );
+  } else if ( view->bytecode != NULL ) {
+    return bytecode_lookup( view->bytecode, pkt );
+  }
+  const rule_t *rules = view->ordered != NULL ? view->ordered : view->rules;
+  for ( int i = 0; i < view->len; i++ ) {
+    if ( packet_match( rules[ i ].match, pkt ) ) {
+      return view->order != NULL ? view->order[ i ] : i;
+    }
+  }
+  return -1;
+}
+
+/**
+    Finds the first matching rule of @view for each of @n packets.
+    The linear scan walks the rules once per group of packets, testing
+    each rule it loads against the whole group.
+    @param view The rules and engine to search
+    @param pkts The packets to match
+    @param n The number of packets
+    @param out Set to the index of each packet's rule, -1 if none match
+*/
+static void view_lookup_batch( const policy_frozen_t *view, const packet_t *pkts, int n, int *out ) {
+  if ( view->tree != NULL ) {
+    tree_lookup_batch( view->tree, pkts, n, out );
+    return;
+  } else if ( view->tuple != NULL ) {
+    tuple_lookup_batch( view->tuple, pkts, n, out );
+    return;
+  } else if ( view->bitvec != NULL || view->scan != NULL || view->bytecode != NULL ) {
+    for ( int j = 0; j < n; j++ ) {
+      out[ j ] = view_lookup( view, pkts[ j ] );
+    }
+    return;
+  }
+  const rule_t *rules = view->ordered != NULL ? view->ordered : view->rules;
+  for ( int base = 0; base < n; base += POLICY_BATCH ) {
+    int m = n - base < POLICY_BATCH ? n - base : POLICY_BATCH;
+    int waiting = m;
+    for ( int j = 0; j < m; j++ ) {
+      out[ base + j ] = -1;
+    }
+    for ( int i = 0; i < view->len && waiting > 0; i++ ) {
+      packet_match_t match = rules[ i ].match;
+      for ( int j = 0; j < m; j++ ) {
+        if ( out[ base + j ] < 0 && packet_match( match, pkts[ base + j ] ) ) {
+          out[ base + j ] = view->order != NULL ? view->order[ i ] : i;
+          waiting--;
+        }
+      }
+    }
+  }
+}
+
+/**
+    Describes the live policy as a view, rebuilding the engine if stale.
+    @param view Filled with the live rules and engine
+*/
+static void live_view( policy_frozen_t *view ) {
+  if ( policy_dirty ) {
+    rebuild_engine();
+  }
+  view->rules = policy;
+  view->len = policy_len;
+  view->ordered = policy_ordered;
+  view->order = policy_order;
+  view->default_action = policy_default;
+  view->tree = policy_tree;
+  view->tuple = policy_tuple;
+  view->bitvec = policy_bitvec;
+  view->scan = policy_scan;
+  view->bytecode = policy_bytecode;
+}
+
+/**
+    Finds the first rule that matches @pkt using the selected engine.
+    @param pkt The packet to match
+    @return Index of the matching rule, -1 if none match
+*/
+static int policy_lookup( packet_t pkt ) {
+  policy_frozen_t view;
+  live_view( &view );
+  return view_lookup( &view, pkt );
+}
+
+/**
+    Finds the first matching rule for each of @n packets using the
+    selected engine.
+    @param pkts The packets to match
+    @param n The number of packets
+    @param out Set to the index of each packet's rule, -1 if none match
+*/
+static void policy_lookup_batch( const packet_t *pkts, int n, int *out ) {
+  policy_frozen_t view;
+  live_view( &view );
+  view_lookup_batch( &view, pkts, n, out );
+}
+
+/**
+    Tests each of @n packets against the live policy, through the verdict
+    cache if there is one.
+    @param pkts The packets to test
+    @param keys Their flow keys, only read if there is a cache
+    @param n The number of packets
+    @param actions The action taken for each packet
+    @param pos The rule position matched by each packet
+*/
+static void classify_batch( const packet_t *pkts, const flow_key_t *keys, int n,
+                            int *actions, int *pos ) {
+  if ( policy_cache == NULL ) {
+    policy_lookup_batch( pkts, n, pos );
+    for ( int j = 0; j < n; j++ ) {
+      int i = pos[ j ];
+      actions[ j ] = i < 0 ? policy_default : ( int ) policy[ i ].action;
+      pos[ j ] = i < 0 ? -1 : i + 1;
+    }
+    return;
+  }
+
+  // Answer what the cache can, then classify the misses together
+  packet_t miss[ POLICY_CACHE_BATCH ];
+  int slot[ POLICY_CACHE_BATCH ];
+  int found[ POLICY_CACHE_BATCH ];
+  for ( int base = 0; base < n; base += POLICY_CACHE_BATCH ) {
+    int m = n - base < POLICY_CACHE_BATCH ? n - base : POLICY_CACHE_BATCH;
+    int misses = 0;
+    for ( int j = base; j < base + m; j++ ) {
+      if ( !cache_lookup( policy_cache, &keys[ j ], policy_gen, &actions[ j ], &pos[ j ] ) ) {
+        miss[ misses ] = pkts[ j ];
+        slot[ misses++ ] = j;
+      }
+    }
+    policy_lookup_batch( miss, misses, found );
+    for ( int k = 0; k < misses; k++ ) {
+      int i = found[ k ];
+      int j = slot[ k ];
+      actions[ j ] = i < 0 ? policy_default : ( int ) policy[ i ].action;
+      pos[ j ] = i < 0 ? -1 : i + 1;
+      cache_insert( policy_cache, &keys[ j ], policy_gen, actions[ j ], pos[ j ] );
+    }
+  }
+}
+
+/**
+    Tests each of @n packets, allowing packets of tracked flows and
+    passing the rest to the policy. Flows the policy allows are tracked,
+    and count for the packets after them in the same group.
+    @param pkts The packets to test
+    @param keys Their flow keys, only read if there is a cache or
+                connection tracking
+    @param n The number of packets
+    @param actions The action taken for each packet
+    @param pos The rule position matched by each packet
+*/
+static void test_batch( const packet_t *pkts, const flow_key_t *keys, int n,
+                        int *actions, int *pos ) {
+  if ( policy_conntrack == NULL ) {
+    classify_batch( pkts, keys, n, actions, pos );
+    return;
+  }
+  uint32_t now = conntrack_now( policy_conntrack );
+  packet_t miss[ POLICY_CACHE_BATCH ];
+  flow_key_t miss_keys[ POLICY_CACHE_BATCH ];
+  int slot[ POLICY_CACHE_BATCH ];
+  int found[ POLICY_CACHE_BATCH ];
+  int found_pos[ POLICY_CACHE_BATCH ];
+  for ( int base = 0; base < n; base += POLICY_CACHE_BATCH ) {
+    int m = n - base < POLICY_CACHE_BATCH ? n - base : POLICY_CACHE_BATCH;
+    int misses = 0;
+    for ( int j = base; j < base + m; j++ ) {
+      if ( conntrack_find( policy_conntrack, &keys[ j ], now, policy_gen, &pos[ j ] ) ) {
+        conntrack_count( policy_conntrack, 1 );
+        actions[ j ] = ACTION_ALLOW;
+      } else {
+        miss[ misses ] = pkts[ j ];
+        miss_keys[ misses ] = keys[ j ];
+        slot[ misses++ ] = j;
+      }
+    }
+    classify_batch( miss, miss_keys, misses, found, found_pos );
+    int tracked = 0;
+    for ( int k = 0; k < misses; k++ ) {
+      int j = slot[ k ];
+      // A flow tracked earlier in the group, such as the one a reply
+      // belongs to, decides the packet as it would one at a time
+      int hit = tracked &&
+                conntrack_find( policy_conntrack, &miss_keys[ k ], now, policy_gen, &pos[ j ] );
+      conntrack_count( policy_conntrack, hit );
+      if ( hit ) {
+        actions[ j ] = ACTION_ALLOW;
+        continue;
+      }
+      actions[ j ] = found[ k ];
+      pos[ j ] = found_pos[ k ];
+      if ( found[ k ] == ACTION_ALLOW ) {
+        conntrack_insert( policy_conntrack, &miss_keys[ k ], now, policy_gen, found_pos[ k ] );
+        tracked = 1;
+      }
+    }
+  }
+}
+
+/**
+    Tests each of @n packets given as packets, as flow keys or both,
+    making whichever form is missing a group at a time. Keys are only
+    made when the cache or connection tracking will read them.
+    @param pkts The packets to test, or NULL to make them from @keys
+    @param keys Their flow keys, or NULL to make them from @pkts
+    @param n The number of packets
+    @param actions The action taken for each packet
+    @param pos The rule position matched by each packet
+*/
+static void test_either( const packet_t *pkts, const flow_key_t *keys, int n,
+                         int *actions, int *pos ) {
+  if ( keys == NULL && policy_cache == NULL && policy_conntrack == NULL ) {
+    test_batch( pkts, NULL, n, actions, pos );
+    return;
+  }
+  packet_t made_pkts[ POLICY_CACHE_BATCH ];
+  flow_key_t made_keys[ POLICY_CACHE_BATCH ];
+  for ( int base = 0; base < n; base += POLICY_CACHE_BATCH ) {
+    int m = n - base < POLICY_CACHE_BATCH ? n - base : POLICY_CACHE_BATCH;
+    for ( int j = 0; j < m; j++ ) {
+      if ( pkts == NULL ) {
+        made_pkts[ j ] = flow_key_packet( keys[ base + j ] );
+      } else {
+        made_keys[ j ] = flow_key_make( pkts[ base + j ] );
+      }
+    }
+    test_batch( pkts == NULL ? made_pkts : pkts + base, keys == NULL ? made_keys : keys + base,
+                m, actions + base, pos + base );
+  }
+}
+
+/**
+    This function will build the selected engine now rather than on the
+    first test after the rules change.
+    It returns 0 if successful, -1 if the engine could not be built and
+    tests will scan the rules instead.
+    @return 0 if success, -1 if fail
+*/
+int policy_compile() {
+  if ( policy_dirty ) {
+    rebuild_engine();
+  }
+  if ( policy_engine == ENGINE_LINEAR || policy_tree != NULL || policy_tuple != NULL ||
+       policy_bitvec != NULL || policy_scan != NULL || policy_bytecode != NULL ) {
+    return 0;
+  }
+  return -1;
+}
+
+/**
+    This function will return the bytes held by the rules and the
+    compiled engine, building the engine if it is stale.
+    @return The footprint of the policy in bytes
+*/
+size_t policy_bytes() {
+  policy_compile();
+  size_t bytes = policy_cap * sizeof( rule_t );
+  if ( policy_order != NULL ) {
+    bytes += policy_len * ( sizeof( rule_t ) + sizeof( int ) );
+  }
+  if ( policy_tree != NULL ) {
+    bytes += tree_bytes( policy_tree );
+  } else if ( policy_tuple != NULL ) {
+    bytes += tuple_bytes( policy_tuple );
+  } else if ( policy_bitvec != NULL ) {
+    bytes += bitvec_bytes( policy_bitvec );
+  } else if ( policy_scan != NULL ) {
+    bytes += scan_bytes( policy_scan );
+  } else if ( policy_bytecode != NULL ) {
+    bytes += bytecode_bytes( policy_bytecode );
+  }
+  return bytes;
+}
+
+/**
+    This function will test each of @n packets in @pkts against the policy
+    without printing anything. actions[ i ] is set to ACTION_ALLOW or
+    ACTION_DENY and pos[ i ] to the position number of the matched rule,
+    or -1 if the default policy decided.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param pkts The packets to test
+    @param n The number of packets
+    @param actions The action taken for each packet
+    @param pos The rule position matched by each packet
+    @return 0 if success, -1 if fail
+*/
+int policy_test_batch(const packet_t *pkts, int n, int *actions, int *pos) {
+  if ( n < 0 || ( n > 0 && ( pkts == NULL || actions == NULL || pos == NULL ) ) ) {
+    return -1;
+  }
+  if ( !policy_counting ) {
+    test_either( pkts, NULL, n, actions, pos );
+    return 0;
+  }
+  uint64_t start = stats_clock();
+  test_either( pkts, NULL, n, actions, pos );
+  stats_time( &policy_stats, n, stats_clock() - start );
+  stats_count( &policy_stats, pos, n );
+  return 0;
+}
+
+/**
+    This function will test each of @n packets, given by their flow keys,
+    exactly as policy_test_batch does. The verdict cache and connection
+    tracking use the keys' hashes as they are, so callers that decode
+    packets straight into keys hash each packet only once.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param keys The flow keys of the packets to test
+    @param n The number of packets
+    @param actions The action taken for each packet
+    @param pos The rule position matched by each packet
+    @return 0 if success, -1 if fail
+*/
+int policy_test_flows(const flow_key_t *keys, int n, int *actions, int *pos) {
+  if ( n < 0 || ( n > 0 && ( keys == NULL || actions == NULL || pos == NULL ) ) ) {
+    return -1;
+  }
+  if ( !policy_counting ) {
+    test_either( NULL, keys, n, actions, pos );
+    return 0;
+  }
+  uint64_t start = stats_clock();
+  test_either( NULL, keys, n, actions, pos );
+  stats_time( &policy_stats, n, stats_clock() - start );
+  stats_count( &policy_stats, pos, n );
+  return 0;
+}
+
+/**
+    Tests @pkt against the live policy, through the verdict cache if
+    there is one.
+    @param pkt The packet to test
+    @param key Its flow key, only read if there is a cache
+    @param pos Set to the position matched, -1 for the default policy
+    @return ACTION_ALLOW or ACTION_DENY
+*/
+static int classify_one( packet_t pkt, const flow_key_t *key, int *pos ) {
+  int action;
+  if ( policy_cache != NULL && cache_lookup( policy_cache, key, policy_gen, &action, pos ) ) {
+    return action;
+  }
+  int i = policy_lookup( pkt );
+  if ( i < 0 ) {
+    *pos = -1;
+    action = policy_default;
+  } else {
+    *pos = i + 1;
+    action = policy[ i ].action;
+  }
+  if ( policy_cache != NULL ) {
+    cache_insert( policy_cache, key, policy_gen, action, *pos );
+  }
+  return action;
+}
+
+/**
+    Tests @pkt, allowing it if its flow is tracked and otherwise asking
+    the policy. A flow the policy allows is tracked. The flow key is made
+    once, and only if the cache or connection tracking needs it.
+    @param pkt The packet to test
+    @param pos Set to the position matched, -1 for the default policy
+    @return ACTION_ALLOW or ACTION_DENY
+*/
+static int test_one( packet_t pkt, int *pos ) {
+  flow_key_t key;
+  if ( policy_cache != NULL || policy_conntrack != NULL ) {
+    key = flow_key_make( pkt );
+  }
+  if ( policy_conntrack == NULL ) {
+    return classify_one( pkt, &key, pos );
+  }
+  uint32_t now = conntrack_now( policy_conntrack );
+  if ( conntrack_lookup( policy_conntrack, &key, now, policy_gen, pos ) ) {
+    return ACTION_ALLOW;
+  }
+  int action = classify_one( pkt, &key, pos );
+  if ( action == ACTION_ALLOW ) {
+    conntrack_insert( policy_conntrack, &key, now, policy_gen, *pos );
+  }
+  return action;
+}
+
 /**
     This function will test if @pkt is allowed or denied by the policy.
     It returns ACTION_ALLOW or ACTION_DENY.
     Additionally the value pointed to by @pos will be updated
     with the position number of the rule that is matched.
     If no rule is matched, the value will be set to -1.
+    Nothing is printed; see report.h for showing the verdict.
     @param pkt The packet to test
     @param pos The position to test
-    @return ACTION_ALLOW if success, ACTION_DENY if fail
+    @return ACTION_ALLOW or ACTION_DENY
 */
 int policy_test(packet_t pkt, int *pos) {
+  if ( !policy_counting ) {
+    return test_one( pkt, pos );
+  }
+  if ( !stats_sample( &policy_stats ) ) {
+    int action = test_one( pkt, pos );
+    stats_count( &policy_stats, pos, 1 );
+    return action;
+  }
+  uint64_t start = stats_clock();
+  int action = test_one( pkt, pos );
+  stats_time( &policy_stats, 1, stats_clock() - start );
+  stats_count( &policy_stats, pos, 1 );
+  return action;
+}
+
+/**
+    This function will put a verdict cache of @entries entries in front
+    of policy_test, replacing any existing cache. 0 disables the cache.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param entries The number of verdicts to cache, 0 for none
+    @return 0 if success, -1 if fail
+*/
+int policy_set_cache(int entries) {
+  if ( entries < 0 ) {
+    return -1;
+  }
+  cache_t *cache = NULL;
+  if ( entries > 0 ) {
+    cache = cache_create( entries );
+    if ( cache == NULL ) {
+      return -1;
+    }
+  }
+  cache_free( policy_cache );
+  policy_cache = cache;
+  return 0;
+}
+
+/**
+    This function will print the size and hit/miss counters of the
+    verdict cache to @stream.
+    @param stream Stream to print to
+*/
+void policy_print_cache(FILE *stream) {
+  if ( policy_cache == NULL ) {
+    fprintf( stream, "cache off\n" );
+    return;
+  }
+  unsigned long long hits = policy_cache->hits;
+  unsigned long long misses = policy_cache->misses;
+  unsigned long long total = hits + misses;
+  fprintf( stream, "cache %d entries, %llu hits, %llu misses, %llu evictions",
+           cache_size( policy_cache ), hits, misses,
+           ( unsigned long long ) policy_cache->evictions );
+  fprintf( stream, " (%.1f%% hit rate)\n", total ? 100.0 * hits / total : 0.0 );
+}
+
+/**
+    This function will put a connection tracking table of @entries flows
+    in front of policy_test and policy_test_batch, replacing any existing
+    table. Once a packet is allowed, later packets of its flow in either
+    direction are allowed without consulting the policy until the flow
+    has been idle for its timeout or the policy changes.
+    0 disables tracking.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param entries The most flows to track, 0 for none
+    @return 0 if success, -1 if fail
+*/
+int policy_set_conntrack(int entries) {
+  if ( entries < 0 ) {
+    return -1;
+  }
+  conntrack_t *ct = NULL;
+  if ( entries > 0 ) {
+    ct = conntrack_create( entries );
+    if ( ct == NULL ) {
+      return -1;
+    }
+  }
+  conntrack_free( policy_conntrack );
+  policy_conntrack = ct;
+  return 0;
+}
+
+/**
+    This function will print the size and counters of the connection
+    tracking table to @stream.
+    @param stream Stream to print to
+*/
+void policy_print_conntrack(FILE *stream) {
+  if ( policy_conntrack == NULL ) {
+    fprintf( stream, "conntrack off\n" );
+    return;
+  }
+  const conntrack_t *ct = policy_conntrack;
+  fprintf( stream, "conntrack %d entries, %d tracked, %llu hits, %llu misses, %llu expired, "
+           "%llu overflows\n", ct->max, ct->used, ( unsigned long long ) ct->hits,
+           ( unsigned long long ) ct->misses, ( unsigned long long ) ct->expired,
+           ( unsigned long long ) ct->overflows );
+}
+
+/**
+    This function will start or stop counting the hits of each rule, the
+    default policy hits and the latency of policy_test and
+    policy_test_batch. Counts are kept while counting is stopped.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param on 1 to count, 0 to stop
+    @return 0 if success, -1 if fail
+*/
+int policy_set_stats(int on) {
+  if ( on && stats_reserve( &policy_stats, policy_len ) != 0 ) {
+    return -1;
+  }
+  policy_counting = on;
+  return 0;
+}
+
+/**
+    This function will return whether lookups are being counted.
+    @return 1 if counting, 0 if not
+*/
+int policy_stats_enabled() {
+  return policy_counting;
+}
+
+/**
+    This function will zero every hit and latency counter.
+*/
+void policy_reset_stats() {
+  stats_reset( &policy_stats );
+}
+
+/**
+    This function will add counters kept by another thread, indexed by
+    the same rule positions, to the policy counters. It must be called
+    from the thread that changes the policy.
+    @param stats The counters to add
+*/
+void policy_merge_stats(const stats_t *stats) {
+  stats_merge( &policy_stats, stats, policy_len );
+}
+
+/**
+    This function will print the hits of each rule that fired, the
+    default policy hits and the latency histogram to @stream.
+    @param stream Stream to print to
+*/
+void policy_print_stats(FILE *stream) {
+  fprintf( stream, "stats %s, ", policy_counting ? "on" : "off" );
+  stats_print( stream, &policy_stats, policy_len );
+}
+
+/**
+    This function will write every counter to the file @filename in the
+    comma separated form described in stats.h.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param filename The file to write
+    @return 0 if success, -1 if fail
+*/
+int policy_dump_stats(const char *filename) {
+  FILE *fp = fopen( filename, "w" );
+  if ( fp == NULL ) {
+    return -1;
+  }
+  stats_dump( fp, &policy_stats, policy_len );
+  return fclose( fp ) == 0 ? 0 : -1;
+}
+
+/**
+    This function will find the rules that never fire because an earlier
+    rule matches all their packets, and the rules whose packets would get
+    the same action without them, and print each to @stream. If @compact
+    is set those rules are removed, which changes no verdict. Rules
+    cannot be removed while a transaction is open.
+    It returns the number of rules found, -1 if unsuccessful.
+    @param stream Stream to print to
+    @param compact 1 to remove the rules found, 0 to only report them
+    @return The number of rules found, -1 if fail
+*/
+int policy_optimize(FILE *stream, int compact) {
+  if ( compact && policy_txn != NULL ) {
+    return -1;
+  }
+  int *verdict = malloc( ( policy_len + 1 ) * sizeof( int ) );
+  int *by = malloc( ( policy_len + 1 ) * sizeof( int ) );
+  int found = verdict == NULL || by == NULL ? -1 :
+              optimize_rules( policy, policy_len, policy_default, verdict, by );
+  if ( found < 0 || ( compact && found > 0 && own_rules() != 0 ) ) {
+    free( verdict );
+    free( by );
+    return -1;
+  }
+  int shadowed = 0;
   for ( int i = 0; i < policy_len; i++ ) {
-    int test = packet_match( policy[ i ]->match, pkt );
-    if ( test == 1 ) { // if packet is matched with a rule
-      if ( policy[ i ]->action == ACTION_ALLOW ) { // if rule says allowed
-        fprintf( stdout, "Allowed via " );
-        policy_print_rule( stdout, i + 1 );
-        return ACTION_ALLOW; // then return allow
-      } else {
-        fprintf( stdout, "Denied via " );
-        policy_print_rule( stdout, i + 1 );
-        return ACTION_DENY; // if not, then return deny
+    if ( verdict[ i ] == OPTIMIZE_SHADOWED ) {
+      fprintf( stream, "[%d] shadowed by [%d]\n", i + 1, by[ i ] + 1 );
+      shadowed++;
+    } else if ( verdict[ i ] == OPTIMIZE_REDUNDANT && by[ i ] >= 0 ) {
+      fprintf( stream, "[%d] redundant, covered by [%d]\n", i + 1, by[ i ] + 1 );
+    } else if ( verdict[ i ] == OPTIMIZE_REDUNDANT ) {
+      fprintf( stream, "[%d] redundant, falls to default policy\n", i + 1 );
+    }
+  }
+  fprintf( stream, "%d of %d rules removable, %d shadowed, %d redundant\n",
+           found, policy_len, shadowed, found - shadowed );
+  if ( compact && found > 0 ) {
+    int kept = 0;
+    for ( int i = 0; i < policy_len; i++ ) {
+      if ( verdict[ i ] == OPTIMIZE_KEEP ) {
+        policy[ kept++ ] = policy[ i ];
       }
-    } // if
+    }
+    stats_compact( &policy_stats, verdict, policy_len );
+    policy_len = kept;
+    shrink_array();
+    policy_dirty = 1;
+    drop_order();
+    bump_generation();
+    republish();
+    fprintf( stream, "Removed %d rules, %d left\n", found, kept );
   }
-  if ( policy_default == ACTION_DENY ) {
-    fprintf( stdout, "Denied via default policy.\n" );
-  } else {
-    fprintf( stdout, "Allowed via default policy.\n" );
+  free( verdict );
+  free( by );
+  return found;
+}
+
+/**
+    This function will move the most hit rules earlier in the order the
+    linear scan tries them, as far as they can go without changing any
+    verdict, or go back to policy order if @on is 0. Rules keep their
+    positions, so print and test still show the policy numbering. The
+    order is dropped when the rules change.
+    It returns the number of rules moved, -1 if unsuccessful.
+    @param stream Stream to print to
+    @param on 1 to reorder by the hits counted so far, 0 for policy order
+    @return The number of rules moved, -1 if fail
+*/
+int policy_reorder(FILE *stream, int on) {
+  if ( !on ) {
+    drop_order();
+    bump_generation();
+    republish();
+    fprintf( stream, "Rules tried in policy order\n" );
+    return 0;
+  }
+  uint64_t *hits = calloc( policy_len + 1, sizeof( uint64_t ) );
+  int *order = malloc( ( policy_len + 1 ) * sizeof( int ) );
+  rule_t *ordered = malloc( ( policy_len + 1 ) * sizeof( rule_t ) );
+  int moved = -1;
+  if ( hits != NULL && order != NULL && ordered != NULL ) {
+    int n = policy_stats.cap < policy_len ? policy_stats.cap : policy_len;
+    if ( policy_stats.hits != NULL ) {
+      memcpy( hits, policy_stats.hits, n * sizeof( uint64_t ) );
+    }
+    moved = reorder_rules( policy, policy_len, hits, order );
+  }
+  if ( moved < 0 ) {
+    free( hits );
+    free( order );
+    free( ordered );
+    return -1;
+  }
+
+  // Mean number of rules the scan tries to reach the rule a packet hit
+  double total = 0.0, before = 0.0, after = 0.0;
+  for ( int k = 0; k < policy_len; k++ ) {
+    int was = policy_order != NULL ? policy_order[ k ] : k;
+    ordered[ k ] = policy[ order[ k ] ];
+    total += hits[ k ];
+    before += ( double ) hits[ was ] * ( k + 1 );
+    after += ( double ) hits[ order[ k ] ] * ( k + 1 );
+  }
+  drop_order();
+  policy_ordered = ordered;
+  policy_order = order;
+  bump_generation();
+  republish();
+  fprintf( stream, "Moved %d of %d rules, mean depth of a hit %.1f -> %.1f\n", moved, policy_len,
+           total > 0 ? before / total : 0.0, total > 0 ? after / total : 0.0 );
+  free( hits );
+  return moved;
+}
+
+/**
+    This function will print the rules compiled into bytecode to @stream.
+    The program the bytecode engine runs is printed if it is selected,
+    otherwise one is compiled just for printing.
+    It returns 0 if successful, -1 if memory ran out.
+    @param stream Stream to print to
+    @return 0 if success, -1 if fail
+*/
+int policy_dump_bytecode(FILE *stream) {
+  if ( policy_dirty ) {
+    rebuild_engine();
+  }
+  bytecode_t *bc = policy_bytecode;
+  if ( bc == NULL ) {
+    bc = bytecode_build( policy, policy_len );
+    if ( bc == NULL ) {
+      return -1;
+    }
+  }
+  bytecode_dump( stream, bc );
+  if ( bc != policy_bytecode ) {
+    bytecode_free( bc );
+  }
+  return 0;
+}
+
+/**
+    This function will return the policy generation, which changes
+    whenever a rule or the default policy changes.
+    @return The current generation
+*/
+unsigned int policy_generation() {
+  return policy_gen;
+}
+
+/**
+    This function will write the rules, default policy and compiled
+    engine to the snapshot file @filename.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param filename The file to write
+    @return 0 if success, -1 if fail
+*/
+int policy_save(const char *filename) {
+  // An edited tuple space ranks rules by priorities the file cannot hold
+  if ( policy_dirty || ( policy_tuple != NULL && policy_tuple->prio != NULL ) ) {
+    rebuild_engine();
+  }
+  snapshot_t snap = { NULL };
+  snap.rules = policy;
+  snap.len = policy_len;
+  snap.default_action = policy_default;
+  snap.engine = policy_engine;
+  snap.tree = policy_tree;
+  snap.tuple = policy_tuple;
+  snap.bitvec = policy_bitvec;
+  snap.scan = policy_scan;
+  return snapshot_save( filename, &snap );
+}
+
+/**
+    This function will replace the policy with the one in the snapshot
+    file @filename. The file is mapped rather than read, so rules and the
+    compiled engine are used in place until the policy is next changed.
+    Nothing is loaded while a transaction is open.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param filename The file to load
+    @return 0 if success, -1 if fail
+*/
+int policy_load(const char *filename) {
+  snapshot_t snap;
+  if ( policy_txn != NULL || snapshot_map( filename, &snap ) != 0 ) {
+    return -1;
+  }
+  if ( snap.engine < ENGINE_LINEAR || snap.engine > ENGINE_BYTECODE ) {
+    snapshot_unmap( &snap );
+    return -1;
+  }
+  if ( !policy_borrowed ) {
+    free( policy );
+  }
+  policy_borrowed = 0;
+  drop_engines();
+  drop_order();
+  policy_snap = snap;
+  policy = snap.rules;
+  policy_borrowed = 1;
+  policy_len = snap.len;
+  policy_cap = snap.len;
+  policy_default = snap.default_action;
+  policy_engine = snap.engine;
+  stats_reset( &policy_stats );
+  policy_tree = snap.tree;
+  policy_tuple = snap.tuple;
+  policy_bitvec = snap.bitvec;
+  policy_scan = snap.scan;
+  policy_dirty = policy_engine != ENGINE_LINEAR && policy_tree == NULL &&
+                 policy_tuple == NULL && policy_bitvec == NULL && policy_scan == NULL;
+  bump_generation();
+  republish();
+  return 0;
+}
+
+/**
+    This function will take an immutable copy of the policy, with its
+    own compiled engine, that threads can test packets against while the
+    policy itself goes on changing.
+    It returns NULL if memory ran out.
+    @return The frozen policy, to be released with policy_frozen_free
+*/
+policy_frozen_t *policy_freeze() {
+  // The version, its rules and its scan order share one block, so a
+  // retired version is one free besides its engine
+  size_t len = policy_len ? policy_len : 1;
+  size_t size = sizeof( policy_frozen_t ) + len * sizeof( rule_t );
+  if ( policy_order != NULL ) {
+    size += len * ( sizeof( rule_t ) + sizeof( int ) );
+  }
+  policy_frozen_t *frozen = malloc( size );
+  if ( frozen == NULL ) {
+    return NULL;
+  }
+  memset( frozen, 0, sizeof( policy_frozen_t ) );
+  frozen->rules = ( rule_t * ) ( frozen + 1 );
+  memcpy( frozen->rules, policy, policy_len * sizeof( rule_t ) );
+  frozen->len = policy_len;
+  if ( policy_order != NULL ) {
+    frozen->ordered = frozen->rules + len;
+    frozen->order = ( int * ) ( frozen->ordered + len );
+    memcpy( frozen->ordered, policy_ordered, policy_len * sizeof( rule_t ) );
+    memcpy( frozen->order, policy_order, policy_len * sizeof( int ) );
+  }
+  frozen->default_action = policy_default;
+  if ( policy_engine == ENGINE_TREE ) {
+    frozen->tree = tree_build( frozen->rules, frozen->len );
+  } else if ( policy_engine == ENGINE_TUPLE ) {
+    frozen->tuple = tuple_build( frozen->rules, frozen->len );
+  } else if ( policy_engine == ENGINE_BITVEC ) {
+    frozen->bitvec = bitvec_build( frozen->rules, frozen->len );
+  } else if ( policy_engine == ENGINE_SCAN ) {
+    frozen->scan = scan_build( frozen->rules, frozen->len );
+  } else if ( policy_engine == ENGINE_BYTECODE ) {
+    frozen->bytecode = bytecode_build( frozen->rules, frozen->len );
+  }
+  // Settle the SIMD dispatch here rather than racing on it in the workers
+  packet_t probe = { 0 };
+  view_lookup( frozen, probe );
+  return frozen;
+}
+
+/**
+    This function will test each of @n packets in @pkts against a frozen
+    policy, exactly as policy_test_batch does for the live one. It only
+    reads @frozen, so it may be called from several threads at once.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param frozen The frozen policy to test against
+    @param pkts The packets to test
+    @param n The number of packets
+    @param actions The action taken for each packet
+    @param pos The rule position matched by each packet
+    @return 0 if success, -1 if fail
+*/
+int policy_frozen_test_batch(const policy_frozen_t *frozen, const packet_t *pkts, int n,
+                             int *actions, int *pos) {
+  if ( n < 0 || ( n > 0 && ( pkts == NULL || actions == NULL || pos == NULL ) ) ) {
+    return -1;
+  }
+  view_lookup_batch( frozen, pkts, n, pos );
+  for ( int j = 0; j < n; j++ ) {
+    int i = pos[ j ];
+    actions[ j ] = i < 0 ? frozen->default_action : ( int ) frozen->rules[ i ].action;
+    pos[ j ] = i < 0 ? -1 : i + 1;
+  }
+  return 0;
+}
+
+/**
+    This function will free a policy returned by policy_freeze.
+    @param frozen The frozen policy to free, may be NULL
+*/
+void policy_frozen_free(policy_frozen_t *frozen) {
+  if ( frozen == NULL ) {
+    return;
+  }
+  tree_free( frozen->tree );
+  tuple_free( frozen->tuple );
+  bitvec_free( frozen->bitvec );
+  scan_free( frozen->scan );
+  bytecode_free( frozen->bytecode );
+  free( frozen );
+}
+
+/**
+    This function will publish the policy as an immutable version that
+    reader threads can test against, and publish a fresh version after
+    every later change. Readers never wait for a change: they keep the
+    version they locked until they unlock it, and replaced versions are
+    freed once no reader can still hold them.
+    It returns 0 if successful, -1 if unsuccessful.
+    @return 0 if success, -1 if fail
+*/
+int policy_publish() {
+  if ( publish() != 0 ) {
+    return -1;
+  }
+  policy_shared = 1;
+  return 0;
+}
+
+/**
+    This function will claim a reader slot for the calling thread.
+    It returns NULL if all POLICY_MAX_READERS slots are taken.
+    @return The reader, to be released with policy_reader_unregister
+*/
+policy_reader_t *policy_reader_register() {
+  for ( int r = 0; r < POLICY_MAX_READERS; r++ ) {
+    int expected = 0;
+    if ( __atomic_compare_exchange_n( &policy_readers[ r ].used, &expected, 1, 0,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) ) {
+      return &policy_readers[ r ];
+    }
+  }
+  return NULL;
+}
+
+/**
+    This function will release a reader slot. The reader must not hold
+    a version.
+    @param reader The reader to release, may be NULL
+*/
+void policy_reader_unregister(policy_reader_t *reader) {
+  if ( reader == NULL ) {
+    return;
+  }
+  __atomic_store_n( &reader->epoch, 0, __ATOMIC_RELEASE );
+  __atomic_store_n( &reader->used, 0, __ATOMIC_RELEASE );
+}
+
+/**
+    This function will return the latest published version of the policy
+    and keep it from being freed until policy_read_unlock. It never
+    blocks and may be called while the policy is being changed.
+    It returns NULL if the policy has not been published.
+    @param reader The calling thread's reader
+    @return The version to test against with policy_frozen_test_batch
+*/
+const policy_frozen_t *policy_read_lock(policy_reader_t *reader) {
+  // Announce the epoch before loading the pointer, so a writer that
+  // misses the announcement has already swapped in the newer version
+  unsigned long epoch = __atomic_load_n( &policy_epoch, __ATOMIC_SEQ_CST );
+  __atomic_store_n( &reader->epoch, epoch, __ATOMIC_SEQ_CST );
+  return __atomic_load_n( &policy_current, __ATOMIC_SEQ_CST );
+}
+
+/**
+    This function will let go of the version returned by policy_read_lock.
+    @param reader The calling thread's reader
+*/
+void policy_read_unlock(policy_reader_t *reader) {
+  __atomic_store_n( &reader->epoch, 0, __ATOMIC_RELEASE );
+}
+
+/**
+    This function will copy the rule at position @pos into @rule.
+    It returns 0 if successful and -1 if unsuccessful
+    @param pos The position to read
+    @param rule The rule to fill
+    @return 0 if success, -1 if fail
+*/
+int policy_get_rule(int pos, rule_t *rule) {
+  if ( pos <= 0 || pos > policy_len ) {
+    return -1;
   }
+  *rule = policy[ pos - 1 ];
   return 0;
 }
 
@@ -210,34 +1691,34 @@ int policy_print_rule(FILE *stream, int pos) {
     return -1;
   }
   pos = pos - 1;
-  //fprintf( stream, "The port of rule %d is: %d \n", pos, policy[ pos ]->match.dst_port );
-  if ( policy[ pos ]->action == 0 ) {
+  //fprintf( stream, "The port of rule %d is: %d \n", pos, policy[ pos ].match.dst_port );
+  if ( policy[ pos ].action == 0 ) {
     fprintf( stream, "allow " );
   } else {
     fprintf( stream, "deny " );
   }
-  if ( policy[ pos ]->match.protocol == 0 ) {
+  if ( policy[ pos ].match.protocol == 0 ) {
     fprintf( stream, "tcp " );
   } else {
     fprintf( stream, "udp " );
   }
-  fprintf( stream, "%d.", policy[ pos ]->match.src_ip.a );
-  fprintf( stream, "%d.", policy[ pos ]->match.src_ip.b );
-  fprintf( stream, "%d.", policy[ pos ]->match.src_ip.c );
-  fprintf( stream, "%d:", policy[ pos ]->match.src_ip.d );
-  if ( policy[ pos ]->match.src_port < 0 ) {
+  fprintf( stream, "%d.", policy[ pos ].match.src_ip.a );
+  fprintf( stream, "%d.", policy[ pos ].match.src_ip.b );
+  fprintf( stream, "%d.", policy[ pos ].match.src_ip.c );
+  fprintf( stream, "%d:", policy[ pos ].match.src_ip.d );
+  if ( policy[ pos ].match.src_port < 0 ) {
     fprintf( stream, "* " );
   } else {
-    fprintf( stream, "%d ", policy[ pos ]->match.src_port );
+    fprintf( stream, "%d ", policy[ pos ].match.src_port );
   }
-  fprintf( stream, "%d.", policy[ pos ]->match.dst_ip.a );
-  fprintf( stream, "%d.", policy[ pos ]->match.dst_ip.b );
-  fprintf( stream, "%d.", policy[ pos ]->match.dst_ip.c );
-  fprintf( stream, "%d:", policy[ pos ]->match.dst_ip.d );
-  if ( policy[ pos ]->match.dst_port < 0 ) {
+  fprintf( stream, "%d.", policy[ pos ].match.dst_ip.a );
+  fprintf( stream, "%d.", policy[ pos ].match.dst_ip.b );
+  fprintf( stream, "%d.", policy[ pos ].match.dst_ip.c );
+  fprintf( stream, "%d:", policy[ pos ].match.dst_ip.d );
+  if ( policy[ pos ].match.dst_port < 0 ) {
     fprintf( stream, "* \n" );
   } else {
-    fprintf( stream, "%d \n", policy[ pos ]->match.dst_port );
+    fprintf( stream, "%d \n", policy[ pos ].match.dst_port );
   }
   return 0;
 }
@@ -7,7 +7,10 @@
 #ifndef POLICY_H
 #define POLICY_H
 
+#include <stddef.h>
+
 #include "packet.h"
+#include "stats.h"
 
 /** Used to indicate an allow rule. */
 #define ACTION_ALLOW   0
@@ -15,6 +18,27 @@
 /** Used to indicate a deny rule. */
 #define ACTION_DENY    1
 
+/** Engine that scans the rules in order. */
+#define ENGINE_LINEAR  0
+
+/** Engine that walks a compiled decision tree. */
+#define ENGINE_TREE    1
+
+/** Engine that probes one hash table per wildcard shape. */
+#define ENGINE_TUPLE   2
+
+/** Engine that intersects per-field bitsets of rules. */
+#define ENGINE_BITVEC  3
+
+/** Engine that scans the rules packed into columns with SIMD. */
+#define ENGINE_SCAN    4
+
+/** Engine that runs the rules compiled into branching bytecode. */
+#define ENGINE_BYTECODE 5
+
+/** Most threads that may read published policy versions at once. */
+#define POLICY_MAX_READERS 256
+
 /**
  * Representation of a firewall rule
  * .action: the rule action (ACTION_ALLOW or ACTION_DENY)
@@ -25,6 +49,15 @@ typedef struct rule {
     packet_match_t  match;
 } rule_t;
 
+/**
+ * An immutable copy of the policy and its compiled engine, see policy_freeze
+ * and policy_read_lock
+ */
+typedef struct policy_frozen policy_frozen_t;
+
+/** A thread's registration to read published policy versions */
+typedef struct policy_reader policy_reader_t;
+
 /**
     This function will set the default policy to the specified action.
     The starter files includes #define's for ACTION_ALLOW and ACTION_DENY.
@@ -79,12 +112,318 @@ int policy_delete(int pos);
     Additionally the value pointed to by @pos will be
     updated with the position number of the rule that is matched.
     If no rule is matched, the value will be set to -1.
+    Nothing is printed; see report.h for showing the verdict.
     @param pkt The packet to test
     @param pos The position to test
-    @return ACTION_ALLOW if success, ACTION_DENY if fail
+    @return ACTION_ALLOW or ACTION_DENY
 */
 int policy_test(packet_t pkt, int *pos);
 
+/**
+    This function will copy the rule at position @pos into @rule.
+    It returns 0 if successful and -1 if unsuccessful
+    @param pos The position to read
+    @param rule The rule to fill
+    @return 0 if success, -1 if fail
+*/
+int policy_get_rule(int pos, rule_t *rule);
+
+/**
+    This function will open a transaction. Until it is committed, rule
+    edits and default policy changes are staged and every test still
+    sees the policy as it was.
+    It returns 0 if successful, -1 if a transaction is already open or
+    memory ran out.
+    @return 0 if success, -1 if fail
+*/
+int policy_begin();
+
+/**
+    This function will apply the staged edits as one new policy version.
+    Engines are rebuilt once for the lot, cached verdicts and tracked
+    flows go stale once, and rule hits follow their rules.
+    It returns the number of edits committed, -1 if no transaction is
+    open or memory ran out, in which case the transaction stays open.
+    @return The number of edits, -1 if fail
+*/
+int policy_commit();
+
+/**
+    This function will drop the staged edits, leaving the policy as it
+    was when the transaction was opened.
+    It returns 0 if successful, -1 if no transaction is open.
+    @return 0 if success, -1 if fail
+*/
+int policy_abort();
+
+/**
+    This function will select the engine used by policy_test.
+    Compiled engines are rebuilt lazily after the rules change.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param engine One of the ENGINE_ values
+    @return 0 if success, -1 if fail
+*/
+int policy_set_engine(int engine);
+
+/**
+    This function will build the selected engine now rather than on the
+    first test after the rules change.
+    It returns 0 if successful, -1 if the engine could not be built and
+    tests will scan the rules instead.
+    @return 0 if success, -1 if fail
+*/
+int policy_compile();
+
+/**
+    This function will return the bytes held by the rules and the
+    compiled engine, building the engine if it is stale.
+    @return The footprint of the policy in bytes
+*/
+size_t policy_bytes();
+
+/**
+    This function will test each of @n packets in @pkts against the policy
+    without printing anything. actions[ i ] is set to ACTION_ALLOW or
+    ACTION_DENY and pos[ i ] to the position number of the matched rule,
+    or -1 if the default policy decided.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param pkts The packets to test
+    @param n The number of packets
+    @param actions The action taken for each packet
+    @param pos The rule position matched by each packet
+    @return 0 if success, -1 if fail
+*/
+int policy_test_batch(const packet_t *pkts, int n, int *actions, int *pos);
+
+/**
+    This function will test each of @n packets, given by their flow keys,
+    exactly as policy_test_batch does. The verdict cache and connection
+    tracking use the keys' hashes as they are, so callers that decode
+    packets straight into keys hash each packet only once.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param keys The flow keys of the packets to test
+    @param n The number of packets
+    @param actions The action taken for each packet
+    @param pos The rule position matched by each packet
+    @return 0 if success, -1 if fail
+*/
+int policy_test_flows(const flow_key_t *keys, int n, int *actions, int *pos);
+
+/**
+    This function will put a verdict cache of @entries entries in front
+    of policy_test, replacing any existing cache. 0 disables the cache.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param entries The number of verdicts to cache, 0 for none
+    @return 0 if success, -1 if fail
+*/
+int policy_set_cache(int entries);
+
+/**
+    This function will print the size and hit/miss counters of the
+    verdict cache to @stream.
+    @param stream Stream to print to
+*/
+void policy_print_cache(FILE *stream);
+
+/**
+    This function will put a connection tracking table of @entries flows
+    in front of policy_test and policy_test_batch, replacing any existing
+    table. Once a packet is allowed, later packets of its flow in either
+    direction are allowed without consulting the policy until the flow
+    has been idle for its timeout or the policy changes.
+    0 disables tracking.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param entries The most flows to track, 0 for none
+    @return 0 if success, -1 if fail
+*/
+int policy_set_conntrack(int entries);
+
+/**
+    This function will print the size and counters of the connection
+    tracking table to @stream.
+    @param stream Stream to print to
+*/
+void policy_print_conntrack(FILE *stream);
+
+/**
+    This function will start or stop counting the hits of each rule, the
+    default policy hits and the latency of policy_test and
+    policy_test_batch. Counts are kept while counting is stopped.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param on 1 to count, 0 to stop
+    @return 0 if success, -1 if fail
+*/
+int policy_set_stats(int on);
+
+/**
+    This function will return whether lookups are being counted.
+    @return 1 if counting, 0 if not
+*/
+int policy_stats_enabled();
+
+/**
+    This function will zero every hit and latency counter.
+*/
+void policy_reset_stats();
+
+/**
+    This function will add counters kept by another thread, indexed by
+    the same rule positions, to the policy counters. It must be called
+    from the thread that changes the policy.
+    @param stats The counters to add
+*/
+void policy_merge_stats(const stats_t *stats);
+
+/**
+    This function will print the hits of each rule that fired, the
+    default policy hits and the latency histogram to @stream.
+    @param stream Stream to print to
+*/
+void policy_print_stats(FILE *stream);
+
+/**
+    This function will write every counter to the file @filename in the
+    comma separated form described in stats.h.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param filename The file to write
+    @return 0 if success, -1 if fail
+*/
+int policy_dump_stats(const char *filename);
+
+/**
+    This function will find the rules that never fire because an earlier
+    rule matches all their packets, and the rules whose packets would get
+    the same action without them, and print each to @stream. If @compact
+    is set those rules are removed, which changes no verdict. Rules
+    cannot be removed while a transaction is open.
+    It returns the number of rules found, -1 if unsuccessful.
+    @param stream Stream to print to
+    @param compact 1 to remove the rules found, 0 to only report them
+    @return The number of rules found, -1 if fail
+*/
+int policy_optimize(FILE *stream, int compact);
+
+/**
+    This function will move the most hit rules earlier in the order the
+    linear scan tries them, as far as they can go without changing any
+    verdict, or go back to policy order if @on is 0. Rules keep their
+    positions, so print and test still show the policy numbering. The
+    order is dropped when the rules change.
+    It returns the number of rules moved, -1 if unsuccessful.
+    @param stream Stream to print to
+    @param on 1 to reorder by the hits counted so far, 0 for policy order
+    @return The number of rules moved, -1 if fail
+*/
+int policy_reorder(FILE *stream, int on);
+
+/**
+    This function will print the rules compiled into bytecode to @stream.
+    The program the bytecode engine runs is printed if it is selected,
+    otherwise one is compiled just for printing.
+    It returns 0 if successful, -1 if memory ran out.
+    @param stream Stream to print to
+    @return 0 if success, -1 if fail
+*/
+int policy_dump_bytecode(FILE *stream);
+
+/**
+    This function will return the policy generation, which changes
+    whenever a rule or the default policy changes.
+    @return The current generation
+*/
+unsigned int policy_generation();
+
+/**
+    This function will write the rules, default policy and compiled
+    engine to the snapshot file @filename.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param filename The file to write
+    @return 0 if success, -1 if fail
+*/
+int policy_save(const char *filename);
+
+/**
+    This function will replace the policy with the one in the snapshot
+    file @filename. The file is mapped rather than read, so rules and the
+    compiled engine are used in place until the policy is next changed.
+    Nothing is loaded while a transaction is open.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param filename The file to load
+    @return 0 if success, -1 if fail
+*/
+int policy_load(const char *filename);
+
+/**
+    This function will take an immutable copy of the policy, with its
+    own compiled engine, that threads can test packets against while the
+    policy itself goes on changing.
+    It returns NULL if memory ran out.
+    @return The frozen policy, to be released with policy_frozen_free
+*/
+policy_frozen_t *policy_freeze();
+
+/**
+    This function will test each of @n packets in @pkts against a frozen
+    policy, exactly as policy_test_batch does for the live one. It only
+    reads @frozen, so it may be called from several threads at once.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param frozen The frozen policy to test against
+    @param pkts The packets to test
+    @param n The number of packets
+    @param actions The action taken for each packet
+    @param pos The rule position matched by each packet
+    @return 0 if success, -1 if fail
+*/
+int policy_frozen_test_batch(const policy_frozen_t *frozen, const packet_t *pkts, int n,
+                             int *actions, int *pos);
+
+/**
+    This function will free a policy returned by policy_freeze.
+    @param frozen The frozen policy to free, may be NULL
+*/
+void policy_frozen_free(policy_frozen_t *frozen);
+
+/**
+    This function will publish the policy as an immutable version that
+    reader threads can test against, and publish a fresh version after
+    every later change. Readers never wait for a change: they keep the
+    version they locked until they unlock it, and replaced versions are
+    freed once no reader can still hold them.
+    It returns 0 if successful, -1 if unsuccessful.
+    @return 0 if success, -1 if fail
+*/
+int policy_publish();
+
+/**
+    This function will claim a reader slot for the calling thread.
+    It returns NULL if all POLICY_MAX_READERS slots are taken.
+    @return The reader, to be released with policy_reader_unregister
+*/
+policy_reader_t *policy_reader_register();
+
+/**
+    This function will release a reader slot. The reader must not hold
+    a version.
+    @param reader The reader to release, may be NULL
+*/
+void policy_reader_unregister(policy_reader_t *reader);
+
+/**
+    This function will return the latest published version of the policy
+    and keep it from being freed until policy_read_unlock. It never
+    blocks and may be called while the policy is being changed.
+    It returns NULL if the policy has not been published.
+    @param reader The calling thread's reader
+    @return The version to test against with policy_frozen_test_batch
+*/
+const policy_frozen_t *policy_read_lock(policy_reader_t *reader);
+
+/**
+    This function will let go of the version returned by policy_read_lock.
+    @param reader The calling thread's reader
+*/
+void policy_read_unlock(policy_reader_t *reader);
+
 /**
     This function will print to @stream the rule at position @pos.
     It returns 0 if successful and -1 if unsuccessful
@@ -0,0 +1,149 @@
+/**
+    @file pool.c
+    @author Griffin Brookshire (glbrook2)
+    Splits a packet array between worker threads that all search the
+    published policy. Published versions are never written and every
+    worker counts into its own cache lines, so the workers share nothing
+    that is written and scale with the number of cores.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+/**
+ * One worker thread and its share of the packets, aligned to a cache
+ * line by its counters.
+ * .running: set if the share is being tested on its own thread
+ * .counting: set if hits and latency are counted into .counters
+ * .stats: the worker's own totals, only read once it has finished
+ */
+typedef struct worker {
+    pthread_t               thread;
+    int                     running;
+    int                     counting;
+    policy_reader_t         *reader;
+    const packet_t          *pkts;
+    size_t                  n;
+    pool_stats_t            stats;
+    stats_t                 counters;
+} worker_t;
+
+/**
+    Tests a worker's share of the packets.
+    @param arg The worker_t
+    @return NULL
+*/
+static void *work( void *arg ) {
+  worker_t *w = arg;
+  int actions[ POOL_BATCH ];
+  int pos[ POOL_BATCH ];
+  pool_stats_t stats = { 0 };
+  for ( size_t base = 0; base < w->n; base += POOL_BATCH ) {
+    int m = w->n - base < POOL_BATCH ? ( int ) ( w->n - base ) : POOL_BATCH;
+    uint64_t start = w->counting ? stats_clock() : 0;
+    const policy_frozen_t *version = policy_read_lock( w->reader );
+    policy_frozen_test_batch( version, w->pkts + base, m, actions, pos );
+    policy_read_unlock( w->reader );
+    if ( w->counting ) {
+      stats_time( &w->counters, m, stats_clock() - start );
+      stats_count( &w->counters, pos, m );
+    }
+    for ( int i = 0; i < m; i++ ) {
+      if ( actions[ i ] == ACTION_ALLOW ) {
+        stats.allowed++;
+      } else {
+        stats.denied++;
+      }
+      if ( pos[ i ] < 0 ) {
+        stats.defaulted++;
+      }
+    }
+    stats.tested += m;
+  }
+  w->stats = stats;
+  return NULL;
+}
+
+/**
+    Tests @n packets against the published policy on @threads threads,
+    each taking an equal contiguous share of @pkts, and sums their totals
+    into @total. Each batch is tested against the latest version, so the
+    policy may be changed while the pool runs. If the policy is counting
+    hits, each thread counts its own and they are merged at the end.
+    @param pkts The packets to test
+    @param n The number of packets
+    @param threads The number of threads, 1 to POOL_MAX_THREADS
+    @param total Filled with the summed totals
+    @return 0 if success, -1 if @threads is out of range, the policy is
+            not published or memory ran out
+*/
+int pool_run(const packet_t *pkts, size_t n, int threads, pool_stats_t *total) {
+  memset( total, 0, sizeof( pool_stats_t ) );
+  if ( threads < 1 || threads > POOL_MAX_THREADS ) {
+    return -1;
+  }
+  void *mem = NULL;
+  if ( posix_memalign( &mem, STATS_LINE, threads * sizeof( worker_t ) ) != 0 ) {
+    return -1;
+  }
+  memset( mem, 0, threads * sizeof( worker_t ) );
+  worker_t *workers = mem;
+  int ready = 1;
+  for ( int t = 0; t < threads; t++ ) {
+    workers[ t ].reader = policy_reader_register();
+    ready = ready && workers[ t ].reader != NULL;
+  }
+  if ( ready ) {
+    ready = policy_read_lock( workers[ 0 ].reader ) != NULL;
+    policy_read_unlock( workers[ 0 ].reader );
+  }
+  if ( !ready ) {
+    for ( int t = 0; t < threads; t++ ) {
+      policy_reader_unregister( workers[ t ].reader );
+    }
+    free( workers );
+    return -1;
+  }
+  size_t share = n / threads;
+  size_t extra = n % threads;
+  size_t next = 0;
+  for ( int t = 0; t < threads; t++ ) {
+    worker_t *w = &workers[ t ];
+    w->counting = policy_stats_enabled();
+    w->pkts = pkts + next;
+    w->n = share + ( ( size_t ) t < extra ? 1 : 0 );
+    next += w->n;
+  }
+  // The calling thread takes the last share, and any share whose thread
+  // could not be started
+  for ( int t = 0; t < threads - 1; t++ ) {
+    workers[ t ].running = pthread_create( &workers[ t ].thread, NULL, work, &workers[ t ] ) == 0;
+  }
+  for ( int t = 0; t < threads; t++ ) {
+    if ( !workers[ t ].running ) {
+      work( &workers[ t ] );
+    }
+  }
+  for ( int t = 0; t < threads; t++ ) {
+    if ( workers[ t ].running ) {
+      pthread_join( workers[ t ].thread, NULL );
+    }
+  }
+  for ( int t = 0; t < threads; t++ ) {
+    policy_reader_unregister( workers[ t ].reader );
+    policy_merge_stats( &workers[ t ].counters );
+    stats_free( &workers[ t ].counters );
+    total->tested += workers[ t ].stats.tested;
+    total->allowed += workers[ t ].stats.allowed;
+    total->denied += workers[ t ].stats.denied;
+    total->defaulted += workers[ t ].stats.defaulted;
+  }
+  free( workers );
+  return 0;
+}
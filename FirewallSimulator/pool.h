@@ -0,0 +1,50 @@
+/**
+    @file pool.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior and data for testing packets on several threads.
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet.h"
+#include "policy.h"
+
+/** Most worker threads a pool will start */
+#define POOL_MAX_THREADS 256
+
+/** Packets each worker tests per call into the policy */
+#define POOL_BATCH 256
+
+/**
+ * Verdict totals, kept separately by each worker and summed at the end.
+ * .tested: packets tested
+ * .allowed / .denied: verdicts of the tested packets
+ * .defaulted: packets decided by the default policy
+ */
+typedef struct pool_stats {
+    uint64_t  tested;
+    uint64_t  allowed;
+    uint64_t  denied;
+    uint64_t  defaulted;
+} pool_stats_t;
+
+/**
+    Tests @n packets against the published policy on @threads threads,
+    each taking an equal contiguous share of @pkts, and sums their totals
+    into @total. Each batch is tested against the latest version, so the
+    policy may be changed while the pool runs. If the policy is counting
+    hits, each thread counts its own and they are merged at the end.
+    @param pkts The packets to test
+    @param n The number of packets
+    @param threads The number of threads, 1 to POOL_MAX_THREADS
+    @param total Filled with the summed totals
+    @return 0 if success, -1 if @threads is out of range, the policy is
+            not published or memory ran out
+*/
+int pool_run(const packet_t *pkts, size_t n, int threads, pool_stats_t *total);
+
+#endif
@@ -0,0 +1,238 @@
+/**
+    @file reorder.c
+    @author Griffin Brookshire (glbrook2)
+    Moves frequently hit rules earlier. The order is a topological sort
+    of the rules taking the most hit ready rule first, where a rule is
+    ready once every earlier rule it must stay behind has been placed.
+    Addresses and protocols are matched exactly, so a rule can only have
+    to stay behind rules sharing those, and only those are compared.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reorder.h"
+
+/**
+ * Most rules sharing protocol and addresses compared pairwise. Larger
+ * groups keep their own relative order so the pass stays near linear.
+ */
+#define REORDER_MAX_GROUP 1024
+
+/**
+ * A rule's place in the sort by protocol and addresses.
+ */
+typedef struct entry {
+    uint32_t  src_ip;
+    uint32_t  dst_ip;
+    uint32_t  protocol;
+    int       index;
+} entry_t;
+
+/**
+    Orders entries by protocol and addresses, then by policy order.
+    @param a The first entry
+    @param b The second entry
+    @return Negative, zero or positive as @a sorts before, with or after @b
+*/
+static int compare_entry( const void *a, const void *b ) {
+  const entry_t *x = a;
+  const entry_t *y = b;
+  if ( x->protocol != y->protocol ) {
+    return x->protocol < y->protocol ? -1 : 1;
+  }
+  if ( x->src_ip != y->src_ip ) {
+    return x->src_ip < y->src_ip ? -1 : 1;
+  }
+  if ( x->dst_ip != y->dst_ip ) {
+    return x->dst_ip < y->dst_ip ? -1 : 1;
+  }
+  return ( x->index > y->index ) - ( x->index < y->index );
+}
+
+/**
+    Tells whether two entries share protocol and addresses.
+    @param x The first entry
+    @param y The second entry
+    @return 1 if they do, 0 otherwise
+*/
+static int same_group( const entry_t *x, const entry_t *y ) {
+  return x->protocol == y->protocol && x->src_ip == y->src_ip && x->dst_ip == y->dst_ip;
+}
+
+/**
+    Tells whether two port matches accept a common port.
+    @param a The first port, or MATCH_PORT_ANY
+    @param b The second port, or MATCH_PORT_ANY
+    @return 1 if they do, 0 otherwise
+*/
+static int ports_meet( int a, int b ) {
+  return a == MATCH_PORT_ANY || b == MATCH_PORT_ANY || a == b;
+}
+
+/**
+    Tells whether two rules of one group must keep their relative order,
+    that is whether some packet matches both and they disagree.
+    @param x The first rule
+    @param y The second rule
+    @return 1 if they must, 0 otherwise
+*/
+static int conflict( const rule_t *x, const rule_t *y ) {
+  return x->action != y->action && ports_meet( x->match.src_port, y->match.src_port ) &&
+         ports_meet( x->match.dst_port, y->match.dst_port );
+}
+
+/**
+    Tells whether rule @a should be placed before rule @b: more hits
+    first, then policy order.
+    @param hits The hits of each rule
+    @param a The first rule index
+    @param b The second rule index
+    @return 1 if @a goes first, 0 otherwise
+*/
+static int hotter( const uint64_t *hits, int a, int b ) {
+  return hits[ a ] != hits[ b ] ? hits[ a ] > hits[ b ] : a < b;
+}
+
+/**
+    Adds a ready rule to the heap.
+    @param heap The heap
+    @param n The number of rules in the heap
+    @param hits The hits of each rule
+    @param i The rule index
+*/
+static void push( int *heap, int n, const uint64_t *hits, int i ) {
+  int k = n;
+  while ( k > 0 && hotter( hits, i, heap[ ( k - 1 ) / 2 ] ) ) {
+    heap[ k ] = heap[ ( k - 1 ) / 2 ];
+    k = ( k - 1 ) / 2;
+  }
+  heap[ k ] = i;
+}
+
+/**
+    Removes the hottest rule from the heap.
+    @param heap The heap
+    @param n The number of rules in the heap, at least 1
+    @param hits The hits of each rule
+    @return The rule index
+*/
+static int pop( int *heap, int n, const uint64_t *hits ) {
+  int top = heap[ 0 ];
+  int last = heap[ --n ];
+  int k = 0;
+  for ( ;; ) {
+    int c = 2 * k + 1;
+    if ( c >= n ) {
+      break;
+    }
+    if ( c + 1 < n && hotter( hits, heap[ c + 1 ], heap[ c ] ) ) {
+      c++;
+    }
+    if ( !hotter( hits, heap[ c ], last ) ) {
+      break;
+    }
+    heap[ k ] = heap[ c ];
+    k = c;
+  }
+  heap[ k ] = last;
+  return top;
+}
+
+/**
+    Finds an evaluation order for @len rules that puts the most hit rules
+    as early as it can. Two rules keep their relative order only if some
+    packet matches both and they disagree, so the first rule a packet
+    matches in the new order always has the action it had before.
+    @param rules The rules in policy order
+    @param len The number of rules
+    @param hits The hits of each rule
+    @param order Set to the policy index of the rule at each position
+    @return The number of rules not at their policy position, -1 if
+            memory ran out
+*/
+int reorder_rules(const rule_t *rules, int len, const uint64_t *hits, int *order) {
+  if ( len <= 0 ) {
+    return 0;
+  }
+  entry_t *sorted = malloc( len * sizeof( entry_t ) );
+  int *place = malloc( len * sizeof( int ) );
+  int *group_start = malloc( len * sizeof( int ) );
+  int *group_end = malloc( len * sizeof( int ) );
+  int *waiting = malloc( len * sizeof( int ) );
+  int *heap = malloc( len * sizeof( int ) );
+  if ( sorted == NULL || place == NULL || group_start == NULL || group_end == NULL ||
+       waiting == NULL || heap == NULL ) {
+    free( sorted );
+    free( place );
+    free( group_start );
+    free( group_end );
+    free( waiting );
+    free( heap );
+    return -1;
+  }
+  for ( int i = 0; i < len; i++ ) {
+    sorted[ i ].src_ip = ipaddr_to_int( rules[ i ].match.src_ip );
+    sorted[ i ].dst_ip = ipaddr_to_int( rules[ i ].match.dst_ip );
+    sorted[ i ].protocol = rules[ i ].match.protocol;
+    sorted[ i ].index = i;
+  }
+  qsort( sorted, len, sizeof( entry_t ), compare_entry );
+
+  // Count the earlier rules each rule must stay behind
+  for ( int start = 0, end; start < len; start = end ) {
+    for ( end = start + 1; end < len && same_group( &sorted[ start ], &sorted[ end ] ); end++ ) {
+    }
+    for ( int k = start; k < end; k++ ) {
+      int i = sorted[ k ].index;
+      place[ i ] = k;
+      group_start[ k ] = start;
+      group_end[ k ] = end;
+      waiting[ i ] = 0;
+      if ( end - start > REORDER_MAX_GROUP ) {
+        waiting[ i ] = k > start;
+        continue;
+      }
+      for ( int e = start; e < k; e++ ) {
+        waiting[ i ] += conflict( &rules[ sorted[ e ].index ], &rules[ i ] );
+      }
+    }
+  }
+
+  int ready = 0;
+  for ( int i = 0; i < len; i++ ) {
+    if ( waiting[ i ] == 0 ) {
+      push( heap, ready++, hits, i );
+    }
+  }
+  int moved = 0;
+  for ( int n = 0; n < len; n++ ) {
+    int i = pop( heap, ready--, hits );
+    order[ n ] = i;
+    moved += i != n;
+
+    // Release the later rules of the group that were waiting on this one
+    int k = place[ i ];
+    int end = group_end[ k ];
+    if ( end - group_start[ k ] > REORDER_MAX_GROUP ) {
+      if ( k + 1 < end ) {
+        push( heap, ready++, hits, sorted[ k + 1 ].index );
+      }
+      continue;
+    }
+    for ( int e = k + 1; e < end; e++ ) {
+      int j = sorted[ e ].index;
+      if ( waiting[ j ] > 0 && conflict( &rules[ i ], &rules[ j ] ) && --waiting[ j ] == 0 ) {
+        push( heap, ready++, hits, j );
+      }
+    }
+  }
+  free( sorted );
+  free( place );
+  free( group_start );
+  free( group_end );
+  free( waiting );
+  free( heap );
+  return moved;
+}
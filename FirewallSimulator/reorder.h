@@ -0,0 +1,30 @@
+/**
+    @file reorder.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior and data for moving frequently hit rules earlier in
+    the order the linear scan evaluates them without changing any verdict.
+*/
+
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <stdint.h>
+
+#include "packet.h"
+#include "policy.h"
+
+/**
+    Finds an evaluation order for @len rules that puts the most hit rules
+    as early as it can. Two rules keep their relative order only if some
+    packet matches both and they disagree, so the first rule a packet
+    matches in the new order always has the action it had before.
+    @param rules The rules in policy order
+    @param len The number of rules
+    @param hits The hits of each rule
+    @param order Set to the policy index of the rule at each position
+    @return The number of rules not at their policy position, -1 if
+            memory ran out
+*/
+int reorder_rules(const rule_t *rules, int len, const uint64_t *hits, int *order);
+
+#endif
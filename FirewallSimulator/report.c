@@ -0,0 +1,232 @@
+/**
+    @file report.c
+    @author Griffin Brookshire (glbrook2)
+    Formats test verdicts into a large buffer that is written out in one
+    go, keeping stdio out of the path that evaluates packets.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "report.h"
+#include "policy.h"
+
+/** Size of the output buffer */
+#define REPORT_BUFFER ( 64 * 1024 )
+
+/** Most bytes a single verdict can take in any format */
+#define REPORT_MAX_LINE 128
+
+/** The format verdicts are written in */
+static int report_format = REPORT_TEXT;
+
+/** The stream verdicts are written to, NULL means stdout */
+static FILE *report_stream = NULL;
+
+/** Where flushed output goes instead of the stream, NULL for none */
+static report_sink_t report_sink = NULL;
+
+/** Verdicts waiting to be written */
+static char report_buf[ REPORT_BUFFER ];
+
+/** Number of bytes used in report_buf */
+static size_t report_len = 0;
+
+/**
+    Appends a string to the buffer.
+    @param s The string to append
+*/
+static void put_str( const char *s ) {
+  size_t n = strlen( s );
+  memcpy( report_buf + report_len, s, n );
+  report_len += n;
+}
+
+/**
+    Appends a character to the buffer.
+    @param c The character to append
+*/
+static void put_char( char c ) {
+  report_buf[ report_len++ ] = c;
+}
+
+/**
+    Appends a non-negative number in decimal to the buffer.
+    @param v The number to append
+*/
+static void put_uint( unsigned int v ) {
+  char digits[ 10 ];
+  int n = 0;
+  do {
+    digits[ n++ ] = '0' + v % 10;
+    v /= 10;
+  } while ( v > 0 );
+  while ( n > 0 ) {
+    report_buf[ report_len++ ] = digits[ --n ];
+  }
+}
+
+/**
+    Appends an address as a.b.c.d to the buffer.
+    @param ip The address to append
+*/
+static void put_ip( ipaddr_t ip ) {
+  put_uint( ip.a );
+  put_char( '.' );
+  put_uint( ip.b );
+  put_char( '.' );
+  put_uint( ip.c );
+  put_char( '.' );
+  put_uint( ip.d );
+}
+
+/**
+    Appends an integer in little-endian byte order to the buffer.
+    @param v The value to append
+    @param bytes The number of bytes to write
+*/
+static void put_le( uint32_t v, int bytes ) {
+  for ( int i = 0; i < bytes; i++ ) {
+    report_buf[ report_len++ ] = ( char ) ( v >> ( 8 * i ) );
+  }
+}
+
+/**
+    Appends a rule the same way policy_print_rule prints it.
+    @param pos The position of the rule
+*/
+static void put_rule( int pos ) {
+  rule_t rule;
+  if ( policy_get_rule( pos, &rule ) != 0 ) {
+    put_str( "[" );
+    put_uint( pos );
+    put_str( "] \n" );
+    return;
+  }
+  put_char( '[' );
+  put_uint( pos );
+  put_str( "] " );
+  put_str( rule.action == ACTION_ALLOW ? "allow " : "deny " );
+  put_str( rule.match.protocol == PROTO_TCP ? "tcp " : "udp " );
+  put_ip( rule.match.src_ip );
+  put_char( ':' );
+  if ( rule.match.src_port < 0 ) {
+    put_str( "* " );
+  } else {
+    put_uint( rule.match.src_port );
+    put_char( ' ' );
+  }
+  put_ip( rule.match.dst_ip );
+  put_char( ':' );
+  if ( rule.match.dst_port < 0 ) {
+    put_str( "* \n" );
+  } else {
+    put_uint( rule.match.dst_port );
+    put_str( " \n" );
+  }
+}
+
+/**
+    Writes any buffered verdicts to the stream, or hands them to the sink.
+*/
+void report_flush() {
+  if ( report_len > 0 && report_sink != NULL ) {
+    report_sink( report_buf, report_len );
+    report_len = 0;
+  } else if ( report_len > 0 ) {
+    FILE *stream = report_stream ? report_stream : stdout;
+    fwrite( report_buf, 1, report_len, stream );
+    fflush( stream );
+    report_len = 0;
+  }
+}
+
+/**
+    Sets the format verdicts are reported in. Pending output is flushed
+    first, and a header line is written when switching to REPORT_CSV.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param format REPORT_TEXT, REPORT_CSV, REPORT_BINARY or REPORT_OFF
+    @return 0 if success, -1 if fail
+*/
+int report_set_format(int format) {
+  if ( format < REPORT_TEXT || format > REPORT_OFF ) {
+    return -1;
+  }
+  report_flush();
+  report_format = format;
+  if ( format == REPORT_CSV ) {
+    put_str( "action,pos,protocol,src_ip,src_port,dst_ip,dst_port\n" );
+  }
+  return 0;
+}
+
+/**
+    Sets the stream verdicts are written to, stdout by default.
+    Pending output is flushed to the old stream first.
+    @param stream The stream to write to
+*/
+void report_set_stream(FILE *stream) {
+  report_flush();
+  report_stream = stream;
+}
+
+/**
+    Sends flushed output to @sink instead of the stream, or back to the
+    stream if @sink is NULL. Pending output is flushed first.
+    @param sink Called with each run of flushed bytes, or NULL
+*/
+void report_set_sink(report_sink_t sink) {
+  report_flush();
+  report_sink = sink;
+}
+
+/**
+    Adds the verdict for one packet to the report buffer.
+    Output only reaches the stream when the buffer fills or on report_flush.
+    @param pkt The packet that was tested
+    @param action The action returned by policy_test
+    @param pos The position returned by policy_test, -1 for the default
+*/
+void report_verdict(packet_t pkt, int action, int pos) {
+  if ( report_format == REPORT_OFF ) {
+    return;
+  }
+  if ( report_len + REPORT_MAX_LINE > REPORT_BUFFER ) {
+    report_flush();
+  }
+  if ( report_format == REPORT_TEXT ) {
+    put_str( action == ACTION_ALLOW ? "Allowed via " : "Denied via " );
+    if ( pos < 0 ) {
+      put_str( "default policy.\n" );
+    } else {
+      put_rule( pos );
+    }
+  } else if ( report_format == REPORT_CSV ) {
+    put_str( action == ACTION_ALLOW ? "allow," : "deny," );
+    if ( pos < 0 ) {
+      put_str( "-1" );
+    } else {
+      put_uint( pos );
+    }
+    put_str( pkt.protocol == PROTO_TCP ? ",tcp," : ",udp," );
+    put_ip( pkt.src_ip );
+    put_char( ',' );
+    put_uint( pkt.src_port );
+    put_char( ',' );
+    put_ip( pkt.dst_ip );
+    put_char( ',' );
+    put_uint( pkt.dst_port );
+    put_char( '\n' );
+  } else {
+    put_le( pkt.protocol, 1 );
+    put_le( action, 1 );
+    put_le( pkt.src_port, 2 );
+    put_le( pkt.dst_port, 2 );
+    put_le( 0, 2 );
+    put_le( ipaddr_to_int( pkt.src_ip ), 4 );
+    put_le( ipaddr_to_int( pkt.dst_ip ), 4 );
+    put_le( ( uint32_t ) pos, 4 );
+  }
+}
@@ -0,0 +1,73 @@
+/**
+    @file report.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior for reporting test verdicts.
+*/
+
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stdio.h>
+
+#include "packet.h"
+
+/** Report verdicts as "Allowed via [pos] <rule>" lines */
+#define REPORT_TEXT    0
+
+/** Report verdicts as comma separated values, one packet per line */
+#define REPORT_CSV     1
+
+/** Report verdicts as fixed size little-endian records */
+#define REPORT_BINARY  2
+
+/** Don't report verdicts at all */
+#define REPORT_OFF     3
+
+/** Size of one REPORT_BINARY record in bytes */
+#define REPORT_RECORD_SIZE 20
+
+/**
+    Sets the format verdicts are reported in. Pending output is flushed
+    first, and a header line is written when switching to REPORT_CSV.
+    It returns 0 if successful, -1 if unsuccessful.
+    @param format REPORT_TEXT, REPORT_CSV, REPORT_BINARY or REPORT_OFF
+    @return 0 if success, -1 if fail
+*/
+int report_set_format(int format);
+
+/**
+    Sets the stream verdicts are written to, stdout by default.
+    Pending output is flushed to the old stream first.
+    @param stream The stream to write to
+*/
+void report_set_stream(FILE *stream);
+
+/**
+    Receives flushed report output.
+    @param buf The bytes
+    @param len The number of bytes
+*/
+typedef void (*report_sink_t)(const char *buf, size_t len);
+
+/**
+    Sends flushed output to @sink instead of the stream, or back to the
+    stream if @sink is NULL. Pending output is flushed first.
+    @param sink Called with each run of flushed bytes, or NULL
+*/
+void report_set_sink(report_sink_t sink);
+
+/**
+    Adds the verdict for one packet to the report buffer.
+    Output only reaches the stream when the buffer fills or on report_flush.
+    @param pkt The packet that was tested
+    @param action The action returned by policy_test
+    @param pos The position returned by policy_test, -1 for the default
+*/
+void report_verdict(packet_t pkt, int action, int pos);
+
+/**
+    Writes any buffered verdicts to the stream, or hands them to the sink.
+*/
+void report_flush();
+
+#endif
@@ -0,0 +1,237 @@
+/**
+    @file scan.c
+    @author Griffin Brookshire (glbrook2)
+    Linear scan over the rules stored as packed columns. The packet is
+    broadcast into vector registers once and compared against eight
+    rules per AVX2 instruction (four with SSE2) until one matches.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+#include "scan.h"
+
+/**
+ * A packet split the same way as the columns.
+ */
+typedef struct scan_key {
+    uint32_t  src_ip;
+    uint32_t  dst_ip;
+    uint32_t  ports;
+    uint32_t  protocol;
+} scan_key_t;
+
+/** Signature shared by the scan routines */
+typedef int ( *scan_fn )( const scan_t *sc, const scan_key_t *key, int from );
+
+/**
+    Scans rules @from to the end of the columns one at a time.
+    @param sc The columns to scan
+    @param key The packet to match
+    @param from The first rule to check
+    @return Index of the first matching rule, -1 if none match
+*/
+static int scan_scalar( const scan_t *sc, const scan_key_t *key, int from ) {
+  for ( int i = from; i < sc->len; i++ ) {
+    if ( sc->src_ip[ i ] == key->src_ip && sc->dst_ip[ i ] == key->dst_ip &&
+         ( key->ports & sc->port_mask[ i ] ) == sc->ports[ i ] &&
+         sc->protocol[ i ] == key->protocol ) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+#ifdef SCAN_X86
+/**
+    Scans the columns four rules per SSE2 compare.
+    @param sc The columns to scan
+    @param key The packet to match
+    @param from The first rule to check
+    @return Index of the first matching rule, -1 if none match
+*/
+__attribute__(( target( "sse2" ) ))
+static int scan_sse2( const scan_t *sc, const scan_key_t *key, int from ) {
+  const __m128i src = _mm_set1_epi32( ( int ) key->src_ip );
+  const __m128i dst = _mm_set1_epi32( ( int ) key->dst_ip );
+  const __m128i ports = _mm_set1_epi32( ( int ) key->ports );
+  const __m128i proto = _mm_set1_epi32( ( int ) key->protocol );
+  const __m128i zero = _mm_setzero_si128();
+  int i = from;
+  for ( ; i + 4 <= sc->len; i += 4 ) {
+    __m128i eq = _mm_cmpeq_epi32( _mm_loadu_si128( ( const __m128i * ) ( sc->src_ip + i ) ), src );
+    eq = _mm_and_si128( eq, _mm_cmpeq_epi32(
+                               _mm_loadu_si128( ( const __m128i * ) ( sc->dst_ip + i ) ), dst ) );
+    __m128i masked = _mm_and_si128( ports,
+                                    _mm_loadu_si128( ( const __m128i * ) ( sc->port_mask + i ) ) );
+    eq = _mm_and_si128( eq, _mm_cmpeq_epi32(
+                               masked, _mm_loadu_si128( ( const __m128i * ) ( sc->ports + i ) ) ) );
+    int bytes;
+    memcpy( &bytes, sc->protocol + i, sizeof( bytes ) );
+    __m128i wide = _mm_unpacklo_epi16( _mm_unpacklo_epi8( _mm_cvtsi32_si128( bytes ), zero ), zero );
+    eq = _mm_and_si128( eq, _mm_cmpeq_epi32( wide, proto ) );
+    int hits = _mm_movemask_ps( _mm_castsi128_ps( eq ) );
+    if ( hits ) {
+      return i + __builtin_ctz( hits );
+    }
+  }
+  return scan_scalar( sc, key, i );
+}
+
+/**
+    Scans the columns eight rules per AVX2 compare.
+    @param sc The columns to scan
+    @param key The packet to match
+    @param from The first rule to check
+    @return Index of the first matching rule, -1 if none match
+*/
+__attribute__(( target( "avx2" ) ))
+static int scan_avx2( const scan_t *sc, const scan_key_t *key, int from ) {
+  const __m256i src = _mm256_set1_epi32( ( int ) key->src_ip );
+  const __m256i dst = _mm256_set1_epi32( ( int ) key->dst_ip );
+  const __m256i ports = _mm256_set1_epi32( ( int ) key->ports );
+  const __m256i proto = _mm256_set1_epi32( ( int ) key->protocol );
+  int i = from;
+  for ( ; i + 8 <= sc->len; i += 8 ) {
+    __m256i eq = _mm256_cmpeq_epi32(
+                   _mm256_loadu_si256( ( const __m256i * ) ( sc->src_ip + i ) ), src );
+    eq = _mm256_and_si256( eq, _mm256_cmpeq_epi32(
+                                 _mm256_loadu_si256( ( const __m256i * ) ( sc->dst_ip + i ) ), dst ) );
+    __m256i masked = _mm256_and_si256( ports,
+                       _mm256_loadu_si256( ( const __m256i * ) ( sc->port_mask + i ) ) );
+    eq = _mm256_and_si256( eq, _mm256_cmpeq_epi32(
+                                 masked, _mm256_loadu_si256( ( const __m256i * ) ( sc->ports + i ) ) ) );
+    __m256i wide = _mm256_cvtepu8_epi32( _mm_loadl_epi64( ( const __m128i * ) ( sc->protocol + i ) ) );
+    eq = _mm256_and_si256( eq, _mm256_cmpeq_epi32( wide, proto ) );
+    int hits = _mm256_movemask_ps( _mm256_castsi256_ps( eq ) );
+    if ( hits ) {
+      return i + __builtin_ctz( hits );
+    }
+  }
+  // gcc drops the vzeroupper on tail calls, and the SSE penalty that follows
+  // costs more than scanning a small policy
+  _mm256_zeroupper();
+  return scan_scalar( sc, key, i );
+}
+#endif
+
+static int scan_first( const scan_t *sc, const scan_key_t *key, int from );
+
+/** The widest scan the CPU supports, picked on first use */
+static scan_fn scan_rules = scan_first;
+
+/**
+    Picks the scan routine for this CPU.
+*/
+static void pick_scan() {
+  scan_rules = scan_scalar;
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports( "avx2" ) ) {
+    scan_rules = scan_avx2;
+  } else if ( __builtin_cpu_supports( "sse2" ) ) {
+    scan_rules = scan_sse2;
+  }
+#endif
+}
+
+/**
+    Picks the scan routine on first use, then hands the call to it.
+    Columns mapped from a snapshot may be scanned before any build.
+    @param sc The columns to scan
+    @param key The packet to match
+    @param from The first rule to check
+    @return Index of the first matching rule, -1 if none match
+*/
+static int scan_first( const scan_t *sc, const scan_key_t *key, int from ) {
+  pick_scan();
+  return scan_rules( sc, key, from );
+}
+
+/**
+    Packs @len rules stored in @rules into columns.
+    @param rules The rules in policy order
+    @param len The number of rules
+    @return The new columns, or NULL if memory ran out
+*/
+scan_t *scan_build(const rule_t *rules, int len) {
+  scan_t *sc = calloc( 1, sizeof( scan_t ) );
+  if ( sc == NULL ) {
+    return NULL;
+  }
+  size_t n = len ? len : 1;
+  sc->len = len;
+  sc->src_ip = malloc( n * sizeof( uint32_t ) );
+  sc->dst_ip = malloc( n * sizeof( uint32_t ) );
+  sc->ports = malloc( n * sizeof( uint32_t ) );
+  sc->port_mask = malloc( n * sizeof( uint32_t ) );
+  sc->protocol = malloc( n + sizeof( uint64_t ) );
+  sc->action = malloc( n );
+  if ( sc->src_ip == NULL || sc->dst_ip == NULL || sc->ports == NULL ||
+       sc->port_mask == NULL || sc->protocol == NULL || sc->action == NULL ) {
+    scan_free( sc );
+    return NULL;
+  }
+  for ( int i = 0; i < len; i++ ) {
+    const packet_match_t *m = &rules[ i ].match;
+    uint32_t src_mask = m->src_port == MATCH_PORT_ANY ? 0 : 0xFFFF;
+    uint32_t dst_mask = m->dst_port == MATCH_PORT_ANY ? 0 : 0xFFFF;
+    sc->src_ip[ i ] = ipaddr_to_int( m->src_ip );
+    sc->dst_ip[ i ] = ipaddr_to_int( m->dst_ip );
+    sc->port_mask[ i ] = ( src_mask << 16 ) | dst_mask;
+    sc->ports[ i ] = ( ( ( uint32_t ) m->src_port & src_mask ) << 16 ) |
+                     ( ( uint32_t ) m->dst_port & dst_mask );
+    sc->protocol[ i ] = ( uint8_t ) m->protocol;
+    sc->action[ i ] = ( uint8_t ) rules[ i ].action;
+  }
+  // The SSE2 and AVX2 loops read a few protocol bytes past the last rule
+  memset( sc->protocol + len, 0, sizeof( uint64_t ) );
+  return sc;
+}
+
+/**
+    Finds the first rule that matches @pkt by scanning the columns.
+    @param sc The columns to scan
+    @param pkt The packet to classify
+    @return Index of the first matching rule, -1 if none match
+*/
+int scan_lookup(const scan_t *sc, packet_t pkt) {
+  scan_key_t key;
+  key.src_ip = ipaddr_to_int( pkt.src_ip );
+  key.dst_ip = ipaddr_to_int( pkt.dst_ip );
+  key.ports = ( ( uint32_t ) pkt.src_port << 16 ) | pkt.dst_port;
+  key.protocol = pkt.protocol;
+  return scan_rules( sc, &key, 0 );
+}
+
+/**
+    Reports the number of bytes held by the columns.
+    @param sc The columns to measure
+    @return Size in bytes
+*/
+size_t scan_bytes(const scan_t *sc) {
+  return sizeof( scan_t ) + sc->len * ( 4 * sizeof( uint32_t ) + 2 );
+}
+
+/**
+    Frees columns returned by scan_build.
+    @param sc The columns to free, may be NULL
+*/
+void scan_free(scan_t *sc) {
+  if ( sc == NULL ) {
+    return;
+  }
+  free( sc->src_ip );
+  free( sc->dst_ip );
+  free( sc->ports );
+  free( sc->port_mask );
+  free( sc->protocol );
+  free( sc->action );
+  free( sc );
+}
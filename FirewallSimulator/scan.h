@@ -0,0 +1,66 @@
+/**
+    @file scan.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior and data for the column-packed linear scan.
+*/
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet.h"
+#include "policy.h"
+
+/**
+ * The rules stored as one column per field, so a vector compare tests
+ * several rules at once.
+ * .src_ip / .dst_ip: the addresses, packed most significant octet first
+ * .ports: source port in the high half, destination port in the low half,
+ *         0 in a half whose port is wild
+ * .port_mask: 0xFFFF in each half with an exact port, 0 where it is wild
+ * .protocol: the protocol of each rule
+ * .action: the action of each rule
+ * .len: the number of rules
+ */
+typedef struct scan {
+    uint32_t  *src_ip;
+    uint32_t  *dst_ip;
+    uint32_t  *ports;
+    uint32_t  *port_mask;
+    uint8_t   *protocol;
+    uint8_t   *action;
+    int       len;
+} scan_t;
+
+/**
+    Packs @len rules stored in @rules into columns.
+    @param rules The rules in policy order
+    @param len The number of rules
+    @return The new columns, or NULL if memory ran out
+*/
+scan_t *scan_build(const rule_t *rules, int len);
+
+/**
+    Finds the first rule that matches @pkt by scanning the columns.
+    @param sc The columns to scan
+    @param pkt The packet to classify
+    @return Index of the first matching rule, -1 if none match
+*/
+int scan_lookup(const scan_t *sc, packet_t pkt);
+
+/**
+    Reports the number of bytes held by the columns.
+    @param sc The columns to measure
+    @return Size in bytes
+*/
+size_t scan_bytes(const scan_t *sc);
+
+/**
+    Frees columns returned by scan_build.
+    @param sc The columns to free, may be NULL
+*/
+void scan_free(scan_t *sc);
+
+#endif
@@ -0,0 +1,500 @@
+/**
+    @file server.c
+    @author Griffin Brookshire (glbrook2)
+    Serves verdicts over a Unix domain socket from a single epoll loop.
+    Each connection keeps what it has read but not yet answered and what
+    it has answered but not yet written. Every complete request in the
+    input is answered at once, so a client that pipelines requests gets
+    its answers in as few writes as the socket allows, and a client that
+    stops reading is not read from until it catches up.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "server.h"
+#include "policy.h"
+#include "packet.h"
+
+/** Events taken from epoll at a time */
+#define SERVER_EVENTS 256
+
+/** Bytes of input buffer a new connection starts with */
+#define SERVER_IN_START 4096
+
+/**
+ * One client connection, in a list of all of them.
+ * .fd: the socket
+ * .in / .in_len / .in_cap: bytes read but not yet answered
+ * .out / .out_off / .out_len / .out_cap: answers, written up to .out_off
+ * .events: the epoll events asked for
+ * .eof: set once the client has shut down its side, it is dropped when
+ *       every answer has been written
+ * .prev / .next: the neighbours in the list
+ */
+typedef struct conn {
+    int             fd;
+    unsigned char   *in;
+    size_t          in_len;
+    size_t          in_cap;
+    unsigned char   *out;
+    size_t          out_off;
+    size_t          out_len;
+    size_t          out_cap;
+    uint32_t        events;
+    int             eof;
+    struct conn     *prev;
+    struct conn     *next;
+} conn_t;
+
+/** Set by SIGINT or SIGTERM */
+static volatile sig_atomic_t server_stop = 0;
+
+/** The epoll instance */
+static int server_epoll = -1;
+
+/** Every open connection */
+static conn_t *server_conns = NULL;
+
+/** The packets of the request being answered */
+static packet_t server_pkts[ SERVER_MAX_BATCH ];
+
+/** The verdicts of the request being answered */
+static int server_actions[ SERVER_MAX_BATCH ];
+static int server_pos[ SERVER_MAX_BATCH ];
+
+/**
+    Asks the loop to stop.
+    @param sig The signal
+*/
+static void on_signal( int sig ) {
+  server_stop = 1;
+}
+
+/**
+    Reads a little-endian integer.
+    @param p The bytes
+    @param bytes The number of bytes
+    @return The value
+*/
+static uint32_t get_le( const unsigned char *p, int bytes ) {
+  uint32_t v = 0;
+  for ( int i = bytes - 1; i >= 0; i-- ) {
+    v = v << 8 | p[ i ];
+  }
+  return v;
+}
+
+/**
+    Writes a little-endian integer.
+    @param p Where to write
+    @param v The value
+    @param bytes The number of bytes
+*/
+static void put_le( unsigned char *p, uint32_t v, int bytes ) {
+  for ( int i = 0; i < bytes; i++ ) {
+    p[ i ] = ( unsigned char ) ( v >> ( 8 * i ) );
+  }
+}
+
+/**
+    Reads an address stored a first.
+    @param p The bytes
+    @return The address
+*/
+static ipaddr_t get_ip( const unsigned char *p ) {
+  ipaddr_t ip;
+  ip.a = p[ 0 ];
+  ip.b = p[ 1 ];
+  ip.c = p[ 2 ];
+  ip.d = p[ 3 ];
+  return ip;
+}
+
+/**
+    Makes a file descriptor non-blocking.
+    @param fd The file descriptor
+    @return 0 if success, -1 if fail
+*/
+static int set_nonblocking( int fd ) {
+  int flags = fcntl( fd, F_GETFL );
+  return flags < 0 ? -1 : fcntl( fd, F_SETFL, flags | O_NONBLOCK );
+}
+
+/**
+    Closes a connection and frees it.
+    @param c The connection
+*/
+static void drop( conn_t *c ) {
+  close( c->fd );
+  if ( c->prev != NULL ) {
+    c->prev->next = c->next;
+  } else {
+    server_conns = c->next;
+  }
+  if ( c->next != NULL ) {
+    c->next->prev = c->prev;
+  }
+  free( c->in );
+  free( c->out );
+  free( c );
+}
+
+/**
+    Grows a buffer to hold at least @need bytes.
+    @param buf The buffer
+    @param cap Its capacity, updated
+    @param need The bytes needed
+    @return 0 if success, -1 if memory ran out
+*/
+static int reserve( unsigned char **buf, size_t *cap, size_t need ) {
+  if ( need <= *cap ) {
+    return 0;
+  }
+  size_t grown = *cap > 0 ? *cap : SERVER_IN_START;
+  while ( grown < need ) {
+    grown *= 2;
+  }
+  unsigned char *bigger = realloc( *buf, grown );
+  if ( bigger == NULL ) {
+    return -1;
+  }
+  *buf = bigger;
+  *cap = grown;
+  return 0;
+}
+
+/**
+    Answers every complete request read so far.
+    @param c The connection
+    @return 0 if success, -1 if a request was bad or memory ran out
+*/
+static int answer( conn_t *c ) {
+  size_t at = 0;
+  while ( c->in_len - at >= SERVER_HEADER_SIZE ) {
+    uint32_t n = get_le( c->in + at, SERVER_HEADER_SIZE );
+    if ( n == 0 || n > SERVER_MAX_BATCH ) {
+      return -1;
+    }
+    size_t size = SERVER_HEADER_SIZE + ( size_t ) n * SERVER_PACKET_SIZE;
+    if ( c->in_len - at < size ) {
+      // Make room for the rest of it
+      if ( reserve( &c->in, &c->in_cap, c->in_len - at + size ) != 0 ) {
+        return -1;
+      }
+      break;
+    }
+    const unsigned char *p = c->in + at + SERVER_HEADER_SIZE;
+    for ( uint32_t i = 0; i < n; i++, p += SERVER_PACKET_SIZE ) {
+      if ( p[ 0 ] != PROTO_TCP && p[ 0 ] != PROTO_UDP ) {
+        return -1;
+      }
+      server_pkts[ i ].protocol = p[ 0 ];
+      server_pkts[ i ].src_ip = get_ip( p + 1 );
+      server_pkts[ i ].src_port = get_le( p + 5, 2 );
+      server_pkts[ i ].dst_ip = get_ip( p + 7 );
+      server_pkts[ i ].dst_port = get_le( p + 11, 2 );
+    }
+    if ( policy_test_batch( server_pkts, n, server_actions, server_pos ) != 0 ) {
+      return -1;
+    }
+    size_t reply = SERVER_HEADER_SIZE + ( size_t ) n * SERVER_VERDICT_SIZE;
+    if ( reserve( &c->out, &c->out_cap, c->out_len + reply ) != 0 ) {
+      return -1;
+    }
+    unsigned char *q = c->out + c->out_len;
+    put_le( q, n, SERVER_HEADER_SIZE );
+    q += SERVER_HEADER_SIZE;
+    for ( uint32_t i = 0; i < n; i++, q += SERVER_VERDICT_SIZE ) {
+      put_le( q, server_actions[ i ], 4 );
+      put_le( q + 4, server_pos[ i ], 4 );
+    }
+    c->out_len += reply;
+    at += size;
+  }
+  memmove( c->in, c->in + at, c->in_len - at );
+  c->in_len -= at;
+  return 0;
+}
+
+/**
+    Writes as many answers as the socket takes.
+    @param c The connection
+    @return 0 if success, -1 if the connection failed
+*/
+static int flush( conn_t *c ) {
+  while ( c->out_off < c->out_len ) {
+    ssize_t n = send( c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL );
+    if ( n < 0 && errno == EINTR ) {
+      continue;
+    }
+    if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+      break;
+    }
+    if ( n < 0 ) {
+      return -1;
+    }
+    c->out_off += n;
+  }
+  if ( c->out_off == c->out_len ) {
+    c->out_off = 0;
+    c->out_len = 0;
+  }
+  return 0;
+}
+
+/**
+    Asks epoll for input while the client keeps up with its answers and
+    has not shut down its side, and for room to write while answers are
+    waiting.
+    @param c The connection
+    @return 0 if success, -1 if fail
+*/
+static int watch( conn_t *c ) {
+  size_t pending = c->out_len - c->out_off;
+  uint32_t events = 0;
+  if ( !c->eof && pending < SERVER_OUT_LIMIT ) {
+    events |= EPOLLIN;
+  }
+  if ( pending > 0 ) {
+    events |= EPOLLOUT;
+  }
+  if ( events == c->events ) {
+    return 0;
+  }
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = c;
+  c->events = events;
+  return epoll_ctl( server_epoll, EPOLL_CTL_MOD, c->fd, &ev );
+}
+
+/**
+    Reads and answers requests until the socket has no more input. When
+    the client shuts down its side, what it sent is still answered.
+    @param c The connection
+    @return 0 if success, -1 if the connection failed
+*/
+static int serve( conn_t *c ) {
+  while ( c->out_len - c->out_off < SERVER_OUT_LIMIT ) {
+    if ( c->in_len == c->in_cap &&
+         reserve( &c->in, &c->in_cap, c->in_len + SERVER_IN_START ) != 0 ) {
+      return -1;
+    }
+    ssize_t n = recv( c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0 );
+    if ( n < 0 && errno == EINTR ) {
+      continue;
+    }
+    if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+      break;
+    }
+    if ( n == 0 ) {
+      // The client is done sending, but still gets its answers
+      c->eof = 1;
+      break;
+    }
+    if ( n < 0 ) {
+      return -1;
+    }
+    c->in_len += n;
+    if ( answer( c ) != 0 ) {
+      return -1;
+    }
+  }
+  return flush( c );
+}
+
+/**
+    Accepts every waiting connection. When out of file descriptors, the
+    spare one is given up to accept and close a connection, so it does
+    not stay waiting and wake the loop forever.
+    @param listener The listening socket
+    @param spare A file descriptor kept open for that, updated
+*/
+static void accept_all( int listener, int *spare ) {
+  for ( ;; ) {
+    int fd = accept( listener, NULL, NULL );
+    if ( fd < 0 ) {
+      if ( ( errno == EMFILE || errno == ENFILE ) && *spare >= 0 ) {
+        close( *spare );
+        fd = accept( listener, NULL, NULL );
+        if ( fd >= 0 ) {
+          close( fd );
+        }
+        *spare = open( "/dev/null", O_RDONLY );
+        continue;
+      }
+      if ( errno == EINTR || errno == ECONNABORTED ) {
+        continue;
+      }
+      return;
+    }
+    conn_t *c = calloc( 1, sizeof( conn_t ) );
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if ( c == NULL || set_nonblocking( fd ) != 0 ||
+         epoll_ctl( server_epoll, EPOLL_CTL_ADD, fd, &ev ) != 0 ) {
+      free( c );
+      close( fd );
+      continue;
+    }
+    c->fd = fd;
+    c->events = EPOLLIN;
+    c->next = server_conns;
+    if ( server_conns != NULL ) {
+      server_conns->prev = c;
+    }
+    server_conns = c;
+  }
+}
+
+/**
+    Tells if the socket at @addr was left behind by a server that is gone,
+    by trying to connect to it. A server still listening there keeps it.
+    @param addr The address of the socket
+    @return 1 if nothing listens on it, 0 if a server does or it can't be told
+*/
+static int is_stale( const struct sockaddr_un *addr ) {
+  int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( fd < 0 ) {
+    return 0;
+  }
+  int rc = connect( fd, ( const struct sockaddr * ) addr, sizeof( *addr ) );
+  int stale = rc != 0 && errno == ECONNREFUSED;
+  close( fd );
+  return stale;
+}
+
+/**
+    Serves verdicts from the policy to clients of a Unix domain socket at
+    @path until SIGINT or SIGTERM. One thread runs an epoll loop over
+    every connection, so thousands of clients cost a buffer each rather
+    than a thread each, and the packets of a request are tested together.
+    A socket at @path that no server listens on any more is replaced. A
+    live server's socket or any other file there is left alone and
+    serving does not start. The socket is removed when serving
+    stops.
+    @param path Where to create the socket
+    @return 0 once stopped, -1 if the socket could not be set up
+*/
+int server_run(const char *path) {
+  struct sockaddr_un addr;
+  if ( strlen( path ) >= sizeof( addr.sun_path ) ) {
+    return -1;
+  }
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sun_family = AF_UNIX;
+  strcpy( addr.sun_path, path );
+
+  // Each client holds a file descriptor, so allow as many as we may
+  struct rlimit lim;
+  if ( getrlimit( RLIMIT_NOFILE, &lim ) == 0 && lim.rlim_cur < lim.rlim_max ) {
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit( RLIMIT_NOFILE, &lim );
+  }
+
+  // Only a socket left behind by a server that is gone may be replaced
+  struct stat st;
+  if ( lstat( path, &st ) == 0 ) {
+    if ( !S_ISSOCK( st.st_mode ) || !is_stale( &addr ) || unlink( path ) != 0 ) {
+      return -1;
+    }
+  } else if ( errno != ENOENT ) {
+    return -1;
+  }
+
+  int listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( listener < 0 ) {
+    return -1;
+  }
+  if ( bind( listener, ( struct sockaddr * ) &addr, sizeof( addr ) ) != 0 ) {
+    close( listener );
+    return -1;
+  }
+  server_epoll = epoll_create1( 0 );
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if ( listen( listener, SERVER_BACKLOG ) != 0 || set_nonblocking( listener ) != 0 ||
+       server_epoll < 0 || epoll_ctl( server_epoll, EPOLL_CTL_ADD, listener, &ev ) != 0 ) {
+    if ( server_epoll >= 0 ) {
+      close( server_epoll );
+      server_epoll = -1;
+    }
+    close( listener );
+    unlink( path );
+    return -1;
+  }
+
+  struct sigaction sa;
+  memset( &sa, 0, sizeof( sa ) );
+  sa.sa_handler = on_signal;
+  sigemptyset( &sa.sa_mask );
+  struct sigaction old_int, old_term;
+  sigaction( SIGINT, &sa, &old_int );
+  sigaction( SIGTERM, &sa, &old_term );
+
+  int spare = open( "/dev/null", O_RDONLY );
+  fprintf( stdout, "Serving verdicts on %s\n", path );
+  fflush( stdout );
+
+  struct epoll_event events[ SERVER_EVENTS ];
+  server_stop = 0;
+  while ( !server_stop ) {
+    int n = epoll_wait( server_epoll, events, SERVER_EVENTS, -1 );
+    for ( int i = 0; i < n; i++ ) {
+      conn_t *c = events[ i ].data.ptr;
+      if ( c == NULL ) {
+        accept_all( listener, &spare );
+        continue;
+      }
+      int rc = 0;
+      if ( events[ i ].events & ( EPOLLERR | EPOLLHUP ) && !( events[ i ].events & EPOLLIN ) ) {
+        rc = -1;
+      }
+      if ( rc == 0 && events[ i ].events & EPOLLOUT ) {
+        rc = flush( c );
+      }
+      if ( rc == 0 && events[ i ].events & EPOLLIN ) {
+        rc = serve( c );
+      }
+      if ( rc == 0 && c->eof && c->out_off == c->out_len ) {
+        rc = -1;
+      }
+      if ( rc == 0 ) {
+        rc = watch( c );
+      }
+      if ( rc != 0 ) {
+        drop( c );
+      }
+    }
+  }
+
+  while ( server_conns != NULL ) {
+    drop( server_conns );
+  }
+  sigaction( SIGINT, &old_int, NULL );
+  sigaction( SIGTERM, &old_term, NULL );
+  if ( spare >= 0 ) {
+    close( spare );
+  }
+  close( server_epoll );
+  server_epoll = -1;
+  close( listener );
+  unlink( path );
+  return 0;
+}
@@ -0,0 +1,54 @@
+/**
+    @file server.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior and the wire format for serving verdicts over a Unix
+    domain socket. A client sends requests and gets one response for each,
+    in order, and may send more requests before the earlier ones are
+    answered. All numbers are little-endian.
+
+    Request: a 4-byte count, then that many packets of SERVER_PACKET_SIZE
+    bytes: the protocol (1 byte), the source address (4 bytes, a first),
+    the source port (2 bytes), the destination address and the
+    destination port.
+
+    Response: the same 4-byte count, then that many verdicts of
+    SERVER_VERDICT_SIZE bytes: the action (4 bytes) and the 1-based
+    position of the matching rule (4 bytes, -1 for the default policy).
+*/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+/** Most packets in one request, larger counts close the connection */
+#define SERVER_MAX_BATCH 4096
+
+/** Size of the count in front of a request or response */
+#define SERVER_HEADER_SIZE 4
+
+/** Size of one packet in a request */
+#define SERVER_PACKET_SIZE 13
+
+/** Size of one verdict in a response */
+#define SERVER_VERDICT_SIZE 8
+
+/** Connections waiting to be accepted */
+#define SERVER_BACKLOG 4096
+
+/** Bytes of responses a client may leave unread before it is not read */
+#define SERVER_OUT_LIMIT ( 1 << 20 )
+
+/**
+    Serves verdicts from the policy to clients of a Unix domain socket at
+    @path until SIGINT or SIGTERM. One thread runs an epoll loop over
+    every connection, so thousands of clients cost a buffer each rather
+    than a thread each, and the packets of a request are tested together.
+    A socket at @path that no server listens on any more is replaced. A
+    live server's socket or any other file there is left alone and
+    serving does not start. The socket is removed when serving
+    stops.
+    @param path Where to create the socket
+    @return 0 once stopped, -1 if the socket could not be set up
+*/
+int server_run(const char *path);
+
+#endif
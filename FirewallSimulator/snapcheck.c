@@ -0,0 +1,277 @@
+/**
+    @file snapcheck.c
+    @author Griffin Brookshire (glbrook2)
+    Checks that snapshots which were damaged but still carry a correct
+    checksum are refused rather than trusted. For every engine it saves
+    a policy, then breaks the counts each section depends on, recomputes
+    the checksum and expects snapshot_map to reject the file. It then
+    flips random bytes the same way and tests traffic against whatever
+    policy_load accepts, which must never crash.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "packet.h"
+#include "policy.h"
+#include "snapshot.h"
+#include "gen.h"
+
+/** Rules in every saved policy */
+#define SNAPCHECK_RULES 300
+
+/** Packets tested against every loaded policy */
+#define SNAPCHECK_PACKETS 200
+
+/** Random corruptions tried per engine */
+#define SNAPCHECK_FLIPS 500
+
+/** Where the damaged snapshot is written */
+#define SNAPCHECK_FILE "snapcheck.snap"
+
+/** Section kinds, as numbered in snapshot.c */
+#define KIND_TREE_NODES    2
+#define KIND_TUPLE_TABLE   5
+#define KIND_BITVEC_VALUES 6
+#define KIND_SCAN_COLUMN   9
+
+/**
+    Computes the snapshot checksum, the same way snapshot.c does.
+    @param p The bytes to checksum
+    @param n The number of bytes, a multiple of 32
+    @return The checksum
+*/
+static uint64_t checksum( const unsigned char *p, size_t n ) {
+  const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+  const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+  uint64_t lane[ 4 ] = { prime1, prime2, 0, ( uint64_t ) 0 - prime1 };
+  for ( size_t i = 0; i < n; i += 32 ) {
+    for ( int l = 0; l < 4; l++ ) {
+      uint64_t w;
+      memcpy( &w, p + i + 8 * l, sizeof( w ) );
+      lane[ l ] += w * prime2;
+      lane[ l ] = ( lane[ l ] << 31 ) | ( lane[ l ] >> 33 );
+      lane[ l ] *= prime1;
+    }
+  }
+  uint64_t h = n;
+  for ( int l = 0; l < 4; l++ ) {
+    h = ( h ^ lane[ l ] ) * prime1;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+/**
+    Reads the whole of @filename.
+    @param filename The file to read
+    @param size Set to the number of bytes read
+    @return The bytes, NULL if the file can't be read
+*/
+static unsigned char *read_file( const char *filename, size_t *size ) {
+  FILE *fp = fopen( filename, "rb" );
+  if ( fp == NULL ) {
+    return NULL;
+  }
+  fseek( fp, 0, SEEK_END );
+  long len = ftell( fp );
+  fseek( fp, 0, SEEK_SET );
+  unsigned char *buf = malloc( len );
+  if ( buf != NULL && fread( buf, 1, len, fp ) != ( size_t ) len ) {
+    free( buf );
+    buf = NULL;
+  }
+  fclose( fp );
+  *size = len;
+  return buf;
+}
+
+/**
+    Writes @buf to SNAPCHECK_FILE with its checksum recomputed. The file
+    is replaced rather than rewritten, since the last policy loaded may
+    still map it.
+    @param buf The snapshot bytes
+    @param size The number of bytes
+    @return 0 if success, -1 if fail
+*/
+static int write_snapshot( unsigned char *buf, size_t size ) {
+  snapshot_header_t *hdr = ( snapshot_header_t * ) buf;
+  hdr->checksum = checksum( buf + sizeof( *hdr ), size - sizeof( *hdr ) );
+  FILE *fp = fopen( SNAPCHECK_FILE ".tmp", "wb" );
+  if ( fp == NULL ) {
+    return -1;
+  }
+  int rc = fwrite( buf, 1, size, fp ) == size ? 0 : -1;
+  if ( fclose( fp ) != 0 || rc != 0 ) {
+    return -1;
+  }
+  return rename( SNAPCHECK_FILE ".tmp", SNAPCHECK_FILE );
+}
+
+/**
+    Writes @buf and expects snapshot_map to refuse it.
+    @param buf The damaged snapshot
+    @param size The number of bytes
+    @param what What was damaged, for the report
+    @return 1 if the file was refused, 0 if not
+*/
+static int expect_refused( unsigned char *buf, size_t size, const char *what ) {
+  snapshot_t snap;
+  if ( write_snapshot( buf, size ) != 0 ) {
+    printf( "Error: Can't write %s\n", SNAPCHECK_FILE );
+    return 0;
+  }
+  int rc = snapshot_map( SNAPCHECK_FILE, &snap );
+  if ( rc == 0 ) {
+    snapshot_unmap( &snap );
+  }
+  if ( rc != -2 ) {
+    printf( "FAIL: %s gave %d, not -2\n", what, rc );
+    return 0;
+  }
+  return 1;
+}
+
+/**
+    Damages every count @kind sections carry in @aux_used, one at a time,
+    and expects each copy to be refused.
+    @param orig The saved snapshot
+    @param size The number of bytes
+    @param kind The section kind to damage
+    @param aux_used Bit i set if aux[i] is read for this kind
+    @param name The engine, for the report
+    @return The number of damaged copies that were not refused
+*/
+static int damage_counts( const unsigned char *orig, size_t size, uint32_t kind,
+                          int aux_used, const char *name ) {
+  const int32_t bad[] = { 50000000, 0x7FFFFFFF, INT32_MIN };
+  const snapshot_header_t *hdr = ( const snapshot_header_t * ) orig;
+  unsigned char *buf = malloc( size );
+  int failed = 0;
+  int found = 0;
+  for ( uint32_t i = 1; i < hdr->nsections; i++ ) {
+    size_t at = sizeof( *hdr ) + i * sizeof( snapshot_section_t );
+    if ( ( ( const snapshot_section_t * ) ( orig + at ) )->kind != kind ) {
+      continue;
+    }
+    found = 1;
+    for ( int a = 0; a < 4; a++ ) {
+      if ( !( aux_used & ( 1 << a ) ) ) {
+        continue;
+      }
+      for ( int b = 0; b < ( int ) ( sizeof( bad ) / sizeof( bad[ 0 ] ) ); b++ ) {
+        char what[ 64 ];
+        memcpy( buf, orig, size );
+        ( ( snapshot_section_t * ) ( buf + at ) )->aux[ a ] = bad[ b ];
+        snprintf( what, sizeof( what ), "%s section %u aux[%d]=%d", name, i, a, bad[ b ] );
+        failed += !expect_refused( buf, size, what );
+      }
+    }
+  }
+  if ( !found ) {
+    printf( "FAIL: %s snapshot has no section of kind %u\n", name, kind );
+    failed++;
+  }
+
+  // Losing the first engine section leaves the engine without one of its arrays
+  memcpy( buf, orig, size );
+  unsigned char *first = buf + sizeof( *hdr ) + sizeof( snapshot_section_t );
+  memmove( first, first + sizeof( snapshot_section_t ),
+           ( hdr->nsections - 2 ) * sizeof( snapshot_section_t ) );
+  ( ( snapshot_header_t * ) buf )->nsections--;
+  failed += !expect_refused( buf, size, "missing section" );
+
+  // A rule the engines were never built for
+  memcpy( buf, orig, size );
+  const snapshot_section_t *rules = ( const snapshot_section_t * ) ( orig + sizeof( *hdr ) );
+  ( ( rule_t * ) ( buf + rules->offset ) )->match.src_port = 70000;
+  failed += !expect_refused( buf, size, "rule port" );
+  free( buf );
+  return failed;
+}
+
+/**
+    Flips random bytes past the header, recomputes the checksum and tests
+    packets against the policy whenever it loads.
+    @param orig The saved snapshot
+    @param size The number of bytes
+    @param pkts The packets to test
+    @param seed The random state
+    @return The number of damaged copies that loaded
+*/
+static int flip_bytes( const unsigned char *orig, size_t size, const packet_t *pkts,
+                       unsigned int *seed ) {
+  unsigned char *buf = malloc( size );
+  size_t body = size - sizeof( snapshot_header_t );
+  int loaded = 0;
+  for ( int i = 0; i < SNAPCHECK_FLIPS; i++ ) {
+    memcpy( buf, orig, size );
+    int flips = 1 + rand_r( seed ) % 4;
+    for ( int f = 0; f < flips; f++ ) {
+      buf[ sizeof( snapshot_header_t ) + rand_r( seed ) % body ] ^= 1 << ( rand_r( seed ) % 8 );
+    }
+    if ( write_snapshot( buf, size ) != 0 || policy_load( SNAPCHECK_FILE ) != 0 ) {
+      continue;
+    }
+    loaded++;
+    for ( int p = 0; p < SNAPCHECK_PACKETS; p++ ) {
+      int pos;
+      policy_test( pkts[ p ], &pos );
+    }
+  }
+  free( buf );
+  return loaded;
+}
+
+/**
+    Program starting point.
+    @return program exit status
+*/
+int main() {
+  const char *names[] = { "tree", "tuple", "bitvec", "scan" };
+  const int engines[] = { ENGINE_TREE, ENGINE_TUPLE, ENGINE_BITVEC, ENGINE_SCAN };
+  const uint32_t kinds[] = { KIND_TREE_NODES, KIND_TUPLE_TABLE, KIND_BITVEC_VALUES,
+                             KIND_SCAN_COLUMN };
+  const int aux_used[] = { 0x1, 0xF, 0x7, 0x1 };
+  gen_params_t params = { SNAPCHECK_RULES, 0.3, 0.5, 0.8, 1 };
+  rule_t rules[ SNAPCHECK_RULES ];
+  packet_t pkts[ SNAPCHECK_PACKETS ];
+  unsigned int seed = 1;
+  int failed = 0;
+
+  if ( gen_rules( &params, rules ) != 0 ) {
+    printf( "Error: Out of memory\n" );
+    return EXIT_FAILURE;
+  }
+  gen_packets( &params, rules, pkts, SNAPCHECK_PACKETS );
+
+  for ( int e = 0; e < 4; e++ ) {
+    size_t size;
+    policy_init();
+    for ( int i = 0; i < SNAPCHECK_RULES; i++ ) {
+      policy_append( rules[ i ] );
+    }
+    if ( policy_set_engine( engines[ e ] ) != 0 || policy_compile() != 0 ||
+         policy_save( SNAPCHECK_FILE ) != 0 ) {
+      printf( "Error: Can't save the %s policy\n", names[ e ] );
+      return EXIT_FAILURE;
+    }
+    unsigned char *orig = read_file( SNAPCHECK_FILE, &size );
+    if ( orig == NULL ) {
+      printf( "Error: Can't read %s\n", SNAPCHECK_FILE );
+      return EXIT_FAILURE;
+    }
+    int bad = damage_counts( orig, size, kinds[ e ], aux_used[ e ], names[ e ] );
+    int loaded = flip_bytes( orig, size, pkts, &seed );
+    printf( "%s: %d damaged counts let through, %d of %d random flips loaded\n",
+            names[ e ], bad, loaded, SNAPCHECK_FLIPS );
+    failed += bad;
+    free( orig );
+    policy_free();
+  }
+  remove( SNAPCHECK_FILE );
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
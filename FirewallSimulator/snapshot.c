@@ -0,0 +1,645 @@
+/**
+    @file snapshot.c
+    @author Griffin Brookshire (glbrook2)
+    Saves the policy and its compiled engine as one flat file that can be
+    mapped straight back into memory. Every engine already keeps its data
+    in arrays linked by index rather than by pointer, so each array is
+    written as-is and loading only has to point the structures at it.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+
+/** The rules in policy order */
+#define SECTION_RULES        1
+
+/** Decision tree nodes, aux[ 0 ] is the root */
+#define SECTION_TREE_NODES   2
+
+/** Decision tree child slots */
+#define SECTION_TREE_KIDS    3
+
+/** Decision tree leaf rule lists */
+#define SECTION_TREE_LEAVES  4
+
+/** One tuple table, aux is shape, mask, count and min_prio */
+#define SECTION_TUPLE_TABLE  5
+
+/** Bit-vector field values, aux is nvalues, len and nwords */
+#define SECTION_BITVEC_VALUES 6
+
+/** Bit-vector field bitsets */
+#define SECTION_BITVEC_SETS  7
+
+/** Bit-vector field wildcard bitset */
+#define SECTION_BITVEC_WILD  8
+
+/** One scan column, index is the column, aux[ 0 ] is the length */
+#define SECTION_SCAN_COLUMN  9
+
+/** Most sections a snapshot can hold */
+#define SNAPSHOT_MAX_SECTIONS ( 4 + TUPLE_SHAPES + 3 * BITVEC_FIELDS + 6 )
+
+/** Sizes of the structures stored raw, packed into the header */
+#define SNAPSHOT_LAYOUT ( ( uint32_t ) sizeof( rule_t ) | \
+                          ( uint32_t ) sizeof( tree_node_t ) << 8 | \
+                          ( uint32_t ) sizeof( tuple_entry_t ) << 16 )
+
+/**
+ * A section waiting to be written.
+ * .sec: its record in the section table
+ * .data: the bytes to write
+ */
+typedef struct pending {
+    snapshot_section_t  sec;
+    const void          *data;
+} pending_t;
+
+/**
+    Rounds @n up to a multiple of SNAPSHOT_ALIGN.
+    @param n The size to round
+    @return The rounded size
+*/
+static uint64_t align_up( uint64_t n ) {
+  return ( n + SNAPSHOT_ALIGN - 1 ) & ~( uint64_t ) ( SNAPSHOT_ALIGN - 1 );
+}
+
+/**
+    Checksums @n bytes, eight at a time in four independent lanes so the
+    multiplies overlap. @n must be a multiple of SNAPSHOT_ALIGN.
+    @param p The bytes to checksum
+    @param n The number of bytes
+    @return The checksum
+*/
+static uint64_t checksum( const unsigned char *p, size_t n ) {
+  const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+  const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+  uint64_t lane[ 4 ] = { prime1, prime2, 0, ( uint64_t ) 0 - prime1 };
+  for ( size_t i = 0; i < n; i += 32 ) {
+    for ( int l = 0; l < 4; l++ ) {
+      uint64_t w;
+      memcpy( &w, p + i + 8 * l, sizeof( w ) );
+      lane[ l ] += w * prime2;
+      lane[ l ] = ( lane[ l ] << 31 ) | ( lane[ l ] >> 33 );
+      lane[ l ] *= prime1;
+    }
+  }
+  uint64_t h = n;
+  for ( int l = 0; l < 4; l++ ) {
+    h = ( h ^ lane[ l ] ) * prime1;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+/**
+    Queues an array to be written as a section.
+    @param list The queued sections
+    @param n The number queued so far, incremented
+    @param kind One of the SECTION_ values
+    @param index The table, field or column the array belongs to
+    @param data The array
+    @param bytes The size of the array
+    @return The queued section, so the caller can fill in aux
+*/
+static snapshot_section_t *add( pending_t *list, int *n, int kind, int index,
+                                const void *data, size_t bytes ) {
+  pending_t *p = &list[ ( *n )++ ];
+  memset( &p->sec, 0, sizeof( p->sec ) );
+  p->sec.kind = kind;
+  p->sec.index = index;
+  p->sec.bytes = bytes;
+  p->data = data;
+  return &p->sec;
+}
+
+/**
+    Writes @snap to @filename, replacing it only once the whole file
+    has been written.
+    @param filename The file to write
+    @param snap The policy and compiled engine to save
+    @return 0 if success, -1 if fail
+*/
+int snapshot_save(const char *filename, const snapshot_t *snap) {
+  pending_t list[ SNAPSHOT_MAX_SECTIONS ];
+  int n = 0;
+  add( list, &n, SECTION_RULES, 0, snap->rules, snap->len * sizeof( rule_t ) );
+  if ( snap->tree != NULL ) {
+    const tree_t *t = snap->tree;
+    add( list, &n, SECTION_TREE_NODES, 0, t->nodes,
+         t->nodes_len * sizeof( tree_node_t ) )->aux[ 0 ] = t->root;
+    add( list, &n, SECTION_TREE_KIDS, 0, t->kids, t->kids_len * sizeof( int ) );
+    add( list, &n, SECTION_TREE_LEAVES, 0, t->leaf_rules, t->leaf_len * sizeof( int ) );
+  } else if ( snap->tuple != NULL ) {
+    for ( int i = 0; i < snap->tuple->ntables; i++ ) {
+      const tuple_table_t *tt = &snap->tuple->tables[ i ];
+      snapshot_section_t *sec = add( list, &n, SECTION_TUPLE_TABLE, i, tt->entries,
+                                     ( ( size_t ) tt->mask + 1 ) * sizeof( tuple_entry_t ) );
+      sec->aux[ 0 ] = tt->shape;
+      sec->aux[ 1 ] = ( int32_t ) tt->mask;
+      sec->aux[ 2 ] = tt->count;
+      sec->aux[ 3 ] = ( int32_t ) tt->min_prio;
+    }
+  } else if ( snap->bitvec != NULL ) {
+    const bitvec_t *bv = snap->bitvec;
+    size_t words = bv->nwords;
+    for ( int f = 0; f < BITVEC_FIELDS; f++ ) {
+      const bitvec_field_t *field = &bv->fields[ f ];
+      snapshot_section_t *sec = add( list, &n, SECTION_BITVEC_VALUES, f, field->values,
+                                     field->nvalues * sizeof( uint32_t ) );
+      sec->aux[ 0 ] = field->nvalues;
+      sec->aux[ 1 ] = bv->len;
+      sec->aux[ 2 ] = bv->nwords;
+      add( list, &n, SECTION_BITVEC_SETS, f, field->sets,
+           field->nvalues * words * sizeof( uint64_t ) );
+      add( list, &n, SECTION_BITVEC_WILD, f, field->wild, words * sizeof( uint64_t ) );
+    }
+  } else if ( snap->scan != NULL ) {
+    const scan_t *sc = snap->scan;
+    size_t len = sc->len;
+    add( list, &n, SECTION_SCAN_COLUMN, 0, sc->src_ip, len * sizeof( uint32_t ) );
+    add( list, &n, SECTION_SCAN_COLUMN, 1, sc->dst_ip, len * sizeof( uint32_t ) );
+    add( list, &n, SECTION_SCAN_COLUMN, 2, sc->ports, len * sizeof( uint32_t ) );
+    add( list, &n, SECTION_SCAN_COLUMN, 3, sc->port_mask, len * sizeof( uint32_t ) );
+    add( list, &n, SECTION_SCAN_COLUMN, 4, sc->protocol, len + sizeof( uint64_t ) );
+    add( list, &n, SECTION_SCAN_COLUMN, 5, sc->action, len );
+    for ( int i = n - 6; i < n; i++ ) {
+      list[ i ].sec.aux[ 0 ] = sc->len;
+    }
+  }
+
+  // Lay the sections out after the header and section table
+  uint64_t off = align_up( sizeof( snapshot_header_t ) + n * sizeof( snapshot_section_t ) );
+  for ( int i = 0; i < n; i++ ) {
+    list[ i ].sec.offset = off;
+    off = align_up( off + list[ i ].sec.bytes );
+  }
+  unsigned char *buf = calloc( 1, off );
+  if ( buf == NULL ) {
+    return -1;
+  }
+  snapshot_header_t *hdr = ( snapshot_header_t * ) buf;
+  memcpy( hdr->magic, SNAPSHOT_MAGIC, sizeof( hdr->magic ) );
+  hdr->version = SNAPSHOT_VERSION;
+  hdr->byte_order = SNAPSHOT_BYTE_ORDER;
+  hdr->layout = SNAPSHOT_LAYOUT;
+  hdr->nsections = n;
+  hdr->count = snap->len;
+  hdr->default_action = snap->default_action;
+  hdr->engine = snap->engine;
+  hdr->file_size = off;
+  snapshot_section_t *table = ( snapshot_section_t * ) ( buf + sizeof( snapshot_header_t ) );
+  for ( int i = 0; i < n; i++ ) {
+    table[ i ] = list[ i ].sec;
+    if ( list[ i ].sec.bytes > 0 ) {
+      memcpy( buf + list[ i ].sec.offset, list[ i ].data, list[ i ].sec.bytes );
+    }
+  }
+  hdr->checksum = checksum( buf + sizeof( snapshot_header_t ), off - sizeof( snapshot_header_t ) );
+
+  // Write beside the target and rename, so a crash never leaves half a file
+  size_t name_len = strlen( filename );
+  char *tmp = malloc( name_len + 5 );
+  if ( tmp == NULL ) {
+    free( buf );
+    return -1;
+  }
+  memcpy( tmp, filename, name_len );
+  memcpy( tmp + name_len, ".tmp", 5 );
+  FILE *file = fopen( tmp, "wb" );
+  int ok = file != NULL && fwrite( buf, 1, off, file ) == off;
+  if ( file != NULL && fclose( file ) != 0 ) {
+    ok = 0;
+  }
+  if ( ok && rename( tmp, filename ) != 0 ) {
+    ok = 0;
+  }
+  if ( !ok ) {
+    remove( tmp );
+  }
+  free( tmp );
+  free( buf );
+  return ok ? 0 : -1;
+}
+
+/**
+    Points the compiled engine of @snap at the arrays in its mapping.
+    Only the small structures holding the array pointers are allocated.
+    @param snap The snapshot being mapped
+    @param base The start of the mapping
+    @param table The section table
+    @param n The number of sections
+    @return 0 if success, -1 if memory ran out, -2 if a section is of no
+            known kind or index
+*/
+static int attach_engine( snapshot_t *snap, unsigned char *base,
+                          const snapshot_section_t *table, int n ) {
+  for ( int i = 0; i < n; i++ ) {
+    const snapshot_section_t *sec = &table[ i ];
+    void *data = base + sec->offset;
+    if ( sec->kind == SECTION_TREE_NODES || sec->kind == SECTION_TREE_KIDS ||
+         sec->kind == SECTION_TREE_LEAVES ) {
+      if ( snap->tree == NULL && ( snap->tree = calloc( 1, sizeof( tree_t ) ) ) == NULL ) {
+        return -1;
+      }
+      if ( sec->index != 0 ) {
+        return -2;
+      }
+      tree_t *t = snap->tree;
+      t->rules = snap->rules;
+      t->len = snap->len;
+      if ( sec->kind == SECTION_TREE_NODES ) {
+        t->nodes = data;
+        t->nodes_len = t->nodes_cap = sec->bytes / sizeof( tree_node_t );
+        t->root = sec->aux[ 0 ];
+      } else if ( sec->kind == SECTION_TREE_KIDS ) {
+        t->kids = data;
+        t->kids_len = t->kids_cap = sec->bytes / sizeof( int );
+      } else {
+        t->leaf_rules = data;
+        t->leaf_len = t->leaf_cap = sec->bytes / sizeof( int );
+      }
+    } else if ( sec->kind == SECTION_TUPLE_TABLE ) {
+      if ( snap->tuple == NULL && ( snap->tuple = calloc( 1, sizeof( tuple_t ) ) ) == NULL ) {
+        return -1;
+      }
+      if ( sec->index >= TUPLE_SHAPES ) {
+        return -2;
+      }
+      tuple_table_t *tt = &snap->tuple->tables[ sec->index ];
+      tt->entries = data;
+      tt->shape = sec->aux[ 0 ];
+      tt->mask = ( uint32_t ) sec->aux[ 1 ];
+      tt->count = sec->aux[ 2 ];
+      tt->min_prio = ( uint32_t ) sec->aux[ 3 ];
+      if ( ( int ) sec->index >= snap->tuple->ntables ) {
+        snap->tuple->ntables = sec->index + 1;
+      }
+    } else if ( sec->kind >= SECTION_BITVEC_VALUES && sec->kind <= SECTION_BITVEC_WILD ) {
+      if ( snap->bitvec == NULL && ( snap->bitvec = calloc( 1, sizeof( bitvec_t ) ) ) == NULL ) {
+        return -1;
+      }
+      if ( sec->index >= BITVEC_FIELDS ) {
+        return -2;
+      }
+      bitvec_field_t *field = &snap->bitvec->fields[ sec->index ];
+      if ( sec->kind == SECTION_BITVEC_VALUES ) {
+        field->values = data;
+        field->nvalues = sec->aux[ 0 ];
+        snap->bitvec->len = sec->aux[ 1 ];
+        snap->bitvec->nwords = sec->aux[ 2 ];
+      } else if ( sec->kind == SECTION_BITVEC_SETS ) {
+        field->sets = data;
+      } else {
+        field->wild = data;
+      }
+    } else if ( sec->kind == SECTION_SCAN_COLUMN ) {
+      if ( snap->scan == NULL && ( snap->scan = calloc( 1, sizeof( scan_t ) ) ) == NULL ) {
+        return -1;
+      }
+      scan_t *sc = snap->scan;
+      if ( sec->index > 5 ) {
+        return -2;
+      }
+      sc->len = sec->aux[ 0 ];
+      if ( sec->index == 0 ) {
+        sc->src_ip = data;
+      } else if ( sec->index == 1 ) {
+        sc->dst_ip = data;
+      } else if ( sec->index == 2 ) {
+        sc->ports = data;
+      } else if ( sec->index == 3 ) {
+        sc->port_mask = data;
+      } else if ( sec->index == 4 ) {
+        sc->protocol = data;
+      } else if ( sec->index == 5 ) {
+        sc->action = data;
+      }
+    } else {
+      return -2;
+    }
+  }
+  return 0;
+}
+
+/**
+    Checks that every rule and the default action hold values the engines
+    and the report can take.
+    @param snap The snapshot being mapped
+    @return 1 if valid, 0 if not
+*/
+static int check_rules( const snapshot_t *snap ) {
+  if ( snap->default_action != ACTION_ALLOW && snap->default_action != ACTION_DENY ) {
+    return 0;
+  }
+  for ( int i = 0; i < snap->len; i++ ) {
+    const rule_t *r = &snap->rules[ i ];
+    if ( ( r->action != ACTION_ALLOW && r->action != ACTION_DENY ) ||
+         ( r->match.protocol != PROTO_TCP && r->match.protocol != PROTO_UDP ) ||
+         r->match.src_port < MATCH_PORT_ANY || r->match.src_port > PORT_MAX ||
+         r->match.dst_port < MATCH_PORT_ANY || r->match.dst_port > PORT_MAX ) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+    Checks the size of every engine section against the counts the
+    structures were given, and that no section appears twice. The
+    checksum only catches accidents, so nothing in the file is trusted.
+    @param snap The snapshot being mapped, with its engine attached
+    @param table The engine sections
+    @param n The number of sections
+    @return 1 if valid, 0 if not
+*/
+static int check_sections( const snapshot_t *snap, const snapshot_section_t *table, int n ) {
+  uint32_t seen[ SECTION_SCAN_COLUMN + 1 ] = { 0 };
+  uint64_t len = snap->len;
+  for ( int i = 0; i < n; i++ ) {
+    const snapshot_section_t *sec = &table[ i ];
+    uint64_t expect;
+    if ( seen[ sec->kind ] & ( 1u << sec->index ) ) {
+      return 0;
+    }
+    seen[ sec->kind ] |= 1u << sec->index;
+    if ( sec->kind == SECTION_TREE_NODES || sec->kind == SECTION_TREE_KIDS ||
+         sec->kind == SECTION_TREE_LEAVES ) {
+      size_t size = sec->kind == SECTION_TREE_NODES ? sizeof( tree_node_t ) : sizeof( int );
+      if ( sec->bytes % size != 0 || sec->bytes / size > INT_MAX ) {
+        return 0;
+      }
+      continue;
+    } else if ( sec->kind == SECTION_TUPLE_TABLE ) {
+      uint32_t mask = ( uint32_t ) sec->aux[ 1 ];
+      if ( ( mask & ( mask + 1 ) ) != 0 || mask >= ( 1u << 30 ) ) {
+        return 0;
+      }
+      expect = ( ( uint64_t ) mask + 1 ) * sizeof( tuple_entry_t );
+    } else if ( sec->kind == SECTION_BITVEC_VALUES ) {
+      if ( sec->aux[ 0 ] < 0 || ( uint64_t ) sec->aux[ 1 ] != len ||
+           ( uint64_t ) sec->aux[ 2 ] != ( len + 63 ) / 64 ) {
+        return 0;
+      }
+      expect = ( uint64_t ) sec->aux[ 0 ] * sizeof( uint32_t );
+    } else if ( sec->kind == SECTION_BITVEC_SETS || sec->kind == SECTION_BITVEC_WILD ) {
+      // Every values section pins nwords, but it may come after this one
+      int nvalues = snap->bitvec->fields[ sec->index ].nvalues;
+      if ( nvalues < 0 || ( uint64_t ) snap->bitvec->nwords != ( len + 63 ) / 64 ) {
+        return 0;
+      }
+      expect = ( uint64_t ) snap->bitvec->nwords * sizeof( uint64_t );
+      if ( sec->kind == SECTION_BITVEC_SETS ) {
+        expect *= ( uint64_t ) nvalues;
+      }
+    } else {
+      if ( ( uint64_t ) sec->aux[ 0 ] != len ) {
+        return 0;
+      }
+      expect = sec->index < 4 ? len * sizeof( uint32_t ) :
+               sec->index == 4 ? len + sizeof( uint64_t ) : len;
+    }
+    if ( sec->bytes != expect ) {
+      return 0;
+    }
+  }
+
+  // An engine is either missing, and rebuilt on the next test, or whole
+  int engines = ( snap->tree != NULL ) + ( snap->tuple != NULL ) + ( snap->bitvec != NULL ) +
+                ( snap->scan != NULL );
+  if ( engines > 1 ) {
+    return 0;
+  }
+  if ( snap->tree != NULL ) {
+    return snap->engine == ENGINE_TREE && seen[ SECTION_TREE_NODES ] &&
+           seen[ SECTION_TREE_KIDS ] && seen[ SECTION_TREE_LEAVES ];
+  } else if ( snap->tuple != NULL ) {
+    return snap->engine == ENGINE_TUPLE &&
+           seen[ SECTION_TUPLE_TABLE ] == ( 1u << snap->tuple->ntables ) - 1;
+  } else if ( snap->bitvec != NULL ) {
+    uint32_t all = ( 1u << BITVEC_FIELDS ) - 1;
+    return snap->engine == ENGINE_BITVEC && seen[ SECTION_BITVEC_VALUES ] == all &&
+           seen[ SECTION_BITVEC_SETS ] == all && seen[ SECTION_BITVEC_WILD ] == all;
+  } else if ( snap->scan != NULL ) {
+    return snap->engine == ENGINE_SCAN && seen[ SECTION_SCAN_COLUMN ] == ( 1u << 6 ) - 1;
+  }
+  return 1;
+}
+
+/**
+    Checks that every index in the tree stays inside its arrays. Children
+    always come after their parent, which also rules out cycles.
+    @param t The tree
+    @return 1 if valid, 0 if not
+*/
+static int check_tree( const tree_t *t ) {
+  if ( t->root < -1 || t->root >= t->nodes_len ) {
+    return 0;
+  }
+  for ( int i = 0; i < t->leaf_len; i++ ) {
+    if ( t->leaf_rules[ i ] < 0 || t->leaf_rules[ i ] >= t->len ) {
+      return 0;
+    }
+  }
+  for ( int n = 0; n < t->nodes_len; n++ ) {
+    const tree_node_t *node = &t->nodes[ n ];
+    if ( node->first < 0 ) {
+      return 0;
+    }
+    if ( node->dim < 0 ) {
+      if ( node->dim != -1 || node->count < 0 ||
+           ( int64_t ) node->first + node->count > t->leaf_len ) {
+        return 0;
+      }
+      continue;
+    }
+    if ( node->dim >= TREE_DIMS || node->shift < 0 || node->shift > 31 ||
+         ( int64_t ) node->first + node->mask >= t->kids_len ) {
+      return 0;
+    }
+    for ( uint32_t c = 0; c <= node->mask; c++ ) {
+      int kid = t->kids[ node->first + c ];
+      if ( kid != -1 && ( kid <= n || kid >= t->nodes_len ) ) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/**
+    Checks every tuple table: each keeps an empty slot so probes end,
+    its counts match its entries, and each priority names a rule.
+    @param ts The tuple space
+    @param len The number of rules
+    @return 1 if valid, 0 if not
+*/
+static int check_tuple( const tuple_t *ts, int len ) {
+  for ( int i = 0; i < ts->ntables; i++ ) {
+    const tuple_table_t *tt = &ts->tables[ i ];
+    if ( tt->shape < 0 || tt->shape >= TUPLE_SHAPES ) {
+      return 0;
+    }
+    uint32_t used = 0;
+    uint32_t min_prio = TUPLE_EMPTY;
+    for ( uint32_t s = 0; s <= tt->mask; s++ ) {
+      uint32_t prio = tt->entries[ s ].prio;
+      if ( prio == TUPLE_EMPTY ) {
+        continue;
+      }
+      if ( prio >= ( uint32_t ) len ) {
+        return 0;
+      }
+      used++;
+      if ( prio < min_prio ) {
+        min_prio = prio;
+      }
+    }
+    if ( used > tt->mask || used != ( uint32_t ) tt->count || min_prio != tt->min_prio ) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+    Checks that no bitset has a bit past the last rule, since the first
+    common bit is taken as a rule index.
+    @param bv The classifier
+    @return 1 if valid, 0 if not
+*/
+static int check_bitvec( const bitvec_t *bv ) {
+  if ( bv->len % 64 == 0 ) {
+    return 1;
+  }
+  uint64_t spare = ~( ( ( uint64_t ) 1 << ( bv->len % 64 ) ) - 1 );
+  int last = bv->nwords - 1;
+  for ( int f = 0; f < BITVEC_FIELDS; f++ ) {
+    const bitvec_field_t *field = &bv->fields[ f ];
+    if ( field->wild[ last ] & spare ) {
+      return 0;
+    }
+    for ( int v = 0; v < field->nvalues; v++ ) {
+      if ( field->sets[ ( size_t ) v * bv->nwords + last ] & spare ) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/**
+    Checks the attached engine, once its sections are known to be whole.
+    @param snap The snapshot being mapped
+    @return 1 if valid, 0 if not
+*/
+static int check_engine( const snapshot_t *snap ) {
+  if ( snap->tree != NULL ) {
+    return check_tree( snap->tree );
+  } else if ( snap->tuple != NULL ) {
+    return check_tuple( snap->tuple, snap->len );
+  } else if ( snap->bitvec != NULL ) {
+    return check_bitvec( snap->bitvec );
+  }
+  return 1;
+}
+
+/**
+    Maps @filename read-only and checks its header and checksum, then
+    every rule and every count and index the compiled engine holds, so
+    a damaged file is refused even when its checksum was recomputed.
+    On success @snap points into the mapping, nothing is copied.
+    @param filename The file to map
+    @param snap Filled with the mapped policy
+    @return 0 if success, -1 if the file can't be read, -2 if it is
+            not a valid snapshot for this build
+*/
+int snapshot_map(const char *filename, snapshot_t *snap) {
+  memset( snap, 0, sizeof( snapshot_t ) );
+  int fd = open( filename, O_RDONLY );
+  if ( fd < 0 ) {
+    return -1;
+  }
+  struct stat st;
+  if ( fstat( fd, &st ) != 0 ) {
+    close( fd );
+    return -1;
+  }
+  size_t size = st.st_size;
+  if ( size < sizeof( snapshot_header_t ) || size % SNAPSHOT_ALIGN != 0 ) {
+    close( fd );
+    return -2;
+  }
+  unsigned char *base = mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if ( base == MAP_FAILED ) {
+    return -1;
+  }
+  snap->map = base;
+  snap->size = size;
+
+  const snapshot_header_t *hdr = ( const snapshot_header_t * ) base;
+  const snapshot_section_t *table = ( const snapshot_section_t * ) ( base + sizeof( *hdr ) );
+  if ( memcmp( hdr->magic, SNAPSHOT_MAGIC, sizeof( hdr->magic ) ) != 0 ||
+       hdr->version != SNAPSHOT_VERSION || hdr->byte_order != SNAPSHOT_BYTE_ORDER ||
+       hdr->layout != SNAPSHOT_LAYOUT || hdr->file_size != size ||
+       hdr->nsections > SNAPSHOT_MAX_SECTIONS ||
+       sizeof( *hdr ) + hdr->nsections * sizeof( snapshot_section_t ) > size ||
+       checksum( base + sizeof( *hdr ), size - sizeof( *hdr ) ) != hdr->checksum ) {
+    snapshot_unmap( snap );
+    return -2;
+  }
+  int n = hdr->nsections;
+  for ( int i = 0; i < n; i++ ) {
+    if ( table[ i ].offset % SNAPSHOT_ALIGN != 0 || table[ i ].offset > size ||
+         table[ i ].bytes > size - table[ i ].offset ) {
+      snapshot_unmap( snap );
+      return -2;
+    }
+  }
+  if ( n < 1 || table[ 0 ].kind != SECTION_RULES ||
+       table[ 0 ].bytes != ( uint64_t ) hdr->count * sizeof( rule_t ) ) {
+    snapshot_unmap( snap );
+    return -2;
+  }
+  snap->rules = ( rule_t * ) ( base + table[ 0 ].offset );
+  snap->len = hdr->count;
+  snap->default_action = hdr->default_action;
+  snap->engine = hdr->engine;
+  int rc = attach_engine( snap, base, table + 1, n - 1 );
+  if ( rc == 0 && ( !check_rules( snap ) || !check_sections( snap, table + 1, n - 1 ) ||
+                    !check_engine( snap ) ) ) {
+    rc = -2;
+  }
+  if ( rc != 0 ) {
+    snapshot_unmap( snap );
+    return rc;
+  }
+  posix_madvise( base, size, POSIX_MADV_WILLNEED );
+  return 0;
+}
+
+/**
+    Releases a snapshot filled by snapshot_map.
+    @param snap The snapshot to release
+*/
+void snapshot_unmap(snapshot_t *snap) {
+  free( snap->tree );
+  free( snap->tuple );
+  free( snap->bitvec );
+  free( snap->scan );
+  if ( snap->map != NULL ) {
+    munmap( snap->map, snap->size );
+  }
+  memset( snap, 0, sizeof( snapshot_t ) );
+}
@@ -0,0 +1,117 @@
+/**
+    @file snapshot.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior and data for binary policy snapshots.
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "policy.h"
+#include "tree.h"
+#include "tuple.h"
+#include "bitvec.h"
+#include "scan.h"
+
+/** First eight bytes of every snapshot */
+#define SNAPSHOT_MAGIC "FWSNAP\r\n"
+
+/** Bumped whenever the file layout changes */
+#define SNAPSHOT_VERSION 3
+
+/** Written as-is, so a file from a host of the other byte order is refused */
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+/** Alignment of every section in the file */
+#define SNAPSHOT_ALIGN 64
+
+/**
+ * Fixed header at the start of a snapshot file.
+ * .layout: sizes of the structures stored raw, so other builds are refused
+ * .nsections: number of snapshot_section_t records following the header
+ * .count / .default_action / .engine: the policy the file holds
+ * .file_size: total size of the file in bytes
+ * .checksum: checksum of every byte after the header
+ */
+typedef struct snapshot_header {
+    char      magic[ 8 ];
+    uint32_t  version;
+    uint32_t  byte_order;
+    uint32_t  layout;
+    uint32_t  nsections;
+    uint32_t  count;
+    uint32_t  default_action;
+    uint32_t  engine;
+    uint32_t  reserved;
+    uint64_t  file_size;
+    uint64_t  checksum;
+    uint64_t  pad;
+} snapshot_header_t;
+
+/**
+ * Describes one array stored in the file.
+ * .kind: which array this is, one of the SECTION_ values in snapshot.c
+ * .index: which table, field or column the array belongs to
+ * .aux: scalars the owning structure needs besides the array
+ * .offset / .bytes: where the array lies in the file
+ */
+typedef struct snapshot_section {
+    uint32_t  kind;
+    uint32_t  index;
+    int32_t   aux[ 4 ];
+    uint64_t  offset;
+    uint64_t  bytes;
+} snapshot_section_t;
+
+/**
+ * A policy as saved to or mapped from a snapshot. When mapped, the
+ * rules and the compiled engine point into the read-only mapping and
+ * must not be modified or freed.
+ * .map / .size: the mapping, NULL when the snapshot is being saved
+ * .rules / .len: the rules in policy order
+ * .tree / .tuple / .bitvec / .scan: the compiled engine, at most one set
+ */
+typedef struct snapshot {
+    void      *map;
+    size_t    size;
+    rule_t    *rules;
+    int       len;
+    int       default_action;
+    int       engine;
+    tree_t    *tree;
+    tuple_t   *tuple;
+    bitvec_t  *bitvec;
+    scan_t    *scan;
+} snapshot_t;
+
+/**
+    Writes @snap to @filename, replacing it only once the whole file
+    has been written.
+    @param filename The file to write
+    @param snap The policy and compiled engine to save
+    @return 0 if success, -1 if fail
+*/
+int snapshot_save(const char *filename, const snapshot_t *snap);
+
+/**
+    Maps @filename read-only and checks its header and checksum, then
+    every rule and every count and index the compiled engine holds, so
+    a damaged file is refused even when its checksum was recomputed.
+    On success @snap points into the mapping, nothing is copied.
+    @param filename The file to map
+    @param snap Filled with the mapped policy
+    @return 0 if success, -1 if the file can't be read, -2 if it is
+            not a valid snapshot for this build
+*/
+int snapshot_map(const char *filename, snapshot_t *snap);
+
+/**
+    Releases a snapshot filled by snapshot_map.
+    @param snap The snapshot to release
+*/
+void snapshot_unmap(snapshot_t *snap);
+
+#endif
@@ -0,0 +1,307 @@
+/**
+    @file stats.c
+    @author Griffin Brookshire (glbrook2)
+    Counts which rules fire and how long lookups take. Every lookup bumps
+    two counters, but the clock is read only around batches and one in
+    STATS_SAMPLE single lookups, so counting can stay on while measuring.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <x86intrin.h>
+#define STATS_TSC 1
+#endif
+
+#include "stats.h"
+
+/** Smallest number of rules room is made for */
+#define STATS_INIT_SIZE 16
+
+/**
+    Reads the cycle counter, or the monotonic clock in ns where there is
+    none. Only differences between readings are meaningful.
+    @return The current tick
+*/
+uint64_t stats_clock() {
+#ifdef STATS_TSC
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ( uint64_t ) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/**
+    Returns the unit stats_clock counts in.
+    @return "tsc" or "ns"
+*/
+const char *stats_unit() {
+#ifdef STATS_TSC
+  return "tsc";
+#else
+  return "ns";
+#endif
+}
+
+/**
+    Picks the latency bucket for @ticks.
+    @param ticks The latency
+    @return The bucket, log2 of @ticks
+*/
+static int bucket_of( uint64_t ticks ) {
+  int b = ticks > 1 ? 63 - __builtin_clzll( ticks ) : 0;
+  return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+/**
+    Decides whether to time the next single lookup. Reading the clock
+    costs more than counting, so only one lookup in STATS_SAMPLE is timed.
+    @param stats The counters
+    @return 1 if the lookup should be timed, 0 if not
+*/
+int stats_sample(stats_t *stats) {
+  return ( ++stats->calls & ( STATS_SAMPLE - 1 ) ) == 0;
+}
+
+/**
+    Counts @n lookups. pos[ i ] is the position number of the rule the
+    lookup matched, or -1 for the default policy.
+    @param stats The counters to add to
+    @param pos The positions matched
+    @param n The number of lookups
+*/
+void stats_count(stats_t *stats, const int *pos, int n) {
+  for ( int i = 0; i < n; i++ ) {
+    int index = pos[ i ] - 1;
+    if ( index < 0 ) {
+      stats->defaulted++;
+    } else if ( index < stats->cap || stats_reserve( stats, index + 1 ) == 0 ) {
+      stats->hits[ index ]++;
+    }
+  }
+  stats->lookups += n;
+}
+
+/**
+    Adds @n lookups that took @ticks in total to the latency histogram.
+    @param stats The counters to add to
+    @param n The number of lookups
+    @param ticks The ticks the lookups took together
+*/
+void stats_time(stats_t *stats, int n, uint64_t ticks) {
+  if ( n <= 0 ) {
+    return;
+  }
+  stats->hist[ bucket_of( ticks / n ) ] += n;
+  stats->timed += n;
+}
+
+/**
+    Makes room for the hits of @len rules.
+    @param stats The counters
+    @param len The number of rules
+    @return 0 if success, -1 if memory ran out
+*/
+int stats_reserve(stats_t *stats, int len) {
+  if ( len <= stats->cap ) {
+    return 0;
+  }
+  int cap = stats->cap > 0 ? stats->cap : STATS_INIT_SIZE;
+  while ( cap < len ) {
+    cap *= 2;
+  }
+  uint64_t *grown = ( uint64_t * )realloc( stats->hits, cap * sizeof( uint64_t ) );
+  if ( grown == NULL ) {
+    return -1;
+  }
+  memset( grown + stats->cap, 0, ( cap - stats->cap ) * sizeof( uint64_t ) );
+  stats->hits = grown;
+  stats->cap = cap;
+  return 0;
+}
+
+/**
+    Moves the hits of rules @index onward up one place for a rule inserted
+    at @index, which starts at 0. Nothing is done if hits are not kept.
+    @param stats The counters
+    @param index The index the rule was inserted at
+    @param len The number of rules before the insert
+*/
+void stats_insert(stats_t *stats, int index, int len) {
+  if ( stats->hits == NULL || stats_reserve( stats, len + 1 ) != 0 ) {
+    return;
+  }
+  memmove( &stats->hits[ index + 1 ], &stats->hits[ index ], ( len - index ) * sizeof( uint64_t ) );
+  stats->hits[ index ] = 0;
+}
+
+/**
+    Drops the hits of the rule at @index and moves later ones down.
+    @param stats The counters
+    @param index The index of the deleted rule
+    @param len The number of rules before the delete
+*/
+void stats_delete(stats_t *stats, int index, int len) {
+  if ( stats->hits == NULL || index >= stats->cap ) {
+    return;
+  }
+  int last = len < stats->cap ? len : stats->cap;
+  memmove( &stats->hits[ index ], &stats->hits[ index + 1 ], ( last - index - 1 ) * sizeof( uint64_t ) );
+  stats->hits[ last - 1 ] = 0;
+}
+
+/**
+    Drops the hits of every rule marked in @drop and moves the rest down
+    to keep their order.
+    @param stats The counters
+    @param drop Nonzero for each rule removed
+    @param len The number of rules before the removal
+*/
+void stats_compact(stats_t *stats, const int *drop, int len) {
+  if ( stats->hits == NULL ) {
+    return;
+  }
+  int last = len < stats->cap ? len : stats->cap;
+  int kept = 0;
+  for ( int i = 0; i < last; i++ ) {
+    if ( !drop[ i ] ) {
+      stats->hits[ kept++ ] = stats->hits[ i ];
+    }
+  }
+  memset( &stats->hits[ kept ], 0, ( last - kept ) * sizeof( uint64_t ) );
+}
+
+/**
+    Moves the hits of each rule to its new index after a batch of edits.
+    Rules that are new start with no hits.
+    @param stats The counters
+    @param from The index each rule had before, -1 for new rules
+    @param len The number of rules after the edits
+    @return 0 if success, -1 if memory ran out
+*/
+int stats_remap(stats_t *stats, const int *from, int len) {
+  if ( stats->hits == NULL ) {
+    return 0;
+  }
+  int cap = stats->cap;
+  while ( cap < len ) {
+    cap *= 2;
+  }
+  uint64_t *hits = ( uint64_t * )calloc( cap, sizeof( uint64_t ) );
+  if ( hits == NULL ) {
+    return -1;
+  }
+  for ( int i = 0; i < len; i++ ) {
+    if ( from[ i ] >= 0 && from[ i ] < stats->cap ) {
+      hits[ i ] = stats->hits[ from[ i ] ];
+    }
+  }
+  free( stats->hits );
+  stats->hits = hits;
+  stats->cap = cap;
+  return 0;
+}
+
+/**
+    Adds the counters of @from to @into.
+    @param into The counters to add to
+    @param from The counters to add
+    @param len The number of rules
+*/
+void stats_merge(stats_t *into, const stats_t *from, int len) {
+  int n = from->cap < len ? from->cap : len;
+  if ( n > 0 && stats_reserve( into, n ) == 0 ) {
+    for ( int i = 0; i < n; i++ ) {
+      into->hits[ i ] += from->hits[ i ];
+    }
+  }
+  into->defaulted += from->defaulted;
+  into->lookups += from->lookups;
+  into->timed += from->timed;
+  for ( int b = 0; b < STATS_BUCKETS; b++ ) {
+    into->hist[ b ] += from->hist[ b ];
+  }
+}
+
+/**
+    Zeroes every counter, keeping the room for hits.
+    @param stats The counters
+*/
+void stats_reset(stats_t *stats) {
+  if ( stats->hits != NULL ) {
+    memset( stats->hits, 0, stats->cap * sizeof( uint64_t ) );
+  }
+  stats->defaulted = 0;
+  stats->lookups = 0;
+  stats->timed = 0;
+  memset( stats->hist, 0, sizeof( stats->hist ) );
+}
+
+/**
+    Frees the hits and zeroes every counter.
+    @param stats The counters
+*/
+void stats_free(stats_t *stats) {
+  free( stats->hits );
+  memset( stats, 0, sizeof( stats_t ) );
+}
+
+/**
+    Prints the hits of each rule that fired, the default policy hits and
+    the latency histogram to @stream.
+    @param stream Stream to print to
+    @param stats The counters
+    @param len The number of rules
+*/
+void stats_print(FILE *stream, const stats_t *stats, int len) {
+  double total = stats->lookups ? ( double ) stats->lookups : 1.0;
+  fprintf( stream, "%llu lookups, %llu timed\n", ( unsigned long long ) stats->lookups,
+           ( unsigned long long ) stats->timed );
+  for ( int i = 0; i < len && i < stats->cap; i++ ) {
+    if ( stats->hits[ i ] != 0 ) {
+      fprintf( stream, "[%d] %llu hits (%.1f%%)\n", i + 1,
+               ( unsigned long long ) stats->hits[ i ], 100.0 * stats->hits[ i ] / total );
+    }
+  }
+  fprintf( stream, "default %llu hits (%.1f%%)\n", ( unsigned long long ) stats->defaulted,
+           100.0 * stats->defaulted / total );
+  for ( int b = 0; b < STATS_BUCKETS; b++ ) {
+    if ( stats->hist[ b ] != 0 ) {
+      fprintf( stream, "%llu-%llu %s: %llu\n", b ? 1ULL << b : 0ULL, ( 2ULL << b ) - 1,
+               stats_unit(), ( unsigned long long ) stats->hist[ b ] );
+    }
+  }
+}
+
+/**
+    Writes every counter to @stream as comma separated records:
+    "unit,<unit>", "lookups,<n>", "timed,<n>", "default,<n>", one
+    "rule,<pos>,<n>" per rule and one "latency,<low>,<high>,<n>" per
+    non-empty bucket.
+    @param stream Stream to write to
+    @param stats The counters
+    @param len The number of rules
+*/
+void stats_dump(FILE *stream, const stats_t *stats, int len) {
+  fprintf( stream, "unit,%s\n", stats_unit() );
+  fprintf( stream, "lookups,%llu\n", ( unsigned long long ) stats->lookups );
+  fprintf( stream, "timed,%llu\n", ( unsigned long long ) stats->timed );
+  fprintf( stream, "default,%llu\n", ( unsigned long long ) stats->defaulted );
+  for ( int i = 0; i < len; i++ ) {
+    fprintf( stream, "rule,%d,%llu\n", i + 1,
+             ( unsigned long long ) ( i < stats->cap ? stats->hits[ i ] : 0 ) );
+  }
+  for ( int b = 0; b < STATS_BUCKETS; b++ ) {
+    if ( stats->hist[ b ] != 0 ) {
+      fprintf( stream, "latency,%llu,%llu,%llu\n", b ? 1ULL << b : 0ULL, ( 2ULL << b ) - 1,
+               ( unsigned long long ) stats->hist[ b ] );
+    }
+  }
+}
@@ -0,0 +1,165 @@
+/**
+    @file stats.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior and data for per-rule hit counters and lookup
+    latency histograms.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/** Latency buckets, bucket b counts lookups of 2^b to 2^(b+1) - 1 ticks */
+#define STATS_BUCKETS 32
+
+/** Size of the cache lines counter sets are aligned to */
+#define STATS_LINE 64
+
+/** One in this many single lookups is timed, a power of two */
+#define STATS_SAMPLE 16
+
+/**
+ * One thread's counters. Each thread counts into its own set, aligned
+ * to a cache line so that counting never touches another thread's line.
+ * .hits / .cap: hits of each rule by index, and the room for them
+ * .defaulted: lookups decided by the default policy
+ * .lookups: lookups counted
+ * .timed: lookups whose latency is in .hist
+ * .calls: single lookups seen, to pick which ones to time
+ * .hist: timed lookups by log2 of their latency in ticks
+ */
+typedef struct stats {
+    uint64_t  *hits;
+    int       cap;
+    uint64_t  defaulted;
+    uint64_t  lookups;
+    uint64_t  timed;
+    uint64_t  calls;
+    uint64_t  hist[ STATS_BUCKETS ];
+} __attribute__(( aligned( STATS_LINE ) )) stats_t;
+
+/**
+    Reads the cycle counter, or the monotonic clock in ns where there is
+    none. Only differences between readings are meaningful.
+    @return The current tick
+*/
+uint64_t stats_clock();
+
+/**
+    Returns the unit stats_clock counts in.
+    @return "tsc" or "ns"
+*/
+const char *stats_unit();
+
+/**
+    Decides whether to time the next single lookup. Reading the clock
+    costs more than counting, so only one lookup in STATS_SAMPLE is timed.
+    @param stats The counters
+    @return 1 if the lookup should be timed, 0 if not
+*/
+int stats_sample(stats_t *stats);
+
+/**
+    Counts @n lookups. pos[ i ] is the position number of the rule the
+    lookup matched, or -1 for the default policy.
+    @param stats The counters to add to
+    @param pos The positions matched
+    @param n The number of lookups
+*/
+void stats_count(stats_t *stats, const int *pos, int n);
+
+/**
+    Adds @n lookups that took @ticks in total to the latency histogram.
+    @param stats The counters to add to
+    @param n The number of lookups
+    @param ticks The ticks the lookups took together
+*/
+void stats_time(stats_t *stats, int n, uint64_t ticks);
+
+/**
+    Makes room for the hits of @len rules.
+    @param stats The counters
+    @param len The number of rules
+    @return 0 if success, -1 if memory ran out
+*/
+int stats_reserve(stats_t *stats, int len);
+
+/**
+    Moves the hits of rules @index onward up one place for a rule inserted
+    at @index, which starts at 0. Nothing is done if hits are not kept.
+    @param stats The counters
+    @param index The index the rule was inserted at
+    @param len The number of rules before the insert
+*/
+void stats_insert(stats_t *stats, int index, int len);
+
+/**
+    Drops the hits of the rule at @index and moves later ones down.
+    @param stats The counters
+    @param index The index of the deleted rule
+    @param len The number of rules before the delete
+*/
+void stats_delete(stats_t *stats, int index, int len);
+
+/**
+    Drops the hits of every rule marked in @drop and moves the rest down
+    to keep their order.
+    @param stats The counters
+    @param drop Nonzero for each rule removed
+    @param len The number of rules before the removal
+*/
+void stats_compact(stats_t *stats, const int *drop, int len);
+
+/**
+    Moves the hits of each rule to its new index after a batch of edits.
+    Rules that are new start with no hits.
+    @param stats The counters
+    @param from The index each rule had before, -1 for new rules
+    @param len The number of rules after the edits
+    @return 0 if success, -1 if memory ran out
+*/
+int stats_remap(stats_t *stats, const int *from, int len);
+
+/**
+    Adds the counters of @from to @into.
+    @param into The counters to add to
+    @param from The counters to add
+    @param len The number of rules
+*/
+void stats_merge(stats_t *into, const stats_t *from, int len);
+
+/**
+    Zeroes every counter, keeping the room for hits.
+    @param stats The counters
+*/
+void stats_reset(stats_t *stats);
+
+/**
+    Frees the hits and zeroes every counter.
+    @param stats The counters
+*/
+void stats_free(stats_t *stats);
+
+/**
+    Prints the hits of each rule that fired, the default policy hits and
+    the latency histogram to @stream.
+    @param stream Stream to print to
+    @param stats The counters
+    @param len The number of rules
+*/
+void stats_print(FILE *stream, const stats_t *stats, int len);
+
+/**
+    Writes every counter to @stream as comma separated records:
+    "unit,<unit>", "lookups,<n>", "timed,<n>", "default,<n>", one
+    "rule,<pos>,<n>" per rule and one "latency,<low>,<high>,<n>" per
+    non-empty bucket.
+    @param stream Stream to write to
+    @param stats The counters
+    @param len The number of rules
+*/
+void stats_dump(FILE *stream, const stats_t *stats, int len);
+
+#endif
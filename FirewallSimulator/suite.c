@@ -0,0 +1,297 @@
+/**
+    @file suite.c
+    @author Griffin Brookshire (glbrook2)
+    Benchmarks every policy engine against the same generated rulesets
+    and traffic. For each ruleset size and engine it reports the build
+    time, the memory held, lookups per second through policy_test and
+    policy_test_batch, p50/p99 lookup latency, and whether the engine
+    agreed with the linear scan, one CSV row each.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "packet.h"
+#include "policy.h"
+#include "stats.h"
+#include "gen.h"
+
+/** Most ruleset sizes measured in one run */
+#define SUITE_MAX_SIZES 16
+
+/** Seconds each throughput measurement runs for */
+#define SUITE_SECONDS 0.2
+
+/** Packets whose verdicts are checked against the linear scan */
+#define SUITE_VERIFY 2000
+
+/** Packets timed one by one for the latency percentiles */
+#define SUITE_LATENCY 20000
+
+/** Packets per policy_test_batch call */
+#define SUITE_BATCH 256
+
+/* Print out a usage message. */
+static void usage()
+{
+  fprintf(stderr, "Usage: suite [-n <rules>[,<rules>...]] [-w <wildcard>] [-o <overlap>] "
+                  "[-m <match>] [-p <packets>] [-s <seed>] [-R <rule_file>] [-T <pcap_file>]\n");
+}
+
+/**
+    Reads the monotonic clock.
+    @return The time in nanoseconds
+*/
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+    Orders two latencies for qsort.
+    @param a The first latency
+    @param b The second latency
+    @return Negative, zero or positive as @a is less, equal or greater
+*/
+static int compare_lat( const void *a, const void *b ) {
+  uint64_t x = *( const uint64_t * ) a;
+  uint64_t y = *( const uint64_t * ) b;
+  return ( x > y ) - ( x < y );
+}
+
+/**
+    Measures how many stats_clock ticks pass per nanosecond.
+    @return Ticks per nanosecond
+*/
+static double ticks_per_ns() {
+  double start = now_ns();
+  uint64_t ticks = stats_clock();
+  while ( now_ns() - start < 2e7 ) {
+  }
+  return ( stats_clock() - ticks ) / ( now_ns() - start );
+}
+
+/**
+    Measures the cost of reading stats_clock twice, to take off each
+    timed lookup.
+    @return The fewest ticks between two back to back readings
+*/
+static uint64_t clock_overhead() {
+  uint64_t best = ~0ULL;
+  for ( int i = 0; i < 1000; i++ ) {
+    uint64_t start = stats_clock();
+    uint64_t took = stats_clock() - start;
+    best = took < best ? took : best;
+  }
+  return best;
+}
+
+/**
+    Replaces the policy with @rules under @engine and builds the engine.
+    @param rules The rules
+    @param len The number of rules
+    @param engine One of the ENGINE_ values
+    @param build_ms Set to the time the engine took to build
+    @return 0 if success, -1 if the engine could not be built
+*/
+static int load_policy( const rule_t *rules, int len, int engine, double *build_ms ) {
+  policy_free();
+  policy_init();
+  policy_set_default( ACTION_DENY );
+  for ( int i = 0; i < len; i++ ) {
+    policy_append( rules[ i ] );
+  }
+  policy_set_engine( engine );
+  double start = now_ns();
+  int rc = policy_compile();
+  *build_ms = ( now_ns() - start ) / 1e6;
+  return rc;
+}
+
+/**
+    Runs policy_test over @pkts, wrapping around, for SUITE_SECONDS.
+    @param pkts The packets
+    @param n The number of packets
+    @return Lookups per second
+*/
+static double single_rate( const packet_t *pkts, int n ) {
+  long lookups = 0;
+  int sink = 0;
+  double start = now_ns();
+  double took;
+  do {
+    for ( int i = 0; i < 1024; i++ ) {
+      int pos;
+      sink += policy_test( pkts[ ( lookups + i ) % n ], &pos );
+    }
+    lookups += 1024;
+    took = now_ns() - start;
+  } while ( took < SUITE_SECONDS * 1e9 );
+  return sink >= 0 ? lookups / ( took / 1e9 ) : 0.0;
+}
+
+/**
+    Runs policy_test_batch over @pkts, wrapping around, for SUITE_SECONDS.
+    @param pkts The packets
+    @param n The number of packets, at least SUITE_BATCH
+    @return Lookups per second
+*/
+static double batch_rate( const packet_t *pkts, int n ) {
+  int actions[ SUITE_BATCH ];
+  int pos[ SUITE_BATCH ];
+  long lookups = 0;
+  int base = 0;
+  double start = now_ns();
+  double took;
+  do {
+    if ( base + SUITE_BATCH > n ) {
+      base = 0;
+    }
+    policy_test_batch( pkts + base, SUITE_BATCH, actions, pos );
+    base += SUITE_BATCH;
+    lookups += SUITE_BATCH;
+    took = now_ns() - start;
+  } while ( took < SUITE_SECONDS * 1e9 );
+  return lookups / ( took / 1e9 );
+}
+
+/**
+    Parses a comma separated list of ruleset sizes.
+    @param list The list
+    @param sizes Filled with the sizes
+    @return The number of sizes, -1 if the list is malformed
+*/
+static int parse_sizes( char *list, int *sizes ) {
+  int n = 0;
+  for ( char *word = strtok( list, "," ); word != NULL; word = strtok( NULL, "," ) ) {
+    if ( n == SUITE_MAX_SIZES || atoi( word ) < 1 ) {
+      return -1;
+    }
+    sizes[ n++ ] = atoi( word );
+  }
+  return n > 0 ? n : -1;
+}
+
+/* Starting point for the benchmark suite.
+   @param argc number of command-line arguments.
+   @param argv list of command-line arguments.
+   @return program exit status
+*/
+int main(int argc, char *argv[])
+{
+  static const char *engines[] = { "linear", "tree", "tuple", "bitvec", "scan", "bytecode" };
+  int sizes[ SUITE_MAX_SIZES ] = { 100, 1000, 10000 };
+  int nsizes = 3;
+  gen_params_t params = { 0, 0.3, 0.5, 0.8, 1 };
+  int npkts = 100000;
+  char *rule_file = NULL;
+  char *pcap_file = NULL;
+
+  if ( argc % 2 == 0 ) { //options all take a value
+    usage();
+    exit( 1 );
+  }
+  for ( int i = 1; i < argc; i += 2 ) {
+    if ( strcmp( argv[ i ], "-n" ) == 0 ) {
+      nsizes = parse_sizes( argv[ i + 1 ], sizes );
+    } else if ( strcmp( argv[ i ], "-w" ) == 0 ) {
+      params.wildcard = atof( argv[ i + 1 ] );
+    } else if ( strcmp( argv[ i ], "-o" ) == 0 ) {
+      params.overlap = atof( argv[ i + 1 ] );
+    } else if ( strcmp( argv[ i ], "-m" ) == 0 ) {
+      params.match = atof( argv[ i + 1 ] );
+    } else if ( strcmp( argv[ i ], "-p" ) == 0 ) {
+      npkts = atoi( argv[ i + 1 ] );
+    } else if ( strcmp( argv[ i ], "-s" ) == 0 ) {
+      params.seed = strtoul( argv[ i + 1 ], NULL, 10 );
+    } else if ( strcmp( argv[ i ], "-R" ) == 0 ) {
+      rule_file = argv[ i + 1 ];
+    } else if ( strcmp( argv[ i ], "-T" ) == 0 ) {
+      pcap_file = argv[ i + 1 ];
+    } else {
+      nsizes = -1;
+    }
+  }
+  if ( nsizes < 0 || npkts < SUITE_BATCH ) {
+    usage();
+    exit( 1 );
+  }
+
+  double rate = ticks_per_ns();
+  uint64_t overhead = clock_overhead();
+  packet_t *pkts = malloc( npkts * sizeof( packet_t ) );
+  int *expected = malloc( SUITE_VERIFY * sizeof( int ) );
+  uint64_t *lat = malloc( SUITE_LATENCY * sizeof( uint64_t ) );
+  if ( pkts == NULL || expected == NULL || lat == NULL ) {
+    fprintf( stderr, "Out of memory.\n" );
+    exit( 1 );
+  }
+  int verify = npkts < SUITE_VERIFY ? npkts : SUITE_VERIFY;
+  int timed = npkts < SUITE_LATENCY ? npkts : SUITE_LATENCY;
+
+  fprintf( stdout, "engine,rules,wildcard,overlap,match,build_ms,bytes,lookups_per_sec,"
+                   "batch_lookups_per_sec,p50_ns,p99_ns,agree\n" );
+  for ( int s = 0; s < nsizes; s++ ) {
+    params.rules = sizes[ s ];
+    rule_t *rules = malloc( params.rules * sizeof( rule_t ) );
+    if ( rules == NULL || gen_rules( &params, rules ) != 0 ) {
+      fprintf( stderr, "Out of memory.\n" );
+      exit( 1 );
+    }
+    gen_packets( &params, rules, pkts, npkts );
+    if ( rule_file != NULL && gen_write_rules( rule_file, rules, params.rules, ACTION_DENY ) != 0 ) {
+      fprintf( stderr, "Could not write %s.\n", rule_file );
+      exit( 1 );
+    }
+    if ( pcap_file != NULL && gen_write_pcap( pcap_file, pkts, npkts ) != 0 ) {
+      fprintf( stderr, "Could not write %s.\n", pcap_file );
+      exit( 1 );
+    }
+
+    for ( int e = ENGINE_LINEAR; e <= ENGINE_BYTECODE; e++ ) {
+      double build_ms;
+      int built = load_policy( rules, params.rules, e, &build_ms ) == 0;
+      size_t bytes = policy_bytes();
+
+      // The linear scan is the reference every other engine must agree with
+      int agree = built;
+      for ( int i = 0; i < verify; i++ ) {
+        int pos;
+        policy_test( pkts[ i ], &pos );
+        if ( e == ENGINE_LINEAR ) {
+          expected[ i ] = pos;
+        } else if ( pos != expected[ i ] ) {
+          agree = 0;
+        }
+      }
+
+      double single = single_rate( pkts, npkts );
+      double batch = batch_rate( pkts, npkts );
+      for ( int i = 0; i < timed; i++ ) {
+        int pos;
+        uint64_t start = stats_clock();
+        policy_test( pkts[ i ], &pos );
+        uint64_t took = stats_clock() - start;
+        lat[ i ] = took > overhead ? took - overhead : 0;
+      }
+      qsort( lat, timed, sizeof( uint64_t ), compare_lat );
+
+      fprintf( stdout, "%s,%d,%.2f,%.2f,%.2f,%.3f,%zu,%.0f,%.0f,%.1f,%.1f,%d\n",
+               engines[ e ], params.rules, params.wildcard, params.overlap, params.match,
+               build_ms, bytes, single, batch, lat[ timed / 2 ] / rate,
+               lat[ ( int ) ( timed * 0.99 ) ] / rate, agree );
+      fflush( stdout );
+    }
+    free( rules );
+  }
+  policy_free();
+  free( pkts );
+  free( expected );
+  free( lat );
+  return EXIT_SUCCESS;
+}
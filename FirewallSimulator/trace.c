@@ -0,0 +1,360 @@
+/**
+    @file trace.c
+    @author Griffin Brookshire (glbrook2)
+    Replays classic pcap files through the policy. The file is streamed
+    through one large buffer, packets are decoded in place and tested in
+    batches, so there is no per-packet system call or allocation.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+#include "policy.h"
+#include "packet.h"
+
+/** pcap magic with microsecond timestamps, as written by the capturing host */
+#define PCAP_MAGIC_USEC 0xA1B2C3D4
+
+/** pcap magic with nanosecond timestamps */
+#define PCAP_MAGIC_NSEC 0xA1B23C4D
+
+/** Size of the pcap file header */
+#define PCAP_FILE_HEADER 24
+
+/** Size of a pcap record header */
+#define PCAP_RECORD_HEADER 16
+
+/** Link type of Ethernet captures */
+#define LINK_ETHERNET 1
+
+/** Link type of raw IP captures */
+#define LINK_RAW 101
+
+/** Link type of Linux cooked captures */
+#define LINK_LINUX_SLL 113
+
+/** Link type of raw IPv4 captures */
+#define LINK_IPV4 228
+
+/** Ethertype of IPv4 */
+#define ETHERTYPE_IPV4 0x0800
+
+/** Ethertype of an 802.1Q VLAN tag */
+#define ETHERTYPE_VLAN 0x8100
+
+/** Ethertype of an 802.1ad service VLAN tag */
+#define ETHERTYPE_QINQ 0x88A8
+
+/** IP protocol number of TCP */
+#define IPPROTO_NUM_TCP 6
+
+/** IP protocol number of UDP */
+#define IPPROTO_NUM_UDP 17
+
+/**
+    Reads a 32-bit value in the trace's byte order.
+    @param p The bytes to read
+    @param swap Nonzero if the trace was written big-endian
+    @return The value
+*/
+static uint32_t read32( const unsigned char *p, int swap ) {
+  if ( swap ) {
+    return ( uint32_t ) p[ 0 ] << 24 | ( uint32_t ) p[ 1 ] << 16 | ( uint32_t ) p[ 2 ] << 8 | p[ 3 ];
+  }
+  return ( uint32_t ) p[ 3 ] << 24 | ( uint32_t ) p[ 2 ] << 16 | ( uint32_t ) p[ 1 ] << 8 | p[ 0 ];
+}
+
+/**
+    Reads a 16-bit value in network byte order.
+    @param p The bytes to read
+    @return The value
+*/
+static unsigned int read16( const unsigned char *p ) {
+  return ( unsigned int ) p[ 0 ] << 8 | p[ 1 ];
+}
+
+/**
+    Decodes the 5-tuple of an IPv4 TCP or UDP packet straight into its
+    flow key.
+    @param p The IPv4 header
+    @param len The bytes captured from the IPv4 header on
+    @param key Filled with the 5-tuple
+    @return 1 if decoded, 0 if the packet can't be tested
+*/
+static int decode_ipv4( const unsigned char *p, size_t len, flow_key_t *key ) {
+  if ( len < 20 || ( p[ 0 ] >> 4 ) != 4 ) {
+    return 0;
+  }
+  size_t ihl = ( size_t ) ( p[ 0 ] & 0x0F ) * 4;
+  // Only the first fragment carries the ports
+  if ( ihl < 20 || len < ihl + 4 || ( read16( p + 6 ) & 0x1FFF ) != 0 ) {
+    return 0;
+  }
+  unsigned int protocol;
+  if ( p[ 9 ] == IPPROTO_NUM_TCP ) {
+    protocol = PROTO_TCP;
+  } else if ( p[ 9 ] == IPPROTO_NUM_UDP ) {
+    protocol = PROTO_UDP;
+  } else {
+    return 0;
+  }
+  *key = flow_key_pack( read32( p + 12, 1 ), read32( p + 16, 1 ), read16( p + ihl ),
+                        read16( p + ihl + 2 ), protocol );
+  return 1;
+}
+
+/**
+    Decodes the 5-tuple of a captured frame.
+    @param link The link type of the trace
+    @param p The frame
+    @param len The bytes captured
+    @param key Filled with the 5-tuple
+    @return 1 if decoded, 0 if the frame can't be tested
+*/
+static int decode_frame( uint32_t link, const unsigned char *p, size_t len, flow_key_t *key ) {
+  size_t off;
+  unsigned int type;
+  if ( link == LINK_RAW || link == LINK_IPV4 ) {
+    return decode_ipv4( p, len, key );
+  } else if ( link == LINK_LINUX_SLL ) {
+    if ( len < 16 ) {
+      return 0;
+    }
+    off = 16;
+    type = read16( p + 14 );
+  } else {
+    if ( len < 14 ) {
+      return 0;
+    }
+    off = 14;
+    type = read16( p + 12 );
+  }
+  while ( ( type == ETHERTYPE_VLAN || type == ETHERTYPE_QINQ ) && len >= off + 4 ) {
+    type = read16( p + off + 2 );
+    off += 4;
+  }
+  if ( type != ETHERTYPE_IPV4 ) {
+    return 0;
+  }
+  return decode_ipv4( p + off, len - off, key );
+}
+
+/**
+ * Receives each batch of decoded packets.
+ * @param keys The flow keys of the packets
+ * @param n The number of packets
+ * @param ctx The context given to read_trace
+ * @return 0 to go on, -1 to stop
+ */
+typedef int ( *trace_sink_t )( const flow_key_t *keys, int n, void *ctx );
+
+/**
+    Streams the pcap file @filename, handing its IPv4 TCP and UDP packets
+    to @sink in batches of up to TRACE_BATCH. A record longer than
+    TRACE_MAX_RECORD ends the stream with an error naming its offset.
+    @param filename The trace to read
+    @param stats Filled with the record counts
+    @param sink Receives the decoded packets
+    @param ctx Passed through to @sink
+    @return 0 if success, -1 if the file can't be read or @sink stopped,
+            -2 if it is not a pcap file or uses an unsupported link type
+*/
+static int read_trace( const char *filename, trace_stats_t *stats, trace_sink_t sink, void *ctx ) {
+  memset( stats, 0, sizeof( trace_stats_t ) );
+  FILE *file = fopen( filename, "rb" );
+  if ( file == NULL ) {
+    return -1;
+  }
+  unsigned char hdr[ PCAP_FILE_HEADER ];
+  if ( fread( hdr, 1, sizeof( hdr ), file ) != sizeof( hdr ) ) {
+    fclose( file );
+    return -2;
+  }
+  int swap;
+  if ( read32( hdr, 0 ) == PCAP_MAGIC_USEC || read32( hdr, 0 ) == PCAP_MAGIC_NSEC ) {
+    swap = 0;
+  } else if ( read32( hdr, 1 ) == PCAP_MAGIC_USEC || read32( hdr, 1 ) == PCAP_MAGIC_NSEC ) {
+    swap = 1;
+  } else {
+    fclose( file );
+    return -2;
+  }
+  uint32_t link = read32( hdr + 20, swap ) & 0xFFFF;
+  if ( link != LINK_ETHERNET && link != LINK_RAW && link != LINK_LINUX_SLL && link != LINK_IPV4 ) {
+    fclose( file );
+    return -2;
+  }
+  unsigned char *buf = malloc( TRACE_BLOCK + TRACE_MAX_RECORD + PCAP_RECORD_HEADER );
+  if ( buf == NULL ) {
+    fclose( file );
+    return -1;
+  }
+  setvbuf( file, NULL, _IONBF, 0 );
+
+  flow_key_t batch[ TRACE_BATCH ];
+  int n = 0;
+  int rc = 0;
+  size_t have = 0;
+  long long base = PCAP_FILE_HEADER;
+  int eof = 0;
+  while ( rc == 0 && ( !eof || have > 0 ) ) {
+    // Top the buffer up with the next block, keeping any partial record
+    if ( !eof ) {
+      size_t got = fread( buf + have, 1, TRACE_BLOCK, file );
+      have += got;
+      eof = got < TRACE_BLOCK;
+    }
+    size_t off = 0;
+    while ( rc == 0 && have - off >= PCAP_RECORD_HEADER ) {
+      uint32_t incl = read32( buf + off + 8, swap );
+      if ( incl > TRACE_MAX_RECORD ) {
+        // Nothing after it can be trusted, so say why the replay ends here
+        fprintf( stdout, "Error: Record at offset %lld is %lu bytes, over the %d byte limit. "
+                 "Stopping there.\n", base + ( long long ) off, ( unsigned long ) incl,
+                 TRACE_MAX_RECORD );
+        eof = 1;
+        off = have;
+        break;
+      }
+      if ( have - off < PCAP_RECORD_HEADER + incl ) {
+        break;
+      }
+      stats->records++;
+      if ( decode_frame( link, buf + off + PCAP_RECORD_HEADER, incl, &batch[ n ] ) ) {
+        if ( ++n == TRACE_BATCH ) {
+          rc = sink( batch, n, ctx );
+          n = 0;
+        }
+      } else {
+        stats->skipped++;
+      }
+      off += PCAP_RECORD_HEADER + incl;
+    }
+    memmove( buf, buf + off, have - off );
+    have -= off;
+    base += off;
+    if ( eof ) {
+      // Whatever is left is a record cut short by the end of the capture
+      if ( have > 0 ) {
+        stats->records++;
+        stats->skipped++;
+      }
+      have = 0;
+    }
+  }
+  if ( rc == 0 && n > 0 ) {
+    rc = sink( batch, n, ctx );
+  }
+  free( buf );
+  fclose( file );
+  return rc;
+}
+
+/**
+    Tests a batch of packets and adds the verdicts to the totals.
+    @param keys The flow keys of the packets
+    @param n The number of packets
+    @param ctx The trace_stats_t to update
+    @return 0 always
+*/
+static int test_batch( const flow_key_t *keys, int n, void *ctx ) {
+  trace_stats_t *stats = ctx;
+  int actions[ TRACE_BATCH ];
+  int pos[ TRACE_BATCH ];
+  policy_test_flows( keys, n, actions, pos );
+  for ( int i = 0; i < n; i++ ) {
+    if ( actions[ i ] == ACTION_ALLOW ) {
+      stats->allowed++;
+    } else {
+      stats->denied++;
+    }
+    if ( pos[ i ] < 0 ) {
+      stats->defaulted++;
+    }
+  }
+  stats->tested += n;
+  return 0;
+}
+
+/**
+    Tests every IPv4 TCP and UDP packet of the pcap file @filename
+    against the policy. Ethernet (with VLAN tags), Linux cooked and raw
+    IP captures in either byte order and timestamp precision are read.
+    @param filename The trace to replay
+    @param stats Filled with the totals
+    @return 0 if success, -1 if the file can't be read, -2 if it is not
+            a pcap file or uses an unsupported link type
+*/
+int trace_replay(const char *filename, trace_stats_t *stats) {
+  struct timespec start, end;
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  trace_stats_t totals = { 0 };
+  int rc = read_trace( filename, stats, test_batch, &totals );
+  clock_gettime( CLOCK_MONOTONIC, &end );
+  stats->tested = totals.tested;
+  stats->allowed = totals.allowed;
+  stats->denied = totals.denied;
+  stats->defaulted = totals.defaulted;
+  stats->seconds = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+  return rc;
+}
+
+/**
+ * A growing array of decoded packets.
+ */
+typedef struct packet_list {
+    packet_t  *pkts;
+    size_t    len;
+    size_t    cap;
+} packet_list_t;
+
+/**
+    Appends a batch of packets to a packet_list_t.
+    @param keys The flow keys of the packets
+    @param n The number of packets
+    @param ctx The packet_list_t to grow
+    @return 0 if success, -1 if memory ran out
+*/
+static int keep_batch( const flow_key_t *keys, int n, void *ctx ) {
+  packet_list_t *list = ctx;
+  if ( list->len + n > list->cap ) {
+    size_t cap = list->cap ? list->cap * 2 : TRACE_BATCH * 64;
+    packet_t *grown = realloc( list->pkts, cap * sizeof( packet_t ) );
+    if ( grown == NULL ) {
+      return -1;
+    }
+    list->pkts = grown;
+    list->cap = cap;
+  }
+  for ( int i = 0; i < n; i++ ) {
+    list->pkts[ list->len++ ] = flow_key_packet( keys[ i ] );
+  }
+  return 0;
+}
+
+/**
+    Decodes every IPv4 TCP and UDP packet of the pcap file @filename into
+    one array without testing them, so they can be split between threads.
+    @param filename The trace to read
+    @param pkts Set to the packets, to be freed by the caller
+    @param n Set to the number of packets
+    @param stats Filled with the record counts
+    @return 0 if success, -1 if the file can't be read or memory ran out,
+            -2 if it is not a pcap file or uses an unsupported link type
+*/
+int trace_load(const char *filename, packet_t **pkts, size_t *n, trace_stats_t *stats) {
+  packet_list_t list = { NULL, 0, 0 };
+  int rc = read_trace( filename, stats, keep_batch, &list );
+  if ( rc != 0 ) {
+    free( list.pkts );
+    return rc;
+  }
+  *pkts = list.pkts;
+  *n = list.len;
+  return 0;
+}
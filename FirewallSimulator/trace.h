@@ -0,0 +1,69 @@
+/**
+    @file trace.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior and data for replaying pcap traces through the policy.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet.h"
+
+/** Bytes read from the trace at a time */
+#define TRACE_BLOCK ( 1 << 20 )
+
+/** Packets handed to policy_test_batch at a time */
+#define TRACE_BATCH 256
+
+/** Largest record accepted, anything bigger means the file is corrupt */
+#define TRACE_MAX_RECORD ( 256 * 1024 )
+
+/**
+ * Totals gathered while replaying a trace.
+ * .records: records read from the file
+ * .tested: IPv4 TCP and UDP packets run through the policy
+ * .skipped: records that were not IPv4 TCP or UDP, fragments or truncated
+ * .allowed / .denied: verdicts of the tested packets
+ * .defaulted: tested packets decided by the default policy
+ * .seconds: wall time spent reading and testing
+ */
+typedef struct trace_stats {
+    uint64_t  records;
+    uint64_t  tested;
+    uint64_t  skipped;
+    uint64_t  allowed;
+    uint64_t  denied;
+    uint64_t  defaulted;
+    double    seconds;
+} trace_stats_t;
+
+/**
+    Tests every IPv4 TCP and UDP packet of the pcap file @filename
+    against the policy. Ethernet (with VLAN tags), Linux cooked and raw
+    IP captures in either byte order and timestamp precision are read.
+    A record over TRACE_MAX_RECORD bytes stops the replay with an error
+    naming its offset, and the totals cover the records before it.
+    @param filename The trace to replay
+    @param stats Filled with the totals
+    @return 0 if success, -1 if the file can't be read, -2 if it is not
+            a pcap file or uses an unsupported link type
+*/
+int trace_replay(const char *filename, trace_stats_t *stats);
+
+/**
+    Decodes every IPv4 TCP and UDP packet of the pcap file @filename into
+    one array without testing them, so they can be split between threads.
+    A record over TRACE_MAX_RECORD bytes stops it as trace_replay does.
+    @param filename The trace to read
+    @param pkts Set to the packets, to be freed by the caller
+    @param n Set to the number of packets
+    @param stats Filled with the record counts
+    @return 0 if success, -1 if the file can't be read or memory ran out,
+            -2 if it is not a pcap file or uses an unsupported link type
+*/
+int trace_load(const char *filename, packet_t **pkts, size_t *n, trace_stats_t *stats);
+
+#endif
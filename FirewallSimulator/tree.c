@@ -0,0 +1,469 @@
+/**
+    @file tree.c
+    @author Griffin Brookshire (glbrook2)
+    Compiles the policy rules into a HiCuts-style decision tree.
+    Each inner node cuts one packet field into equal sized, power of two
+    pieces, so a lookup walks a handful of nodes and then checks the few
+    rules left in a leaf instead of scanning the whole policy.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "tree.h"
+
+/** Most rules a leaf may hold before it is cut again */
+#define TREE_BINTH 8
+
+/** Most bits of a field consumed by a single cut */
+#define TREE_MAX_CUT_BITS 8
+
+/** Space factor bounding how many rule copies one cut may create */
+#define TREE_SPFAC 4
+
+/** Packets walked side by side by tree_lookup_batch */
+#define TREE_BATCH 8
+
+/** Width in bits of each field, in tree dimension order */
+static const int dim_bits[ TREE_DIMS ] = { 8, 32, 16, 32, 16 };
+
+/**
+ * State shared by the recursive build.
+ * .lo / .hi: the range each rule covers in every dimension
+ */
+typedef struct builder {
+    tree_t    *tree;
+    uint32_t  (*lo)[ TREE_DIMS ];
+    uint32_t  (*hi)[ TREE_DIMS ];
+} builder_t;
+
+/**
+    Makes sure @arr can hold @need elements of @size bytes.
+    @param arr The array to grow
+    @param cap The current capacity, updated on growth
+    @param need The number of elements required
+    @param size The size of one element
+    @return 0 if success, -1 if fail
+*/
+static int reserve( void **arr, int *cap, int need, size_t size ) {
+  if ( need <= *cap ) {
+    return 0;
+  }
+  int new_cap = *cap ? *cap : 64;
+  while ( new_cap < need ) {
+    new_cap *= 2;
+  }
+  void *grown = realloc( *arr, new_cap * size );
+  if ( grown == NULL ) {
+    return -1;
+  }
+  *arr = grown;
+  *cap = new_cap;
+  return 0;
+}
+
+/**
+    Fills the value of every tree dimension for @pkt.
+    @param pkt The packet to read
+    @param v The values, in tree dimension order
+*/
+static void packet_values( packet_t pkt, uint32_t v[ TREE_DIMS ] ) {
+  v[ 0 ] = pkt.protocol;
+  v[ 1 ] = ipaddr_to_int( pkt.src_ip );
+  v[ 2 ] = pkt.src_port;
+  v[ 3 ] = ipaddr_to_int( pkt.dst_ip );
+  v[ 4 ] = pkt.dst_port;
+}
+
+/**
+    Fills the range a rule covers in every tree dimension.
+    @param rule The rule to read
+    @param lo The lowest value matched in each dimension
+    @param hi The highest value matched in each dimension
+*/
+static void rule_ranges( const rule_t *rule, uint32_t lo[ TREE_DIMS ], uint32_t hi[ TREE_DIMS ] ) {
+  lo[ 0 ] = hi[ 0 ] = rule->match.protocol;
+  lo[ 1 ] = hi[ 1 ] = ipaddr_to_int( rule->match.src_ip );
+  lo[ 3 ] = hi[ 3 ] = ipaddr_to_int( rule->match.dst_ip );
+  if ( rule->match.src_port == MATCH_PORT_ANY ) {
+    lo[ 2 ] = PORT_MIN;
+    hi[ 2 ] = PORT_MAX;
+  } else {
+    lo[ 2 ] = hi[ 2 ] = rule->match.src_port;
+  }
+  if ( rule->match.dst_port == MATCH_PORT_ANY ) {
+    lo[ 4 ] = PORT_MIN;
+    hi[ 4 ] = PORT_MAX;
+  } else {
+    lo[ 4 ] = hi[ 4 ] = rule->match.dst_port;
+  }
+}
+
+/**
+    Tells if rule @r matches every packet in the region.
+    @param b The build state
+    @param r The rule index
+    @param base The lowest value of the region in each dimension
+    @param width The number of free bits in each dimension
+    @return 1 if the rule covers the region, 0 if not
+*/
+static int covers( const builder_t *b, int r, const uint32_t base[], const int width[] ) {
+  for ( int d = 0; d < TREE_DIMS; d++ ) {
+    uint64_t end = ( uint64_t ) base[ d ] + ( ( ( uint64_t ) 1 << width[ d ] ) - 1 );
+    if ( b->lo[ r ][ d ] > base[ d ] || b->hi[ r ][ d ] < end ) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+    Finds the children of a cut that rule @r falls into.
+    @param b The build state
+    @param r The rule index
+    @param d The dimension being cut
+    @param base The lowest value of the region in @d
+    @param shift The free bits left in each child
+    @param children The number of children of the cut
+    @param first Set to the first child covered
+    @param last Set to the last child covered
+*/
+static void child_span( const builder_t *b, int r, int d, uint32_t base, int shift,
+                        int children, int *first, int *last ) {
+  uint32_t lo = b->lo[ r ][ d ] < base ? base : b->lo[ r ][ d ];
+  uint64_t hi = ( ( uint64_t ) b->hi[ r ][ d ] - base ) >> shift;
+  *first = ( int ) ( ( ( uint64_t ) lo - base ) >> shift );
+  *last = hi < ( uint64_t ) children ? ( int ) hi : children - 1;
+}
+
+/**
+    Appends a leaf holding the given rules.
+    @param b The build state
+    @param list The rule indexes, in policy order
+    @param count The number of rules
+    @return The node index, or -2 if memory ran out
+*/
+static int make_leaf( builder_t *b, const int *list, int count ) {
+  tree_t *t = b->tree;
+  if ( reserve( ( void ** ) &t->nodes, &t->nodes_cap, t->nodes_len + 1, sizeof( tree_node_t ) ) ||
+       reserve( ( void ** ) &t->leaf_rules, &t->leaf_cap, t->leaf_len + count, sizeof( int ) ) ) {
+    return -2;
+  }
+  tree_node_t *node = &t->nodes[ t->nodes_len ];
+  node->dim = -1;
+  node->shift = 0;
+  node->mask = 0;
+  node->first = t->leaf_len;
+  node->count = count;
+  memcpy( t->leaf_rules + t->leaf_len, list, count * sizeof( int ) );
+  t->leaf_len += count;
+  return t->nodes_len++;
+}
+
+/**
+    Builds the subtree for a region of the packet space.
+    @param b The build state
+    @param list The rules that intersect the region, in policy order
+    @param count The number of rules
+    @param base The lowest value of the region in each dimension
+    @param width The number of free bits in each dimension
+    @return The node index, -1 if no rule matches, -2 if memory ran out
+*/
+static int build_node( builder_t *b, const int *list, int count,
+                       const uint32_t base[], const int width[] ) {
+  // Rules after one that covers the whole region can never match here
+  for ( int i = 0; i < count; i++ ) {
+    if ( covers( b, list[ i ], base, width ) ) {
+      count = i + 1;
+      break;
+    }
+  }
+  if ( count == 0 ) {
+    return -1;
+  }
+  if ( count <= TREE_BINTH ) {
+    return make_leaf( b, list, count );
+  }
+
+  // Pick the cut that leaves the smallest largest child for the fewest copies
+  int best_dim = -1;
+  int best_bits = 0;
+  long best_score = 0;
+  long best_sum = 0;
+  int *hist = malloc( ( ( 1 << TREE_MAX_CUT_BITS ) + 1 ) * sizeof( int ) );
+  if ( hist == NULL ) {
+    return -2;
+  }
+  for ( int d = 0; d < TREE_DIMS; d++ ) {
+    int limit = width[ d ] < TREE_MAX_CUT_BITS ? width[ d ] : TREE_MAX_CUT_BITS;
+    int bits = 0;
+    long sum = 0;
+    for ( int k = 1; k <= limit; k++ ) {
+      long copies = 0;
+      for ( int i = 0; i < count; i++ ) {
+        int first, last;
+        child_span( b, list[ i ], d, base[ d ], width[ d ] - k, 1 << k, &first, &last );
+        copies += last - first + 1;
+      }
+      if ( k > 1 && copies + ( 1L << k ) > ( long ) TREE_SPFAC * count ) {
+        break;
+      }
+      bits = k;
+      sum = copies;
+    }
+    if ( bits == 0 ) {
+      continue;
+    }
+    int children = 1 << bits;
+    memset( hist, 0, ( children + 1 ) * sizeof( int ) );
+    for ( int i = 0; i < count; i++ ) {
+      int first, last;
+      child_span( b, list[ i ], d, base[ d ], width[ d ] - bits, children, &first, &last );
+      hist[ first ]++;
+      hist[ last + 1 ]--;
+    }
+    long max = 0;
+    long run = 0;
+    for ( int c = 0; c < children; c++ ) {
+      run += hist[ c ];
+      if ( run > max ) {
+        max = run;
+      }
+    }
+    // Copies made by wildcards count against the cut, or replication explodes
+    long score = max + ( sum - count );
+    if ( best_dim < 0 || score < best_score ) {
+      best_dim = d;
+      best_bits = bits;
+      best_score = score;
+      best_sum = sum;
+    }
+  }
+  free( hist );
+  if ( best_dim < 0 ) {
+    return make_leaf( b, list, count );
+  }
+
+  // Reserve the node and its child slots before recursing
+  tree_t *t = b->tree;
+  int children = 1 << best_bits;
+  int shift = width[ best_dim ] - best_bits;
+  if ( reserve( ( void ** ) &t->nodes, &t->nodes_cap, t->nodes_len + 1, sizeof( tree_node_t ) ) ||
+       reserve( ( void ** ) &t->kids, &t->kids_cap, t->kids_len + children, sizeof( int ) ) ) {
+    return -2;
+  }
+  int index = t->nodes_len++;
+  int first_kid = t->kids_len;
+  t->kids_len += children;
+  t->nodes[ index ].dim = best_dim;
+  t->nodes[ index ].shift = shift;
+  t->nodes[ index ].mask = children - 1;
+  t->nodes[ index ].first = first_kid;
+  t->nodes[ index ].count = 0;
+
+  // Bucket the rules by child, keeping policy order inside each bucket
+  int *offset = calloc( children + 1, sizeof( int ) );
+  int *fill = malloc( children * sizeof( int ) );
+  int *spread = malloc( best_sum * sizeof( int ) );
+  if ( offset == NULL || fill == NULL || spread == NULL ) {
+    free( offset );
+    free( fill );
+    free( spread );
+    return -2;
+  }
+  for ( int i = 0; i < count; i++ ) {
+    int first, last;
+    child_span( b, list[ i ], best_dim, base[ best_dim ], shift, children, &first, &last );
+    for ( int c = first; c <= last; c++ ) {
+      offset[ c + 1 ]++;
+    }
+  }
+  for ( int c = 0; c < children; c++ ) {
+    offset[ c + 1 ] += offset[ c ];
+    fill[ c ] = offset[ c ];
+  }
+  for ( int i = 0; i < count; i++ ) {
+    int first, last;
+    child_span( b, list[ i ], best_dim, base[ best_dim ], shift, children, &first, &last );
+    for ( int c = first; c <= last; c++ ) {
+      spread[ fill[ c ]++ ] = list[ i ];
+    }
+  }
+
+  uint32_t child_base[ TREE_DIMS ];
+  int child_width[ TREE_DIMS ];
+  memcpy( child_base, base, sizeof( child_base ) );
+  memcpy( child_width, width, sizeof( child_width ) );
+  child_width[ best_dim ] = shift;
+  int result = index;
+  for ( int c = 0; c < children; c++ ) {
+    int n = offset[ c + 1 ] - offset[ c ];
+    // Neighbours holding the same rules share one subtree
+    if ( c > 0 && n == offset[ c ] - offset[ c - 1 ] &&
+         memcmp( spread + offset[ c ], spread + offset[ c - 1 ], n * sizeof( int ) ) == 0 ) {
+      t->kids[ first_kid + c ] = t->kids[ first_kid + c - 1 ];
+      continue;
+    }
+    child_base[ best_dim ] = base[ best_dim ] + ( ( uint32_t ) c << shift );
+    int kid = build_node( b, spread + offset[ c ], n, child_base, child_width );
+    if ( kid == -2 ) {
+      result = -2;
+      break;
+    }
+    t->kids[ first_kid + c ] = kid;
+  }
+  free( offset );
+  free( fill );
+  free( spread );
+  return result;
+}
+
+/**
+    Builds a decision tree from @len rules stored in @rules.
+    @param rules The rules in policy order
+    @param len The number of rules
+    @return The new tree, or NULL if memory ran out
+*/
+tree_t *tree_build(const rule_t *rules, int len) {
+  tree_t *t = calloc( 1, sizeof( tree_t ) );
+  if ( t == NULL ) {
+    return NULL;
+  }
+  t->root = -1;
+  t->len = len;
+  t->rules = malloc( ( len ? len : 1 ) * sizeof( rule_t ) );
+  builder_t b = { t, malloc( ( len ? len : 1 ) * sizeof( *b.lo ) ),
+                  malloc( ( len ? len : 1 ) * sizeof( *b.hi ) ) };
+  int *list = malloc( ( len ? len : 1 ) * sizeof( int ) );
+  if ( t->rules == NULL || b.lo == NULL || b.hi == NULL || list == NULL ) {
+    free( b.lo );
+    free( b.hi );
+    free( list );
+    tree_free( t );
+    return NULL;
+  }
+  memcpy( t->rules, rules, len * sizeof( rule_t ) );
+  for ( int i = 0; i < len; i++ ) {
+    rule_ranges( &rules[ i ], b.lo[ i ], b.hi[ i ] );
+    list[ i ] = i;
+  }
+  uint32_t base[ TREE_DIMS ] = { 0 };
+  int width[ TREE_DIMS ];
+  memcpy( width, dim_bits, sizeof( width ) );
+  t->root = build_node( &b, list, len, base, width );
+  free( b.lo );
+  free( b.hi );
+  free( list );
+  if ( t->root == -2 ) {
+    tree_free( t );
+    return NULL;
+  }
+  return t;
+}
+
+/**
+    Checks the rules held by a leaf against @pkt.
+    @param tree The tree holding the leaf
+    @param node The leaf
+    @param pkt The packet to match
+    @return Index of the first matching rule, -1 if none match
+*/
+static int leaf_match( const tree_t *tree, const tree_node_t *node, packet_t pkt ) {
+  const int *leaf = tree->leaf_rules + node->first;
+  for ( int i = 0; i < node->count; i++ ) {
+    if ( packet_match( tree->rules[ leaf[ i ] ].match, pkt ) ) {
+      return leaf[ i ];
+    }
+  }
+  return -1;
+}
+
+/**
+    Finds the first rule in the tree that matches @pkt.
+    @param tree The tree to search
+    @param pkt The packet to classify
+    @return Index of the first matching rule, -1 if none match
+*/
+int tree_lookup(const tree_t *tree, packet_t pkt) {
+  uint32_t v[ TREE_DIMS ];
+  packet_values( pkt, v );
+  int n = tree->root;
+  while ( n >= 0 ) {
+    const tree_node_t *node = &tree->nodes[ n ];
+    if ( node->dim < 0 ) {
+      return leaf_match( tree, node, pkt );
+    }
+    n = tree->kids[ node->first + ( ( v[ node->dim ] >> node->shift ) & node->mask ) ];
+  }
+  return -1;
+}
+
+/**
+    Finds the first matching rule for each of @n packets. Each round
+    moves every unfinished packet down one level and prefetches the node
+    it lands on, so the misses of the whole group are in flight together.
+    @param tree The tree to search
+    @param pkts The packets to classify
+    @param n The number of packets
+    @param out Set to the index of each packet's rule, -1 if none match
+*/
+void tree_lookup_batch(const tree_t *tree, const packet_t *pkts, int n, int *out) {
+  uint32_t v[ TREE_BATCH ][ TREE_DIMS ];
+  int at[ TREE_BATCH ];
+  for ( int base = 0; base < n; base += TREE_BATCH ) {
+    int m = n - base < TREE_BATCH ? n - base : TREE_BATCH;
+    for ( int j = 0; j < m; j++ ) {
+      packet_values( pkts[ base + j ], v[ j ] );
+      at[ j ] = tree->root;
+      out[ base + j ] = -1;
+    }
+    int active = m;
+    while ( active > 0 ) {
+      active = 0;
+      for ( int j = 0; j < m; j++ ) {
+        if ( at[ j ] < 0 ) {
+          continue;
+        }
+        const tree_node_t *node = &tree->nodes[ at[ j ] ];
+        if ( node->dim < 0 ) {
+          out[ base + j ] = leaf_match( tree, node, pkts[ base + j ] );
+          at[ j ] = -1;
+          continue;
+        }
+        at[ j ] = tree->kids[ node->first + ( ( v[ j ][ node->dim ] >> node->shift ) & node->mask ) ];
+        if ( at[ j ] >= 0 ) {
+          __builtin_prefetch( &tree->nodes[ at[ j ] ] );
+          active++;
+        }
+      }
+    }
+  }
+}
+
+/**
+    Reports the number of bytes held by the tree.
+    @param tree The tree to measure
+    @return Size of the tree in bytes
+*/
+size_t tree_bytes(const tree_t *tree) {
+  return sizeof( tree_t ) + tree->len * sizeof( rule_t ) +
+         tree->nodes_cap * sizeof( tree_node_t ) +
+         ( tree->kids_cap + tree->leaf_cap ) * sizeof( int );
+}
+
+/**
+    Frees a tree returned by tree_build.
+    @param tree The tree to free, may be NULL
+*/
+void tree_free(tree_t *tree) {
+  if ( tree == NULL ) {
+    return;
+  }
+  free( tree->rules );
+  free( tree->nodes );
+  free( tree->kids );
+  free( tree->leaf_rules );
+  free( tree );
+}
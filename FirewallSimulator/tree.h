@@ -0,0 +1,97 @@
+/**
+    @file tree.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior and data for the decision-tree rule classifier.
+*/
+
+#ifndef TREE_H
+#define TREE_H
+
+#include <stddef.h>
+
+#include "packet.h"
+#include "policy.h"
+
+/** Number of packet fields the tree cuts on */
+#define TREE_DIMS 5
+
+/**
+ * A node of the decision tree.
+ * .dim: the field cut at this node, or -1 for a leaf
+ * .shift: how far to shift the field value before masking
+ * .mask: selects the child once the value is shifted
+ * .first: offset of the node's children (or the leaf's rules)
+ * .count: the number of rules held by a leaf
+ */
+typedef struct tree_node {
+    int           dim;
+    int           shift;
+    unsigned int  mask;
+    int           first;
+    int           count;
+} tree_node_t;
+
+/**
+ * A compiled HiCuts-style decision tree over the policy rules.
+ * .rules: copy of the rules the tree was built from
+ * .len: the number of rules
+ * .nodes: every node of the tree, root first
+ * .kids: node index of each child slot, -1 if no rule can match
+ * .leaf_rules: rule indexes held by the leaves, in policy order
+ * .root: index of the root node, -1 for an empty policy
+ */
+typedef struct tree {
+    rule_t        *rules;
+    int           len;
+    tree_node_t   *nodes;
+    int           nodes_len;
+    int           nodes_cap;
+    int           *kids;
+    int           kids_len;
+    int           kids_cap;
+    int           *leaf_rules;
+    int           leaf_len;
+    int           leaf_cap;
+    int           root;
+} tree_t;
+
+/**
+    Builds a decision tree from @len rules stored in @rules.
+    @param rules The rules in policy order
+    @param len The number of rules
+    @return The new tree, or NULL if memory ran out
+*/
+tree_t *tree_build(const rule_t *rules, int len);
+
+/**
+    Finds the first rule in the tree that matches @pkt.
+    @param tree The tree to search
+    @param pkt The packet to classify
+    @return Index of the first matching rule, -1 if none match
+*/
+int tree_lookup(const tree_t *tree, packet_t pkt);
+
+/**
+    Finds the first matching rule for each of @n packets. The walks of
+    neighbouring packets are interleaved to overlap their cache misses.
+    @param tree The tree to search
+    @param pkts The packets to classify
+    @param n The number of packets
+    @param out Set to the index of each packet's rule, -1 if none match
+*/
+void tree_lookup_batch(const tree_t *tree, const packet_t *pkts, int n, int *out);
+
+/**
+    Reports the number of bytes held by the tree.
+    @param tree The tree to measure
+    @return Size of the tree in bytes
+*/
+size_t tree_bytes(const tree_t *tree);
+
+/**
+    Frees a tree returned by tree_build.
+    @param tree The tree to free, may be NULL
+*/
+void tree_free(tree_t *tree);
+
+#endif
@@ -0,0 +1,527 @@
+/**
+    @file tuple.c
+    @author Griffin Brookshire (glbrook2)
+    Tuple space search over the policy rules. Rules are split by which
+    ports they leave wild and each split is hashed on its masked 5-tuple,
+    so a lookup probes at most four hash tables instead of every rule.
+    Entries keep the hash of their flow key, so growing a table or
+    closing the hole a delete leaves rehashes nothing.
+    Rules are ranked by a priority rather than their index, so inserting
+    or deleting a rule touches only that rule's entry.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tuple.h"
+
+/** Shape bit set when the source port is wild */
+#define WILD_SRC 1
+
+/** Shape bit set when the destination port is wild */
+#define WILD_DST 2
+
+/** Packets whose probes are overlapped by tuple_lookup_batch */
+#define TUPLE_BATCH 16
+
+/** Spacing of priorities after the first edit, halved by each insert
+    between the same two rules */
+#define TUPLE_GAP ( 1u << 16 )
+
+/** Edits always absorbed before a rebuild is considered */
+#define TUPLE_MIN_EDITS 64
+
+/**
+    Gives the hash of a masked key, stored in it when it was made.
+    Rules are directed, so the direction is folded in.
+    @param e The key
+    @return The hash value
+*/
+static uint32_t key_hash( const tuple_entry_t *e ) {
+  return FLOW_DIRECTED_HASH( e->key );
+}
+
+/**
+    Tells if two keys are the same.
+    @param a The first key
+    @param b The second key
+    @return 1 if equal, 0 if not
+*/
+static int key_equal( const tuple_entry_t *a, const tuple_entry_t *b ) {
+  return FLOW_KEY_EQUAL( a->key, b->key );
+}
+
+/**
+    Fills @key with the fields of @pkt masked by @shape.
+    @param key The key to fill
+    @param pkt The packet to read
+    @param shape The wildcard shape
+*/
+static void packet_key( tuple_entry_t *key, packet_t pkt, int shape ) {
+  key->key = flow_key_pack( ipaddr_to_int( pkt.src_ip ), ipaddr_to_int( pkt.dst_ip ),
+                            ( shape & WILD_SRC ) ? 0 : pkt.src_port,
+                            ( shape & WILD_DST ) ? 0 : pkt.dst_port, pkt.protocol );
+}
+
+/**
+    Gives the wildcard shape of a rule and fills its masked key.
+    @param key The key to fill
+    @param rule The rule to read
+    @return The wildcard shape of the rule
+*/
+static int rule_key( tuple_entry_t *key, const rule_t *rule ) {
+  int shape = 0;
+  if ( rule->match.src_port == MATCH_PORT_ANY ) {
+    shape |= WILD_SRC;
+  }
+  if ( rule->match.dst_port == MATCH_PORT_ANY ) {
+    shape |= WILD_DST;
+  }
+  key->key = flow_key_from_match( rule->match );
+  return shape;
+}
+
+/**
+    Finds the lowest priority stored under @key, starting from the slot
+    its hash picks and walking to the end of the probe run.
+    @param table The table to probe
+    @param key The key to find
+    @param hash The hash of @key
+    @return The priority, TUPLE_EMPTY if @key is missing
+*/
+static uint32_t probe_from( const tuple_table_t *table, const tuple_entry_t *key,
+                            uint32_t hash ) {
+  uint32_t best = TUPLE_EMPTY;
+  for ( uint32_t i = hash & table->mask; table->entries[ i ].prio != TUPLE_EMPTY;
+        i = ( i + 1 ) & table->mask ) {
+    if ( table->entries[ i ].prio < best && key_equal( &table->entries[ i ], key ) ) {
+      best = table->entries[ i ].prio;
+    }
+  }
+  return best;
+}
+
+/**
+    Stores @key with priority @prio in the first empty slot of its run.
+    The table must have an empty slot.
+    @param table The table to add to
+    @param key The key to store
+    @param prio The rule's priority
+*/
+static void add_entry( tuple_table_t *table, const tuple_entry_t *key, uint32_t prio ) {
+  uint32_t i = key_hash( key ) & table->mask;
+  while ( table->entries[ i ].prio != TUPLE_EMPTY ) {
+    i = ( i + 1 ) & table->mask;
+  }
+  table->entries[ i ] = *key;
+  table->entries[ i ].prio = prio;
+  table->count++;
+  if ( prio < table->min_prio ) {
+    table->min_prio = prio;
+  }
+}
+
+/**
+    Empties slot @i, moving later entries of the probe run back so that
+    no lookup stops short of them.
+    @param table The table
+    @param i The slot to empty
+*/
+static void remove_at( tuple_table_t *table, uint32_t i ) {
+  for ( uint32_t j = ( i + 1 ) & table->mask; table->entries[ j ].prio != TUPLE_EMPTY;
+        j = ( j + 1 ) & table->mask ) {
+    uint32_t k = key_hash( &table->entries[ j ] ) & table->mask;
+
+    // An entry whose home lies after the hole, up to itself, stays put
+    if ( i <= j ? ( i < k && k <= j ) : ( i < k || k <= j ) ) {
+      continue;
+    }
+    table->entries[ i ] = table->entries[ j ];
+    i = j;
+  }
+  table->entries[ i ].prio = TUPLE_EMPTY;
+  table->count--;
+}
+
+/**
+    Gives a table room for @slots slots, all empty.
+    @param table The table
+    @param slots The number of slots, a power of two
+    @return 0 if success, -1 if memory ran out
+*/
+static int init_table( tuple_table_t *table, uint32_t slots ) {
+  table->entries = malloc( slots * sizeof( tuple_entry_t ) );
+  if ( table->entries == NULL ) {
+    return -1;
+  }
+  for ( uint32_t j = 0; j < slots; j++ ) {
+    table->entries[ j ].prio = TUPLE_EMPTY;
+  }
+  table->mask = slots - 1;
+  table->count = 0;
+  table->min_prio = TUPLE_EMPTY;
+  return 0;
+}
+
+/**
+    Orders tables by the earliest rule they hold.
+    @param a The first table
+    @param b The second table
+    @return Negative, zero or positive as for qsort
+*/
+static int by_min_prio( const void *a, const void *b ) {
+  uint32_t x = ( ( const tuple_table_t * ) a )->min_prio;
+  uint32_t y = ( ( const tuple_table_t * ) b )->min_prio;
+  return ( x > y ) - ( x < y );
+}
+
+/**
+    Finds the index of the rule with priority @prio.
+    @param ts The tuple space
+    @param prio The priority of a rule in the tuple space
+    @return The rule's index in the policy
+*/
+static int rule_index( const tuple_t *ts, uint32_t prio ) {
+  if ( ts->prio == NULL ) {
+    return prio;
+  }
+  int lo = 0, hi = ts->len;
+  while ( lo < hi ) {
+    int mid = ( lo + hi ) / 2;
+    if ( ts->prio[ mid ] < prio ) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/**
+    Builds the tuple space from @len rules stored in @rules.
+    @param rules The rules in policy order
+    @param len The number of rules
+    @return The new tuple space, or NULL if memory ran out
+*/
+tuple_t *tuple_build(const rule_t *rules, int len) {
+  tuple_t *ts = calloc( 1, sizeof( tuple_t ) );
+  if ( ts == NULL ) {
+    return NULL;
+  }
+  ts->len = len;
+  int counts[ TUPLE_SHAPES ] = { 0 };
+  tuple_entry_t key;
+  for ( int i = 0; i < len; i++ ) {
+    counts[ rule_key( &key, &rules[ i ] ) ]++;
+  }
+
+  // Size each table to stay under half full
+  int index[ TUPLE_SHAPES ];
+  for ( int s = 0; s < TUPLE_SHAPES; s++ ) {
+    index[ s ] = -1;
+    if ( counts[ s ] == 0 ) {
+      continue;
+    }
+    uint32_t slots = 16;
+    while ( slots < ( uint32_t ) counts[ s ] * 2 ) {
+      slots *= 2;
+    }
+    tuple_table_t *table = &ts->tables[ ts->ntables ];
+    table->shape = s;
+    if ( init_table( table, slots ) != 0 ) {
+      tuple_free( ts );
+      return NULL;
+    }
+    index[ s ] = ts->ntables++;
+  }
+
+  for ( int i = 0; i < len; i++ ) {
+    tuple_table_t *table = &ts->tables[ index[ rule_key( &key, &rules[ i ] ) ] ];
+    add_entry( table, &key, i );
+  }
+  qsort( ts->tables, ts->ntables, sizeof( tuple_table_t ), by_min_prio );
+  return ts;
+}
+
+/**
+    Finds the first rule in the tuple space that matches @pkt.
+    @param ts The tuple space to search
+    @param pkt The packet to classify
+    @return Index of the first matching rule, -1 if none match
+*/
+int tuple_lookup(const tuple_t *ts, packet_t pkt) {
+  uint32_t best = TUPLE_EMPTY;
+  tuple_entry_t key;
+  for ( int t = 0; t < ts->ntables; t++ ) {
+    const tuple_table_t *table = &ts->tables[ t ];
+    // Tables are sorted by their earliest rule, none later can do better
+    if ( table->min_prio > best ) {
+      break;
+    }
+    packet_key( &key, pkt, table->shape );
+    uint32_t prio = probe_from( table, &key, key_hash( &key ) );
+    if ( prio < best ) {
+      best = prio;
+    }
+  }
+  return best == TUPLE_EMPTY ? -1 : rule_index( ts, best );
+}
+
+/**
+    Finds the first matching rule for each of @n packets. Each table is
+    probed for a group of packets at once: all slots are prefetched
+    before any is compared, so the cache misses overlap.
+    @param ts The tuple space to search
+    @param pkts The packets to classify
+    @param n The number of packets
+    @param out Set to the index of each packet's rule, -1 if none match
+*/
+void tuple_lookup_batch(const tuple_t *ts, const packet_t *pkts, int n, int *out) {
+  tuple_entry_t keys[ TUPLE_BATCH ];
+  uint32_t hashes[ TUPLE_BATCH ];
+  uint32_t best[ TUPLE_BATCH ];
+  for ( int base = 0; base < n; base += TUPLE_BATCH ) {
+    int m = n - base < TUPLE_BATCH ? n - base : TUPLE_BATCH;
+    for ( int j = 0; j < m; j++ ) {
+      best[ j ] = TUPLE_EMPTY;
+    }
+    for ( int t = 0; t < ts->ntables; t++ ) {
+      const tuple_table_t *table = &ts->tables[ t ];
+      for ( int j = 0; j < m; j++ ) {
+        // Packets that already beat this table need no key
+        if ( table->min_prio > best[ j ] ) {
+          continue;
+        }
+        packet_key( &keys[ j ], pkts[ base + j ], table->shape );
+        hashes[ j ] = key_hash( &keys[ j ] );
+        __builtin_prefetch( &table->entries[ hashes[ j ] & table->mask ] );
+      }
+      for ( int j = 0; j < m; j++ ) {
+        if ( table->min_prio > best[ j ] ) {
+          continue;
+        }
+        uint32_t prio = probe_from( table, &keys[ j ], hashes[ j ] );
+        if ( prio < best[ j ] ) {
+          best[ j ] = prio;
+        }
+      }
+    }
+    for ( int j = 0; j < m; j++ ) {
+      out[ base + j ] = best[ j ] == TUPLE_EMPTY ? -1 : rule_index( ts, best[ j ] );
+    }
+  }
+}
+
+/**
+    Spaces the priorities out ahead of the first edit, so later edits
+    find room between neighbours. This touches every entry once.
+    @param ts The tuple space
+    @return 0 if success, -1 if memory ran out or the rules are too many
+*/
+static int spread( tuple_t *ts ) {
+  if ( ts->prio != NULL ) {
+    return 0;
+  }
+  uint32_t gap = TUPLE_GAP;
+  if ( ( uint64_t ) ( ts->len + 1 ) * gap >= TUPLE_EMPTY ) {
+    gap = ( TUPLE_EMPTY - 1 ) / ( uint32_t ) ( ts->len + 1 );
+  }
+  if ( gap < 2 ) {
+    return -1;
+  }
+  int cap = ts->len > 16 ? ts->len + ts->len / 2 : 16;
+  ts->prio = malloc( cap * sizeof( uint32_t ) );
+  if ( ts->prio == NULL ) {
+    return -1;
+  }
+  ts->cap = cap;
+  ts->gap = gap;
+  for ( int i = 0; i < ts->len; i++ ) {
+    ts->prio[ i ] = ( uint32_t ) ( i + 1 ) * gap;
+  }
+  for ( int t = 0; t < ts->ntables; t++ ) {
+    tuple_table_t *table = &ts->tables[ t ];
+    for ( uint32_t j = 0; j <= table->mask; j++ ) {
+      if ( table->entries[ j ].prio != TUPLE_EMPTY ) {
+        table->entries[ j ].prio = ( table->entries[ j ].prio + 1 ) * gap;
+      }
+    }
+    table->min_prio = ( table->min_prio + 1 ) * gap;
+  }
+  return 0;
+}
+
+/**
+    Finds the table holding rules of @shape, adding an empty one if none
+    does yet.
+    @param ts The tuple space
+    @param shape The wildcard shape
+    @return The table, NULL if memory ran out
+*/
+static tuple_table_t *shape_table( tuple_t *ts, int shape ) {
+  for ( int t = 0; t < ts->ntables; t++ ) {
+    if ( ts->tables[ t ].shape == shape ) {
+      return &ts->tables[ t ];
+    }
+  }
+  tuple_table_t *table = &ts->tables[ ts->ntables ];
+  table->shape = shape;
+  if ( init_table( table, 16 ) != 0 ) {
+    return NULL;
+  }
+  ts->ntables++;
+  return table;
+}
+
+/**
+    Doubles a table once it is half full.
+    @param table The table
+    @return 0 if success, -1 if memory ran out
+*/
+static int make_room( tuple_table_t *table ) {
+  if ( ( uint32_t ) ( table->count + 1 ) * 2 <= table->mask + 1 ) {
+    return 0;
+  }
+  tuple_table_t grown = *table;
+  if ( init_table( &grown, ( table->mask + 1 ) * 2 ) != 0 ) {
+    return -1;
+  }
+  for ( uint32_t j = 0; j <= table->mask; j++ ) {
+    if ( table->entries[ j ].prio != TUPLE_EMPTY ) {
+      add_entry( &grown, &table->entries[ j ], table->entries[ j ].prio );
+    }
+  }
+  free( table->entries );
+  *table = grown;
+  return 0;
+}
+
+/**
+    Adds @rule to the tuple space as the rule at index @pos, moving the
+    rules from @pos on one later. The new rule takes a priority between
+    its neighbours', so only its own entry is written; the rules after it
+    take their new indices from the priority array.
+    @param ts The tuple space to update
+    @param rule The rule being inserted
+    @param pos Its index in the policy, from 0 to the number of rules
+    @return 0 if success, -1 if the tuple space must be rebuilt instead
+*/
+int tuple_insert(tuple_t *ts, const rule_t *rule, int pos) {
+  if ( pos < 0 || pos > ts->len || spread( ts ) != 0 ) {
+    return -1;
+  }
+  uint32_t lo = pos > 0 ? ts->prio[ pos - 1 ] : 0;
+  uint32_t hi = pos < ts->len ? ts->prio[ pos ] : TUPLE_EMPTY;
+  if ( hi - lo < 2 ) {
+    return -1;
+  }
+  // Appends keep the full gap so a run of them does not halve it each time
+  uint32_t prio = lo + ( pos == ts->len && hi - lo > 2 * ts->gap ? ts->gap : ( hi - lo ) / 2 );
+
+  if ( ts->len == ts->cap ) {
+    uint32_t *grown = realloc( ts->prio, ts->cap * 2 * sizeof( uint32_t ) );
+    if ( grown == NULL ) {
+      return -1;
+    }
+    ts->prio = grown;
+    ts->cap *= 2;
+  }
+  tuple_entry_t key;
+  tuple_table_t *table = shape_table( ts, rule_key( &key, rule ) );
+  if ( table == NULL || make_room( table ) != 0 ) {
+    return -1;
+  }
+  add_entry( table, &key, prio );
+  qsort( ts->tables, ts->ntables, sizeof( tuple_table_t ), by_min_prio );
+  memmove( &ts->prio[ pos + 1 ], &ts->prio[ pos ], ( ts->len - pos ) * sizeof( uint32_t ) );
+  ts->prio[ pos ] = prio;
+  ts->len++;
+  ts->edits++;
+  return 0;
+}
+
+/**
+    Removes @rule, the rule at index @pos, from the tuple space, moving
+    the rules after it one earlier. Only the rule's own entry is cleared;
+    the table's earliest priority is left as a lower bound.
+    @param ts The tuple space to update
+    @param rule The rule being deleted
+    @param pos Its index in the policy
+    @return 0 if success, -1 if the tuple space must be rebuilt instead
+*/
+int tuple_delete(tuple_t *ts, const rule_t *rule, int pos) {
+  if ( pos < 0 || pos >= ts->len || spread( ts ) != 0 ) {
+    return -1;
+  }
+  uint32_t prio = ts->prio[ pos ];
+  tuple_entry_t key;
+  int shape = rule_key( &key, rule );
+  for ( int t = 0; t < ts->ntables; t++ ) {
+    tuple_table_t *table = &ts->tables[ t ];
+    if ( table->shape != shape ) {
+      continue;
+    }
+    uint32_t i = key_hash( &key ) & table->mask;
+    while ( table->entries[ i ].prio != TUPLE_EMPTY &&
+            ( table->entries[ i ].prio != prio || !key_equal( &table->entries[ i ], &key ) ) ) {
+      i = ( i + 1 ) & table->mask;
+    }
+    if ( table->entries[ i ].prio == TUPLE_EMPTY ) {
+      return -1;
+    }
+    remove_at( table, i );
+
+    // Drop a table left empty, the rest stay in order
+    if ( table->count == 0 ) {
+      free( table->entries );
+      memmove( table, table + 1, ( ts->ntables - t - 1 ) * sizeof( tuple_table_t ) );
+      ts->ntables--;
+    }
+    memmove( &ts->prio[ pos ], &ts->prio[ pos + 1 ], ( ts->len - pos - 1 ) * sizeof( uint32_t ) );
+    ts->len--;
+    ts->edits++;
+    return 0;
+  }
+  return -1;
+}
+
+/**
+    Tells whether enough edits have gathered that rebuilding the tuple
+    space is worth it. A rebuild costs about as much as the edits it
+    follows, and gives back index priorities, so lookups skip the search
+    for a rule's index, and tight table bounds.
+    @param ts The tuple space
+    @return 1 if it should be rebuilt, 0 otherwise
+*/
+int tuple_fragmented(const tuple_t *ts) {
+  return ts->edits > TUPLE_MIN_EDITS && ts->edits > ts->len / 2;
+}
+
+/**
+    Reports the number of bytes held by the tuple space.
+    @param ts The tuple space to measure
+    @return Size in bytes
+*/
+size_t tuple_bytes(const tuple_t *ts) {
+  size_t bytes = sizeof( tuple_t ) + ts->cap * sizeof( uint32_t );
+  for ( int t = 0; t < ts->ntables; t++ ) {
+    bytes += ( ts->tables[ t ].mask + 1 ) * sizeof( tuple_entry_t );
+  }
+  return bytes;
+}
+
+/**
+    Frees a tuple space returned by tuple_build.
+    @param ts The tuple space to free, may be NULL
+*/
+void tuple_free(tuple_t *ts) {
+  if ( ts == NULL ) {
+    return;
+  }
+  for ( int t = 0; t < ts->ntables; t++ ) {
+    free( ts->tables[ t ].entries );
+  }
+  free( ts->prio );
+  free( ts );
+}
@@ -0,0 +1,138 @@
+/**
+    @file tuple.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior and data for the tuple space search classifier.
+*/
+
+#ifndef TUPLE_H
+#define TUPLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet.h"
+#include "policy.h"
+
+/** Number of wildcard shapes a rule can have (either port may be any) */
+#define TUPLE_SHAPES 4
+
+/** The priority of an empty slot, above every rule's */
+#define TUPLE_EMPTY 0xFFFFFFFFu
+
+/**
+ * One entry of a tuple hash table, keyed on the masked 5-tuple. Rules
+ * sharing a key each have an entry, in the same probe run.
+ * .key: the 5-tuple to match, ports 0 where the shape is wild
+ * .prio: the rule's priority, lower first, TUPLE_EMPTY if the slot is empty
+ */
+typedef struct tuple_entry {
+    flow_key_t  key;
+    uint32_t    prio;
+} tuple_entry_t;
+
+/**
+ * Hash table holding every rule of one wildcard shape.
+ * .shape: bit 0 set if the source port is wild, bit 1 for destination
+ * .entries: open addressed slots, a power of two in number
+ * .mask: the number of slots minus one
+ * .count: the number of keys stored
+ * .min_prio: no higher than the lowest priority stored, used to stop
+ *            probing early
+ */
+typedef struct tuple_table {
+    int             shape;
+    tuple_entry_t   *entries;
+    uint32_t        mask;
+    int             count;
+    uint32_t        min_prio;
+} tuple_table_t;
+
+/**
+ * The compiled tuple space: one hash table per wildcard shape in use,
+ * sorted so the table holding the earliest rule is probed first.
+ * A rule's priority is its index until the first edit, which spaces the
+ * priorities out so that a rule can be slotted between two others
+ * without renumbering the rest.
+ * .prio / .len / .cap: each rule's priority in policy order, ascending,
+ *                      NULL while priorities are indices
+ * .gap: the spacing between priorities once spaced out
+ * .edits: the rules inserted or deleted since the build
+ */
+typedef struct tuple {
+    tuple_table_t   tables[ TUPLE_SHAPES ];
+    int             ntables;
+    uint32_t        *prio;
+    int             len;
+    int             cap;
+    uint32_t        gap;
+    int             edits;
+} tuple_t;
+
+/**
+    Builds the tuple space from @len rules stored in @rules.
+    @param rules The rules in policy order
+    @param len The number of rules
+    @return The new tuple space, or NULL if memory ran out
+*/
+tuple_t *tuple_build(const rule_t *rules, int len);
+
+/**
+    Finds the first rule in the tuple space that matches @pkt.
+    @param ts The tuple space to search
+    @param pkt The packet to classify
+    @return Index of the first matching rule, -1 if none match
+*/
+int tuple_lookup(const tuple_t *ts, packet_t pkt);
+
+/**
+    Finds the first matching rule for each of @n packets, overlapping
+    the hash probes of neighbouring packets.
+    @param ts The tuple space to search
+    @param pkts The packets to classify
+    @param n The number of packets
+    @param out Set to the index of each packet's rule, -1 if none match
+*/
+void tuple_lookup_batch(const tuple_t *ts, const packet_t *pkts, int n, int *out);
+
+/**
+    Adds @rule to the tuple space as the rule at index @pos, moving the
+    rules from @pos on one later. Only the rule's own entry is written.
+    @param ts The tuple space to update
+    @param rule The rule being inserted
+    @param pos Its index in the policy, from 0 to the number of rules
+    @return 0 if success, -1 if the tuple space must be rebuilt instead
+*/
+int tuple_insert(tuple_t *ts, const rule_t *rule, int pos);
+
+/**
+    Removes @rule, the rule at index @pos, from the tuple space, moving
+    the rules after it one earlier. Only the rule's own entry is cleared.
+    @param ts The tuple space to update
+    @param rule The rule being deleted
+    @param pos Its index in the policy
+    @return 0 if success, -1 if the tuple space must be rebuilt instead
+*/
+int tuple_delete(tuple_t *ts, const rule_t *rule, int pos);
+
+/**
+    Tells whether enough edits have gathered that rebuilding the tuple
+    space is worth it.
+    @param ts The tuple space
+    @return 1 if it should be rebuilt, 0 otherwise
+*/
+int tuple_fragmented(const tuple_t *ts);
+
+/**
+    Reports the number of bytes held by the tuple space.
+    @param ts The tuple space to measure
+    @return Size in bytes
+*/
+size_t tuple_bytes(const tuple_t *ts);
+
+/**
+    Frees a tuple space returned by tuple_build.
+    @param ts The tuple space to free, may be NULL
+*/
+void tuple_free(tuple_t *ts);
+
+#endif
@@ -0,0 +1,210 @@
+/**
+    @file txn.c
+    @author Griffin Brookshire (glbrook2)
+    Stages policy edits until they are committed. The staged rules are
+    kept in chunks that start half full, so an insert or delete shifts
+    rules within one chunk and only splits or drops a chunk now and then.
+    Each rule remembers where it was when the transaction began, which is
+    all a commit needs to carry per-rule state across.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "txn.h"
+
+/**
+    Adds an empty chunk at index @at.
+    @param txn The transaction
+    @param at Where the chunk goes, from 0 to the number of chunks
+    @return The chunk, NULL if memory ran out
+*/
+static txn_chunk_t *add_chunk( txn_t *txn, int at ) {
+  if ( txn->nchunks == txn->cap ) {
+    int cap = txn->cap > 0 ? txn->cap * 2 : 16;
+    txn_chunk_t **chunks = realloc( txn->chunks, cap * sizeof( txn_chunk_t * ) );
+    if ( chunks == NULL ) {
+      return NULL;
+    }
+    txn->chunks = chunks;
+    int *lens = realloc( txn->lens, cap * sizeof( int ) );
+    if ( lens == NULL ) {
+      return NULL;
+    }
+    txn->lens = lens;
+    txn->cap = cap;
+  }
+  txn_chunk_t *chunk = malloc( sizeof( txn_chunk_t ) );
+  if ( chunk == NULL ) {
+    return NULL;
+  }
+  int later = txn->nchunks - at;
+  memmove( &txn->chunks[ at + 1 ], &txn->chunks[ at ], later * sizeof( txn_chunk_t * ) );
+  memmove( &txn->lens[ at + 1 ], &txn->lens[ at ], later * sizeof( int ) );
+  txn->chunks[ at ] = chunk;
+  txn->lens[ at ] = 0;
+  txn->nchunks++;
+  return chunk;
+}
+
+/**
+    Frees the chunk at index @at.
+    @param txn The transaction
+    @param at The chunk to remove
+*/
+static void remove_chunk( txn_t *txn, int at ) {
+  free( txn->chunks[ at ] );
+  int later = txn->nchunks - at - 1;
+  memmove( &txn->chunks[ at ], &txn->chunks[ at + 1 ], later * sizeof( txn_chunk_t * ) );
+  memmove( &txn->lens[ at ], &txn->lens[ at + 1 ], later * sizeof( int ) );
+  txn->nchunks--;
+}
+
+/**
+    Finds the chunk holding index @pos. An index one past the last rule
+    is placed at the end of the last chunk.
+    @param txn The transaction, with at least one chunk
+    @param pos The index
+    @param off Set to the index within the chunk
+    @return The chunk index
+*/
+static int locate( const txn_t *txn, int pos, int *off ) {
+  int c = 0;
+  while ( c < txn->nchunks - 1 && pos >= txn->lens[ c ] ) {
+    pos -= txn->lens[ c ];
+    c++;
+  }
+  *off = pos;
+  return c;
+}
+
+/**
+    Starts a transaction on @len rules stored in @rules.
+    @param rules The rules in policy order
+    @param len The number of rules
+    @param default_action The default policy
+    @return The transaction, or NULL if memory ran out
+*/
+txn_t *txn_begin(const rule_t *rules, int len, int default_action) {
+  txn_t *txn = calloc( 1, sizeof( txn_t ) );
+  if ( txn == NULL ) {
+    return NULL;
+  }
+  txn->default_action = default_action;
+  for ( int i = 0; i < len; i += TXN_CHUNK / 2 ) {
+    txn_chunk_t *chunk = add_chunk( txn, txn->nchunks );
+    if ( chunk == NULL ) {
+      txn_free( txn );
+      return NULL;
+    }
+    int n = len - i < TXN_CHUNK / 2 ? len - i : TXN_CHUNK / 2;
+    memcpy( chunk->rules, &rules[ i ], n * sizeof( rule_t ) );
+    for ( int k = 0; k < n; k++ ) {
+      chunk->from[ k ] = i + k;
+    }
+    txn->lens[ txn->nchunks - 1 ] = n;
+  }
+  txn->len = len;
+  return txn;
+}
+
+/**
+    Stages @rule as the rule at index @pos, moving later rules up one.
+    A full chunk is split in two first.
+    @param txn The transaction
+    @param rule The rule to insert
+    @param pos Its index, from 0 to the number of rules
+    @return 0 if success, -1 if fail
+*/
+int txn_insert(txn_t *txn, rule_t rule, int pos) {
+  if ( pos < 0 || pos > txn->len ) {
+    return -1;
+  }
+  if ( txn->nchunks == 0 && add_chunk( txn, 0 ) == NULL ) {
+    return -1;
+  }
+  int off;
+  int c = locate( txn, pos, &off );
+  if ( txn->lens[ c ] == TXN_CHUNK ) {
+    txn_chunk_t *upper = add_chunk( txn, c + 1 );
+    if ( upper == NULL ) {
+      return -1;
+    }
+    txn_chunk_t *lower = txn->chunks[ c ];
+    memcpy( upper->rules, &lower->rules[ TXN_CHUNK / 2 ], TXN_CHUNK / 2 * sizeof( rule_t ) );
+    memcpy( upper->from, &lower->from[ TXN_CHUNK / 2 ], TXN_CHUNK / 2 * sizeof( int ) );
+    txn->lens[ c ] = TXN_CHUNK / 2;
+    txn->lens[ c + 1 ] = TXN_CHUNK / 2;
+    if ( off > TXN_CHUNK / 2 ) {
+      c++;
+      off -= TXN_CHUNK / 2;
+    }
+  }
+  txn_chunk_t *chunk = txn->chunks[ c ];
+  int later = txn->lens[ c ] - off;
+  memmove( &chunk->rules[ off + 1 ], &chunk->rules[ off ], later * sizeof( rule_t ) );
+  memmove( &chunk->from[ off + 1 ], &chunk->from[ off ], later * sizeof( int ) );
+  chunk->rules[ off ] = rule;
+  chunk->from[ off ] = -1;
+  txn->lens[ c ]++;
+  txn->len++;
+  txn->edits++;
+  return 0;
+}
+
+/**
+    Stages deleting the rule at index @pos. A chunk left empty is freed.
+    @param txn The transaction
+    @param pos The index of the rule to delete
+    @return 0 if success, -1 if fail
+*/
+int txn_delete(txn_t *txn, int pos) {
+  if ( pos < 0 || pos >= txn->len ) {
+    return -1;
+  }
+  int off;
+  int c = locate( txn, pos, &off );
+  txn_chunk_t *chunk = txn->chunks[ c ];
+  int later = txn->lens[ c ] - off - 1;
+  memmove( &chunk->rules[ off ], &chunk->rules[ off + 1 ], later * sizeof( rule_t ) );
+  memmove( &chunk->from[ off ], &chunk->from[ off + 1 ], later * sizeof( int ) );
+  if ( --txn->lens[ c ] == 0 ) {
+    remove_chunk( txn, c );
+  }
+  txn->len--;
+  txn->edits++;
+  return 0;
+}
+
+/**
+    Writes the staged rules out in order.
+    @param txn The transaction
+    @param rules Set to the rules, room for txn->len of them
+    @param from Set to the index each rule had when the transaction
+                began, -1 for rules it added
+*/
+void txn_flatten(const txn_t *txn, rule_t *rules, int *from) {
+  int at = 0;
+  for ( int c = 0; c < txn->nchunks; c++ ) {
+    memcpy( &rules[ at ], txn->chunks[ c ]->rules, txn->lens[ c ] * sizeof( rule_t ) );
+    memcpy( &from[ at ], txn->chunks[ c ]->from, txn->lens[ c ] * sizeof( int ) );
+    at += txn->lens[ c ];
+  }
+}
+
+/**
+    Frees a transaction returned by txn_begin.
+    @param txn The transaction to free, may be NULL
+*/
+void txn_free(txn_t *txn) {
+  if ( txn == NULL ) {
+    return;
+  }
+  for ( int c = 0; c < txn->nchunks; c++ ) {
+    free( txn->chunks[ c ] );
+  }
+  free( txn->chunks );
+  free( txn->lens );
+  free( txn );
+}
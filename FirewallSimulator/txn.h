@@ -0,0 +1,86 @@
+/**
+    @file txn.h
+    @author Griffin Brookshire (glbrook2)
+    Defines behavior and data for policy edits staged in a transaction.
+*/
+
+#ifndef TXN_H
+#define TXN_H
+
+#include "policy.h"
+
+/** Most rules held by one chunk of a staged policy */
+#define TXN_CHUNK 512
+
+/**
+ * A run of consecutive staged rules.
+ * .rules: the rules, in policy order
+ * .from: each rule's index in the policy the transaction began from,
+ *        -1 for rules added since
+ */
+typedef struct txn_chunk {
+    rule_t  rules[ TXN_CHUNK ];
+    int     from[ TXN_CHUNK ];
+} txn_chunk_t;
+
+/**
+ * The policy as a transaction has edited it so far, kept in chunks so an
+ * edit moves at most one chunk of rules rather than every later rule.
+ * .chunks / .lens / .nchunks / .cap: the chunks in order and the number
+ *                                    of rules in each
+ * .len: the number of rules
+ * .default_action: the staged default policy
+ * .edits: the edits staged so far
+ */
+typedef struct txn {
+    txn_chunk_t **chunks;
+    int         *lens;
+    int         nchunks;
+    int         cap;
+    int         len;
+    int         default_action;
+    int         edits;
+} txn_t;
+
+/**
+    Starts a transaction on @len rules stored in @rules.
+    @param rules The rules in policy order
+    @param len The number of rules
+    @param default_action The default policy
+    @return The transaction, or NULL if memory ran out
+*/
+txn_t *txn_begin(const rule_t *rules, int len, int default_action);
+
+/**
+    Stages @rule as the rule at index @pos, moving later rules up one.
+    @param txn The transaction
+    @param rule The rule to insert
+    @param pos Its index, from 0 to the number of rules
+    @return 0 if success, -1 if fail
+*/
+int txn_insert(txn_t *txn, rule_t rule, int pos);
+
+/**
+    Stages deleting the rule at index @pos.
+    @param txn The transaction
+    @param pos The index of the rule to delete
+    @return 0 if success, -1 if fail
+*/
+int txn_delete(txn_t *txn, int pos);
+
+/**
+    Writes the staged rules out in order.
+    @param txn The transaction
+    @param rules Set to the rules, room for txn->len of them
+    @param from Set to the index each rule had when the transaction
+                began, -1 for rules it added
+*/
+void txn_flatten(const txn_t *txn, rule_t *rules, int *from);
+
+/**
+    Frees a transaction returned by txn_begin.
+    @param txn The transaction to free, may be NULL
+*/
+void txn_free(txn_t *txn);
+
+#endif